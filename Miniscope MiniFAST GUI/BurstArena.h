@@ -0,0 +1,104 @@
+// BurstArena.h : a recording held in RAM until it is over, for rates the disk cannot keep up with
+//
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include "FrameQueue.h"
+
+enum BurstState {
+	BURST_IDLE = 0,		// no burst this recording yet
+	BURST_FILLING,		// the capture thread grabs into it
+	BURST_COMPLETE,		// full, at its length, or recording stopped; the writer owns the frames
+	BURST_FLUSHED		// written
+};
+
+// A source with an arena records bursts: from its first recorded frame the capture thread grabs
+// straight into the arena until it is full, reaches the burst's frame count or duration, or the
+// recording stops, and nothing is queued meanwhile. The writer leaves the disk alone until the
+// burst is complete, then writes the frames in order. Buffers are bound from a pool of their own,
+// locked in RAM, so a burst never pages.
+class CBurstArena
+{
+public:
+	CBurstArena() : mCount(0), mLimit(0), mDurationMs(0), mFirstMs(0) { mState.store(BURST_IDLE); }
+
+	// Not thread safe. Only call while neither side is running. 0 frames turns bursts off.
+	void Init(UINT frames)
+	{
+		mSlots.clear();
+		mSlots.resize(frames);
+		Reset();
+	}
+	UINT Capacity() const { return (UINT)mSlots.size(); }
+	// Direct slot access for binding buffers. Same rules as Init().
+	FrameSlot& Slot(UINT i) { return mSlots[i]; }
+	// UI thread, before the record flag goes true
+	void Reset()
+	{
+		mCount = 0;
+		mState.store(BURST_IDLE);
+	}
+	// Any thread. The burst of this recording is in RAM, it may be written already.
+	bool IsOver() const
+	{
+		int state = mState.load(std::memory_order_acquire);
+		return state == BURST_COMPLETE || state == BURST_FLUSHED;
+	}
+
+	//---------- Capture thread ----------
+	// Up to frames, 0 for as many as fit, and up to durationMs from the first frame, 0 for no limit
+	void Start(UINT frames, UINT durationMs)
+	{
+		mCount = 0;
+		mLimit = frames > 0 && frames < Capacity() ? frames : Capacity();
+		mDurationMs = durationMs;
+		mState.store(BURST_FILLING, std::memory_order_release);
+	}
+	bool IsFilling() const { return mState.load(std::memory_order_acquire) == BURST_FILLING; }
+	// Slot for a frame timed capTime, or NULL once the burst is over, which completes it
+	FrameSlot* BeginWrite(UINT capTime)
+	{
+		if (!IsFilling())
+			return NULL;
+		if (mCount == 0)
+			mFirstMs = capTime;
+		else if (mDurationMs > 0 && capTime - mFirstMs >= mDurationMs) {
+			Complete();
+			return NULL;
+		}
+		return &mSlots[mCount];
+	}
+	void CommitWrite()
+	{
+		if (++mCount == mLimit)
+			Complete();
+	}
+	void Complete()
+	{
+		if (IsFilling())
+			mState.store(BURST_COMPLETE, std::memory_order_release);
+	}
+
+	//---------- Writer thread ----------
+	bool IsComplete() const { return mState.load(std::memory_order_acquire) == BURST_COMPLETE; }
+	// Valid once complete, until Release()
+	UINT Count() const { return mCount; }
+	FrameSlot& Frame(UINT i) { return mSlots[i]; }
+	void Release()
+	{
+		if (IsComplete())
+			mState.store(BURST_FLUSHED, std::memory_order_release);
+	}
+
+private:
+	CBurstArena(const CBurstArena&);
+	CBurstArena& operator=(const CBurstArena&);
+
+	std::vector<FrameSlot> mSlots;
+	UINT mCount;
+	UINT mLimit;
+	UINT mDurationMs;
+	UINT mFirstMs;
+	std::atomic<int> mState;
+};
@@ -0,0 +1,1225 @@
+// CaptureSource.cpp : one camera and everything that moves its frames to disk
+//
+
+#include "stdafx.h"
+#include "CaptureSource.h"
+#include "LumaExtract.h"
+#include "SamplePack.h"
+#include "SyntheticCapture.h"
+#include "UVCReceiver.h"
+#include "PipelineTrace.h"
+#include "FFV1Writer.h"
+#include "RawFrameFile.h"
+#include "StripedRawWriter.h"
+#include "TimestampLog.h"
+#include "WorkerThread.h"
+
+// One video file of a recording. The writer thread fills one while the segment thread gets the other ready.
+struct VideoSegment {
+	cv::VideoWriter video;
+	CFFV1Writer ffv1;
+	CRawFrameWriter raw;
+	CStripedRawWriter striped;	// instead of raw with stripe folders
+	std::string fileName;
+	std::vector<std::string> partNames;	// of a striped file
+	int fileNumber;
+	int frames;				// handed to the file so far
+	ULONGLONG bytes;
+	UINT firstTimeMs;		// capTime of the first frame
+	UINT lastTimeMs;		// and of the last
+
+	VideoSegment() : fileNumber(0), frames(0), bytes(0), firstTimeMs(0), lastTimeMs(0) {}
+};
+
+namespace {
+
+ULONGLONG FileTimeTo100ns(const FILETIME& ft)
+{
+	return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+// CPU the calling thread used since started, in percent of one core
+double ThreadCPUPercent(const LARGE_INTEGER& started, const LARGE_INTEGER& frequency)
+{
+	FILETIME creation, exit, kernel, user;
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+	if (now.QuadPart <= started.QuadPart || !GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+		return 0;
+	return 100*((FileTimeTo100ns(kernel) + FileTimeTo100ns(user))/1e7)/(((double)now.QuadPart - started.QuadPart)/frequency.QuadPart);
+}
+
+// CreateDirectory only makes the last folder of a path, this makes every missing one in turn
+void CreateFolderPath(const CString& folder)
+{
+	for (int i = 1; i < folder.GetLength(); i++) {
+		if (folder[i] == L'\\' || folder[i] == L'/')
+			CreateDirectory(folder.Left(i), NULL);
+	}
+	CreateDirectory(folder, NULL);
+}
+
+} // namespace
+
+CCaptureSource::CCaptureSource()
+	: firmwareFPS(0)
+	, firmwareWindow(0)
+	, mHost(NULL)
+	, mSession(NULL)
+	, mInput(&cam)
+	, mSynthetic(NULL)
+	, mUSB(NULL)
+	, mCaptureThread(NULL)
+	, mDisplayThread(NULL)
+	, mConnected(false)
+	, mStreaming(false)
+	, mStopping(false)
+	, mRaw(false)
+	, mBits(8)
+	, mFrameRows(0)
+	, mFrameCols(0)
+	, mFrameType(CV_8UC1)
+	, mMaxFramesPerFile(1000)
+	, mSegmentBytes(0)
+	, mSegmentMs(0)
+	, mSegmentThread(NULL)
+	, mSegmentIdle(TRUE, TRUE)
+	, mSegmentJob(NULL)
+	, mSegmentFile(0)
+	, mSegmentStop(false)
+	, mCodec(VIDEO_DIB)
+	, mRawPacked(true)
+	, mRawWriteMode(RAW_WRITE_DIRECT)
+	, mFFV1Threads(1)
+	, mFFV1Slices(1)
+	, mStripeFrames(1)
+	, mBurstFrames(0)
+	, mBurstMs(0)
+	, mCurrentFPS(0)
+	, mGrabIntervalNs(0)
+	, mReportedFPS(0)
+	, mWriteFPS(0)
+	, mQueueSampleDepth(0)
+	, mQueueSampleTicks(0)
+	, mQueueGrowth(0)
+	, mSecondsToOverflow(-1)
+	, mOverflowWarnSeconds(0)
+	, mOverflowReportTicks(0)
+	, mFramesWritten(0)
+	, mRetrieveErrors(0)
+	, mFramesGrabbed(0)
+	, mRawBytesWritten(0)
+	, mEncodeSeconds(0)
+{
+	for (int i = 0; i < SOURCE_THREAD_COUNT; i++)
+		mThreadCPU[i] = 0;
+	mConfig.kind = CAPTURE_SCOPE;
+	mConfig.device = 0;
+	mConfig.rawCapture = false;
+	mConfig.bitDepth = 8;
+}
+
+CCaptureSource::~CCaptureSource()
+{ //A capture thread still grabbing when the application exits dies with the process, and so does its input
+	if (mCaptureThread != NULL && WaitForSingleObject(mCaptureThread->m_hThread, 0) == WAIT_TIMEOUT)
+		return;
+	Close();
+	delete mSynthetic;
+	delete mUSB;
+}
+
+void CCaptureSource::Init(const CaptureSourceConfig& config, CCaptureHost* host, const CaptureSession* session)
+{ //Overflow policy, codec and queue budget are looked up per source, e.g. Writer\msOverflowPolicy for msCam
+	CWinApp* app = AfxGetApp();
+	CString key(config.name);
+	SYSTEM_INFO system;
+
+	mConfig = config;
+	mHost = host;
+	mSession = session;
+	key.Replace(L"Cam", L"");
+	mOverflow.Init((OverflowPolicy)min(app->GetProfileInt(L"Writer", key + L"OverflowPolicy", OVERFLOW_DROP_NEWEST), (UINT)OVERFLOW_POLICY_COUNT - 1),
+		&mQueue, &mWriterSignal);
+	// Frames the capture thread queues before waking the writer
+	mWriterSignal.SetBatch(app->GetProfileInt(L"Writer", L"BatchFrames", 1));
+	mCodec = (VideoCodec)min(app->GetProfileInt(L"Writer", key + L"Codec", VIDEO_DIB), (UINT)VIDEO_CODEC_COUNT - 1);
+	// 10 and 12 bit samples take 1.25 and 1.5 bytes in a raw file instead of 2
+	mRawPacked = app->GetProfileInt(L"Writer", L"RawPacked", 1) != 0;
+	// Files are also started again once they reach Writer\SegmentMB or span Writer\SegmentSeconds, 0 for no limit
+	mSegmentBytes = (ULONGLONG)app->GetProfileInt(L"Writer", L"SegmentMB", 0)*1048576;
+	mSegmentMs = 1000*app->GetProfileInt(L"Writer", L"SegmentSeconds", 0);
+	// How long a burst is, for sources with a burst arena. It also ends once the arena is full.
+	mBurstFrames = app->GetProfileInt(L"Burst", L"Frames", 0);
+	mBurstMs = app->GetProfileInt(L"Burst", L"DurationMs", 0);
+	// A recording whose queue is projected to fill sooner than this is reported every 10 s
+	mOverflowWarnSeconds = app->GetProfileInt(L"DiskCheck", L"WarnSeconds", 60);
+	// How raw files get to disk, see RawWriteMode. The Linux io_uring mode falls back to direct here.
+	mRawWriteMode = min(app->GetProfileInt(L"Writer", L"RawWriteMode", RAW_WRITE_DIRECT), (UINT)RAW_WRITE_MODE_COUNT - 1);
+	// FFV1 slice threads, shared by every file of a recording. Half the cores leaves the rest to
+	// the capture threads and the other sources, twice as many slices as threads evens out slices
+	// that take longer.
+	GetSystemInfo(&system);
+	mFFV1Threads = app->GetProfileInt(L"Writer", L"FFV1Threads", max(1, (int)system.dwNumberOfProcessors/2));
+	mFFV1Slices = app->GetProfileInt(L"Writer", L"FFV1Slices", 2*mFFV1Threads);
+	// RAW files go to Writer\StripeFolders instead, e.g. "D:\stripe;E:\stripe" for one folder on each of two
+	// disks, each taking Writer\StripeFrames frames in turn
+	CString folders = app->GetProfileString(L"Writer", L"StripeFolders", L"");
+	CString folder;
+	int position = 0;
+	mStripeFolders.clear();
+	while (position >= 0) {
+		folder = folders.Tokenize(L";", position);
+		folder.Trim();
+		folder.TrimRight(L"\\/");
+		if (!folder.IsEmpty())
+			mStripeFolders.push_back(folder);
+	}
+	mStripeFrames = max(app->GetProfileInt(L"Writer", L"StripeFrames", 16), 1U);
+}
+
+bool CCaptureSource::Open()
+{ //Opens the camera, or the libusb or synthetic input Config().input asks for
+	CString error;
+
+	delete mSynthetic;
+	mSynthetic = NULL;
+	delete mUSB;
+	mUSB = NULL;
+	mInput = &cam;
+	if (mConfig.input.Left(4) == L"usb,") {
+		mUSB = CreateUSBCapture(mConfig.input, error);
+		if (mUSB == NULL) {
+			mHost->AddListText(error);
+			return false;
+		}
+		mInput = mUSB;
+	}
+	else if (!mConfig.input.IsEmpty()) {
+		mSynthetic = CreateSyntheticCapture(mConfig.input, error);
+		if (mSynthetic == NULL) {
+			mHost->AddListText(error);
+			return false;
+		}
+		mInput = mSynthetic;
+	}
+	else {
+		cam.open(mConfig.device);
+		if (!cam.isOpened())
+			return false;
+	}
+	// Raw YUY2 passthrough so the capture thread can pull the Y plane itself instead of DirectShow
+	// converting to BGR and the display converting back to gray
+	mRaw = mConfig.rawCapture && mInput->set(CV_CAP_PROP_CONVERT_RGB, FALSE);
+	// Samples above 8 bits as words in the two bytes per pixel the 8 bit stream takes. The scope's
+	// firmware sends 8 bits a pixel and has no command for more, so only synthetic inputs deliver
+	// them, which is what the 10 and 12 bit paths downstream are exercised with.
+	mBits = 8;
+	if (mRaw && (mConfig.bitDepth == 10 || mConfig.bitDepth == 12)) {
+		if (mSynthetic != NULL && mSynthetic->SetBitDepth(mConfig.bitDepth))
+			mBits = mConfig.bitDepth;
+		else
+			mHost->AddListText(CString(Name()) + L": the scope's firmware does not send more than 8 bits, Scope\\BitDepth ignored");
+	}
+	mRetrieveErrors = 0;
+	mConnected = true;
+	return true;
+}
+
+void CCaptureSource::Reopen()
+{ //Only the camera is reconnected. A synthetic input has nothing to reconnect, and a libusb
+  //one fails its grab() once the scope is gone.
+	if (mInput != &cam)
+		return;
+	cam.release();
+	cam.open(mConfig.device);
+	if (mRaw == true)
+		cam.set(CV_CAP_PROP_CONVERT_RGB, FALSE);
+}
+
+void CCaptureSource::StartCapture()
+{
+	// Threads of a connection that was lost have ended by now
+	JoinThread(mCaptureThread);
+	JoinThread(mDisplayThread);
+	mStopping = false;
+	mCaptureThread = StartThread(CaptureThread, (LPVOID)this, THREAD_PRIORITY_NORMAL);
+}
+
+void CCaptureSource::Close()
+{
+	mStopping = true;
+	JoinThread(mCaptureThread);
+	mConnected = false;
+	mStreaming = false;
+	JoinThread(mDisplayThread);
+	mStopping = false;
+	mInput->release();
+}
+
+bool CCaptureSource::ReadSample(cv::Mat& sample)
+{ //First frame off the camera, which sizes every buffer. Falls back to the backend's RGB conversion
+  //if it does not deliver raw YUY2 after all.
+	cv::Mat raw;
+	CString str;
+
+	mFrameRows = (int)mInput->get(CV_CAP_PROP_FRAME_HEIGHT);
+	mFrameCols = (int)mInput->get(CV_CAP_PROP_FRAME_WIDTH);
+	if (!mInput->read(raw))
+		return false;
+	if (mBits > 8) {
+		if (UnpackSamples(raw, sample, mFrameRows, mFrameCols, mBits) == false) {
+			str.Format(L"%s: %d bit samples expected, got %u bytes for %dx%d", Name(), mBits, (UINT)(raw.total()*raw.elemSize()),
+				mFrameCols, mFrameRows);
+			mHost->AddListText(str);
+			return false;
+		}
+		str.Format(L"%s raw %d bit capture", Name(), mBits);
+		mHost->AddListText(str);
+		return true;
+	}
+	if (mRaw == true) {
+		if (ExtractLuma(raw, sample, mFrameRows, mFrameCols) == true) {
+			str.Format(L"%s raw YUY2 capture, %s luma extraction", Name(), LumaKernelName(BestLumaKernel()));
+			mHost->AddListText(str);
+			return true;
+		}
+		str.Format(L"%s backend does not deliver raw YUY2, using its RGB conversion", Name());
+		mHost->AddListText(str);
+		mRaw = false;
+		mInput->set(CV_CAP_PROP_CONVERT_RGB, TRUE);
+		if (!mInput->read(raw))
+			return false;
+	}
+	sample = raw;
+	mFrameRows = sample.rows;
+	mFrameCols = sample.cols;
+	mFrameType = sample.type();
+	return true;
+}
+
+UINT CCaptureSource::StripeBuffers() const
+{ //Each part queues two stripes, see CStripedRawWriter::Init. Reserved whatever the codec, which can change until recording.
+	return 2*(UINT)mStripeFolders.size()*2*mStripeFrames;
+}
+
+bool CCaptureSource::Retrieve(cv::Mat& frame, cv::Mat& raw, UINT traceFrame)
+{ //Decodes the grabbed frame into frame's pool buffer
+	uchar* before = frame.data;
+	bool status;
+	LONGLONG traceBegin = TraceNow();
+
+	if (mRaw == true) {
+		// Deinterleaves straight into the queue slot
+		status = mInput->retrieve(raw);
+		TraceSpan("retrieve", traceBegin, traceFrame);
+		if (status == true) {
+			traceBegin = TraceNow();
+			if (mBits > 8)
+				status = UnpackSamples(raw, frame, mFrameRows, mFrameCols, mBits);
+			else
+				status = ExtractLuma(raw, frame, mFrameRows, mFrameCols);
+			TraceSpan("convert", traceBegin, traceFrame);
+		}
+	}
+	else {
+		// The backend converts to BGR inside retrieve()
+		status = mInput->retrieve(frame);
+		TraceSpan("retrieve", traceBegin, traceFrame);
+	}
+	pool.Track(frame, before);
+	return status;
+}
+
+bool CCaptureSource::InitFrameBuffers(const cv::Mat& sample, double fps)
+{ //Preallocates every frame buffer the source uses, sized from the frame geometry the camera negotiated.
+  //The queue gets as many frames as fit in Memory\<cam>BudgetMB unless Writer\<cam>QueueFrames fixes it.
+	CWinApp* app = AfxGetApp();
+	CString str;
+	CString camKey(mConfig.name);
+	size_t bufferBytes;
+	UINT budgetMB;
+	UINT capacity;
+	UINT preTrigger = 0;
+	UINT burst;
+	UINT flags = 0;
+
+	camKey.Replace(L"Cam", L"");	//msCam -> ms, behavCam -> behav
+	if (sample.empty()) {
+		str.Format(L"%s: could not preallocate frame buffers", Name());
+		mHost->AddListText(str);
+		return false;
+	}
+	bufferBytes = CFramePool::BufferBytes(sample.rows, sample.cols, sample.type());
+	budgetMB = app->GetProfileInt(L"Memory", camKey + L"BudgetMB", QUEUE_BUDGET_MB);
+	capacity = app->GetProfileInt(L"Writer", camKey + L"QueueFrames", 0);
+	if (capacity == 0)
+		capacity = (UINT)((ULONGLONG)budgetMB*1048576/bufferBytes);
+	if (capacity < MIN_QUEUE_FRAMES)
+		capacity = MIN_QUEUE_FRAMES;
+	// Triggered recordings keep up to Trigger\PreTriggerSeconds before the trigger, in as many frames as fit in Memory\<cam>PreTriggerMB
+	if (app->GetProfileInt(L"Trigger", L"PreTriggerSeconds", 0) > 0)
+		preTrigger = (UINT)((ULONGLONG)app->GetProfileInt(L"Memory", camKey + L"PreTriggerMB", PRETRIGGER_BUDGET_MB)*1048576/bufferBytes);
+	if (app->GetProfileInt(L"Memory", L"LockPages", 0) != 0)
+		flags |= POOL_LOCK_PAGES;
+	if (app->GetProfileInt(L"Memory", L"LargePages", 0) != 0)
+		flags |= POOL_LARGE_PAGES;
+
+	// A 32 bit process may not have that much contiguous address space left, back off until it fits
+	while (1) {
+		mOverflow.SetCapacity(capacity);
+		mPreTrigger.Init(preTrigger);
+		if (pool.Init(mQueue.SlotCount() + mOverflow.SpillSlotCount() + preTrigger + StripeBuffers() + SOURCE_SPARE_BUFFERS,
+			sample.rows, sample.cols, sample.type(), flags))
+			break;
+		if (capacity == MIN_QUEUE_FRAMES) {
+			str.Format(L"%s: could not preallocate frame buffers", Name());
+			mHost->AddListText(str);
+			return false;
+		}
+		capacity = max(capacity/2, (UINT)MIN_QUEUE_FRAMES);
+		preTrigger /= 2;
+	}
+	for (UINT i = 0; i < mQueue.SlotCount(); i++)
+		mQueue.Slot(i).frame = pool.Borrow(sample.rows, sample.cols, sample.type());
+	for (UINT i = 0; i < mOverflow.SpillSlotCount(); i++)
+		mOverflow.SpillSlot(i).frame = pool.Borrow(sample.rows, sample.cols, sample.type());
+	for (UINT i = 0; i < preTrigger; i++)
+		mPreTrigger.Slot(i).frame = pool.Borrow(sample.rows, sample.cols, sample.type());
+	// Memory\<cam>BurstMB makes every recording a burst into an arena that size. It is always locked,
+	// and halved until the address space has room for it.
+	burst = (UINT)((ULONGLONG)app->GetProfileInt(L"Memory", camKey + L"BurstMB", 0)*1048576/bufferBytes);
+	mBurst.Init(0);
+	while (burst > 0 && !mBurstPool.Init(burst, sample.rows, sample.cols, sample.type(), flags | POOL_LOCK_PAGES))
+		burst /= 2;
+	if (burst == 0)
+		mBurstPool.Release();
+	mBurst.Init(burst);
+	for (UINT i = 0; i < burst; i++)
+		mBurst.Slot(i).frame = mBurstPool.Borrow(sample.rows, sample.cols, sample.type());
+
+	str.Format(L"%s: %u frame buffers of %dx%d preallocated (%.1f MB%s%s)", Name(), pool.Count(), sample.cols, sample.rows,
+		pool.Count()*pool.BufferSize()/1048576.0,
+		(pool.Backing() & POOL_LARGE_PAGES) != 0 ? L", large pages" : (pool.Backing() & POOL_LOCK_PAGES) != 0 ? L", locked" : L"",
+		(flags & ~pool.Backing()) != 0 ? L", could not lock as configured" : L"");
+	mHost->AddListText(str);
+	if (fps > 0)
+		str.Format(L"%s: queue holds %u frames, %.2f s at %.0f fps", Name(), mQueue.Capacity(), mQueue.Capacity()/fps, fps);
+	else
+		str.Format(L"%s: queue holds %u frames, camera did not report its frame rate", Name(), mQueue.Capacity());
+	mHost->AddListText(str);
+	if (preTrigger > 0 && fps > 0) {
+		str.Format(L"%s: pre-trigger window holds %u frames, %.2f s at %.0f fps", Name(), preTrigger, preTrigger/fps, fps);
+		mHost->AddListText(str);
+	}
+	else if (preTrigger > 0) {
+		str.Format(L"%s: pre-trigger window holds %u frames", Name(), preTrigger);
+		mHost->AddListText(str);
+	}
+	if (burst > 0)
+		mHost->AddListText(BurstSummary());
+	if (!mStripeFolders.empty()) {
+		str.Format(L"%s: RAW files striped over %u folders, %u frames at a time, %u of the buffers are theirs", Name(),
+			(UINT)mStripeFolders.size(), mStripeFrames, StripeBuffers());
+		mHost->AddListText(str);
+	}
+	return true;
+}
+
+void CCaptureSource::PrepareRecording(const std::string& fileBase, int maxFramesPerFile)
+{
+	mFileBase = fileBase;
+	mMaxFramesPerFile = maxFramesPerFile;
+	mFramesWritten = 0;
+	mFramesGrabbed = 0;
+	mRawBytesWritten = 0;
+	mEncodeSeconds = 0;
+	for (int i = 0; i < PIPELINE_STAGE_COUNT; i++)
+		mLatency[i].Reset();
+	// A crop dragged past the edge of the frame would make every write throw
+	roi &= cv::Rect(0, 0, mFrameCols, mFrameRows);
+	mQueue.Discard();
+	mBurst.Reset();
+	mWriteRate.Reset();
+	mOverflow.StartRecording(CString(mFileBase.c_str()) + L"_spill.raw");
+}
+
+void CCaptureSource::StartWriter()
+{
+	AfxBeginThread(WriterThread, (LPVOID)this, THREAD_PRIORITY_HIGHEST);
+}
+
+LPCTSTR CCaptureSource::CodecName(VideoCodec codec)
+{
+	switch (codec) {
+	case VIDEO_FFV1:
+		return L"FFV1";
+	case VIDEO_RAW:
+		return L"RAW";
+	default:
+		return L"DIB";
+	}
+}
+
+void CCaptureSource::UpdateStats(LONGLONG now, LONGLONG frequency)
+{
+	CString str;
+	LONG drops;
+	UINT percent;
+	UINT depth = mQueue.Size();
+
+	mWriteFPS = (UINT)mWriteRate.Sample(now, frequency);
+	// A burst does not go through the queue
+	if (*mSession->record == true && !IsBursting() && mQueueSampleTicks > 0 && now > mQueueSampleTicks)
+		mQueueGrowth += (((double)depth - mQueueSampleDepth)*frequency/(now - mQueueSampleTicks) - mQueueGrowth)/8;
+	else
+		mQueueGrowth = 0;
+	mQueueSampleDepth = depth;
+	mQueueSampleTicks = now;
+	mSecondsToOverflow = mQueueGrowth > 0 ? (mQueue.Capacity() - depth)/mQueueGrowth : -1;
+	if (mSecondsToOverflow >= 0 && mSecondsToOverflow < mOverflowWarnSeconds && now - mOverflowReportTicks > 10*frequency) {
+		str.Format(L"%s: queue full in about %.0f s at the current write rate (%u/%u frames, %.0f more a second)", Name(),
+			mSecondsToOverflow, depth, mQueue.Capacity(), mQueueGrowth);
+		mHost->AddListText(str);
+		mOverflowReportTicks = now;
+	}
+	if (pool.Allocations() > 0) {
+		str.Format(L"%s: %d frame buffer reallocations", Name(), pool.Allocations());
+		mHost->AddListText(str);
+		pool.ResetAllocations();
+	}
+	drops = mOverflow.TakeNewDrops();
+	if (drops > 0) {
+		str.Format(L"%s buffer error! %d frames not queued (%s)", Name(), drops, CFrameOverflow::PolicyName(mOverflow.Policy()));
+		mHost->AddListText(str);
+	}
+	if (*mSession->record == true && mOverflow.HighWaterRaised(percent)) {
+		str.Format(L"%s queue reached %u%% (%u/%u frames)", Name(), percent, mOverflow.HighWater(), mQueue.Capacity());
+		mHost->AddListText(str);
+	}
+}
+
+double CCaptureSource::DiskBytesPerSecond() const
+{ //Sample sizes as OpenVideo() writes them, DIB files drop the low bits
+	cv::Size size = roi.area() > 0 ? roi.size() : cv::Size(mFrameCols, mFrameRows);
+	int channels = mConfig.kind == CAPTURE_BEHAVIOR && !mRaw ? 3 : 1;
+	double sampleBytes = 1;
+	LPCTSTR rateSource;
+	double fps = ConfiguredFPS(rateSource);
+
+	if (!mStreaming)
+		return 0;
+	if (mBits > 8 && mCodec == VIDEO_RAW)
+		sampleBytes = mRawPacked ? mBits/8.0 : 2;
+	else if (mBits > 8 && mCodec == VIDEO_FFV1)
+		sampleBytes = 2;
+	return (double)size.area()*channels*sampleBytes*fps;
+}
+
+CString CCaptureSource::BurstSummary() const
+{ //Geometry is the one streaming negotiated, so a different sensor window shows once the source reconnects
+	CString str;
+	CString limit;
+	LPCTSTR rateSource;
+	double fps = ConfiguredFPS(rateSource);
+	UINT frames = mBurst.Capacity();
+
+	if (frames == 0)
+		return str;
+	if (fps > 0)
+		str.Format(L"%s: burst arena holds %u frames of %dx%d, %.2f s at %.0f fps (%s), %.0f MB%s", Name(), frames, mFrameCols, mFrameRows,
+			frames/fps, fps, rateSource, mBurstPool.Count()*mBurstPool.BufferSize()/1048576.0,
+			(mBurstPool.Backing() & POOL_LOCK_PAGES) != 0 ? L" locked" : L", could not lock");
+	else
+		str.Format(L"%s: burst arena holds %u frames of %dx%d, %.0f MB%s", Name(), frames, mFrameCols, mFrameRows,
+			mBurstPool.Count()*mBurstPool.BufferSize()/1048576.0, (mBurstPool.Backing() & POOL_LOCK_PAGES) != 0 ? L" locked" : L", could not lock");
+	if (mBurstFrames > frames || (fps > 0 && mBurstMs > 1000*frames/fps)) {
+		limit.Format(L", shorter than Burst\\%s asks for", mBurstFrames > frames ? L"Frames" : L"DurationMs");
+		str += limit;
+	}
+	return str;
+}
+
+CString CCaptureSource::Summary() const
+{
+	CString str;
+
+	str.Format(L"%s: %d frames dropped, %d spilled, %.1f s blocked, queue high water %u/%u",
+		Name(), mOverflow.Dropped(), mOverflow.Spilled(), mOverflow.BlockedSeconds(), mOverflow.HighWater(), mQueue.Capacity());
+	if (mOverflow.SpillErrors() > 0)
+		str.AppendFormat(L", %d spilled frames could not be written to %s_spill.raw", mOverflow.SpillErrors(),
+			(LPCTSTR)CString(mFileBase.c_str()));
+	return str;
+}
+
+void CCaptureSource::WaitDisplayTick(LARGE_INTEGER& nextTime)
+{ //Sleeps until the next display refresh. nextTime is advanced by one displayMaxFPS period.
+	const LARGE_INTEGER& frequency = mSession->frequency;
+	LARGE_INTEGER currentTime;
+
+	nextTime.QuadPart += frequency.QuadPart/mSession->displayMaxFPS;
+	QueryPerformanceCounter(&currentTime);
+	if (currentTime.QuadPart < nextTime.QuadPart)
+		Sleep((DWORD)(1000*(nextTime.QuadPart - currentTime.QuadPart)/frequency.QuadPart));
+	else
+		nextTime = currentTime; //fell behind, don't try to catch up
+}
+
+void CCaptureSource::OpenVideo(VideoSegment& segment, int fileNumber)
+{ //Writer thread for the first file, the segment thread for the others //Scopes are written as gray at the depth they deliver, behavior cameras in colour
+	std::string fileName = mFileBase + std::to_string(fileNumber);
+	cv::Size size = roi.area() > 0 ? roi.size() : cv::Size(mFrameCols, mFrameRows);
+	RawFileHeader header;
+	ULONGLONG frameBytes = (ULONGLONG)size.area()*(mConfig.kind == CAPTURE_BEHAVIOR && !mRaw ? 3 : 1)*(mBits > 8 ? 2 : 1);
+	int preallocate = mMaxFramesPerFile;
+	LPCTSTR rateSource;
+	double fps = NominalFPS(segment, rateSource);
+	bool opened;
+	CString str;
+	cv::VideoWriter& video = segment.video;
+	CFFV1Writer& ffv1 = segment.ffv1;
+	CRawFrameWriter& raw = segment.raw;
+	CStripedRawWriter& striped = segment.striped;
+
+	segment.fileNumber = fileNumber;
+	segment.frames = 0;
+	segment.bytes = 0;
+	segment.firstTimeMs = 0;
+	segment.lastTimeMs = 0;
+
+	if (mCodec == VIDEO_FFV1) {
+		fileName += ".mkv";
+		opened = ffv1.Open(fileName, size, mConfig.kind == CAPTURE_BEHAVIOR, mBits, fps);
+	}
+	else if (mCodec == VIDEO_RAW) {
+		fileName += ".msraw";
+		memset(&header, 0, sizeof header);
+		header.width = size.width;
+		header.height = size.height;
+		header.bitDepth = mBits;
+		header.packing = mBits > 8 && mRawPacked ? RAW_PACK_MIPI : RAW_PACK_NONE;
+		header.channels = mConfig.kind == CAPTURE_BEHAVIOR && !mRaw ? 3 : 1;
+		header.device = mConfig.device;
+		header.firmwareFPS = firmwareFPS;
+		header.firmwareWindow = firmwareWindow;
+		header.tickFrequency = mSession->frequency.QuadPart;
+		header.startTicks = mSession->startOfRecord->QuadPart;
+		header.rateMilliHz = (uint32_t)(fps*1000 + 0.5);
+		strncpy_s(header.name, CT2CA(mConfig.name), _TRUNCATE);
+		// The whole part is reserved up front, a recording that stops early gives the rest back.
+		// Without a frame limit as many frames as the size limit allows, or a time limit spans.
+		if (preallocate <= 0 && mSegmentBytes > 0)
+			preallocate = (int)(mSegmentBytes/max(frameBytes, 1ULL) + 1);
+		else if (preallocate <= 0 && mSegmentMs > 0)
+			preallocate = (int)(mSegmentMs*fps/1000 + 1);
+		else if (preallocate <= 0)
+			preallocate = 1000;
+		if (IsStriping()) {
+			segment.partNames = StripeParts(fileNumber);
+			fileName = segment.partNames[0];
+			opened = striped.Open(segment.partNames, header, preallocate, (RawWriteMode)mRawWriteMode);
+		}
+		else
+			opened = raw.Open(fileName, header, preallocate, (RawWriteMode)mRawWriteMode);
+		if (opened && fileNumber == 1 && (IsStriping() ? striped.Mode() : raw.Mode()) != mRawWriteMode) {
+			str.Format(L"%s: %S writes not available, using %S", Name(), CRawFrameWriter::ModeName((RawWriteMode)mRawWriteMode),
+				CRawFrameWriter::ModeName(IsStriping() ? striped.Mode() : raw.Mode()));
+			mHost->AddListText(str);
+		}
+		if (opened && (IsStriping() ? striped.IsBuffered() : raw.IsBuffered()) && mRawWriteMode != RAW_WRITE_BUFFERED) {
+			str.Format(L"%s: unbuffered writes not supported for %S, using the file cache", Name(), fileName.c_str());
+			mHost->AddListText(str);
+		}
+	}
+	else {
+		fileName += ".avi";
+		// AVI has no per frame times, players get the rate from the header and timestamp.dat has the rest
+		opened = video.open(fileName, CV_FOURCC('D', 'I', 'B', ' '), fps, size, mConfig.kind == CAPTURE_BEHAVIOR);
+		if (opened && mBits > 8 && fileNumber == 1) {
+			str.Format(L"%s: DIB files hold 8 bits, the low %d bits of each sample are not recorded", Name(), mBits - 8);
+			mHost->AddListText(str);
+		}
+	}
+	segment.fileName = fileName;
+	if (opened && fileNumber == 1) {
+		str.Format(L"%s: files stamped at %.2f fps (%s)", Name(), fps, rateSource);
+		mHost->AddListText(str);
+	}
+	if (opened == false) {
+		str.Format(L"%s: could not create %S", Name(), fileName.c_str());
+		if (mCodec == VIDEO_RAW)
+			str += L" (" + CString(IsStriping() ? striped.LastError().c_str() : raw.LastError().c_str()) + L")";
+		mHost->AddListText(str);
+	}
+}
+
+double CCaptureSource::NominalFPS(const VideoSegment& segment, LPCTSTR& source) const
+{ //The first two files of a recording are opened before it has frames, they go by the setting or what streaming measured.
+  //The 20 fps every file used to get is only left for an input that neither sets, reports nor delivers a rate.
+	double fps;
+
+	if (segment.frames > 1 && segment.lastTimeMs > segment.firstTimeMs) {
+		source = L"measured over the file before";
+		return 1000.0*(segment.frames - 1)/(segment.lastTimeMs - segment.firstTimeMs);
+	}
+	fps = ConfiguredFPS(source);
+	if (fps > 0)
+		return fps;
+	source = L"default";
+	return 20;
+}
+
+double CCaptureSource::ConfiguredFPS(LPCTSTR& source) const
+{
+	if (firmwareFPS > 0) {
+		source = L"scope setting";
+		return firmwareFPS;
+	}
+	if (mGrabIntervalNs > 0) {
+		source = L"measured while streaming";
+		return 1e9/mGrabIntervalNs;
+	}
+	if (mReportedFPS > 0) {
+		source = L"reported by the camera";
+		return mReportedFPS;
+	}
+	source = L"unknown";
+	return 0;
+}
+
+void CCaptureSource::CloseVideo(VideoSegment& segment)
+{
+	CString str;
+
+	segment.video.release();
+	if (!segment.ffv1.Release()) {
+		str.Format(L"%s: FFV1 file %d not finished, a write failed", Name(), segment.fileNumber);
+		mHost->AddListText(str);
+	}
+	if (segment.raw.IsOpened() && !segment.raw.Close()) {
+		str.Format(L"%s: raw file not finished, %S", Name(), segment.raw.LastError().c_str());
+		mHost->AddListText(str);
+	}
+	if (segment.striped.IsOpened() && !segment.striped.Close()) {
+		str.Format(L"%s: striped raw file %d not finished, %S", Name(), segment.fileNumber, segment.striped.LastError().c_str());
+		mHost->AddListText(str);
+	}
+}
+
+std::vector<std::string> CCaptureSource::StripeParts(int fileNumber) const
+{ //<folder>\<recording's file base><n>_s<lane>.msraw. The base loses its drive so it fits under any folder,
+  //and the lane keeps the names apart once the parts are gathered into one folder.
+	std::string base = mFileBase;
+	std::vector<std::string> names;
+
+	if (base.size() > 1 && base[1] == ':')
+		base.erase(0, 2);
+	while (!base.empty() && (base[0] == '\\' || base[0] == '/'))
+		base.erase(0, 1);
+	for (size_t i = 0; i < mStripeFolders.size(); i++)
+		names.push_back(std::string(CT2CA(mStripeFolders[i])) + "\\" + base + std::to_string(fileNumber) + "_s" + std::to_string((int)i) + ".msraw");
+	return names;
+}
+
+void CCaptureSource::OpenStripeManifest()
+{ //Next to the recording's other files, so it moves with them
+	CString str;
+	CString folder;
+	std::vector<std::string> parts = StripeParts(1);
+
+	for (size_t i = 0; i < parts.size(); i++) {
+		folder = parts[i].c_str();
+		CreateFolderPath(folder.Left(folder.ReverseFind(L'\\')));
+	}
+	str = CString(mFileBase.c_str()) + L".msstripe";
+	if (!mStripeManifest.Open(str, CFile::modeCreate|CFile::modeWrite|CFile::typeText, NULL)) {
+		mHost->AddListText(L"Could not create " + str);
+		return;
+	}
+	mStripeManifest.WriteString(L"msstripe 1\n");
+	str.Format(L"stripe %u\n", mStripeFrames);
+	mStripeManifest.WriteString(str);
+	mStripeManifest.Flush();
+}
+
+void CCaptureSource::ListStripeParts(const VideoSegment& segment)
+{ //Only files the writer got to are listed, the one made ready for frames that never came is deleted
+	CString str;
+
+	if (mStripeManifest.m_pStream == NULL || !segment.striped.IsOpened())
+		return;
+	for (size_t i = 0; i < segment.partNames.size(); i++) {
+		str.Format(L"part %d %u %S\n", segment.fileNumber, (UINT)i, segment.partNames[i].c_str());
+		mStripeManifest.WriteString(str);
+	}
+	mStripeManifest.Flush();
+}
+
+void CCaptureSource::QueueSegment(VideoSegment* retired, int fileNumber)
+{
+	mSegmentIdle.ResetEvent();
+	mSegmentJob = retired;
+	mSegmentFile = fileNumber;
+	mSegmentWake.SetEvent();
+}
+
+void CCaptureSource::WaitSegment()
+{
+	WaitForSingleObject(mSegmentIdle, INFINITE);
+}
+
+UINT CCaptureSource::SegmentThread(LPVOID pParam)
+{ //Finishes the file the writer just left and creates the one it will need next, so the writer only swaps pointers
+	CCaptureSource* self = (CCaptureSource*)pParam;
+	LONGLONG traceBegin;
+
+	TraceThreadName(CString(self->Name()) + L" segments");
+	while (1) {
+		WaitForSingleObject(self->mSegmentWake, INFINITE);
+		if (self->mSegmentStop)
+			break;
+		traceBegin = TraceNow();
+		self->CloseVideo(*self->mSegmentJob);
+		TraceSpan("close file", traceBegin);
+		if (self->mSegmentFile > 0) {
+			traceBegin = TraceNow();
+			self->OpenVideo(*self->mSegmentJob, self->mSegmentFile);
+			TraceSpan("open file", traceBegin);
+		}
+		self->mSegmentIdle.SetEvent();
+	}
+	return 0;
+}
+
+UINT CCaptureSource::CaptureThread(LPVOID pParam)
+{
+	CCaptureSource* self = (CCaptureSource*)pParam;
+	const CaptureSession& session = *self->mSession;
+	FrameSlot* slot;
+	cv::Mat sample;
+	cv::Mat raw; //YUY2 as the camera sent it, only used with raw capture
+	uchar* before;
+	bool status;
+	bool recording;
+	bool wasRecording = false;
+	bool windowed;
+	bool bursting;
+	UINT kept;
+	UINT capTime;
+	CString str;
+	LONGLONG traceBegin;
+	UINT traceFrame;
+
+	LARGE_INTEGER threadStart;
+	LARGE_INTEGER previousTime;
+	LARGE_INTEGER currentTime;
+	LARGE_INTEGER retrievedTime;
+	LARGE_INTEGER lastPublishTime;
+	LONGLONG publishInterval;
+	double grabInterval = 0;
+	double interval;
+	QueryPerformanceCounter(&threadStart);
+	TraceThreadName(CString(self->Name()) + L" capture");
+	lastPublishTime.QuadPart = 0;
+	publishInterval = session.frequency.QuadPart/session.displayMaxFPS;
+
+	self->mGrabIntervalNs = 0;
+	self->mReportedFPS = self->mInput->get(CV_CAP_PROP_FPS);
+	if (!self->ReadSample(sample) || !self->InitFrameBuffers(sample, self->mReportedFPS)) {
+		if (!self->mConfig.input.IsEmpty())
+			str.Format(L"%s: no frame from %s", self->Name(), (LPCTSTR)self->mConfig.input);
+		else
+			str.Format(L"%s: no frame from camera %d", self->Name(), self->mConfig.device);
+		self->mHost->AddListText(str);
+		self->mConnected = false;
+		self->mThreadCPU[THREAD_CAPTURE] = ThreadCPUPercent(threadStart, session.frequency);
+		self->mHost->SourceLost(*self);
+		return 0;
+	}
+
+	// Everything the capture and display loops write into is borrowed from the pool so steady state streaming never allocates
+	self->mOverflow.OverflowSlot().frame = self->pool.Borrow(sample.rows, sample.cols, sample.type());
+	self->mMailbox.Init(self->pool.Borrow(sample.rows, sample.cols, sample.type()),
+		self->pool.Borrow(sample.rows, sample.cols, sample.type()),
+		self->pool.Borrow(sample.rows, sample.cols, sample.type()));
+	self->mDisplayThread = StartThread(DisplayThread, (LPVOID)self, THREAD_PRIORITY_NORMAL);
+	self->mStreaming = true;
+
+	QueryPerformanceCounter(&currentTime);
+	while (self->mStopping == false) {
+		self->mHost->PollTrigger(*self);
+
+		traceBegin = TraceNow();
+		status = self->mInput->grab();
+		// Read once, so a frame is either windowed or queued even if the flag changes under it
+		recording = *session.record;
+		if (recording && !wasRecording) {
+			// The window's frames since startOfRecord become the recording's first, ahead of anything queued
+			kept = self->mPreTrigger.Freeze(session.startOfRecord->QuadPart, session.frequency.QuadPart);
+			self->mOverflow.ReserveFrameNums(kept);
+			InterlockedExchangeAdd(&self->mFramesGrabbed, kept);
+			if (self->mBurst.Capacity() > 0)
+				self->mBurst.Start(self->mBurstFrames, self->mBurstMs);
+		}
+		else if (!recording && wasRecording)
+			self->mBurst.Complete();
+		wasRecording = recording;
+		traceFrame = recording ? self->mOverflow.NextFrameNum() : 0;
+		TraceSpan("grab", traceBegin, traceFrame);
+		if (status == false) {
+			str.Format(L"%s frame grab error!", self->Name());
+			self->mHost->AddListText(str);
+			self->mStreaming = false;
+			self->mConnected = false;
+			self->mThreadCPU[THREAD_CAPTURE] = ThreadCPUPercent(threadStart, session.frequency);
+			self->mHost->SourceLost(*self);
+			return 0;
+		}
+
+		previousTime = currentTime;
+		QueryPerformanceCounter(&currentTime);
+		if (currentTime.QuadPart > previousTime.QuadPart) {
+			self->mCurrentFPS = (UINT)(session.frequency.QuadPart/(currentTime.QuadPart - previousTime.QuadPart));
+			interval = 1e9*(currentTime.QuadPart - previousTime.QuadPart)/session.frequency.QuadPart;
+			grabInterval = grabInterval > 0 ? grabInterval + (interval - grabInterval)/16 : interval;
+			self->mGrabIntervalNs = (LONG)min(grabInterval, 2e9);
+		}
+
+		traceBegin = TraceNow();
+		capTime = (UINT)(1000*((double)currentTime.QuadPart - session.startOfRecord->QuadPart)/session.frequency.QuadPart);
+		slot = !recording && *session.armed ? self->mPreTrigger.BeginWrite() : NULL;
+		windowed = slot != NULL;
+		// A burst recording goes to the arena only. Frames after it are not recorded, and not dropped either.
+		bursting = recording && self->mBurst.Capacity() > 0;
+		if (bursting) {
+			slot = self->mBurst.BeginWrite(capTime);
+			if (slot == NULL)
+				slot = &self->mOverflow.OverflowSlot();
+		}
+		else if (slot == NULL)
+			slot = self->mOverflow.BeginWrite(recording, *session.record);
+		TraceSpan("reserve", traceBegin, traceFrame);
+		slot->capTime = capTime;
+		slot->grabTicks = currentTime.QuadPart;
+		if (self->Retrieve(slot->frame, raw, traceFrame) == false) {
+			InterlockedIncrement(&self->mRetrieveErrors);
+			str.Format(L"%s frame retrieve error! reconnecting", self->Name());
+			self->mHost->AddListText(str);
+			self->Reopen();
+			continue;
+		}
+		if (recording) {
+			QueryPerformanceCounter(&retrievedTime);
+			self->mLatency[STAGE_RETRIEVE].Record(retrievedTime.QuadPart - currentTime.QuadPart, session.frequency.QuadPart);
+		}
+
+		// Hand the display thread the newest frame, at most at its refresh rate.
+		// It renders on its own time so a slow repaint never delays the next grab.
+		if (currentTime.QuadPart - lastPublishTime.QuadPart >= publishInterval) {
+			traceBegin = TraceNow();
+			before = self->mMailbox.Back().data;
+			slot->frame.copyTo(self->mMailbox.Back());
+			self->pool.Track(self->mMailbox.Back(), before);
+			self->mMailbox.Publish();
+			TraceSpan("publish", traceBegin, traceFrame);
+			lastPublishTime = currentTime;
+		}
+
+		if (windowed)
+			self->mPreTrigger.CommitWrite();
+		else if (bursting) {
+			if (slot != &self->mOverflow.OverflowSlot()) {
+				InterlockedIncrement(&self->mFramesGrabbed);
+				slot->frameNum = self->mOverflow.NextFrameNum();
+				self->mOverflow.ReserveFrameNums(1);
+				self->mBurst.CommitWrite();
+			}
+		}
+		else if (recording) {
+			InterlockedIncrement(&self->mFramesGrabbed);
+			traceBegin = TraceNow();
+			self->mOverflow.Commit(slot);
+			TraceSpan("enqueue", traceBegin, traceFrame);
+		}
+	}
+	self->mThreadCPU[THREAD_CAPTURE] = ThreadCPUPercent(threadStart, session.frequency);
+	return 0;
+}
+
+UINT CCaptureSource::DisplayThread(LPVOID pParam)
+{ //Hands the host the newest frame CaptureThread published, at no more than displayMaxFPS
+	CCaptureSource* self = (CCaptureSource*)pParam;
+	const CaptureSession& session = *self->mSession;
+	LARGE_INTEGER threadStart;
+	LARGE_INTEGER nextTime;
+	LARGE_INTEGER drawTime;
+	LARGE_INTEGER shownTime;
+	bool recording;
+
+	QueryPerformanceCounter(&threadStart);
+	TraceThreadName(CString(self->Name()) + L" display");
+	nextTime = threadStart;
+	while (self->mConnected == true) {
+		self->WaitDisplayTick(nextTime);
+		if (self->mMailbox.Fetch() == false)
+			continue;
+		recording = *session.record;
+		QueryPerformanceCounter(&drawTime);
+		self->mHost->ShowFrame(*self, self->mMailbox.Front());
+		TraceSpan("display", drawTime.QuadPart);
+		if (recording == true) {
+			QueryPerformanceCounter(&shownTime);
+			self->mLatency[STAGE_DISPLAY].Record(shownTime.QuadPart - drawTime.QuadPart, session.frequency.QuadPart);
+		}
+	}
+	self->mThreadCPU[THREAD_DISPLAY] = ThreadCPUPercent(threadStart, session.frequency);
+	return 0;
+}
+
+UINT CCaptureSource::WriterThread(LPVOID pParam)
+{ //Drains the queue to disk. Never waits on another source's writer, so one stalled camera cannot cost the others frames.
+	CCaptureSource* self = (CCaptureSource*)pParam;
+	const CaptureSession& session = *self->mSession;
+	VideoSegment segments[2];
+	VideoSegment* segment = &segments[0];
+	VideoSegment* spare;
+	RawFrameHeader record;
+	TimestampRecord timestamps[TIMESTAMP_BATCH];
+	int batched = 0;
+	UINT lastCaptureFrame = 0;
+	UINT flags = TIMESTAMP_NEW_FILE;
+	cv::Mat narrow;
+	FrameSlot* slot;
+	UINT windowFrames;
+	UINT windowNext = 0;
+	bool windowed;
+	UINT burstFrames;
+	UINT burstNext = 0;
+	bool bursted;
+	LARGE_INTEGER threadStart;
+	LARGE_INTEGER takenTime;
+	LARGE_INTEGER encodedTime;
+	LARGE_INTEGER writtenTime;
+	LARGE_INTEGER rolledTime;
+	LONGLONG encodeTicks = 0;
+	LONGLONG traceBegin;
+
+	CString str;
+	int frameCount = 0;
+
+	QueryPerformanceCounter(&threadStart);
+	TraceThreadName(CString(self->Name()) + L" writer");
+	// A burst is written once it is all in RAM, so not even the files are created while its frames come in
+	while (self->mBurst.Capacity() > 0 && !self->mBurst.IsComplete() && (*session.record == true || self->mBurst.IsFilling()) &&
+		self->mStreaming)
+		Sleep(10);
+	burstFrames = self->mBurst.IsComplete() ? self->mBurst.Count() : 0;
+	if (burstFrames > 0) {
+		str.Format(L"%s: burst of %u frames over %.2f s in RAM, writing it", self->Name(), burstFrames,
+			(double)(self->mBurst.Frame(burstFrames - 1).grabTicks - self->mBurst.Frame(0).grabTicks)/session.frequency.QuadPart);
+		self->mHost->AddListText(str);
+	}
+	else
+		self->mBurst.Release();
+	// Both files share one encoder, so FFV1 does not start a second set of slice threads
+	segments[0].ffv1.SetThreads(self->mFFV1Threads, self->mFFV1Slices);
+	segments[1].ffv1.ShareEncoder(segments[0].ffv1);
+	// Each file's parts queue pool buffers, which then change places with the source's queue
+	if (self->IsStriping()) {
+		for (int i = 0; i < 2; i++) {
+			// The segment thread opens one file while the other is still written, so their lanes trace apart
+			str.Format(L"%s file %c", self->Name(), L'A' + i);
+			segments[i].striped.Init((UINT)self->mStripeFolders.size(), self->mStripeFrames, str);
+			for (UINT j = 0; j < segments[i].striped.SlotCount(); j++) {
+				cv::Mat& buffer = segments[i].striped.Slot(j).frame;
+				buffer = self->pool.Borrow(self->mFrameRows, self->mFrameCols, self->mFrameType);
+				if (buffer.empty())
+					buffer.create(self->mFrameRows, self->mFrameCols, self->mFrameType);
+			}
+		}
+		self->OpenStripeManifest();
+	}
+	else if (!self->mStripeFolders.empty()) {
+		str.Format(L"%s: only RAW files are striped, writing to the data folder", self->Name());
+		self->mHost->AddListText(str);
+	}
+	self->OpenVideo(segments[0], 1);
+	self->ListStripeParts(segments[0]);
+	self->mSegmentStop = false;
+	self->mSegmentIdle.SetEvent();
+	self->mSegmentThread = StartThread(SegmentThread, (LPVOID)self, THREAD_PRIORITY_NORMAL);
+	self->QueueSegment(&segments[1], 2);
+	memset(&record, 0, sizeof record);
+	// The capture thread freezes the pre-trigger window on its first frame of the recording, before it queues any
+	while (self->mPreTrigger.Capacity() > 0 && !self->mPreTrigger.IsFrozen() && *session.record == true && self->mStreaming)
+		Sleep(1);
+	windowFrames = self->mPreTrigger.IsFrozen() ? self->mPreTrigger.KeptCount() : 0;
+	if (windowFrames > 0) {
+		str.Format(L"%s: %u frames from the %.2f s before the trigger written ahead of live frames", self->Name(), windowFrames,
+			(double)(self->mPreTrigger.Kept(windowFrames - 1).grabTicks - self->mPreTrigger.Kept(0).grabTicks)/session.frequency.QuadPart);
+		self->mHost->AddListText(str);
+	}
+	else
+		self->mPreTrigger.Release();
+	while (1) {
+		self->mOverflow.FlushDrops(*session.droppedFile, *session.fileCS, self->mConfig.device);
+		traceBegin = TraceNow();
+		windowed = windowNext < windowFrames;
+		bursted = !windowed && burstNext < burstFrames;
+		slot = windowed ? &self->mPreTrigger.Kept(windowNext) : bursted ? &self->mBurst.Frame(burstNext) : self->mQueue.Front();
+		if (slot != NULL) {
+			QueryPerformanceCounter(&takenTime);
+			TraceSpan("dequeue", traceBegin, slot->frameNum);
+			frameCount++;
+			self->mFramesWritten = frameCount;
+
+			// A full file is swapped for the one the segment thread has ready, which then finishes the
+			// full one and creates the file after. The writer only waits if that took longer than a file.
+			if (segment->frames > 0 && ((self->mMaxFramesPerFile > 0 && segment->frames >= self->mMaxFramesPerFile) ||
+				(self->mSegmentBytes > 0 && segment->bytes >= self->mSegmentBytes) ||
+				(self->mSegmentMs > 0 && slot->capTime - segment->firstTimeMs >= self->mSegmentMs))) {
+				traceBegin = TraceNow();
+				self->WaitSegment();
+				spare = segment;
+				segment = spare == &segments[0] ? &segments[1] : &segments[0];
+				self->QueueSegment(spare, segment->fileNumber + 1);
+				self->ListStripeParts(*segment);
+				QueryPerformanceCounter(&rolledTime);
+				self->mLatency[STAGE_ROLLOVER].Record(rolledTime.QuadPart - takenTime.QuadPart, session.frequency.QuadPart);
+				TraceSpan("rollover", traceBegin, slot->frameNum);
+				flags = TIMESTAMP_NEW_FILE;
+			}
+
+			// OpenCV encodes and writes the file in the same call, and so does FFV1 once every slice is coded
+			traceBegin = TraceNow();
+			cv::Mat frame = self->roi.area() > 0 ? slot->frame(self->roi) : slot->frame;
+			if (self->mCodec == VIDEO_FFV1) {
+				if (!segment->ffv1.Write(frame, slot->capTime))
+					flags |= TIMESTAMP_NOT_WRITTEN;
+			}
+			else if (self->mCodec == VIDEO_RAW) {
+				record.frameNumber = frameCount;
+				record.captureFrame = slot->frameNum;
+				record.capTimeMs = slot->capTime;
+				record.hostTicks = slot->grabTicks;
+				// A failed write closes the part so the frames before it keep their index. Striped, the
+				// frame only changes hands, so the disk stage is timed to the handoff.
+				if (!segment->raw.IsOpened() && !segment->striped.IsOpened())
+					flags |= TIMESTAMP_NOT_WRITTEN;
+				else if (segment->striped.IsOpened() ? !segment->striped.Write(record, slot->frame, self->roi, windowed || bursted) :
+					!segment->raw.Write(record, frame)) {
+					str.Format(L"%s: raw write failed at frame %d, %S", self->Name(), frameCount,
+						segment->striped.IsOpened() ? segment->striped.LastError().c_str() : segment->raw.LastError().c_str());
+					self->mHost->AddListText(str);
+					self->CloseVideo(*segment);
+					flags |= TIMESTAMP_NOT_WRITTEN;
+				}
+			}
+			else if (!segment->video.isOpened())
+				flags |= TIMESTAMP_NOT_WRITTEN;
+			else if (frame.depth() == CV_16U) {
+				frame.convertTo(narrow, CV_8U, 1.0/(1 << (self->mBits - 8)));
+				segment->video.write(narrow);
+			}
+			else
+				segment->video.write(frame);
+			TraceSpan("encode", traceBegin, slot->frameNum);
+			if (segment->frames++ == 0)
+				segment->firstTimeMs = slot->capTime;
+			segment->lastTimeMs = slot->capTime;
+			if (self->mCodec == VIDEO_FFV1)
+				segment->bytes = segment->ffv1.BytesWritten();
+			else if (self->mCodec == VIDEO_RAW)
+				segment->bytes = self->IsStriping() ? segment->striped.BytesWritten() : segment->raw.BytesWritten();
+			else
+				segment->bytes += frame.total()*frame.elemSize();
+			QueryPerformanceCounter(&encodedTime);
+			encodeTicks += encodedTime.QuadPart - takenTime.QuadPart;
+			self->mRawBytesWritten += frame.total()*frame.elemSize();
+
+			// Batched, so the writers share the log's lock once every TIMESTAMP_BATCH frames
+			traceBegin = TraceNow();
+			if (slot->frameNum != lastCaptureFrame + 1)
+				flags |= TIMESTAMP_FRAMES_LOST;
+			if (windowed)
+				flags |= TIMESTAMP_PRE_TRIGGER;
+			lastCaptureFrame = slot->frameNum;
+			TimestampRecord& timestamp = timestamps[batched++];
+			timestamp.camera = self->mConfig.device;
+			timestamp.frameNumber = frameCount;
+			timestamp.captureFrame = slot->frameNum;
+			timestamp.capTimeMs = slot->capTime;
+			timestamp.hostTicks = slot->grabTicks;
+			timestamp.deviceTimestamp = 0;
+			timestamp.queueDepth = self->mQueue.Size();
+			timestamp.flags = flags;
+			flags = 0;
+			if (batched == TIMESTAMP_BATCH) {
+				session.tsLog->Append(timestamps, batched);
+				batched = 0;
+			}
+			TraceSpan("timestamp", traceBegin, slot->frameNum);
+
+			QueryPerformanceCounter(&writtenTime);
+			self->mLatency[STAGE_WRITE].Record(writtenTime.QuadPart - takenTime.QuadPart, session.frequency.QuadPart);
+			if (windowed) {
+				// Window and burst frames waited in RAM on purpose, which says nothing about the queue or the disk
+				if (++windowNext == windowFrames)
+					self->mPreTrigger.Release();
+			}
+			else if (bursted) {
+				if (++burstNext == burstFrames)
+					self->mBurst.Release();
+			}
+			else {
+				self->mLatency[STAGE_QUEUE].Record(takenTime.QuadPart - slot->grabTicks, session.frequency.QuadPart);
+				self->mLatency[STAGE_DISK].Record(writtenTime.QuadPart - slot->grabTicks, session.frequency.QuadPart);
+				self->mQueue.Pop();
+				self->mOverflow.NotifySpace();
+			}
+			self->mWriteRate.Count();
+			continue;
+		}
+		// Nothing pending, so the log gets what is batched before the writer sleeps
+		if (batched > 0) {
+			session.tsLog->Append(timestamps, batched);
+			batched = 0;
+		}
+		if (*session.record == false)
+			break;
+		// Nothing pending. Sleep until the capture thread has queued a batch or recording stops.
+		self->mWriterSignal.PrepareWait();
+		if (*session.record == true && self->mQueue.Size() == 0)
+			self->mWriterSignal.Wait(WRITER_IDLE_TIMEOUT);
+		else
+			self->mWriterSignal.CancelWait();
+	}
+
+	// The file made ready for frames that never came goes again
+	self->WaitSegment();
+	self->mSegmentStop = true;
+	self->mSegmentWake.SetEvent();
+	JoinThread(self->mSegmentThread);
+	self->CloseVideo(*segment);
+	spare = segment == &segments[0] ? &segments[1] : &segments[0];
+	if (spare->frames == 0 && spare->fileNumber > segment->fileNumber) {
+		self->CloseVideo(*spare);
+		DeleteFile(CString(spare->fileName.c_str()));
+		for (size_t i = 1; i < spare->partNames.size(); i++)
+			DeleteFile(CString(spare->partNames[i].c_str()));
+	}
+	for (int i = 0; i < 2; i++) {
+		for (UINT j = 0; j < segments[i].striped.SlotCount(); j++)
+			self->pool.Return(segments[i].striped.Slot(j).frame);
+	}
+	if (self->mStripeManifest.m_pStream != NULL)
+		self->mStripeManifest.Close();
+	self->mPreTrigger.Release();
+	self->mBurst.Release();
+	self->mEncodeSeconds = (double)encodeTicks/session.frequency.QuadPart;
+	self->mOverflow.FinishSpill();
+	self->mOverflow.FlushDrops(*session.droppedFile, *session.fileCS, self->mConfig.device);
+	self->mThreadCPU[THREAD_WRITER] = ThreadCPUPercent(threadStart, session.frequency);
+	self->mHost->WriterFinished(*self);
+	return 0;
+}
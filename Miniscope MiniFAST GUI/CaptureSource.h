@@ -0,0 +1,285 @@
+// CaptureSource.h : one camera and everything that moves its frames to disk
+//
+
+#pragma once
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+#include "opencv2/videoio.hpp"
+#include "FrameQueue.h"
+#include "FrameOverflow.h"
+#include "BurstArena.h"
+#include "FramePool.h"
+#include "FrameMailbox.h"
+#include "PreTriggerRing.h"
+#include "RateMeter.h"
+#include "LatencyHistogram.h"
+
+#define QUEUE_BUDGET_MB 512		//default RAM per stream for queued frames, see InitFrameBuffers
+#define PRETRIGGER_BUDGET_MB 256	//default RAM per stream for the pre-trigger window
+#define MIN_QUEUE_FRAMES 2
+#define SOURCE_SPARE_BUFFERS 6	//overflow slot, three mailbox buffers and two for the host to draw the display in
+#define MAX_CAPTURE_SOURCES 8
+
+enum CaptureKind {
+	CAPTURE_SCOPE = 0,
+	CAPTURE_BEHAVIOR,
+	CAPTURE_KIND_COUNT
+};
+
+// Per frame latencies a source measures while recording, see Latency()
+enum PipelineStage {
+	STAGE_RETRIEVE = 0,	// grab returned -> frame converted into its queue slot
+	STAGE_QUEUE,		// grab returned -> writer takes the frame off the queue
+	STAGE_WRITE,		// writer handing the frame to the video file and logging its timestamp
+	STAGE_DISK,			// grab returned -> frame written
+	STAGE_DISPLAY,		// host drawing one display frame
+	STAGE_ROLLOVER,		// writer switching to the next video file, once per file
+	PIPELINE_STAGE_COUNT
+};
+
+// How a source's video files are written, Writer\<cam>Codec in the app profile
+enum VideoCodec {
+	VIDEO_DIB = 0,		// uncompressed AVI through OpenCV, <prefix><n>.avi
+	VIDEO_FFV1,			// lossless FFV1 in Matroska on a pool of slice threads, <prefix><n>.mkv, see FFV1Writer.h
+	VIDEO_RAW,			// frames as captured in an indexed raw container, <prefix><n>.msraw, see RawFrameFile.h
+	VIDEO_CODEC_COUNT
+};
+
+enum SourceThread {
+	THREAD_CAPTURE = 0,
+	THREAD_DISPLAY,
+	THREAD_WRITER,
+	SOURCE_THREAD_COUNT
+};
+
+struct CaptureSourceConfig {
+	CString name;		// window title, file prefix and app profile key, e.g. msCam
+	CaptureKind kind;
+	int device;			// cv::VideoCapture index, also the camNum column of timestamp.dat
+	bool rawCapture;	// CONVERT_RGB off, keep only the Y plane of the YUY2 stream
+	int bitDepth;		// sensor samples, 10 and 12 need rawCapture and keep frames as CV_16UC1
+	CString input;		// empty for the camera, usb,<cols>x<rows> for the scope over libusb, see CreateUSBCapture,
+						// else a synthetic input spec, see CreateSyntheticCapture
+};
+
+class CTimestampLog;
+
+// Owned by the host and shared by every source while recording
+struct CaptureSession {
+	volatile bool* record;
+	volatile bool* armed;		// a trigger starts the next recording, sources keep their pre-trigger windows
+	const LARGE_INTEGER* startOfRecord;	// goes back by the pre-trigger window for a triggered recording
+	LARGE_INTEGER frequency;
+	UINT displayMaxFPS;
+	CTimestampLog* tsLog;
+	CStdioFile* droppedFile;
+	CCriticalSection* fileCS;	// guards droppedFile
+};
+
+class CCaptureSource;
+class CSyntheticCapture;
+struct VideoSegment;
+
+// What a source needs from the application, called on the source's own threads
+class CCaptureHost
+{
+public:
+	virtual ~CCaptureHost() {}
+	virtual void AddListText(CString str) = 0;
+	// Capture thread, before every grab. Lets a scope's trigger input start and stop recordings,
+	// so it must not wait on the UI thread.
+	virtual void PollTrigger(CCaptureSource& source) = 0;
+	// Display thread, at most displayMaxFPS times a second with the newest frame.
+	// The frame is the display's own copy and may be drawn on.
+	virtual void ShowFrame(CCaptureSource& source, cv::Mat& frame) = 0;
+	// Capture thread, once the camera stopped delivering frames. The source is disconnected by then.
+	virtual void SourceLost(CCaptureSource& source) = 0;
+	// Writer thread, once the queue is drained and the files are closed after a recording
+	virtual void WriterFinished(CCaptureSource& source) = 0;
+};
+
+// Every source has its own capture, display and writer threads, queue, pool and
+// statistics, so sources only meet at the shared timestamp and dropped frame files
+// and any number of them scale until the USB bus or the disk runs out.
+class CCaptureSource
+{
+public:
+	CCaptureSource();
+	~CCaptureSource();
+
+	// UI thread, while the source is not connected
+	void Init(const CaptureSourceConfig& config, CCaptureHost* host, const CaptureSession* session);
+	bool Open();
+	// Starts the capture thread, which sizes every frame buffer from the first frame and then starts the display
+	void StartCapture();
+	// Stops the capture and display threads and releases the input. Not while recording.
+	void Close();
+	bool IsConnected() const { return mConnected; }
+	// Frame buffers are sized and frames are flowing, so the source can record
+	bool IsStreaming() const { return mStreaming; }
+	bool IsSynthetic() const { return mSynthetic != NULL; }
+
+	// UI thread. PrepareRecording before the session's record flag goes true, StartWriter after.
+	// A new file is started every maxFramesPerFile frames, 0 for no limit, or earlier once the file
+	// reaches Writer\SegmentMB or spans Writer\SegmentSeconds.
+	void PrepareRecording(const std::string& fileBase, int maxFramesPerFile);
+	void StartWriter();
+	// UI thread, while not recording. Init() sets it from the app profile.
+	void SetCodec(VideoCodec codec) { mCodec = codec; }
+	VideoCodec Codec() const { return mCodec; }
+	// RAW files are split over Writer\StripeFolders, see StripedRawWriter.h
+	bool IsStriping() const { return !mStripeFolders.empty() && mCodec == VIDEO_RAW; }
+	const std::vector<CString>& StripeFolders() const { return mStripeFolders; }
+	static LPCTSTR CodecName(VideoCodec codec);
+	// UI thread, after the record flag went false
+	void WakeWriter() { mWriterSignal.Wake(); }
+
+	// UI thread, once per timer tick. Samples the write rate and reports reallocations,
+	// drops and queue high water to the host.
+	void UpdateStats(LONGLONG now, LONGLONG frequency);
+	CString Summary() const;
+
+	const CaptureSourceConfig& Config() const { return mConfig; }
+	LPCTSTR Name() const { return mConfig.name; }
+	CaptureKind Kind() const { return mConfig.kind; }
+	// Of the frames the source delivers, 8 unless the scope streams its native depth
+	int BitDepth() const { return mBits; }
+	UINT CurrentFPS() const { return mCurrentFPS; }
+	UINT WriteFPS() const { return mWriteFPS; }
+	LONG FramesWritten() const { return mFramesWritten; }
+	LONG RetrieveErrors() const { return mRetrieveErrors; }
+	LONG Unlogged() const { return mOverflow.Unlogged(); }
+	LONG Dropped() const { return mOverflow.Dropped(); }
+	LONG Spilled() const { return mOverflow.Spilled(); }
+	UINT HighWater() const { return mOverflow.HighWater(); }
+	UINT QueueCapacity() const { return mQueue.Capacity(); }
+	// While recording, how long until the queue is full if the writer keeps falling behind as it
+	// did over the last second or so, -1 while it keeps up. UpdateStats() samples it.
+	double SecondsToOverflow() const { return mSecondsToOverflow; }
+	// What the files take at the configured rate, with the codec and crop set now. FFV1 is counted
+	// uncompressed, which noisy frames come close to. 0 before streaming or without a known rate.
+	double DiskBytesPerSecond() const;
+	// With Memory\<cam>BurstMB every recording is a burst into RAM, see BurstArena.h
+	bool IsBursting() const { return mBurst.Capacity() > 0; }
+	// Any thread. The burst of the recording is in RAM, the writer may still be writing it.
+	bool BurstOver() const { return mBurst.IsOver(); }
+	// The longest burst the arena holds at the rate the scope is set to, and what Burst\ asks for
+	CString BurstSummary() const;
+	// Frames grabbed during the last recording, dropped ones included
+	LONG FramesGrabbed() const { return mFramesGrabbed; }
+	// Read once the recording's threads are done, they are reset by PrepareRecording
+	const CLatencyHistogram& Latency(PipelineStage stage) const { return mLatency[stage]; }
+	// CPU the thread used over its last run, in percent of one core
+	double ThreadCPU(SourceThread thread) const { return mThreadCPU[thread]; }
+	// Frame bytes handed to the video files during the last recording and the time encoding
+	// and writing them took, for the compression ratio and encode rate of the codec
+	ULONGLONG RawBytesWritten() const { return mRawBytesWritten; }
+	double EncodeSeconds() const { return mEncodeSeconds; }
+
+	cv::VideoCapture cam;	// the UI sets camera properties on it directly, unused with a synthetic input
+	cv::Rect roi;			// part of the frame that is written, empty for all of it
+	UINT firmwareFPS;		// modes the UI last set the scope to, 0 if it did not, stored in raw recordings
+	UINT firmwareWindow;
+	CFramePool pool;		// the host may borrow display buffers from it
+
+private:
+	CCaptureSource(const CCaptureSource&);
+	CCaptureSource& operator=(const CCaptureSource&);
+
+	bool ReadSample(cv::Mat& sample);
+	bool Retrieve(cv::Mat& frame, cv::Mat& raw, UINT traceFrame);
+	void Reopen();
+	bool InitFrameBuffers(const cv::Mat& sample, double fps);
+	void WaitDisplayTick(LARGE_INTEGER& nextTime);
+	void OpenVideo(VideoSegment& segment, int fileNumber);
+	// Buffers the striped parts' queues take from the pool, for both files of a recording
+	UINT StripeBuffers() const;
+	// One name per stripe folder for the parts of a file
+	std::vector<std::string> StripeParts(int fileNumber) const;
+	// Writer thread. Creates the stripe folders and the recording's manifest, and lists a file's
+	// parts in it once the writer starts on the file.
+	void OpenStripeManifest();
+	void ListStripeParts(const VideoSegment& segment);
+	// The rate the scope is set to, or else what streaming measured or the camera reports
+	double ConfiguredFPS(LPCTSTR& source) const;
+	// Frame rate a file is stamped with, and where it came from. segment is the file that was
+	// open before, its frames measure the rate best once there is one.
+	double NominalFPS(const VideoSegment& segment, LPCTSTR& source) const;
+	void CloseVideo(VideoSegment& segment);
+	// Writer thread. The segment thread closes retired and opens it again as the file after
+	// next, fileNumber 0 only closes it.
+	void QueueSegment(VideoSegment* retired, int fileNumber);
+	// Writer thread, once the segment thread is done with what was queued
+	void WaitSegment();
+
+	static UINT CaptureThread(LPVOID pParam);
+	static UINT DisplayThread(LPVOID pParam);
+	static UINT WriterThread(LPVOID pParam);
+	static UINT SegmentThread(LPVOID pParam);
+
+	CaptureSourceConfig mConfig;
+	CCaptureHost* mHost;
+	const CaptureSession* mSession;
+	cv::VideoCapture* mInput;			// cam, mSynthetic or mUSB, what the threads grab from
+	CSyntheticCapture* mSynthetic;
+	cv::VideoCapture* mUSB;				// the scope read over libusb
+	CWinThread* mCaptureThread;
+	CWinThread* mDisplayThread;
+	volatile bool mConnected;
+	volatile bool mStreaming;
+	volatile bool mStopping;
+	bool mRaw;				// raw capture asked for and the backend delivers it
+	int mBits;				// bits per sample of the frames, above 8 only with mRaw
+	int mFrameRows;
+	int mFrameCols;
+	int mFrameType;			// of the pool's buffers
+
+	CFrameQueue<FrameSlot> mQueue;
+	CFrameSignal mWriterSignal;
+	CFrameOverflow mOverflow;
+	CFrameMailbox mMailbox;
+	CPreTriggerRing mPreTrigger;
+	CBurstArena mBurst;
+	CFramePool mBurstPool;		// the arena's buffers, locked
+	UINT mBurstFrames;			// Burst\Frames, 0 for as many as fit
+	UINT mBurstMs;				// Burst\DurationMs, 0 for no limit
+	CRateMeter mWriteRate;
+
+	std::string mFileBase;
+	int mMaxFramesPerFile;
+	ULONGLONG mSegmentBytes;	// 0 for no limit
+	UINT mSegmentMs;			// 0 for no limit
+	CWinThread* mSegmentThread;	// started and stopped by the writer thread
+	CEvent mSegmentWake;		// auto reset, a segment is queued or the thread should stop
+	CEvent mSegmentIdle;		// manual reset, set while nothing is queued
+	VideoSegment* volatile mSegmentJob;
+	volatile int mSegmentFile;
+	volatile bool mSegmentStop;
+	VideoCodec mCodec;
+	bool mRawPacked;		// store 10 and 12 bit samples MIPI packed in raw files
+	int mRawWriteMode;		// RawWriteMode, RawFrameFile.h is not included here
+	int mFFV1Threads;
+	int mFFV1Slices;
+	std::vector<CString> mStripeFolders;	// Writer\StripeFolders, one per volume, empty to write RAW files whole
+	UINT mStripeFrames;			// Writer\StripeFrames, frames a part takes before the next part's turn
+	CStdioFile mStripeManifest;	// <file base>.msstripe while a striped recording is written
+
+	volatile UINT mCurrentFPS;
+	volatile LONG mGrabIntervalNs;	// between grabs, smoothed over about 16 of them, 0 before the second
+	double mReportedFPS;			// what the camera or input says it runs at, 0 if it does not say
+	UINT mWriteFPS;
+	UINT mQueueSampleDepth;		// queue depth and time at the last UpdateStats()
+	LONGLONG mQueueSampleTicks;
+	double mQueueGrowth;		// frames a second, smoothed
+	double mSecondsToOverflow;
+	UINT mOverflowWarnSeconds;	// DiskCheck\WarnSeconds, projections below it are reported
+	LONGLONG mOverflowReportTicks;
+	volatile LONG mFramesWritten;
+	volatile LONG mRetrieveErrors;
+	volatile LONG mFramesGrabbed;
+	CLatencyHistogram mLatency[PIPELINE_STAGE_COUNT];
+	double mThreadCPU[SOURCE_THREAD_COUNT];
+	ULONGLONG mRawBytesWritten;
+	double mEncodeSeconds;
+};
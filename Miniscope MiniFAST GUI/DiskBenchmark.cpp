@@ -0,0 +1,150 @@
+// DiskBenchmark.cpp : how fast a folder takes .msraw frames with each write mode
+//
+// Builds on Windows and Linux, so it does not use the precompiled MFC header.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "DiskBenchmark.h"
+
+namespace {
+
+// Seconds on a monotonic clock
+double Now()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart/frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec*1e-9;
+#endif
+}
+
+// Sleeps while the deadline is more than a scheduler tick away and yields for the rest
+void WaitUntil(double deadline)
+{
+	double left;
+
+	while ((left = deadline - Now()) > 0) {
+#ifdef _WIN32
+		if (left > 0.002)
+			Sleep(1);
+		else
+			SwitchToThread();
+#else
+		if (left > 0.002)
+			usleep(1000);
+		else
+			sched_yield();
+#endif
+	}
+}
+
+double Percentile(const std::vector<double>& sorted, double fraction)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[(size_t)(fraction*(sorted.size() - 1))];
+}
+
+} // namespace
+
+DiskBenchResult BenchRawWrite(const std::string& fileName, RawWriteMode mode, int rows, int cols, double fps, uint64_t frames)
+{ //Frames are paced like a camera delivers them, so a mode that only keeps up on average still shows in lateFrames
+	DiskBenchResult result;
+	CRawFrameWriter writer;
+	RawFileHeader header;
+	RawFrameHeader frame;
+	cv::Mat pixels(rows, cols, CV_8UC1);
+	std::vector<double> writeUs;
+	double start;
+	double before;
+	double after;
+	double closeStart;
+
+	result.requested = mode;
+	result.mode = mode;
+	result.buffered = false;
+	result.rows = rows;
+	result.cols = cols;
+	result.fps = fps;
+	result.frames = 0;
+	result.seconds = 0;
+	result.MBps = 0;
+	result.writeP50Us = result.writeP99Us = result.writeMaxUs = 0;
+	result.lateFrames = 0;
+	result.closeMs = 0;
+
+	memset(&header, 0, sizeof header);
+	header.width = cols;
+	header.height = rows;
+	header.bitDepth = 8;
+	header.channels = 1;
+	header.tickFrequency = 1000000;
+	header.rateMilliHz = fps > 0 ? (uint32_t)(fps*1000 + 0.5) : 0;
+	strncpy(header.name, "diskBench", sizeof header.name - 1);
+	if (!writer.Open(fileName, header, (uint32_t)frames, mode)) {
+		result.error = writer.LastError();
+		return result;
+	}
+	result.mode = writer.Mode();
+	result.buffered = writer.IsBuffered();
+	for (int row = 0; row < rows; row++) {
+		uint8_t* line = pixels.ptr<uint8_t>(row);
+		for (int col = 0; col < cols; col++)
+			line[col] = (uint8_t)(row*7 + col*3);
+	}
+
+	writeUs.reserve((size_t)frames);
+	memset(&frame, 0, sizeof frame);
+	start = Now();
+	for (uint64_t i = 0; i < frames; i++) {
+		if (fps > 0)
+			WaitUntil(start + i/fps);
+		// Changes every frame, so nothing below can skip identical pages
+		pixels.data[0] = (uint8_t)i;
+		frame.frameNumber = (uint32_t)(i + 1);
+		frame.captureFrame = (uint32_t)(i + 1);
+		before = Now();
+		frame.capTimeMs = (uint32_t)(fps > 0 ? i*1000/fps : (before - start)*1000);
+		frame.hostTicks = (uint64_t)(fps > 0 ? i*1000000/fps : (before - start)*1000000);
+		if (!writer.Write(frame, pixels)) {
+			result.error = writer.LastError();
+			break;
+		}
+		after = Now();
+		writeUs.push_back((after - before)*1e6);
+		if (fps > 0 && after > start + (i + 1)/fps)
+			result.lateFrames++;
+	}
+	result.frames = writer.FramesWritten();
+	closeStart = Now();
+	if (!writer.Close() && result.error.empty())
+		result.error = writer.LastError();
+	after = Now();
+	result.closeMs = (after - closeStart)*1000;
+	result.seconds = after - start;
+	if (result.seconds > 0)
+		result.MBps = writer.BytesWritten()/1048576.0/result.seconds;
+	std::sort(writeUs.begin(), writeUs.end());
+	result.writeP50Us = Percentile(writeUs, 0.5);
+	result.writeP99Us = Percentile(writeUs, 0.99);
+	result.writeMaxUs = writeUs.empty() ? 0 : writeUs.back();
+	remove(fileName.c_str());
+	return result;
+}
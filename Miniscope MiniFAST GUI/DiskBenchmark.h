@@ -0,0 +1,31 @@
+// DiskBenchmark.h : how fast a folder takes .msraw frames with each write mode
+//
+// Builds on Windows and Linux, so it does not use the precompiled MFC header.
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include "RawFrameFile.h"
+
+struct DiskBenchResult {
+	RawWriteMode requested;
+	RawWriteMode mode;			// what the writer used, see CRawFrameWriter::Open
+	bool buffered;				// went through the OS file cache
+	int rows;
+	int cols;
+	double fps;					// pace the frames were offered at, 0 for as fast as the file takes them
+	uint64_t frames;			// frames written
+	double seconds;				// from the first Write() to the end of Close()
+	double MBps;				// file bytes over seconds
+	double writeP50Us;			// time one Write() call took
+	double writeP99Us;
+	double writeMaxUs;
+	uint64_t lateFrames;		// frames whose Write() returned after the next frame was due
+	double closeMs;				// flushing the last buffers, the index and the header
+	std::string error;			// empty if every frame was written
+};
+
+// Writes 'frames' rows x cols 8 bit gray frames to fileName at 'fps' with mode, the way the
+// writer thread of a scope would, and deletes the file again. With fps 0 nothing is paced and
+// MBps is the most the folder sustains.
+DiskBenchResult BenchRawWrite(const std::string& fileName, RawWriteMode mode, int rows, int cols, double fps, uint64_t frames);
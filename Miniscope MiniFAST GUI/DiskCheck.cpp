@@ -0,0 +1,62 @@
+// DiskCheck.cpp : whether the folder a recording goes to can keep up with it
+//
+
+#include "stdafx.h"
+#include "DiskCheck.h"
+#include "DiskBenchmark.h"
+
+namespace {
+
+// 1 MB frames, large enough that the rate is the volume's and not the per frame overhead's
+const int kCheckRows = 1024;
+const int kCheckCols = 1024;
+
+CString FullPath(LPCTSTR folder)
+{
+	TCHAR path[MAX_PATH];
+
+	if (GetFullPathName(folder, MAX_PATH, path, NULL) == 0)
+		return folder;
+	return path;
+}
+
+} // namespace
+
+bool CheckFolderMBps(LPCTSTR folder, bool measure, DiskCheckResult& result)
+{ //Cached as "<MB/s> <seconds since 1970>", direct writes so the cache of a recent run does not flatter the volume
+	CWinApp* app = AfxGetApp();
+	CString key = FullPath(folder);
+	CString value = app->GetProfileString(L"DiskCheck", key, L"");
+	CTime now = CTime::GetCurrentTime();
+	CTimeSpan maxAge(app->GetProfileInt(L"DiskCheck", L"MaxAgeDays", 7), 0, 0, 0);
+	double MBps;
+	__int64 when;
+	UINT MB;
+	DiskBenchResult bench;
+
+	result.MBps = 0;
+	result.cached = false;
+	result.error.Empty();
+	if (swscanf_s(value, L"%lf %I64d", &MBps, &when) == 2 && MBps > 0 && when > 0 && now - CTime(when) < maxAge) {
+		result.MBps = MBps;
+		result.measured = CTime(when);
+		result.cached = true;
+		return true;
+	}
+	if (!measure) {
+		result.error = L"not measured yet";
+		return false;
+	}
+	MB = max(app->GetProfileInt(L"DiskCheck", L"MB", 256), 16U);
+	CreateDirectory(folder, NULL);
+	bench = BenchRawWrite(std::string(CT2CA(key)) + "\\diskcheck.msraw", RAW_WRITE_DIRECT, kCheckRows, kCheckCols, 0, MB);
+	if (!bench.error.empty()) {
+		result.error = bench.error.c_str();
+		return false;
+	}
+	result.MBps = bench.MBps;
+	result.measured = now;
+	value.Format(L"%.1f %I64d", bench.MBps, (__int64)now.GetTime());
+	app->WriteProfileString(L"DiskCheck", key, value);
+	return true;
+}
@@ -0,0 +1,18 @@
+// DiskCheck.h : whether the folder a recording goes to can keep up with it
+//
+// A folder's sustained write rate is measured once with BenchRawWrite, unpaced and past the OS
+// file cache, and kept in the app profile under DiskCheck, keyed by the folder's full path, until
+// it is DiskCheck\MaxAgeDays old. A recording then only compares what its sources need against it.
+
+#pragma once
+
+struct DiskCheckResult {
+	double MBps;		// what the folder sustains, 0 if it is not known
+	CTime measured;		// when it was
+	bool cached;		// from the profile, not measured just now
+	CString error;		// why it is not known
+};
+
+// Looks the folder up, and measures it if it has no rate or an old one and measure is true. Measuring
+// writes and deletes DiskCheck\MB of frames, a second or two on a hard disk, so only on the UI thread.
+bool CheckFolderMBps(LPCTSTR folder, bool measure, DiskCheckResult& result);
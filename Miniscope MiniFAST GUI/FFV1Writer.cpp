@@ -0,0 +1,879 @@
+// FFV1Writer.cpp : lossless FFV1 video in Matroska files, encoded on a pool of slice threads
+//
+// The bitstream follows RFC 9043 (FFV1 versions 0-3) with the range coder and its default
+// state table. Only what this application writes is implemented: 8 to 15 bit gray or 8 bit
+// RGB, one column of slices, no initial states and no subsampled chroma.
+
+#include "stdafx.h"
+#include "FFV1Writer.h"
+#include "WorkerThread.h"
+#include "opencv2/imgproc.hpp"
+
+namespace {
+
+// State transitions of the range coder, built the way RFC 9043 section 3.8.1.3 derives the
+// default table
+struct RangeTables {
+	RangeTables();
+
+	uchar one[256];
+	uchar zero[256];
+};
+
+RangeTables::RangeTables()
+{
+	const LONGLONG unit = 1LL << 32;
+	const LONGLONG factor = (LONGLONG)(0.05*unit);
+	const int maxState = 256 - 8;
+	LONGLONG p = unit/2;
+	int last = 0;
+	int p8;
+
+	memset(one, 0, sizeof(one));
+	memset(zero, 0, sizeof(zero));
+	for (int i = 0; i < 128; i++) {
+		p8 = (int)((256*p + unit/2) >> 32);
+		if (p8 <= last)
+			p8 = last + 1;
+		if (last != 0 && last < 256 && p8 <= maxState)
+			one[last] = (uchar)p8;
+		p += ((unit - p)*factor + unit/2) >> 32;
+		last = p8;
+	}
+	for (int i = 256 - maxState; i <= maxState; i++) {
+		if (one[i] != 0)
+			continue;
+		p = (i*unit + 128) >> 8;
+		p += ((unit - p)*factor + unit/2) >> 32;
+		p8 = (int)((256*p + unit/2) >> 32);
+		if (p8 <= i)
+			p8 = i + 1;
+		if (p8 > maxState)
+			p8 = maxState;
+		one[i] = (uchar)p8;
+	}
+	for (int i = 1; i < 255; i++)
+		zero[i] = (uchar)(256 - one[256 - i]);
+}
+
+// Context quantisation: each of the three neighbour differences falls into one of 9 levels,
+// -4..4, weighted 1, 9 and 81, which gives 9*9*9 contexts, (729 + 1)/2 once the sign is folded
+struct QuantTables {
+	QuantTables();
+
+	uchar level[128];	// level of a difference of 0..127
+	short table[3][256];
+};
+
+QuantTables::QuantTables()
+{
+	int scale = 1;
+
+	for (int i = 0; i < 128; i++)
+		level[i] = (uchar)(i == 0 ? 0 : i < 3 ? 1 : i < 7 ? 2 : i < 21 ? 3 : 4);
+	// Mirrors the tables the decoder rebuilds from the configuration record
+	for (int t = 0; t < 3; t++) {
+		for (int i = 0; i < 128; i++)
+			table[t][i] = (short)(scale*level[i]);
+		for (int i = 1; i < 128; i++)
+			table[t][256 - i] = (short)-table[t][i];
+		table[t][128] = (short)-table[t][127];
+		scale *= 9;
+	}
+}
+
+const RangeTables gRange;
+const QuantTables gQuant;
+
+// CRC-32 with polynomial 0x04C11DB7, MSB first and no inversion. Appended big endian it
+// makes the CRC of the whole block 0, which is how FFV1 checks slices and its configuration.
+struct CRCTable {
+	CRCTable()
+	{
+		UINT crc;
+
+		for (UINT i = 0; i < 256; i++) {
+			crc = i << 24;
+			for (int bit = 0; bit < 8; bit++)
+				crc = (crc & 0x80000000) != 0 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+			entry[i] = crc;
+		}
+	}
+
+	UINT entry[256];
+};
+
+const CRCTable gCRC;
+
+#define FFV1_SYMBOL_BYTES 32	// most a symbol can cost, 32 bits at 8 bits each when every one was unexpected
+
+void AppendCRC(std::vector<uchar>& data)
+{
+	UINT crc = 0;
+
+	for (size_t i = 0; i < data.size(); i++)
+		crc = (crc << 8) ^ gCRC.entry[(crc >> 24) ^ data[i]];
+	for (int shift = 24; shift >= 0; shift -= 8)
+		data.push_back((uchar)(crc >> shift));
+}
+
+// Binary adaptive range coder of FFV1. Writes into out, which Reserve() grows ahead of the
+// symbols so the bytes themselves go out through a plain pointer.
+class CRangeEncoder
+{
+public:
+	explicit CRangeEncoder(std::vector<uchar>& out)
+		: mOut(out)
+		, mPos(0)
+		, mLow(0)
+		, mRange(0xFF00)
+		, mOutstandingCount(0)
+		, mOutstandingByte(-1)
+	{
+		mOut.resize(max(mOut.capacity(), (size_t)4096));
+		mBytes = &mOut[0];
+	}
+
+	// Room for 'bytes' more output, a symbol takes at most FFV1_SYMBOL_BYTES plus any 0xFF bytes held back
+	void Reserve(size_t bytes)
+	{
+		bytes += mPos + mOutstandingCount + 2;
+		if (bytes > mOut.size()) {
+			mOut.resize(max(bytes, 2*mOut.size()));
+			mBytes = &mOut[0];
+		}
+	}
+
+	void PutBit(uchar& state, int bit)
+	{
+		int range1 = (mRange*state) >> 8;
+
+		if (bit == 0) {
+			mRange -= range1;
+			state = gRange.zero[state];
+		}
+		else {
+			mLow += mRange - range1;
+			mRange = range1;
+			state = gRange.one[state];
+		}
+		if (mRange < 0x100)
+			Renormalize();
+	}
+
+	// Exponent in unary, mantissa and sign, each bit with its own state out of FFV1_CONTEXT_SIZE
+	void PutSymbol(uchar* state, int value, bool isSigned)
+	{
+		int a = value < 0 ? -value : value;
+		int e = 0;
+		int i;
+
+		if (value == 0) {
+			PutBit(state[0], 1);
+			return;
+		}
+		while ((a >> (e + 1)) != 0)
+			e++;
+		PutBit(state[0], 0);
+		for (i = 0; i < e; i++)
+			PutBit(state[1 + min(i, 9)], 1);
+		PutBit(state[1 + min(i, 9)], 0);
+		for (i = e - 1; i >= 0; i--)
+			PutBit(state[22 + min(i, 9)], (a >> i) & 1);
+		if (isSigned)
+			PutBit(state[11 + min(e, 10)], value < 0);
+	}
+
+	// Flushes what the decoder still needs to read the last symbol and trims out to the coded bytes
+	void Terminate()
+	{
+		Reserve(FFV1_SYMBOL_BYTES);
+		mRange = 0xFF;
+		mLow += 0xFF;
+		Renormalize();
+		mRange = 0xFF;
+		Renormalize();
+		mOut.resize(mPos);
+	}
+
+private:
+	CRangeEncoder(const CRangeEncoder&);
+	CRangeEncoder& operator=(const CRangeEncoder&);
+
+	void Renormalize()
+	{ //A byte that may still get a carry is held back, together with the 0xFF bytes after it
+		while (mRange < 0x100) {
+			if (mOutstandingByte < 0)
+				mOutstandingByte = mLow >> 8;
+			else if (mLow <= 0xFF00) {
+				mBytes[mPos++] = (uchar)mOutstandingByte;
+				for (; mOutstandingCount > 0; mOutstandingCount--)
+					mBytes[mPos++] = 0xFF;
+				mOutstandingByte = mLow >> 8;
+			}
+			else if (mLow >= 0x10000) {
+				mBytes[mPos++] = (uchar)(mOutstandingByte + 1);
+				for (; mOutstandingCount > 0; mOutstandingCount--)
+					mBytes[mPos++] = 0x00;
+				mOutstandingByte = (mLow >> 8) - 0x100;
+			}
+			else
+				mOutstandingCount++;
+			mLow = (mLow & 0xFF) << 8;
+			mRange <<= 8;
+		}
+	}
+
+	std::vector<uchar>& mOut;
+	uchar* mBytes;
+	size_t mPos;
+	int mLow;
+	int mRange;
+	int mOutstandingCount;
+	int mOutstandingByte;
+};
+
+inline int MedianOf3(int a, int b, int c)
+{
+	if (a > b)
+		std::swap(a, b);
+	return max(a, min(b, c));
+}
+
+// One row of one plane. row[-1] and prev[cols] are set up here from the row above, the way
+// the decoder does, and the rows of a slice start from zeros.
+void EncodeLine(CRangeEncoder& coder, uchar* state, short* row, short* prev, int cols, int bits)
+{
+	int left, top, topLeft, context, diff;
+	const int shift = 32 - bits;
+
+	coder.Reserve(cols*FFV1_SYMBOL_BYTES);
+	row[-1] = prev[0];
+	prev[cols] = prev[cols - 1];
+	for (int x = 0; x < cols; x++) {
+		left = row[x - 1];
+		top = prev[x];
+		topLeft = prev[x - 1];
+		context = gQuant.table[0][(left - topLeft) & 0xFF] + gQuant.table[1][(topLeft - top) & 0xFF] + gQuant.table[2][(top - prev[x + 1]) & 0xFF];
+		diff = row[x] - MedianOf3(left, top, left + top - topLeft);
+		if (context < 0) {
+			context = -context;
+			diff = -diff;
+		}
+		// Residuals wrap around to the sample's range, which is what makes the coding lossless in 'bits' bits
+		diff = (int)((UINT)diff << shift) >> shift;
+		coder.PutSymbol(state + context*FFV1_CONTEXT_SIZE, diff, true);
+	}
+}
+
+// Matroska's EBML: element IDs carry their own length marker, sizes are variable length integers
+void PutID(std::vector<uchar>& b, UINT id)
+{
+	for (int shift = id > 0xFFFFFF ? 24 : id > 0xFFFF ? 16 : id > 0xFF ? 8 : 0; shift >= 0; shift -= 8)
+		b.push_back((uchar)(id >> shift));
+}
+
+void PutSize(std::vector<uchar>& b, ULONGLONG size, int length = 0)
+{ //length 0 picks the shortest. All ones is reserved for "unknown", so 127 already needs two bytes.
+	if (length == 0) {
+		length = 1;
+		while (length < 8 && size >= (1ULL << (7*length)) - 1)
+			length++;
+	}
+	for (int i = length - 1; i >= 0; i--)
+		b.push_back((uchar)((size >> (8*i)) | (i == length - 1 ? 0x80 >> (length - 1) : 0)));
+}
+
+void PutUInt(std::vector<uchar>& b, UINT id, ULONGLONG value)
+{
+	int length = 1;
+
+	while (length < 8 && (value >> (8*length)) != 0)
+		length++;
+	PutID(b, id);
+	PutSize(b, length);
+	for (int i = length - 1; i >= 0; i--)
+		b.push_back((uchar)(value >> (8*i)));
+}
+
+void PutBinary(std::vector<uchar>& b, UINT id, const void* data, size_t length)
+{
+	PutID(b, id);
+	PutSize(b, length);
+	b.insert(b.end(), (const uchar*)data, (const uchar*)data + length);
+}
+
+void PutString(std::vector<uchar>& b, UINT id, const char* text)
+{
+	PutBinary(b, id, text, strlen(text));
+}
+
+// Master element whose size is filled in by EndMaster(). Returns where the size goes.
+size_t BeginMaster(std::vector<uchar>& b, UINT id)
+{
+	PutID(b, id);
+	PutSize(b, 0, 8);
+	return b.size() - 8;
+}
+
+void EndMaster(std::vector<uchar>& b, size_t at)
+{
+	std::vector<uchar> size;
+
+	PutSize(size, b.size() - at - 8, 8);
+	memcpy(&b[at], &size[0], 8);
+}
+
+void PutUnknownSize(std::vector<uchar>& b)
+{
+	b.push_back(0x01);
+	b.insert(b.end(), 7, 0xFF);
+}
+
+void PutLE(std::vector<uchar>& b, UINT value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		b.push_back((uchar)(value >> (8*i)));
+}
+
+#define MKV_EBML 0x1A45DFA3
+#define MKV_SEGMENT 0x18538067
+#define MKV_SEEK_HEAD 0x114D9B74
+#define MKV_SEEK 0x4DBB
+#define MKV_SEEK_ID 0x53AB
+#define MKV_SEEK_POSITION 0x53AC
+#define MKV_INFO 0x1549A966
+#define MKV_TRACKS 0x1654AE6B
+#define MKV_CLUSTER 0x1F43B675
+#define MKV_CUES 0x1C53BB6B
+#define MKV_VOID 0xEC
+#define MKV_SEEK_HEAD_SPACE 96		// the seek head is rewritten with the cues' position on close
+
+void PutSeek(std::vector<uchar>& b, UINT id, ULONGLONG position)
+{
+	std::vector<uchar> idBytes;
+	size_t seek = BeginMaster(b, MKV_SEEK);
+
+	PutID(idBytes, id);
+	PutBinary(b, MKV_SEEK_ID, &idBytes[0], idBytes.size());
+	PutUInt(b, MKV_SEEK_POSITION, position);
+	EndMaster(b, seek);
+}
+
+} // namespace
+
+CFFV1Encoder::CFFV1Encoder()
+	: mRows(0)
+	, mCols(0)
+	, mColor(false)
+	, mBits(8)
+	, mFrame(NULL)
+	, mNextSlice(0)
+	, mPending(0)
+	, mStopping(false)
+{
+}
+
+CFFV1Encoder::~CFFV1Encoder()
+{
+	Release();
+}
+
+bool CFFV1Encoder::Init(int rows, int cols, bool color, int threads, int slices, int bits)
+{ //Slices are rows/slices high, the way the decoder places them from the configuration record
+	int planes = color ? 3 : 1;
+
+	Release();
+	if (rows < 1 || cols < 1 || bits < 8 || bits > (color ? 8 : FFV1_MAX_BITS))
+		return false;
+	mRows = rows;
+	mCols = cols;
+	mColor = color;
+	mBits = bits;
+	slices = max(1, min(min(slices, FFV1_MAX_SLICES), rows));
+	mSlices.resize(slices);
+	for (int i = 0; i < slices; i++) {
+		Slice& slice = mSlices[i];
+		slice.row = i*rows/slices;
+		slice.rows = (i + 1)*rows/slices - slice.row;
+		slice.sample.assign(2*planes*(cols + 6), 0);
+		slice.state.resize((color ? 2 : 1)*FFV1_CONTEXT_COUNT*FFV1_CONTEXT_SIZE);
+		slice.out.reserve(rows*cols*planes*(bits > 8 ? 2 : 1)/slices + 1024);
+	}
+	WriteConfigRecord();
+
+	mStopping = false;
+	threads = max(1, min(min(threads, FFV1_MAX_THREADS), slices));
+	for (int i = 1; i < threads; i++) {
+		Worker* worker = new Worker;
+		worker->encoder = this;
+		worker->thread = StartThread(WorkerThread, worker, THREAD_PRIORITY_HIGHEST);
+		mWorkers.push_back(worker);
+	}
+	return true;
+}
+
+void CFFV1Encoder::Release()
+{
+	mStopping = true;
+	for (size_t i = 0; i < mWorkers.size(); i++)
+		mWorkers[i]->wake.SetEvent();
+	for (size_t i = 0; i < mWorkers.size(); i++) {
+		JoinThread(mWorkers[i]->thread);
+		delete mWorkers[i];
+	}
+	mWorkers.clear();
+	mSlices.clear();
+	mConfig.clear();
+	mRows = 0;
+	mCols = 0;
+}
+
+void CFFV1Encoder::WriteConfigRecord()
+{ //Version 3 keeps everything about the stream here, see RFC 9043 section 4.2
+	CRangeEncoder coder(mConfig);
+	uchar state[FFV1_CONTEXT_SIZE];
+	uchar tableState[FFV1_CONTEXT_SIZE];
+	int run;
+
+	memset(state, 128, sizeof(state));
+	coder.PutSymbol(state, 3, false);					// version
+	coder.PutSymbol(state, 4, false);					// micro version
+	coder.PutSymbol(state, 1, false);					// range coder with the default state table
+	coder.PutSymbol(state, mColor ? 1 : 0, false);		// colorspace: YCbCr, or RGB through the reversible transform
+	coder.PutSymbol(state, mBits, false);				// bits per sample
+	coder.PutBit(state[0], mColor ? 1 : 0);				// chroma planes
+	coder.PutSymbol(state, 0, false);					// no chroma subsampling
+	coder.PutSymbol(state, 0, false);
+	coder.PutBit(state[0], 0);							// no alpha
+	coder.PutSymbol(state, 0, false);					// one column of slices
+	coder.PutSymbol(state, (int)mSlices.size() - 1, false);
+	coder.PutSymbol(state, 1, false);					// quantisation tables
+	// Each of the 5 context inputs as runs of equal levels over differences 0..127, the last
+	// two unused
+	for (int t = 0; t < 5; t++) {
+		memset(tableState, 128, sizeof(tableState));
+		run = 0;
+		for (int i = 1; i < 128; i++) {
+			if (t < 3 && gQuant.level[i] != gQuant.level[i - 1]) {
+				coder.PutSymbol(tableState, i - run - 1, false);
+				run = i;
+			}
+		}
+		coder.PutSymbol(tableState, 128 - run - 1, false);
+	}
+	coder.PutBit(state[0], 0);							// contexts start from the default state
+	coder.PutSymbol(state, 1, false);					// slices carry a CRC
+	coder.PutSymbol(state, 1, false);					// every frame is a keyframe
+	coder.Terminate();
+	AppendCRC(mConfig);
+}
+
+bool CFFV1Encoder::Encode(const cv::Mat& frame, std::vector<uchar>& packet)
+{
+	if (mRows == 0 || frame.rows != mRows || frame.cols != mCols || frame.type() != (mColor ? CV_8UC3 : mBits > 8 ? CV_16UC1 : CV_8UC1))
+		return false;
+	mFrame = &frame;
+	mNextSlice = 0;
+	mPending = (LONG)mWorkers.size() + 1;
+	mDone.ResetEvent();
+	for (size_t i = 0; i < mWorkers.size(); i++)
+		mWorkers[i]->wake.SetEvent();
+	EncodeSlices();
+	WaitForSingleObject(mDone, INFINITE);
+
+	// Slices one after the other, the decoder finds them from the sizes in their footers
+	packet.clear();
+	for (size_t i = 0; i < mSlices.size(); i++)
+		packet.insert(packet.end(), mSlices[i].out.begin(), mSlices[i].out.end());
+	return true;
+}
+
+void CFFV1Encoder::EncodeSlices()
+{ //Every worker passes through here once per frame, so none can still be in a frame the caller has moved on from
+	LONG index;
+
+	while ((index = InterlockedIncrement(&mNextSlice) - 1) < (LONG)mSlices.size())
+		EncodeSlice(index);
+	if (InterlockedDecrement(&mPending) == 0)
+		mDone.SetEvent();
+}
+
+void CFFV1Encoder::EncodeSlice(int index)
+{
+	Slice& slice = mSlices[index];
+	CRangeEncoder coder(slice.out);
+	const int stride = mCols + 6;
+	const int planes = mColor ? 3 : 1;
+	const int contextBytes = FFV1_CONTEXT_COUNT*FFV1_CONTEXT_SIZE;
+	uchar header[FFV1_CONTEXT_SIZE];
+	uchar keyState = 128;
+	uchar endState = 129;
+	short* row[3];		// per plane, being coded
+	short* prev[3];		// the one above
+	const uchar* src;
+	int b, g, r;
+	size_t size;
+
+	// The first slice shares its coder with the frame header, which is only the keyframe bit
+	if (index == 0)
+		coder.PutBit(keyState, 1);
+	memset(header, 128, sizeof(header));
+	coder.PutSymbol(header, 0, false);			// slice position and size in slices
+	coder.PutSymbol(header, index, false);
+	coder.PutSymbol(header, 0, false);
+	coder.PutSymbol(header, 0, false);
+	coder.PutSymbol(header, 0, false);			// quantisation table of each context plane, version 3 always has two
+	coder.PutSymbol(header, 0, false);
+	coder.PutSymbol(header, 3, false);			// progressive
+	coder.PutSymbol(header, 0, false);			// sample aspect ratio unknown, 0/1
+	coder.PutSymbol(header, 1, false);
+
+	memset(&slice.state[0], 128, slice.state.size());
+	std::fill(slice.sample.begin(), slice.sample.end(), 0);
+	for (int p = 0; p < planes; p++) {
+		row[p] = &slice.sample[2*p*stride + 3];
+		prev[p] = &slice.sample[(2*p + 1)*stride + 3];
+	}
+	for (int y = slice.row; y < slice.row + slice.rows; y++) {
+		src = mFrame->ptr(y);
+		if (mColor == false) {
+			if (mBits > 8) {
+				for (int x = 0; x < mCols; x++)
+					row[0][x] = (short)((const ushort*)src)[x];
+			}
+			else {
+				for (int x = 0; x < mCols; x++)
+					row[0][x] = src[x];
+			}
+			EncodeLine(coder, &slice.state[0], row[0], prev[0], mCols, mBits);
+		}
+		else {
+			// Reversible colour transform: green, then blue and red relative to it, one bit wider
+			for (int x = 0; x < mCols; x++) {
+				b = src[3*x] - src[3*x + 1];
+				g = src[3*x + 1];
+				r = src[3*x + 2] - g;
+				g += (b + r) >> 2;
+				row[0][x] = (short)g;
+				row[1][x] = (short)(b + 256);
+				row[2][x] = (short)(r + 256);
+			}
+			EncodeLine(coder, &slice.state[0], row[0], prev[0], mCols, 9);
+			EncodeLine(coder, &slice.state[contextBytes], row[1], prev[1], mCols, 9);
+			EncodeLine(coder, &slice.state[contextBytes], row[2], prev[2], mCols, 9);
+		}
+		for (int p = 0; p < planes; p++)
+			std::swap(row[p], prev[p]);
+	}
+	// A 0 with state 129 ends a version 3 slice, the decoder checks it lands on the footer
+	coder.PutBit(endState, 0);
+	coder.Terminate();
+
+	// Footer: coded size, error status 0 and the CRC of the whole slice
+	size = slice.out.size();
+	slice.out.push_back((uchar)(size >> 16));
+	slice.out.push_back((uchar)(size >> 8));
+	slice.out.push_back((uchar)size);
+	slice.out.push_back(0);
+	AppendCRC(slice.out);
+}
+
+UINT CFFV1Encoder::WorkerThread(LPVOID pParam)
+{
+	Worker* worker = (Worker*)pParam;
+	CFFV1Encoder* self = worker->encoder;
+
+	while (1) {
+		WaitForSingleObject(worker->wake, INFINITE);
+		if (self->mStopping)
+			break;
+		self->EncodeSlices();
+	}
+	return 0;
+}
+
+CMatroskaFile::CMatroskaFile()
+	: mPosition(0)
+	, mSegmentData(0)
+	, mSeekHead(0)
+	, mInfo(0)
+	, mTracks(0)
+	, mDuration(0)
+	, mClusterSize(0)
+	, mClusterTime(0)
+	, mFirstTime(0)
+	, mLastTime(0)
+	, mFrames(0)
+	, mFailed(false)
+{
+}
+
+bool CMatroskaFile::Open(LPCTSTR fileName, int width, int height, int bitCount, DWORD fourCC, const std::vector<uchar>& codecPrivate,
+	double fps)
+{ //Segment and clusters start with unknown sizes, so a file cut short by a crash still reads up to its last frame
+	std::vector<uchar> header;
+	std::vector<uchar> format;
+	size_t ebml, info, tracks, entry, video;
+
+	Close();
+	if (!mFile.Open(fileName, CFile::modeCreate|CFile::modeWrite|CFile::shareDenyWrite, NULL))
+		return false;
+	mFailed = false;
+	mPosition = 0;
+	mClusterSize = 0;
+	mFrames = 0;
+	mFirstTime = 0;
+	mLastTime = 0;
+	mCues.clear();
+
+	ebml = BeginMaster(header, MKV_EBML);
+	PutUInt(header, 0x4286, 1);				// EBMLVersion
+	PutUInt(header, 0x42F7, 1);				// EBMLReadVersion
+	PutUInt(header, 0x42F2, 4);				// EBMLMaxIDLength
+	PutUInt(header, 0x42F3, 8);				// EBMLMaxSizeLength
+	PutString(header, 0x4282, "matroska");	// DocType
+	PutUInt(header, 0x4287, 4);				// DocTypeVersion
+	PutUInt(header, 0x4285, 2);				// DocTypeReadVersion
+	EndMaster(header, ebml);
+
+	PutID(header, MKV_SEGMENT);
+	PutUnknownSize(header);
+	mSegmentData = header.size();
+	mSeekHead = header.size();
+	header.resize(header.size() + MKV_SEEK_HEAD_SPACE);
+
+	mInfo = header.size();
+	info = BeginMaster(header, MKV_INFO);
+	PutUInt(header, 0x2AD7B1, 1000000);		// TimestampScale, 1 ms
+	PutString(header, 0x4D80, "MiniScopeControl");
+	PutString(header, 0x5741, "MiniScopeControl");
+	PutID(header, 0x4489);					// Duration in ms, a float filled in on close
+	PutSize(header, 8);
+	mDuration = header.size();
+	header.insert(header.end(), 8, 0);
+	EndMaster(header, info);
+
+	// BITMAPINFOHEADER followed by the codec's own data, the way Video for Windows stores it
+	PutLE(format, 40 + (UINT)codecPrivate.size(), 4);
+	PutLE(format, width, 4);
+	PutLE(format, height, 4);
+	PutLE(format, 1, 2);
+	PutLE(format, bitCount, 2);
+	PutLE(format, fourCC, 4);
+	PutLE(format, width*height*bitCount/8, 4);
+	format.insert(format.end(), 16, 0);
+	format.insert(format.end(), codecPrivate.begin(), codecPrivate.end());
+
+	mTracks = header.size();
+	tracks = BeginMaster(header, MKV_TRACKS);
+	entry = BeginMaster(header, 0xAE);
+	PutUInt(header, 0xD7, 1);				// TrackNumber
+	PutUInt(header, 0x73C5, 1);				// TrackUID
+	PutUInt(header, 0x83, 1);				// TrackType video
+	PutUInt(header, 0x9C, 0);				// no lacing
+	if (fps > 0)
+		PutUInt(header, 0x23E383, (ULONGLONG)(1e9/fps + 0.5));	// DefaultDuration in ns
+	PutString(header, 0x86, "V_MS/VFW/FOURCC");
+	PutBinary(header, 0x63A2, &format[0], format.size());
+	video = BeginMaster(header, 0xE0);
+	PutUInt(header, 0xB0, width);
+	PutUInt(header, 0xBA, height);
+	EndMaster(header, video);
+	EndMaster(header, entry);
+	EndMaster(header, tracks);
+
+	if (!Write(header))
+		return false;
+	WriteSeekHead(0);
+	return IsOpened();
+}
+
+bool CMatroskaFile::WriteFrame(const std::vector<uchar>& frame, UINT timeMs)
+{ //A SimpleBlock per frame, its time relative to the cluster's in a signed 16 bit field
+	if (!IsOpened())
+		return false;
+	mBuffer.clear();
+	if (mClusterSize == 0 || timeMs < mClusterTime || timeMs - mClusterTime > MATROSKA_CLUSTER_MS) {
+		CloseCluster();
+		Cue cue = {timeMs, mPosition - mSegmentData};
+		mCues.push_back(cue);
+		PutID(mBuffer, MKV_CLUSTER);
+		mClusterSize = mPosition + mBuffer.size();
+		PutUnknownSize(mBuffer);
+		PutUInt(mBuffer, 0xE7, timeMs);		// Timestamp
+		mClusterTime = timeMs;
+	}
+	PutID(mBuffer, 0xA3);
+	PutSize(mBuffer, frame.size() + 4);
+	mBuffer.push_back(0x81);				// track 1
+	mBuffer.push_back((uchar)((timeMs - mClusterTime) >> 8));
+	mBuffer.push_back((uchar)(timeMs - mClusterTime));
+	mBuffer.push_back(0x80);				// keyframe
+	if (!Write(mBuffer) || !Write(frame))
+		return false;
+
+	if (mFrames == 0)
+		mFirstTime = timeMs;
+	mLastTime = timeMs;
+	mFrames++;
+	return true;
+}
+
+bool CMatroskaFile::Close()
+{
+	std::vector<uchar> size;
+	ULONGLONG cues = mPosition;
+	size_t master, point, positions;
+	double duration;
+	ULONGLONG bits;
+	bool failed;
+
+	if (!IsOpened()) {
+		failed = mFailed;
+		mFailed = false;
+		return !failed;
+	}
+	CloseCluster();
+
+	mBuffer.clear();
+	master = BeginMaster(mBuffer, MKV_CUES);
+	for (size_t i = 0; i < mCues.size(); i++) {
+		point = BeginMaster(mBuffer, 0xBB);
+		PutUInt(mBuffer, 0xB3, mCues[i].timeMs);
+		positions = BeginMaster(mBuffer, 0xB7);
+		PutUInt(mBuffer, 0xF7, 1);
+		PutUInt(mBuffer, 0xF1, mCues[i].position);
+		EndMaster(mBuffer, positions);
+		EndMaster(mBuffer, point);
+	}
+	EndMaster(mBuffer, master);
+	if (!mCues.empty()) {
+		Write(mBuffer);
+		WriteSeekHead(cues - mSegmentData);
+	}
+
+	// The last frame lasts as long as the average one
+	duration = mFrames > 1 ? (mLastTime - mFirstTime)*(double)mFrames/(mFrames - 1) : 0;
+	memcpy(&bits, &duration, sizeof(bits));
+	for (int i = 7; i >= 0; i--)
+		size.push_back((uchar)(bits >> (8*i)));
+	Patch(mDuration, &size[0], 8);
+
+	size.clear();
+	PutSize(size, mPosition - mSegmentData, 8);
+	if (Patch(mSegmentData - 8, &size[0], 8)) {
+		try {
+			mFile.Close();
+		}
+		catch (CFileException* e) {
+			e->Delete();
+			Fail();
+		}
+	}
+	failed = mFailed;
+	mFailed = false;
+	return !failed;
+}
+
+bool CMatroskaFile::Write(const std::vector<uchar>& data)
+{
+	if (!IsOpened())
+		return false;
+	if (data.empty())
+		return true;
+	try {
+		mFile.Write(&data[0], (UINT)data.size());
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		Fail();
+		return false;
+	}
+	mPosition += data.size();
+	return true;
+}
+
+bool CMatroskaFile::Patch(ULONGLONG position, const uchar* data, UINT length)
+{
+	if (!IsOpened())
+		return false;
+	try {
+		mFile.Seek(position, CFile::begin);
+		mFile.Write(data, length);
+		mFile.Seek(mPosition, CFile::begin);
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		Fail();
+		return false;
+	}
+	return true;
+}
+
+void CMatroskaFile::Fail()
+{ //What was written stays, the segment and cluster sizes it did not get are unknown sizes
+	mFile.Abort();
+	mClusterSize = 0;
+	mFailed = true;
+}
+
+void CMatroskaFile::CloseCluster()
+{
+	std::vector<uchar> size;
+
+	if (mClusterSize == 0)
+		return;
+	PutSize(size, mPosition - mClusterSize - 8, 8);
+	Patch(mClusterSize, &size[0], 8);
+	mClusterSize = 0;
+}
+
+void CMatroskaFile::WriteSeekHead(ULONGLONG cues)
+{ //Fills MKV_SEEK_HEAD_SPACE, what the seek head leaves is a Void element
+	std::vector<uchar> head;
+	size_t master = BeginMaster(head, MKV_SEEK_HEAD);
+
+	PutSeek(head, MKV_INFO, mInfo - mSegmentData);
+	PutSeek(head, MKV_TRACKS, mTracks - mSegmentData);
+	if (cues != 0)
+		PutSeek(head, MKV_CUES, cues);
+	EndMaster(head, master);
+	PutID(head, MKV_VOID);
+	PutSize(head, MKV_SEEK_HEAD_SPACE - head.size() - 1);
+	head.resize(MKV_SEEK_HEAD_SPACE, 0);
+	Patch(mSeekHead, &head[0], MKV_SEEK_HEAD_SPACE);
+}
+
+bool CFFV1Writer::Open(const std::string& fileName, cv::Size size, bool color, int bits, double fps)
+{ //The encoder and its threads carry over from the last file if the frame format did not change
+	if (!mEncoder->IsInitialized() || mEncoder->Rows() != size.height || mEncoder->Cols() != size.width || mEncoder->IsColor() != color ||
+		mEncoder->Bits() != bits) {
+		if (!mEncoder->Init(size.height, size.width, color, mThreads, mSlices, bits))
+			return false;
+	}
+	return mFile.Open(CString(fileName.c_str()), size.width, size.height, color ? 24 : bits > 8 ? 16 : 8,
+		MAKEFOURCC('F', 'F', 'V', '1'), mEncoder->ConfigRecord(), fps);
+}
+
+bool CFFV1Writer::Write(const cv::Mat& frame, UINT timeMs)
+{
+	const cv::Mat* source = &frame;
+
+	if (!mFile.IsOpened())
+		return false;
+	if (mEncoder->IsColor() == false && frame.channels() == 3) {
+		cv::cvtColor(frame, mGray, CV_BGR2GRAY);
+		source = &mGray;
+	}
+	if (!mEncoder->Encode(*source, mPacket))
+		return false;
+	mRawBytes += source->total()*source->elemSize();
+	mCodedBytes += mPacket.size();
+	return mFile.WriteFrame(mPacket, timeMs);
+}
+
+bool CFFV1Writer::Release()
+{ //Closes the file, the encoder's threads stay for the next one
+	return mFile.Close();
+}
@@ -0,0 +1,178 @@
+// FFV1Writer.h : lossless FFV1 video in Matroska files, encoded on a pool of slice threads
+//
+// FFV1 version 3 cuts every frame into horizontal slices that are coded independently, so
+// a frame's slices are spread over worker threads and the frame is done when the last slice
+// is. Frames still go into the file one after the other in the order they were written, each
+// with the capture time it was given, so the .mkv carries the same per frame times as
+// timestamp.dat. FFmpeg, and everything built on it, decodes the files.
+
+#pragma once
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+
+#define FFV1_CONTEXT_SIZE 32		// adaptive states per context, one per bit of a symbol
+#define FFV1_CONTEXT_COUNT 365		// contexts per plane with the quantisation of FFV1Writer.cpp
+#define FFV1_MAX_THREADS 16
+#define FFV1_MAX_SLICES 64
+#define FFV1_MAX_BITS 15			// of a gray sample, the slice rows hold shorts
+#define MATROSKA_CLUSTER_MS 5000	// longest stretch of frames in one cluster, the unit players seek to
+
+// Encodes 8 bit gray or BGR frames, or deeper gray ones, into FFV1 version 3 packets. BGR goes
+// through FFV1's reversible colour transform. Every frame is a keyframe and every slice carries a CRC.
+class CFFV1Encoder
+{
+public:
+	CFFV1Encoder();
+	~CFFV1Encoder();
+
+	// Starts threads - 1 workers, the thread calling Encode() is the last one. slices is
+	// clamped to the frame's rows. Gray frames of more than 8 bits are CV_16UC1, up to FFV1_MAX_BITS.
+	bool Init(int rows, int cols, bool color, int threads, int slices, int bits = 8);
+	void Release();
+	bool IsInitialized() const { return mRows > 0; }
+
+	// Codec private data, the FFV1 configuration record
+	const std::vector<uchar>& ConfigRecord() const { return mConfig; }
+	// Encodes frame, which must have the size, channels and depth given to Init(), into packet
+	bool Encode(const cv::Mat& frame, std::vector<uchar>& packet);
+
+	int Rows() const { return mRows; }
+	int Cols() const { return mCols; }
+	bool IsColor() const { return mColor; }
+	int Bits() const { return mBits; }
+	int Slices() const { return (int)mSlices.size(); }
+	int Threads() const { return (int)mWorkers.size() + 1; }
+
+private:
+	CFFV1Encoder(const CFFV1Encoder&);
+	CFFV1Encoder& operator=(const CFFV1Encoder&);
+
+	struct Worker {
+		CFFV1Encoder* encoder;
+		CEvent wake;			// set once for every frame
+		CWinThread* thread;
+	};
+
+	struct Slice {
+		int row;					// first frame row
+		int rows;
+		std::vector<uchar> out;		// coded slice with its footer
+		std::vector<short> sample;	// two rows of (cols + 6) samples per plane
+		std::vector<uchar> state;	// FFV1_CONTEXT_COUNT*FFV1_CONTEXT_SIZE states per context plane
+	};
+
+	void WriteConfigRecord();
+	// Workers and the caller take slices until none are left, the last one to finish sets mDone
+	void EncodeSlices();
+	void EncodeSlice(int index);
+	static UINT WorkerThread(LPVOID pParam);
+
+	int mRows;
+	int mCols;
+	bool mColor;
+	int mBits;
+	std::vector<uchar> mConfig;
+	std::vector<Slice> mSlices;
+	std::vector<Worker*> mWorkers;
+	CEvent mDone;
+	const cv::Mat* mFrame;			// being encoded
+	volatile LONG mNextSlice;
+	volatile LONG mPending;			// workers and caller still in EncodeSlices() for this frame
+	volatile bool mStopping;
+};
+
+// Writes one video track into a Matroska file. Clusters, cues and the duration are finished
+// by Close(), a file that was not closed still plays but cannot seek.
+class CMatroskaFile
+{
+public:
+	CMatroskaFile();
+	~CMatroskaFile() { Close(); }
+
+	// fourCC and codecPrivate become the track's BITMAPINFOHEADER, e.g. 'FFV1' and the config record.
+	// fps > 0 is stored as the track's default frame duration, frames keep their own times.
+	bool Open(LPCTSTR fileName, int width, int height, int bitCount, DWORD fourCC, const std::vector<uchar>& codecPrivate,
+		double fps = 0);
+	// timeMs is the frame's presentation time, it must not go backwards. A failed write closes
+	// the file, which then reads up to the frame before.
+	bool WriteFrame(const std::vector<uchar>& frame, UINT timeMs);
+	// False if the file could not be finished, or a write failed since Open(). Reported once.
+	bool Close();
+	bool IsOpened() const { return mFile.m_hFile != CFile::hFileNull; }
+	ULONGLONG BytesWritten() const { return mPosition; }
+
+private:
+	CMatroskaFile(const CMatroskaFile&);
+	CMatroskaFile& operator=(const CMatroskaFile&);
+
+	struct Cue {
+		UINT timeMs;
+		ULONGLONG position;	// of the cluster, from the start of the segment data
+	};
+
+	// Both close the file on an error and return false, and do nothing once it is closed
+	bool Write(const std::vector<uchar>& data);
+	bool Patch(ULONGLONG position, const uchar* data, UINT length);
+	void Fail();
+	void CloseCluster();
+	// cues is the position of the cues from the start of the segment data, 0 before there are any
+	void WriteSeekHead(ULONGLONG cues);
+
+	CFile mFile;
+	ULONGLONG mPosition;		// bytes written, where the next write goes
+	ULONGLONG mSegmentData;		// file position of the segment's first child
+	ULONGLONG mSeekHead;
+	ULONGLONG mInfo;
+	ULONGLONG mTracks;
+	ULONGLONG mDuration;		// file position of the duration's float
+	ULONGLONG mClusterSize;		// file position of the open cluster's size, 0 if none
+	UINT mClusterTime;
+	UINT mFirstTime;
+	UINT mLastTime;
+	UINT mFrames;
+	bool mFailed;				// a write failed since Open()
+	std::vector<Cue> mCues;
+	std::vector<uchar> mBuffer;
+};
+
+// A recording file: frames are encoded with CFFV1Encoder and stored with their capture time
+class CFFV1Writer
+{
+public:
+	CFFV1Writer() : mEncoder(&mOwnEncoder), mThreads(1), mSlices(1), mRawBytes(0), mCodedBytes(0) {}
+
+	// Encoder settings for the files opened after it. Rows decide how many slices there really are.
+	void SetThreads(int threads, int slices) { mThreads = threads; mSlices = slices; }
+	// Encodes with owner's encoder and its threads, for a file opened while owner's is still
+	// written. Open() sets the encoder up again if the format differs, so both files must have
+	// the same format once the first is open, and only one thread may Write() to either.
+	void ShareEncoder(CFFV1Writer& owner) { mEncoder = &owner.mOwnEncoder; mThreads = owner.mThreads; mSlices = owner.mSlices; }
+	// Gray frames are stored as gray unless color, at bits per sample. fps is the nominal rate,
+	// for players that want one, each frame is still timed by Write().
+	bool Open(const std::string& fileName, cv::Size size, bool color, int bits = 8, double fps = 0);
+	// BGR frames go to a gray file as gray
+	bool Write(const cv::Mat& frame, UINT timeMs);
+	// False if the file was not written in full, see CMatroskaFile::Close()
+	bool Release();
+	bool IsOpened() const { return mFile.IsOpened(); }
+	ULONGLONG BytesWritten() const { return mFile.BytesWritten(); }
+
+	// Totals over every file since the writer was made, for the compression ratio
+	ULONGLONG RawBytes() const { return mRawBytes; }
+	ULONGLONG CodedBytes() const { return mCodedBytes; }
+
+private:
+	CFFV1Writer(const CFFV1Writer&);
+	CFFV1Writer& operator=(const CFFV1Writer&);
+
+	CFFV1Encoder mOwnEncoder;
+	CFFV1Encoder* mEncoder;		// mOwnEncoder unless shared
+	CMatroskaFile mFile;
+	std::vector<uchar> mPacket;
+	cv::Mat mGray;
+	int mThreads;
+	int mSlices;
+	ULONGLONG mRawBytes;
+	ULONGLONG mCodedBytes;
+};
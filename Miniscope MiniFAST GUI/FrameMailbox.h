@@ -0,0 +1,56 @@
+// FrameMailbox.h : single slot "latest frame" handoff from a capture thread to a display thread
+//
+
+#pragma once
+#include <atomic>
+#include "opencv2/core.hpp"
+
+// Triple buffer. The capture thread fills Back() and Publish()es it, the display thread
+// Fetch()es whatever was published last and renders Front(). Neither side ever waits:
+// publishing over a frame the display has not picked up simply replaces it, and the
+// display keeps showing its current Front() until something newer arrives.
+class CFrameMailbox
+{
+public:
+	CFrameMailbox() : mBack(0), mFront(2) { mMiddle.store(1); }
+
+	// Not thread safe. Only call while neither side is running.
+	void Init(cv::Mat back, cv::Mat middle, cv::Mat front)
+	{
+		mBuffers[0] = back;
+		mBuffers[1] = middle;
+		mBuffers[2] = front;
+		mBack = 0;
+		mMiddle.store(1);
+		mFront = 2;
+	}
+
+	//---------- Capture side ----------
+	cv::Mat& Back() { return mBuffers[mBack]; }
+	void Publish()
+	{
+		mBack = mMiddle.exchange(mBack | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+	}
+
+	//---------- Display side ----------
+	// Returns true if a frame newer than Front() was published
+	bool Fetch()
+	{
+		if ((mMiddle.load(std::memory_order_relaxed) & FRESH) == 0)
+			return false;
+		mFront = mMiddle.exchange(mFront, std::memory_order_acq_rel) & INDEX_MASK;
+		return true;
+	}
+	cv::Mat& Front() { return mBuffers[mFront]; }
+
+private:
+	CFrameMailbox(const CFrameMailbox&);
+	CFrameMailbox& operator=(const CFrameMailbox&);
+
+	enum { INDEX_MASK = 0x3, FRESH = 0x4 };
+
+	cv::Mat mBuffers[3];
+	int mBack;					// only touched by the capture thread
+	std::atomic<int> mMiddle;	// buffer index | FRESH
+	int mFront;					// only touched by the display thread
+};
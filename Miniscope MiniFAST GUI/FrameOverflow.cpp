@@ -0,0 +1,336 @@
+// FrameOverflow.cpp : what a capture thread does when its writer has fallen a full queue behind
+//
+
+#include "stdafx.h"
+#include "FrameOverflow.h"
+#include "WorkerThread.h"
+
+CFrameOverflow::CFrameOverflow()
+	: mPolicy(OVERFLOW_DROP_NEWEST)
+	, mQueue(NULL)
+	, mWriterSignal(NULL)
+	, mSpillThread(NULL)
+	, mSpillStop(false)
+	, mSpillOpen(false)
+	, mSpillFailed(false)
+	, mFrameNum(0)
+	, mHighWater(0)
+	, mReportedQuarter(0)
+	, mDropped(0)
+	, mSpilled(0)
+	, mSpillErrors(0)
+	, mUnlogged(0)
+	, mNewDrops(0)
+	, mBlockedTicks(0)
+{
+	QueryPerformanceFrequency(&mFrequency);
+	mDropLog.Init(DROP_LOG_LENGTH);
+}
+
+CFrameOverflow::~CFrameOverflow()
+{
+	FinishSpill();
+}
+
+void CFrameOverflow::Init(OverflowPolicy policy, CFrameQueue<FrameSlot>* queue, CFrameSignal* writerSignal)
+{
+	mPolicy = policy;
+	mQueue = queue;
+	mWriterSignal = writerSignal;
+}
+
+void CFrameOverflow::SetCapacity(UINT capacity)
+{
+	mQueue->Init(capacity, mPolicy == OVERFLOW_DROP_OLDEST);
+	mSpillQueue.Init(mPolicy == OVERFLOW_SPILL ? SPILL_QUEUE_LENGTH : 0);
+}
+
+LPCTSTR CFrameOverflow::PolicyName(OverflowPolicy policy)
+{
+	switch (policy) {
+	case OVERFLOW_DROP_OLDEST:
+		return L"drop oldest";
+	case OVERFLOW_BLOCK:
+		return L"block capture";
+	case OVERFLOW_SPILL:
+		return L"spill to disk";
+	default:
+		return L"drop newest";
+	}
+}
+
+void CFrameOverflow::StartRecording(const CString& spillFileName)
+{ //The last recording's spill thread is long done, but frames spilled after it stopped may still be queued
+	FinishSpill();
+	mSpillFileName = spillFileName;
+	mFrameNum = 0;
+	mHighWater = 0;
+	mReportedQuarter = 0;
+	mDropped = 0;
+	mSpilled = 0;
+	mSpillErrors = 0;
+	mUnlogged = 0;
+	mNewDrops = 0;
+	mBlockedTicks = 0;
+	if (mPolicy != OVERFLOW_SPILL)
+		return;
+	mSpillQueue.Discard();
+	mSpillStop = false;
+	mSpillFailed = false;
+	mSpillThread = StartThread(SpillThread, (LPVOID)this, THREAD_PRIORITY_HIGHEST);
+}
+
+FrameSlot* CFrameOverflow::BeginWrite(bool recording, volatile bool& record)
+{
+	FrameSlot* slot = mQueue->BeginWrite();
+	FrameSlot* dropped;
+	LARGE_INTEGER start, end;
+
+	if (slot != NULL)
+		return slot;
+	if (recording == false)
+		return &mOverflowSlot;
+
+	switch (mPolicy) {
+	case OVERFLOW_DROP_OLDEST:
+		dropped = mQueue->DropOldest();
+		if (dropped != NULL)
+			LogDrop(*dropped, OVERFLOW_DROP_OLDEST);
+		slot = mQueue->BeginWrite();
+		break;
+	case OVERFLOW_BLOCK:
+		QueryPerformanceCounter(&start);
+		while (record == true && (slot = mQueue->BeginWrite()) == NULL) {
+			mSpaceSignal.PrepareWait();
+			if (mQueue->BeginWrite() == NULL)
+				mSpaceSignal.Wait(WRITER_IDLE_TIMEOUT);
+			else
+				mSpaceSignal.CancelWait();
+		}
+		QueryPerformanceCounter(&end);
+		InterlockedExchangeAdd64(&mBlockedTicks, end.QuadPart - start.QuadPart);
+		break;
+	default:
+		break;
+	}
+	return slot != NULL ? slot : &mOverflowSlot;
+}
+
+void CFrameOverflow::Commit(FrameSlot* slot)
+{
+	FrameSlot* spill;
+	UINT size;
+
+	slot->frameNum = ++mFrameNum;
+	if (slot != &mOverflowSlot) {
+		slot->seq = mQueue->WriteSeq();
+		mQueue->CommitWrite();
+		size = mQueue->Size();
+		if (size > mHighWater)
+			mHighWater = size;
+		mWriterSignal->Notify(size);
+		return;
+	}
+
+	// The queue was full when this frame was grabbed
+	mHighWater = mQueue->Capacity();
+	if (mPolicy == OVERFLOW_SPILL && (spill = mSpillQueue.BeginWrite()) != NULL) {
+		LogDrop(*slot, OVERFLOW_SPILL);
+		swap(*spill, *slot);
+		mSpillQueue.CommitWrite();
+		mSpillSignal.Notify(1);
+	}
+	else
+		LogDrop(*slot, OVERFLOW_DROP_NEWEST);
+}
+
+void CFrameOverflow::FinishSpill()
+{
+	if (mSpillThread == NULL)
+		return;
+	mSpillStop = true;
+	mSpillSignal.Wake();
+	JoinThread(mSpillThread);
+}
+
+void CFrameOverflow::LogDrop(const FrameSlot& slot, OverflowPolicy how)
+{
+	DroppedFrame* entry;
+
+	if (how == OVERFLOW_SPILL)
+		InterlockedIncrement(&mSpilled);
+	else
+		InterlockedIncrement(&mDropped);
+	InterlockedIncrement(&mNewDrops);
+
+	entry = mDropLog.BeginWrite();
+	if (entry == NULL) {
+		// The writer is not even keeping up with the drop log
+		InterlockedIncrement(&mUnlogged);
+		return;
+	}
+	entry->frameNum = slot.frameNum;
+	entry->capTime = slot.capTime;
+	entry->how = how;
+	mDropLog.CommitWrite();
+}
+
+bool CFrameOverflow::Spill(const FrameSlot& slot)
+{ //Gives up on the file at the first error, a full disk is not going to fill any slower
+	SpillFrameHeader header;
+	size_t rowBytes;
+
+	if (mSpillFailed)
+		return false;
+	if (!mSpillOpen) {
+		if (!mSpillFile.Open(mSpillFileName, CFile::modeCreate|CFile::modeWrite|CFile::shareDenyWrite, NULL)) {
+			mSpillFailed = true;
+			return false;
+		}
+		mSpillOpen = true;
+	}
+	header.frameNum = slot.frameNum;
+	header.capTime = slot.capTime;
+	header.rows = slot.frame.rows;
+	header.cols = slot.frame.cols;
+	header.type = slot.frame.type();
+	rowBytes = slot.frame.cols*slot.frame.elemSize();
+	try {
+		mSpillFile.Write(&header, sizeof(header));
+		if (slot.frame.isContinuous())
+			mSpillFile.Write(slot.frame.data, (UINT)(rowBytes*slot.frame.rows));
+		else {
+			for (int row = 0; row < slot.frame.rows; row++)
+				mSpillFile.Write(slot.frame.ptr(row), (UINT)rowBytes);
+		}
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		// Keeps what was written before, the reader stops at the frame cut short
+		mSpillFile.Abort();
+		mSpillOpen = false;
+		mSpillFailed = true;
+		return false;
+	}
+	return true;
+}
+
+UINT CFrameOverflow::SpillThread(LPVOID pParam)
+{ //Opens the spill file with the first frame, so recordings that never overflow leave none behind
+	CFrameOverflow* self = (CFrameOverflow*)pParam;
+	FrameSlot* slot;
+	bool stop;
+
+	while (1) {
+		// Read first, so every frame spilled before FinishSpill() set it is written below
+		stop = self->mSpillStop;
+		slot = self->mSpillQueue.Front();
+		if (slot != NULL) {
+			if (!self->Spill(*slot))
+				InterlockedIncrement(&self->mSpillErrors);
+			self->mSpillQueue.Pop();
+			continue;
+		}
+		if (stop)
+			break;
+		self->mSpillSignal.PrepareWait();
+		if (!self->mSpillStop && self->mSpillQueue.Size() == 0)
+			self->mSpillSignal.Wait(WRITER_IDLE_TIMEOUT);
+		else
+			self->mSpillSignal.CancelWait();
+	}
+	if (self->mSpillOpen) {
+		try {
+			self->mSpillFile.Close();
+		}
+		catch (CFileException* e) {
+			e->Delete();
+			self->mSpillFile.Abort();
+		}
+		self->mSpillOpen = false;
+	}
+	return 0;
+}
+
+void CFrameOverflow::FlushDrops(CStdioFile& file, CCriticalSection& fileCS, int camNum)
+{
+	CSingleLock singleLock(&fileCS);
+	DroppedFrame* entry;
+	CString str;
+
+	if (mDropLog.Size() == 0)
+		return;
+	singleLock.Lock();
+	while ((entry = mDropLog.Front()) != NULL) {
+		str.Format(L"%u\t%u\t%u\t%s\n", camNum, entry->frameNum, entry->capTime,
+			entry->how == OVERFLOW_SPILL ? L"spilled" : entry->how == OVERFLOW_DROP_OLDEST ? L"oldest" : L"newest");
+		file.WriteString(str);
+		mDropLog.Pop();
+	}
+	singleLock.Unlock();
+}
+
+double CFrameOverflow::BlockedSeconds() const
+{
+	// 64 bit reads are not atomic on Win32
+	return (double)InterlockedCompareExchange64((volatile LONGLONG*)&mBlockedTicks, 0, 0)/mFrequency.QuadPart;
+}
+
+bool CFrameOverflow::HighWaterRaised(UINT& percent)
+{
+	UINT quarter;
+
+	if (mQueue == NULL || mQueue->Capacity() == 0)
+		return false;
+	quarter = 4*mHighWater/mQueue->Capacity();
+	if (quarter <= mReportedQuarter)
+		return false;
+	mReportedQuarter = quarter;
+	percent = 25*quarter;
+	return true;
+}
+
+CSpillReader::CSpillReader()
+	: mOpen(false)
+{
+}
+
+CSpillReader::~CSpillReader()
+{
+	Close();
+}
+
+bool CSpillReader::Open(const CString& fileName)
+{
+	Close();
+	mOpen = mFile.Open(fileName, CFile::modeRead|CFile::shareDenyWrite, NULL) != FALSE;
+	return mOpen;
+}
+
+bool CSpillReader::Next(SpillFrameHeader& header, cv::Mat& frame)
+{
+	if (!mOpen || !Read(&header, sizeof(header)))
+		return false;
+	if (header.rows <= 0 || header.cols <= 0 || header.type < 0)
+		return false;
+	frame.create(header.rows, header.cols, header.type);
+	return Read(frame.data, (UINT)(frame.total()*frame.elemSize()));
+}
+
+void CSpillReader::Close()
+{
+	if (mOpen)
+		mFile.Abort();
+	mOpen = false;
+}
+
+bool CSpillReader::Read(void* data, UINT bytes)
+{
+	try {
+		return mFile.Read(data, bytes) == bytes;
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		return false;
+	}
+}
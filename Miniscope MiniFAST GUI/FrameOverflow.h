@@ -0,0 +1,156 @@
+// FrameOverflow.h : what a capture thread does when its writer has fallen a full queue behind
+//
+
+#pragma once
+#include "FrameQueue.h"
+
+enum OverflowPolicy {
+	OVERFLOW_DROP_NEWEST = 0,	// keep what is queued, lose the frame just grabbed
+	OVERFLOW_DROP_OLDEST,		// make room by discarding the oldest unwritten frame
+	OVERFLOW_BLOCK,				// stop grabbing until the writer frees a slot
+	OVERFLOW_SPILL,				// hand the frame to a thread that appends it raw to a spill file next to the video
+	OVERFLOW_POLICY_COUNT
+};
+
+#define DROP_LOG_LENGTH 4096
+#define SPILL_QUEUE_LENGTH 16	// frames waiting for the spill thread, more are dropped
+
+// One line of droppedFrames.dat
+struct DroppedFrame {
+	UINT frameNum;
+	UINT capTime;
+	OverflowPolicy how;
+};
+
+// Header written in front of every frame in a spill file. The spill file is not merged
+// back into the video: the frames marked spilled in droppedFrames.dat are in it, in
+// frame number order, for offline recovery with CSpillReader.
+struct SpillFrameHeader {
+	UINT frameNum;
+	UINT capTime;
+	int rows;
+	int cols;
+	int type;
+};
+
+// Owns the overflow side of one stream. Every frame captured while recording gets a frame
+// number, and every one that does not make it into the queue is logged with that number,
+// so droppedFrames.dat says exactly which frames are missing from the video files.
+class CFrameOverflow
+{
+public:
+	CFrameOverflow();
+	~CFrameOverflow();
+
+	// Not thread safe. Call before the capture thread starts.
+	void Init(OverflowPolicy policy, CFrameQueue<FrameSlot>* queue, CFrameSignal* writerSignal);
+	// Sizes the queue and sets it up to match the policy. Same rules as Init().
+	void SetCapacity(UINT capacity);
+	OverflowPolicy Policy() const { return mPolicy; }
+	static LPCTSTR PolicyName(OverflowPolicy policy);
+	// Buffer the capture thread grabs into when a frame has nowhere else to go
+	FrameSlot& OverflowSlot() { return mOverflowSlot; }
+	// Spill queue slots that need a buffer bound, none unless the policy spills. Same rules as Init().
+	UINT SpillSlotCount() const { return mSpillQueue.SlotCount(); }
+	FrameSlot& SpillSlot(UINT i) { return mSpillQueue.Slot(i); }
+
+	// UI thread, before record goes true. Starts the spill thread if the policy spills.
+	void StartRecording(const CString& spillFileName);
+
+	//---------- Capture thread ----------
+	// Use instead of CFrameQueue::BeginWrite(). Applies the policy if the queue is full
+	// while recording and never returns NULL. recording is the flag as the capture thread
+	// read it for this frame, record the live one that ends a blocking wait.
+	FrameSlot* BeginWrite(bool recording, volatile bool& record);
+	// Use instead of CFrameQueue::CommitWrite() while recording. A frame that is spilled
+	// trades buffers with the spill queue, so the capture thread never writes to disk.
+	void Commit(FrameSlot* slot);
+	// frameNum Commit() will give the frame being captured
+	UINT NextFrameNum() const { return mFrameNum + 1; }
+	// The next count frame numbers went to frames recorded another way, e.g. from the pre-trigger window
+	void ReserveFrameNums(UINT count) { mFrameNum += count; }
+
+	//---------- Writer thread ----------
+	// Call after every Pop() so a blocked capture thread can continue
+	void NotifySpace()
+	{
+		if (mPolicy == OVERFLOW_BLOCK)
+			mSpaceSignal.Notify(1);
+	}
+	// Appends the drops logged since the last call to droppedFrames.dat
+	void FlushDrops(CStdioFile& file, CCriticalSection& fileCS, int camNum);
+	// Once recording stopped. Waits until the spill thread has written what it was handed
+	// and closed the spill file.
+	void FinishSpill();
+
+	//---------- Any thread ----------
+	UINT HighWater() const { return mHighWater; }
+	LONG Dropped() const { return mDropped; }
+	LONG Spilled() const { return mSpilled; }
+	// Spilled frames the spill thread could not write. After the first failure the spill
+	// file is closed and every frame spilled later counts here.
+	LONG SpillErrors() const { return mSpillErrors; }
+	LONG Unlogged() const { return mUnlogged; }
+	double BlockedSeconds() const;
+	// Frames dropped or spilled since the last call
+	LONG TakeNewDrops() { return InterlockedExchange(&mNewDrops, 0); }
+	// UI thread. True once each time the high water mark passes another quarter of the queue.
+	bool HighWaterRaised(UINT& percent);
+
+private:
+	CFrameOverflow(const CFrameOverflow&);
+	CFrameOverflow& operator=(const CFrameOverflow&);
+
+	void LogDrop(const FrameSlot& slot, OverflowPolicy how);
+	bool Spill(const FrameSlot& slot);
+	static UINT SpillThread(LPVOID pParam);
+
+	OverflowPolicy mPolicy;
+	CFrameQueue<FrameSlot>* mQueue;
+	CFrameSignal* mWriterSignal;
+	CFrameSignal mSpaceSignal;				// writer -> capture, OVERFLOW_BLOCK only
+	FrameSlot mOverflowSlot;
+	CFrameQueue<DroppedFrame> mDropLog;		// capture -> writer
+
+	CFrameQueue<FrameSlot> mSpillQueue;		// capture -> spill thread
+	CFrameSignal mSpillSignal;
+	CWinThread* mSpillThread;
+	volatile bool mSpillStop;
+	CString mSpillFileName;
+	CFile mSpillFile;						// spill thread only
+	bool mSpillOpen;
+	bool mSpillFailed;						// spill thread only, the file could not be opened or written
+
+	UINT mFrameNum;
+	volatile UINT mHighWater;
+	UINT mReportedQuarter;
+	volatile LONG mDropped;
+	volatile LONG mSpilled;
+	volatile LONG mSpillErrors;
+	volatile LONG mUnlogged;
+	volatile LONG mNewDrops;
+	volatile LONGLONG mBlockedTicks;
+	LARGE_INTEGER mFrequency;
+};
+
+// Reads the frames back from a spill file
+class CSpillReader
+{
+public:
+	CSpillReader();
+	~CSpillReader();
+
+	bool Open(const CString& fileName);
+	// False at the end of the file, or if the last frame was cut short
+	bool Next(SpillFrameHeader& header, cv::Mat& frame);
+	void Close();
+
+private:
+	CSpillReader(const CSpillReader&);
+	CSpillReader& operator=(const CSpillReader&);
+
+	bool Read(void* data, UINT bytes);
+
+	CFile mFile;
+	bool mOpen;
+};
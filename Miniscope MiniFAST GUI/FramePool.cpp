@@ -0,0 +1,153 @@
+// FramePool.cpp : preallocated frame buffers shared by the capture, display and writer stages
+//
+
+#include "stdafx.h"
+#include "FramePool.h"
+
+CFramePool::CFramePool()
+	: mBlock(NULL)
+	, mBlockSize(0)
+	, mBufferSize(0)
+	, mBacking(0)
+	, mWorkingSetAdded(0)
+	, mCount(0)
+	, mFreeList(NULL)
+	, mFreeCount(0)
+	, mAllocations(0)
+{
+}
+
+CFramePool::~CFramePool()
+{
+	Release();
+}
+
+size_t CFramePool::BufferBytes(int rows, int cols, int type)
+{
+	SYSTEM_INFO sysInfo;
+	size_t frameBytes;
+
+	GetSystemInfo(&sysInfo);
+	frameBytes = (size_t)rows*cols*CV_ELEM_SIZE(type);
+	return (frameBytes + sysInfo.dwPageSize - 1)/sysInfo.dwPageSize*sysInfo.dwPageSize;
+}
+
+bool CFramePool::Init(UINT count, int rows, int cols, int type, UINT flags)
+{
+	SYSTEM_INFO sysInfo;
+	size_t offset;
+	size_t largePage;
+	SIZE_T minWorkingSet, maxWorkingSet;
+
+	Release();
+	GetSystemInfo(&sysInfo);
+	mBufferSize = BufferBytes(rows, cols, type);
+	mBlockSize = mBufferSize*count;
+
+	if ((flags & POOL_LARGE_PAGES) != 0) {
+		largePage = GetLargePageMinimum();
+		if (largePage != 0 && EnableLockMemoryPrivilege()) {
+			mBlockSize = (mBlockSize + largePage - 1)/largePage*largePage;
+			mBlock = (uchar*)VirtualAlloc(NULL, mBlockSize, MEM_COMMIT|MEM_RESERVE|MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (mBlock != NULL)
+				mBacking = POOL_LARGE_PAGES|POOL_LOCK_PAGES;	// large pages are never paged out
+			else
+				mBlockSize = mBufferSize*count;
+		}
+	}
+	if (mBlock == NULL)
+		mBlock = (uchar*)VirtualAlloc(NULL, mBlockSize, MEM_COMMIT|MEM_RESERVE, PAGE_READWRITE);
+	if (mBlock == NULL) {
+		mBlockSize = 0;
+		mBufferSize = 0;
+		return false;
+	}
+
+	if ((flags & POOL_LOCK_PAGES) != 0 && (mBacking & POOL_LOCK_PAGES) == 0) {
+		// VirtualLock can only pin what fits in the minimum working set
+		if (GetProcessWorkingSetSize(GetCurrentProcess(), &minWorkingSet, &maxWorkingSet)
+			&& SetProcessWorkingSetSize(GetCurrentProcess(), minWorkingSet + mBlockSize, maxWorkingSet + mBlockSize)) {
+			mWorkingSetAdded = mBlockSize;
+			if (VirtualLock(mBlock, mBlockSize))
+				mBacking |= POOL_LOCK_PAGES;
+		}
+	}
+	// Touch every page now so the capture loop never takes a demand-zero fault
+	for (offset = 0; offset < mBlockSize; offset += sysInfo.dwPageSize)
+		mBlock[offset] = 0;
+
+	mCount = count;
+	mFreeList = new UINT[count];
+	for (UINT i = 0; i < count; i++)
+		mFreeList[i] = count - 1 - i;
+	mFreeCount = count;
+	mAllocations = 0;
+	return true;
+}
+
+void CFramePool::Release()
+{
+	SIZE_T minWorkingSet, maxWorkingSet;
+
+	if (mBlock != NULL)
+		VirtualFree(mBlock, 0, MEM_RELEASE);
+	if (mWorkingSetAdded != 0 && GetProcessWorkingSetSize(GetCurrentProcess(), &minWorkingSet, &maxWorkingSet))
+		SetProcessWorkingSetSize(GetCurrentProcess(), minWorkingSet - mWorkingSetAdded, maxWorkingSet - mWorkingSetAdded);
+	delete[] mFreeList;
+	mBlock = NULL;
+	mBlockSize = 0;
+	mBufferSize = 0;
+	mBacking = 0;
+	mWorkingSetAdded = 0;
+	mCount = 0;
+	mFreeList = NULL;
+	mFreeCount = 0;
+}
+
+bool CFramePool::EnableLockMemoryPrivilege()
+{
+	HANDLE token;
+	TOKEN_PRIVILEGES privileges;
+	bool enabled;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES|TOKEN_QUERY, &token))
+		return false;
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+		&& AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+		&& GetLastError() == ERROR_SUCCESS;	// not ERROR_NOT_ALL_ASSIGNED
+	CloseHandle(token);
+	return enabled;
+}
+
+cv::Mat CFramePool::Borrow(int rows, int cols, int type)
+{
+	CSingleLock singleLock(&mCS, TRUE);
+	UINT index;
+
+	if (mFreeCount == 0 || (size_t)rows*cols*CV_ELEM_SIZE(type) > mBufferSize)
+		return cv::Mat();
+	index = mFreeList[--mFreeCount];
+	return cv::Mat(rows, cols, type, mBlock + index*mBufferSize);
+}
+
+void CFramePool::Return(cv::Mat& mat)
+{
+	CSingleLock singleLock(&mCS, TRUE);
+
+	if (Owns(mat))
+		mFreeList[mFreeCount++] = (UINT)((mat.datastart - mBlock)/mBufferSize);
+	mat.release();
+}
+
+bool CFramePool::Owns(const cv::Mat& mat) const
+{
+	return mat.datastart >= mBlock && mat.datastart < mBlock + mBlockSize;
+}
+
+UINT CFramePool::FreeCount()
+{
+	CSingleLock singleLock(&mCS, TRUE);
+	return mFreeCount;
+}
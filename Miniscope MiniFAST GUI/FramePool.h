@@ -0,0 +1,71 @@
+// FramePool.h : preallocated frame buffers shared by the capture, display and writer stages
+//
+
+#pragma once
+#include "opencv2/core.hpp"
+
+// All buffers come from one page aligned VirtualAlloc block that is touched up front,
+// so the first frames of a recording never page fault and steady state streaming
+// never goes back to the heap. Stages borrow a cv::Mat header over a pool buffer and
+// keep reusing it; OpenCV only reallocates a Mat when the size or type it is asked to
+// produce does not match, and Track() counts every time that happens.
+//
+// Optionally the block is locked into RAM or backed by large pages so that a long
+// idle period before a recording cannot page it back out.
+enum {
+	POOL_LOCK_PAGES = 0x1,		// VirtualLock the block, growing the working set to fit
+	POOL_LARGE_PAGES = 0x2		// large pages, needs the "Lock pages in memory" user right
+};
+
+class CFramePool
+{
+public:
+	CFramePool();
+	~CFramePool();
+
+	// Not thread safe. Only call while no stage is using the pool.
+	// flags are POOL_ bits. Backing() tells which of them could be honoured.
+	bool Init(UINT count, int rows, int cols, int type, UINT flags = 0);
+	void Release();
+	// Bytes one buffer of this geometry takes in a pool
+	static size_t BufferBytes(int rows, int cols, int type);
+
+	// Returns a Mat of the given geometry over a free buffer, or an empty Mat if
+	// the pool is exhausted or the geometry does not fit in one buffer.
+	cv::Mat Borrow(int rows, int cols, int type);
+	void Return(cv::Mat& mat);
+	bool Owns(const cv::Mat& mat) const;
+
+	// Call after any OpenCV operation that writes into a borrowed Mat, with the data
+	// pointer it had before. Counts the operation as a heap allocation if OpenCV
+	// had to replace the buffer.
+	void Track(const cv::Mat& mat, const uchar* before)
+	{
+		if (mat.data != before)
+			InterlockedIncrement(&mAllocations);
+	}
+	LONG Allocations() const { return mAllocations; }
+	void ResetAllocations() { InterlockedExchange(&mAllocations, 0); }
+
+	UINT Count() const { return mCount; }
+	UINT FreeCount();
+	size_t BufferSize() const { return mBufferSize; }
+	UINT Backing() const { return mBacking; }
+
+private:
+	CFramePool(const CFramePool&);
+	CFramePool& operator=(const CFramePool&);
+
+	static bool EnableLockMemoryPrivilege();
+
+	uchar* mBlock;
+	size_t mBlockSize;
+	size_t mBufferSize;		// bytes per buffer, rounded up to a page
+	UINT mBacking;			// POOL_ flags in effect
+	SIZE_T mWorkingSetAdded;	// what Init added to the working set for POOL_LOCK_PAGES
+	UINT mCount;
+	UINT* mFreeList;
+	UINT mFreeCount;
+	CCriticalSection mCS;	// only taken by Borrow/Return, never per frame
+	volatile LONG mAllocations;
+};
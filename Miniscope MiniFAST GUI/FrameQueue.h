@@ -0,0 +1,248 @@
+// FrameQueue.h : lock-free frame queue shared by a capture thread and a writer thread
+//
+
+#pragma once
+#include <atomic>
+#include <algorithm>
+#include "opencv2/core.hpp"
+
+#define CACHE_LINE_SIZE 64
+#define WRITER_IDLE_TIMEOUT 100	//ms a writer sleeps at most before rechecking its queues
+
+// One captured frame plus what its writer thread needs for timestamp.dat
+struct FrameSlot {
+	cv::Mat frame;
+	UINT capTime;		// ms since startOfRecord
+	UINT frameNum;		// frames captured since the recording started, including dropped ones
+	ULONGLONG seq;		// capture sequence number, never wraps
+	LONGLONG grabTicks;	// performance counter when grab() returned, for stage latencies
+};
+
+// Exchanges buffers without copying pixels
+inline void swap(FrameSlot& a, FrameSlot& b)
+{
+	cv::swap(a.frame, b.frame);
+	std::swap(a.capTime, b.capTime);
+	std::swap(a.frameNum, b.frameNum);
+	std::swap(a.seq, b.seq);
+	std::swap(a.grabTicks, b.grabTicks);
+}
+
+// Single producer / single consumer ring.
+// The producer fills the slot returned by BeginWrite() and publishes it with CommitWrite().
+// The consumer works on Front() in place and hands the slot back with Pop().
+// mHead and mTail are 64 bit sequence numbers so they never wrap during a session,
+// and each lives on its own cache line together with the owning side's cached copy
+// of the other index, so the two threads only touch each other's line when they
+// have to (queue looks full to the producer or empty to the consumer).
+//
+// A queue set up with dropOldest lets the producer throw away the oldest unread slot
+// when it is full. The consumer then can no longer work in place, because the producer
+// may advance mTail under it, so Front() claims the slot with a CAS on mTail and swaps
+// it into a spare slot that only the consumer touches. The ring gets one extra slot so
+// the one the consumer just swapped out is never the next one the producer fills.
+template <class T>
+class CFrameQueue
+{
+public:
+	CFrameQueue() : mHolding(false), mSlots(NULL), mCapacity(0), mRingSize(0), mSlotCount(0), mDropOldest(false)
+	{
+		mHead.store(0);
+		mTail.store(0);
+		mClaim.store(NO_CLAIM);
+		mCachedTail = 0;
+		mCachedHead = 0;
+	}
+	~CFrameQueue() { delete[] mSlots; }
+
+	// Not thread safe. Only call while neither side is running.
+	void Init(UINT capacity, bool dropOldest = false)
+	{
+		delete[] mSlots;
+		mCapacity = capacity;
+		mDropOldest = dropOldest;
+		mRingSize = dropOldest ? capacity + 1 : capacity;
+		mSlotCount = dropOldest ? capacity + 2 : capacity;
+		mSlots = new T[mSlotCount];
+		mHolding = false;
+		mHead.store(0);
+		mTail.store(0);
+		mClaim.store(NO_CLAIM);
+		mCachedTail = 0;
+		mCachedHead = 0;
+	}
+	UINT Capacity() const { return mCapacity; }
+	bool DropsOldest() const { return mDropOldest; }
+	// Slots that need a buffer bound, Capacity() plus two with dropOldest
+	UINT SlotCount() const { return mSlotCount; }
+	// Direct slot access for binding buffers. Same rules as Init().
+	T& Slot(UINT i) { return mSlots[i]; }
+
+	// Safe from any thread, but only a snapshot
+	UINT Size() const
+	{
+		ULONGLONG tail = mTail.load(std::memory_order_acquire);
+		return (UINT)(mHead.load(std::memory_order_acquire) - tail);
+	}
+
+	//---------- Producer side ----------
+	// Returns the slot to fill next or NULL if the queue is full
+	T* BeginWrite()
+	{
+		ULONGLONG head = mHead.load(std::memory_order_relaxed);
+		if (head - mCachedTail >= mCapacity) {
+			mCachedTail = mTail.load(std::memory_order_acquire);
+			if (head - mCachedTail >= mCapacity)
+				return NULL;
+		}
+		if (mDropOldest) {
+			// The consumer may still be swapping out the slot we would fill next
+			ULONGLONG claim = mClaim.load(std::memory_order_seq_cst);
+			if (claim != NO_CLAIM && claim + mRingSize == head)
+				return NULL;
+		}
+		return &mSlots[head % mRingSize];
+	}
+	void CommitWrite()
+	{
+		mHead.store(mHead.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// Sequence number the next committed slot will get
+	ULONGLONG WriteSeq() const { return mHead.load(std::memory_order_relaxed); }
+	// Only with dropOldest. Discards the oldest unread slot to make room and returns it so
+	// the caller can log what was lost, or returns NULL if the consumer got to it first.
+	// The returned slot stays intact until the producer has gone once more around the ring.
+	T* DropOldest()
+	{
+		ULONGLONG tail = mTail.load(std::memory_order_acquire);
+		if (tail == mHead.load(std::memory_order_relaxed))
+			return NULL;
+		if (!mTail.compare_exchange_strong(tail, tail + 1, std::memory_order_seq_cst))
+			return NULL;
+		mCachedTail = tail + 1;
+		return &mSlots[tail % mRingSize];
+	}
+
+	//---------- Consumer side ----------
+	// Returns the oldest committed slot or NULL if the queue is empty
+	T* Front()
+	{
+		if (mDropOldest)
+			return ClaimFront();
+		ULONGLONG tail = mTail.load(std::memory_order_relaxed);
+		if (tail == mCachedHead) {
+			mCachedHead = mHead.load(std::memory_order_acquire);
+			if (tail == mCachedHead)
+				return NULL;
+		}
+		return &mSlots[tail % mRingSize];
+	}
+	void Pop()
+	{
+		if (mDropOldest) {
+			mHolding = false;
+			return;
+		}
+		mTail.store(mTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// Drops everything that has been committed so far
+	void Discard()
+	{
+		mCachedHead = mHead.load(std::memory_order_acquire);
+		mTail.store(mCachedHead, std::memory_order_release);
+	}
+
+private:
+	CFrameQueue(const CFrameQueue&);
+	CFrameQueue& operator=(const CFrameQueue&);
+
+	static const ULONGLONG NO_CLAIM = ~0ULL;
+
+	// Consumer side of a dropOldest queue. mClaim covers the few instructions between
+	// winning a slot from DropOldest() and swapping it into the spare.
+	T* ClaimFront()
+	{
+		T& spare = mSlots[mRingSize];
+		ULONGLONG tail;
+
+		if (mHolding)
+			return &spare;
+		while (1) {
+			tail = mTail.load(std::memory_order_acquire);
+			if (tail == mHead.load(std::memory_order_acquire)) {
+				mClaim.store(NO_CLAIM, std::memory_order_relaxed);
+				return NULL;
+			}
+			mClaim.store(tail, std::memory_order_seq_cst);
+			if (mTail.compare_exchange_strong(tail, tail + 1, std::memory_order_seq_cst))
+				break;
+		}
+		using std::swap;
+		swap(mSlots[tail % mRingSize], spare);
+		mClaim.store(NO_CLAIM, std::memory_order_release);
+		mHolding = true;
+		return &spare;
+	}
+
+	char mPad0[CACHE_LINE_SIZE];
+	std::atomic<ULONGLONG> mHead;		// written by producer
+	ULONGLONG mCachedTail;				// producer's copy of mTail
+	char mPad1[CACHE_LINE_SIZE - sizeof(std::atomic<ULONGLONG>) - sizeof(ULONGLONG)];
+	std::atomic<ULONGLONG> mTail;		// written by consumer
+	ULONGLONG mCachedHead;				// consumer's copy of mHead
+	char mPad2[CACHE_LINE_SIZE - sizeof(std::atomic<ULONGLONG>) - sizeof(ULONGLONG)];
+	std::atomic<ULONGLONG> mClaim;		// slot the consumer is swapping out, dropOldest only
+	bool mHolding;						// consumer owns the spare slot until Pop()
+	char mPad3[CACHE_LINE_SIZE - sizeof(std::atomic<ULONGLONG>) - sizeof(bool)];
+
+	T* mSlots;
+	UINT mCapacity;
+	UINT mRingSize;		// slots the ring cycles through
+	UINT mSlotCount;	// mRingSize plus the consumer's spare
+	bool mDropOldest;
+};
+
+// Lets a consumer sleep while its queues are empty instead of spinning.
+// Consumer:  PrepareWait(), check the queues once more, then Wait() if still idle or
+//            CancelWait() if something arrived in between.
+// Producer:  Notify() after every CommitWrite(). It only costs a SetEvent when the
+//            consumer is actually asleep and at least mBatch frames are pending.
+class CFrameSignal
+{
+public:
+	CFrameSignal() : mEvent(FALSE, FALSE), mBatch(1) { mWaiting.store(0); }
+
+	void SetBatch(UINT batch) { mBatch = batch < 1 ? 1 : batch; }
+	UINT Batch() const { return mBatch; }
+
+	void Notify(UINT pending)
+	{
+		// Pairs with the fence in PrepareWait() so that either the consumer
+		// sees the committed frame or we see it waiting
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (mWaiting.load(std::memory_order_relaxed) != 0 && pending >= mBatch)
+			mEvent.SetEvent();
+	}
+	// Wakes the consumer regardless of batching, e.g. when recording stops
+	void Wake() { mEvent.SetEvent(); }
+
+	void PrepareWait()
+	{
+		mWaiting.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+	void CancelWait() { mWaiting.store(0, std::memory_order_relaxed); }
+	void Wait(DWORD timeoutMs)
+	{
+		WaitForSingleObject(mEvent.m_hObject, timeoutMs);
+		mWaiting.store(0, std::memory_order_relaxed);
+	}
+
+private:
+	CFrameSignal(const CFrameSignal&);
+	CFrameSignal& operator=(const CFrameSignal&);
+
+	CEvent mEvent;			// auto reset
+	std::atomic<int> mWaiting;
+	UINT mBatch;
+};
@@ -0,0 +1,79 @@
+// LatencyHistogram.h : latency distribution with percentiles, cheap enough for every frame
+//
+
+#pragma once
+
+#define LATENCY_SUB_BUCKETS 16			// buckets per power of two, so a percentile is off by at most 1/16
+#define LATENCY_BUCKET_COUNT (LATENCY_SUB_BUCKETS*38)	// 1 us up to about 25 days
+
+// Recording is a shift loop and an increment, from one thread at a time. Values below 2x
+// LATENCY_SUB_BUCKETS us get a bucket each, above that every power of two is split into
+// LATENCY_SUB_BUCKETS equal buckets. Read the percentiles once the recording thread is done.
+class CLatencyHistogram
+{
+public:
+	CLatencyHistogram() { Reset(); }
+
+	void Reset()
+	{
+		memset(mCounts, 0, sizeof(mCounts));
+		mCount = 0;
+		mMaxUs = 0;
+	}
+
+	//---------- Recording thread ----------
+	void Record(LONGLONG ticks, LONGLONG frequency)
+	{
+		ULONGLONG us = ticks > 0 ? (ULONGLONG)(1000000*(double)ticks/frequency) : 0;
+
+		mCounts[Bucket(us)]++;
+		mCount++;
+		if (us > mMaxUs)
+			mMaxUs = us;
+	}
+
+	//---------- Reading thread ----------
+	ULONGLONG Count() const { return mCount; }
+	double MaxUs() const { return (double)mMaxUs; }
+	// Upper edge of the bucket the p-th fraction of the values fall in, e.g. p = 0.99
+	double PercentileUs(double p) const
+	{
+		ULONGLONG rank = (ULONGLONG)(p*mCount + 0.5);
+		ULONGLONG seen = 0;
+
+		if (mCount == 0)
+			return 0;
+		if (rank < 1)
+			rank = 1;
+		for (UINT i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+			seen += mCounts[i];
+			if (seen >= rank)
+				return (double)(BucketTop(i) < mMaxUs ? BucketTop(i) : mMaxUs);
+		}
+		return (double)mMaxUs;
+	}
+
+private:
+	static UINT Bucket(ULONGLONG us)
+	{
+		UINT shift = 0;
+
+		while (us >= 2*LATENCY_SUB_BUCKETS) {
+			us >>= 1;
+			shift++;
+		}
+		// us is now in [LATENCY_SUB_BUCKETS, 2*LATENCY_SUB_BUCKETS) unless it was small to begin with
+		shift = LATENCY_SUB_BUCKETS*shift + (UINT)us;
+		return shift < LATENCY_BUCKET_COUNT ? shift : LATENCY_BUCKET_COUNT - 1;
+	}
+	static ULONGLONG BucketTop(UINT bucket)
+	{
+		if (bucket < 2*LATENCY_SUB_BUCKETS)
+			return bucket;
+		return ((ULONGLONG)(bucket%LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS + 1) << (bucket/LATENCY_SUB_BUCKETS - 1)) - 1;
+	}
+
+	ULONGLONG mCounts[LATENCY_BUCKET_COUNT];
+	ULONGLONG mCount;
+	ULONGLONG mMaxUs;
+};
@@ -0,0 +1,140 @@
+// LumaExtract.cpp : pulls the luma plane out of a raw YUY2 frame
+//
+
+#include "stdafx.h"
+#include "LumaExtract.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#define LUMA_X86
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace {
+
+void ExtractLumaScalar(const uchar* yuyv, uchar* y, size_t pixels)
+{
+	for (size_t i = 0; i < pixels; i++)
+		y[i] = yuyv[2*i];
+}
+
+#ifdef LUMA_X86
+// Masking off the chroma byte of each 16 bit pair leaves the luma as a 16 bit value that
+// fits a byte, so one saturating pack puts the luma of two registers side by side.
+// SSE2 is all that takes; SSE4.1 adds nothing for this shuffle.
+void ExtractLumaSSE2(const uchar* yuyv, uchar* y, size_t pixels)
+{
+	const __m128i mask = _mm_set1_epi16(0x00FF);
+	size_t i = 0;
+
+	for (; i + 16 <= pixels; i += 16) {
+		__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(yuyv + 2*i)), mask);
+		__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(yuyv + 2*i + 16)), mask);
+		_mm_storeu_si128((__m128i*)(y + i), _mm_packus_epi16(a, b));
+	}
+	ExtractLumaScalar(yuyv + 2*i, y + i, pixels - i);
+}
+
+// Same as SSE2 on 32 pixels at a time. The AVX2 pack works within 128 bit lanes, so the
+// middle two quarters come out swapped and one permute puts them back in order.
+void ExtractLumaAVX2(const uchar* yuyv, uchar* y, size_t pixels)
+{
+	const __m256i mask = _mm256_set1_epi16(0x00FF);
+	size_t i = 0;
+
+	for (; i + 32 <= pixels; i += 32) {
+		__m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(yuyv + 2*i)), mask);
+		__m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(yuyv + 2*i + 32)), mask);
+		_mm256_storeu_si256((__m256i*)(y + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+	}
+	_mm256_zeroupper();
+	ExtractLumaSSE2(yuyv + 2*i, y + i, pixels - i);
+}
+#endif
+
+LumaKernel DetectLumaKernel()
+{
+#ifdef LUMA_X86
+	int info[4];
+	bool avx2 = false;
+
+	__cpuid(info, 0);
+	if (info[0] >= 7) {
+		// AVX2 needs the instructions and an OS that saves the YMM registers
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6) {
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+		}
+	}
+	if (avx2)
+		return LUMA_AVX2;
+	__cpuid(info, 1);
+	if ((info[3] & (1 << 26)) != 0)
+		return LUMA_SSE2;
+#endif
+	return LUMA_SCALAR;
+}
+
+// Detected during static initialisation, before any capture thread can ask
+const LumaKernel gBestLumaKernel = DetectLumaKernel();
+
+} // namespace
+
+LumaKernel BestLumaKernel()
+{
+	return gBestLumaKernel;
+}
+
+bool LumaKernelSupported(LumaKernel kernel)
+{
+	return kernel <= BestLumaKernel();
+}
+
+LPCTSTR LumaKernelName(LumaKernel kernel)
+{
+	switch (kernel) {
+	case LUMA_SSE2:
+		return L"SSE2";
+	case LUMA_AVX2:
+		return L"AVX2";
+	default:
+		return L"scalar";
+	}
+}
+
+void ExtractLuma(const uchar* yuyv, uchar* y, size_t pixels, LumaKernel kernel)
+{
+	switch (kernel) {
+#ifdef LUMA_X86
+	case LUMA_AVX2:
+		ExtractLumaAVX2(yuyv, y, pixels);
+		break;
+	case LUMA_SSE2:
+		ExtractLumaSSE2(yuyv, y, pixels);
+		break;
+#endif
+	default:
+		ExtractLumaScalar(yuyv, y, pixels);
+		break;
+	}
+}
+
+bool ExtractLuma(const cv::Mat& raw, cv::Mat& y, int rows, int cols)
+{
+	LumaKernel kernel = BestLumaKernel();
+
+	if (raw.empty() || raw.depth() != CV_8U || raw.total()*raw.elemSize() != (size_t)rows*cols*2)
+		return false;
+	y.create(rows, cols, CV_8UC1);
+	if (raw.isContinuous() && y.isContinuous()) {
+		ExtractLuma(raw.data, y.data, (size_t)rows*cols, kernel);
+		return true;
+	}
+	// Padded rows, only possible when raw already has the frame's shape
+	if (raw.rows != rows)
+		return false;
+	for (int row = 0; row < rows; row++)
+		ExtractLuma(raw.ptr(row), y.ptr(row), cols, kernel);
+	return true;
+}
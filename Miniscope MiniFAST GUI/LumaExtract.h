@@ -0,0 +1,30 @@
+// LumaExtract.h : pulls the luma plane out of a raw YUY2 frame
+//
+// The scope sensor is monochrome and the firmware streams it as YUY2 with the pixel values
+// in the Y bytes, so with CV_CAP_PROP_CONVERT_RGB off the frame is recovered by taking
+// every other byte. That replaces DirectShow's YUY2 -> BGR conversion and the BGR -> gray
+// one after it.
+
+#pragma once
+#include "opencv2/core.hpp"
+
+enum LumaKernel {
+	LUMA_SCALAR = 0,
+	LUMA_SSE2,
+	LUMA_AVX2,
+	LUMA_KERNEL_COUNT
+};
+
+// Fastest kernel this CPU and OS support. Checked once.
+LumaKernel BestLumaKernel();
+bool LumaKernelSupported(LumaKernel kernel);
+LPCTSTR LumaKernelName(LumaKernel kernel);
+
+// Writes the Y byte of each of 'pixels' YUY2 pixels to y. Any alignment.
+void ExtractLuma(const uchar* yuyv, uchar* y, size_t pixels, LumaKernel kernel);
+
+// Fills y with the rows x cols luma plane of raw, using the best kernel. raw is whatever
+// the capture backend returned with RGB conversion off: rows x cols CV_8UC2 or the same
+// bytes as one continuous CV_8UC1 buffer. y is only reallocated if it is not already
+// rows x cols CV_8UC1. Returns false if raw does not hold a frame of that size.
+bool ExtractLuma(const cv::Mat& raw, cv::Mat& y, int rows, int cols);
@@ -8,6 +8,10 @@
 #include "afxdialogex.h"
 #include "definitions.h"
 #include "resource.h"
+#include "PipelineBenchmark.h"
+#include "LumaExtract.h"
+#include "PipelineTrace.h"
+#include "DiskCheck.h"
 #include <Windows.h>
 
 //OpenCV Headers
@@ -40,8 +44,6 @@
 #endif
 
 
-	CCriticalSection msCS;
-	CCriticalSection behavCS;
 // CAboutDlg dialog used for App About
 
 class CAboutDlg : public CDialogEx
@@ -195,6 +197,9 @@ BEGIN_MESSAGE_MAP(CMiniScopeControlDlg, CDialogEx)
 	ON_CBN_CLOSEUP(IDC_COMBO1, &CMiniScopeControlDlg::OnCbnCloseupCombo1)
 	ON_CBN_CLOSEUP(IDC_COMBO2, &CMiniScopeControlDlg::OnCbnCloseupCombo2)
 	ON_CBN_SELCHANGE(IDC_COMBO1, &CMiniScopeControlDlg::OnCbnSelchangeCombo1)
+	ON_MESSAGE(WM_TRIGGER_EVENT, &CMiniScopeControlDlg::OnTriggerEvent)
+	ON_MESSAGE(WM_LIST_TEXT, &CMiniScopeControlDlg::OnListText)
+	ON_MESSAGE(WM_RECORDING_CLOSED, &CMiniScopeControlDlg::OnRecordingClosed)
 	
 	
 END_MESSAGE_MAP()
@@ -224,6 +229,8 @@ BOOL CMiniScopeControlDlg::OnInitDialog()
 			pSysMenu->AppendMenu(MF_SEPARATOR);
 			pSysMenu->AppendMenu(MF_STRING, IDM_ABOUTBOX, strAboutMenu);
 		}
+		pSysMenu->AppendMenu(MF_STRING, IDM_BENCHMARK, L"Run Pipeline Benchmark");
+		pSysMenu->AppendMenu(MF_STRING, IDM_TRACESAVE, L"Save Pipeline Trace");
 	}
 
 	// Set the icon for this dialog.  The framework does this automatically
@@ -262,10 +269,11 @@ BOOL CMiniScopeControlDlg::OnInitDialog()
 	mMSColorCheck = FALSE;
 	mExcitationX10 = FALSE;
 
-	msReadPos = 0;
-	msWritePos = 0;
-	behavReadPos = 0;
-	behavWritePos = 0;
+	mActiveWriters = 0;
+	mRecordingOpen = false;
+	mArmed = false;
+	mTriggerPosted = 0;
+	armedTime.QuadPart = 0;
 
 	mSaturationThresh = 255;
 	mElapsedTime = 0;
@@ -285,6 +293,13 @@ BOOL CMiniScopeControlDlg::OnInitDialog()
 
 	mMsCapFrameCountGlobal = 0;
 	mBehavCapFrameCountGlobal = 0;
+
+	// Display refresh cap, independent of the scope frame rate. Stored in the app profile.
+	mDisplayMaxFPS = AfxGetApp()->GetProfileInt(L"Display", L"MaxFPS", 30);
+	if (mDisplayMaxFPS < 1)
+		mDisplayMaxFPS = 1;
+	if (mDisplayMaxFPS > 240)
+		mDisplayMaxFPS = 240;
 	//mMSFPS = 1;			Changed to '0' by Jill 8/30/18
 	mMSFPS = 0;
 	mMSWIN = 0;
@@ -292,6 +307,11 @@ BOOL CMiniScopeControlDlg::OnInitDialog()
 	QueryPerformanceFrequency(&Frequency); 
 	QueryPerformanceCounter(&StartingTime);
 
+	// Each source has its own queue, overflow policy and writer so a slow behavior writer never eats into a scope's slack
+	LoadSourceConfigs();
+	// Pipeline trace points, saved from the system menu and after recordings that dropped frames
+	TraceEnable(AfxGetApp()->GetProfileInt(L"Trace", L"Enabled", 1) != 0);
+
 	mTimer = SetTimer(1,100,NULL);
 	//-----------------------------------
 	UpdateData(FALSE);
@@ -316,6 +336,26 @@ void CMiniScopeControlDlg::OnSysCommand(UINT nID, LPARAM lParam)
 		CAboutDlg dlgAbout;
 		dlgAbout.DoModal();
 	}
+	else if ((nID & 0xFFF0) == IDM_BENCHMARK)
+	{
+		AfxBeginThread(runBenchmark,(LPVOID)this);
+	}
+	else if ((nID & 0xFFF0) == IDM_TRACESAVE)
+	{
+		CTime time = CTime::GetCurrentTime();
+		CString str;
+		CString fileName;
+		CreateDirectory(L"data",NULL);
+		fileName.Format(L"data\\pipelineTrace_%u_%u_%u_H%u_M%u_S%u.json",time.GetMonth(),time.GetDay(),time.GetYear(),time.GetHour(),time.GetMinute(),time.GetSecond());
+		if (!gTraceEnabled)
+			AddListText(L"Tracing is off, Trace\\Enabled in the app profile turns it on");
+		else if (TraceSave(fileName)) {
+			str.Format(L"Pipeline trace saved to %s, open it in chrome://tracing or Perfetto", (LPCTSTR)fileName);
+			AddListText(str);
+		}
+		else
+			AddListText(L"Could not save the pipeline trace");
+	}
 	else
 	{
 		CDialogEx::OnSysCommand(nID, lParam);
@@ -369,7 +409,7 @@ void CMiniScopeControlDlg::UpdateLEDs(int ledNum, int value) {
 		outValue = ((UINT16)(value*(0x0FFF)/1000))|(0x3000);//0 to 10 but 10 times resolution
 	
 	if (scopeCamConnected==true) { //Added by Daniel and commented out COMM communication below 4_9_2015
-		msCam.set(CV_CAP_PROP_HUE,(outValue>>4)&0x00FF); //Added by Daniel and commented out COMM communication below 4_9_2015
+		mScope->cam.set(CV_CAP_PROP_HUE,(outValue>>4)&0x00FF); //Added by Daniel and commented out COMM communication below 4_9_2015
 
 		
 			str.Format(L"LED power updated: %d", value);
@@ -389,13 +429,132 @@ void CMiniScopeControlDlg::UpdateLEDs(int ledNum, int value) {
 
 
 void  CMiniScopeControlDlg::AddListText(CString str)
-{ //Used to add text to the Infor Box List
+{ //Used to add text to the Infor Box List. Any thread but the UI thread posts it there.
+	CString* posted;
+
+	if (GetCurrentThreadId() != AfxGetApp()->m_nThreadID) {
+		posted = new CString(str);
+		if (!::PostMessage(GetSafeHwnd(), WM_LIST_TEXT, 0, (LPARAM)posted))
+			delete posted;
+		return;
+	}
 	int index = mInfoList.GetCount();
 	mInfoList.InsertString( index, str );
 	mInfoList.SetTopIndex(mInfoList.GetCount() - 1);
 	//m_InfoList.EnsureVisible(index, FALSE);
 }
 
+LRESULT CMiniScopeControlDlg::OnListText(WPARAM wParam, LPARAM lParam)
+{
+	CString* str = (CString*)lParam;
+
+	AddListText(*str);
+	delete str;
+	return 0;
+}
+
+void CMiniScopeControlDlg::LoadSourceConfigs()
+{ //Source 0 is the scope and source 1 the behavior cam the dialog's controls drive. Sources\Count in the
+  //app profile adds more, each described by Sources\Source<n>Kind (0 scope, 1 behavior), Source<n>Device
+  //and Source<n>Name. Extra sources connect with the button of their kind and record with the rest.
+  //Sources\ScopeInput, Sources\BehaviorInput and Sources\Source<n>Input replace a camera with a
+  //synthetic input such as "phantom,752x480,60,40,4", see CreateSyntheticCapture.
+	CWinApp* app = AfxGetApp();
+	CString key;
+	CString name;
+	int extra;
+	int kindCount[CAPTURE_KIND_COUNT] = {1, 1};
+
+	mSession.record = &record;
+	mSession.armed = &mArmed;
+	mSession.startOfRecord = &startOfRecord;
+	mSession.frequency = Frequency;
+	mSession.displayMaxFPS = mDisplayMaxFPS;
+	mSession.tsLog = &mTSLog;
+	mSession.droppedFile = &droppedFile;
+	mSession.fileCS = &mTSFileCS;
+
+	// Raw YUY2 passthrough for scopes, see CCaptureSource::Open. Stored in the app profile.
+	mSourceConfigs[0].name = L"msCam";
+	mSourceConfigs[0].kind = CAPTURE_SCOPE;
+	mSourceConfigs[0].device = mScopeCamID;
+	mSourceConfigs[0].rawCapture = app->GetProfileInt(L"Scope", L"RawCapture", 1) != 0;
+	// 10 or 12 to record the sensor's native depth, needs RawCapture. Only synthetic inputs deliver it so far.
+	mSourceConfigs[0].bitDepth = app->GetProfileInt(L"Scope", L"BitDepth", 8);
+	mSourceConfigs[0].input = app->GetProfileString(L"Sources", L"ScopeInput", L"");
+	mSourceConfigs[1].name = L"behavCam";
+	mSourceConfigs[1].kind = CAPTURE_BEHAVIOR;
+	mSourceConfigs[1].device = mBehaviorCamID;
+	mSourceConfigs[1].rawCapture = false;
+	mSourceConfigs[1].bitDepth = 8;
+	mSourceConfigs[1].input = app->GetProfileString(L"Sources", L"BehaviorInput", L"");
+	mSourceCount = 2;
+
+	extra = app->GetProfileInt(L"Sources", L"Count", 0);
+	for (int i = 1; i <= extra && mSourceCount < MAX_CAPTURE_SOURCES; i++) {
+		CaptureSourceConfig& config = mSourceConfigs[mSourceCount];
+		key.Format(L"Source%d", i);
+		config.kind = app->GetProfileInt(L"Sources", key + L"Kind", CAPTURE_BEHAVIOR) == CAPTURE_SCOPE ? CAPTURE_SCOPE : CAPTURE_BEHAVIOR;
+		config.device = app->GetProfileInt(L"Sources", key + L"Device", mSourceCount);
+		kindCount[config.kind]++;
+		name.Format(L"%s%d", config.kind == CAPTURE_SCOPE ? L"msCam" : L"behavCam", kindCount[config.kind]);
+		config.name = app->GetProfileString(L"Sources", key + L"Name", name);
+		config.rawCapture = config.kind == CAPTURE_SCOPE && mSourceConfigs[0].rawCapture;
+		config.bitDepth = config.kind == CAPTURE_SCOPE ? mSourceConfigs[0].bitDepth : 8;
+		config.input = app->GetProfileString(L"Sources", key + L"Input", L"");
+		mSourceCount++;
+	}
+	for (int i = 0; i < mSourceCount; i++)
+		mSources[i].Init(mSourceConfigs[i], this, &mSession);
+	mScope = &mSources[0];
+	mBehav = &mSources[1];
+	if (mSourceCount > 2) {
+		key.Format(L"%d extra capture sources configured", mSourceCount - 2);
+		AddListText(key);
+	}
+}
+
+int CMiniScopeControlDlg::ConnectSources(CaptureKind kind)
+{ //Opens and starts every source of one kind that is not already running. Returns how many are running.
+	CString str;
+	int connected = 0;
+
+	mSourceConfigs[0].device = mScopeCamID;
+	mSourceConfigs[1].device = mBehaviorCamID;
+	for (int i = 0; i < mSourceCount; i++) {
+		CCaptureSource& source = mSources[i];
+		if (mSourceConfigs[i].kind != kind)
+			continue;
+		if (source.IsConnected()) {
+			connected++;
+			continue;
+		}
+		// Joins the threads of a connection that was lost. With the display thread gone the scratch
+		// buffers it drew into can be handed back before the capture thread rebuilds the pool.
+		source.Close();
+		if (&source == mScope) {
+			mScopeFrame.release();
+			mScopeColorFrame.release();
+		}
+		source.Init(mSourceConfigs[i], this, &mSession);
+		if (!source.Open()) {
+			if (mSourceConfigs[i].input.IsEmpty()) {
+				str.Format(L"%s: camera %d not opened", source.Name(), mSourceConfigs[i].device);
+				AddListText(str);
+			}
+			continue;
+		}
+		if (source.IsSynthetic()) {
+			str.Format(L"%s: synthetic input %s", source.Name(), (LPCTSTR)mSourceConfigs[i].input);
+			AddListText(str);
+		}
+		if (&source != mScope && &source != mBehav)
+			cv::namedWindow((LPCSTR)CT2CA(source.Name()), CV_WINDOW_NORMAL);
+		source.StartCapture();
+		connected++;
+	}
+	return connected;
+}
 
 void CMiniScopeControlDlg::OnNMReleasedcaptureSliderexcitation(NMHDR *pNMHDR, LRESULT *pResult)
 {
@@ -428,7 +587,7 @@ void CMiniScopeControlDlg::OnEnKillfocusEdit17()
 	CString str;
 	UpdateData(TRUE);
 	mSliderScopeGain.SetPos(mScopeGain);
-	msCam.set(CV_CAP_PROP_GAIN,mScopeGain);
+	mScope->cam.set(CV_CAP_PROP_GAIN,mScopeGain);
 	str.Format(L"\tGain Value set to %d\n", mScopeGain);
 	AddListText(str);	
 	UpdateData(FALSE);
@@ -438,7 +597,7 @@ void CMiniScopeControlDlg::OnEnKillfocusEdit6()
 	CString str;
 	UpdateData(TRUE);
 	mSliderScopeExposure.SetPos(mScopeExposure);
-	msCam.set(CV_CAP_PROP_BRIGHTNESS,mScopeExposure);
+	mScope->cam.set(CV_CAP_PROP_BRIGHTNESS,mScopeExposure);
 	str.Format(L"\tBlack Offset Value set to %d\n", mScopeExposure);
 	AddListText(str);	
 	UpdateData(FALSE);
@@ -464,10 +623,19 @@ void CMiniScopeControlDlg::OnTimer(UINT_PTR nIDEvent)
 	ElapsedMicroseconds.QuadPart /= Frequency.QuadPart;
 	mMSCurrentFPS = (int)(1000000/ElapsedMicroseconds.QuadPart);*/
 
+	QueryPerformanceCounter(&EndingTime);
 	if (record == true) {
-		QueryPerformanceCounter(&EndingTime);
 		mElapsedTime =(EndingTime.QuadPart -startOfRecord.QuadPart)/Frequency.QuadPart;
 	}
+	for (int i = 0; i < mSourceCount; i++)
+		mSources[i].UpdateStats(EndingTime.QuadPart, Frequency.QuadPart);
+	mMSCamWriteFPS = mScope->WriteFPS();
+	mBehavCamWriteFPS = mBehav->WriteFPS();
+	mMsCapFrameCountGlobal = mScope->FramesWritten();
+	mBehavCapFrameCountGlobal = mBehav->FramesWritten();
+	mMSCurrentFPS = mScope->CurrentFPS();
+	mBehavCurrentFPS = mBehav->CurrentFPS();
+	mMSDroppedFrames = mScope->RetrieveErrors();
 
 	SetDlgItemInt(IDC_EDIT9,mElapsedTime);
 	SetDlgItemInt(IDC_EDIT8,mMsCapFrameCountGlobal);
@@ -481,15 +649,13 @@ void CMiniScopeControlDlg::OnTimer(UINT_PTR nIDEvent)
 	SetDlgItemInt(IDC_MINFLUOR,mMinFluor);
 	SetDlgItemInt(IDC_MAXFLUOR,mMaxFluor);
 
-	if ((msWritePos-msReadPos) >= BUFFERLENGTH) {
-		AddListText(L"Scope cam buffer error!");				
-	}
-	if ((behavWritePos-behavReadPos) >= BUFFERLENGTH) {
-		AddListText(L"Behavior cam buffer error!");				
-	}
 	if (mRecordLength <= mElapsedTime && mRecordLength != 0) {
 		OnBnClickedStoprecord();
 	}
+	else if (record == true && BurstsOver()) {
+		AddListText(L"Burst captured, writing it to disk");
+		OnBnClickedStoprecord();
+	}
 
 	//SetDlgItem(IDC_EDIT7,mMSCurrentFPS);
 	
@@ -502,6 +668,7 @@ void CMiniScopeControlDlg::OnTimer(UINT_PTR nIDEvent)
 void CMiniScopeControlDlg::OnClose()
 {
 	KillTimer(mTimer);
+	DisarmRecording();
 	CDialogEx::OnClose();
 }
 
@@ -521,9 +688,9 @@ void CMiniScopeControlDlg::OnBnClickedScopeconnect()
 	cv::moveWindow("msCam", 1100,1);
 	//cv::resizeWindow("msCam",752,480);
 	//cv::resizeWindow("msCam",1280,1024);
-	msCam.open(mScopeCamID);
-	
-	//msCam.set(CV_CAP_PROP_CONVERT_RGB,FALSE); //Added to fix messed up top 8 bit of pixel stream
+	ConnectSources(CAPTURE_SCOPE);
+	if (!mScope->IsConnected())
+		AddListText(L"Camera Not Opened.");
 
 	//str.Format(L"Mat Channel: %d", msFrame[0].channels());
 	//		AddListText(str);
@@ -532,33 +699,31 @@ void CMiniScopeControlDlg::OnBnClickedScopeconnect()
 
 	GetDlgItem(IDC_SLIDERSCOPEEXPOSURE)->EnableWindow(TRUE);
 	GetDlgItem(IDC_SLIDERSCOPEGAIN)->EnableWindow(TRUE);
-	//mScopeExposure = msCam.get(CV_CAP_PROP_BRIGHTNESS);
+	//mScopeExposure = mScope->cam.get(CV_CAP_PROP_BRIGHTNESS);
 	//mSliderScopeExposure.SetPos(mScopeExposure);
 	UpdateData(FALSE);
-//	msCam.set(CV_CAP_PROP_SATURATION, FPS30_720);	
+//	mScope->cam.set(CV_CAP_PROP_SATURATION, FPS30_720);	
 	/*GetDlgItem(IDC_SLIDERSCOPEEXPOSURE)->EnableWindow(TRUE);
-	mScopeExposure = msCam.get(CV_CAP_PROP_EXPOSURE);
+	mScopeExposure = mScope->cam.get(CV_CAP_PROP_EXPOSURE);
 	mSliderScopeExposure.SetPos(mScopeExposure/255*100);*/
 	
-//	msCam.set(CV_CAP_PROP_SATURATION, SET_CMOS_SETTINGS); //Initiallizes CMOS sensor (FPS, gain and exposure enabled...)
+//	mScope->cam.set(CV_CAP_PROP_SATURATION, SET_CMOS_SETTINGS); //Initiallizes CMOS sensor (FPS, gain and exposure enabled...)
 
 	mScopeExposure = 0;		//Changed Out Jill 2/17/19
 	mSliderScopeExposure.SetPos(mScopeExposure);
-	//msCam.set(CV_CAP_PROP_BRIGHTNESS,mScopeExposure); 
+	//mScope->cam.set(CV_CAP_PROP_BRIGHTNESS,mScopeExposure); 
 
 
 	mScopeGain = 0;
 	mSliderScopeGain.SetPos(mScopeGain);
-	//msCam.set(CV_CAP_PROP_GAIN,mScopeGain);
+	//mScope->cam.set(CV_CAP_PROP_GAIN,mScopeGain);
 
 	UpdateData(FALSE);
-	scopeCamConnected = true;
+	scopeCamConnected = mScope->IsConnected();
 
 	mValueExcitation = 0;
 	mSliderExcitation.SetPos(mValueExcitation);
 	UpdateLEDs(0,0);
-
-	AfxBeginThread(msCapture,(LPVOID)this);
 }
 
 
@@ -569,35 +734,35 @@ void CMiniScopeControlDlg::OnBnClickedBehaviorconnect()
 	GetDlgItem(IDC_RECORD)->EnableWindow(FALSE);
 	cv::namedWindow("behavCam");
 	cv::moveWindow("behavCam", 1000,400);
-	behavCam.open(mBehaviorCamID);
+	ConnectSources(CAPTURE_BEHAVIOR);
+	if (!mBehav->IsConnected()) {
+		UpdateData(FALSE);
+		return;
+	}
 	
 	GetDlgItem(IDC_SLIDERBEHAVEXPOSURE)->EnableWindow(TRUE);
-	mBehavExposure = behavCam.get(CV_CAP_PROP_BRIGHTNESS);
+	mBehavExposure = mBehav->cam.get(CV_CAP_PROP_BRIGHTNESS);
 	mSliderBehavExposure.SetPos(mBehavExposure);
 
-	//behavCam.set(CV_CAP_PROP_FRAME_WIDTH,424);
-	//behavCam.set(CV_CAP_PROP_FRAME_HEIGHT,240);
+	//mBehav->cam.set(CV_CAP_PROP_FRAME_WIDTH,424);
+	//mBehav->cam.set(CV_CAP_PROP_FRAME_HEIGHT,240);
 
-	behavCam.set(CV_CAP_PROP_GAIN,behavCam.get(CV_CAP_PROP_GAIN));
-	behavCam.set(CV_CAP_PROP_CONTRAST,behavCam.get(CV_CAP_PROP_CONTRAST));
-	behavCam.set(CV_CAP_PROP_SATURATION,behavCam.get(CV_CAP_PROP_SATURATION));
-	behavCam.set(CV_CAP_PROP_EXPOSURE,behavCam.get(CV_CAP_PROP_EXPOSURE));
+	mBehav->cam.set(CV_CAP_PROP_GAIN,mBehav->cam.get(CV_CAP_PROP_GAIN));
+	mBehav->cam.set(CV_CAP_PROP_CONTRAST,mBehav->cam.get(CV_CAP_PROP_CONTRAST));
+	mBehav->cam.set(CV_CAP_PROP_SATURATION,mBehav->cam.get(CV_CAP_PROP_SATURATION));
+	mBehav->cam.set(CV_CAP_PROP_EXPOSURE,mBehav->cam.get(CV_CAP_PROP_EXPOSURE));
 
 	
-	//behavCam.set(CV_CAP_PROP_SETTINGS,1);
+	//mBehav->cam.set(CV_CAP_PROP_SETTINGS,1);
 
 	UpdateData(FALSE);
 	GetDlgItem(IDC_BEHAVPROP)->EnableWindow(TRUE);
-	behavCam.grab();
-	behavCam.retrieve(behavFrame[behavWritePos%BUFFERLENGTH]);
-	//cv::imshow("behavCam", initialBehavFrame);
 	cv::setMouseCallback("behavCam",mouseClick,this);
 	AddListText(L"Select Behavior Cam ROI");
 
 	//while(!behavGotROI) {}
 
 	behaviorCamConnected = true;
-	AfxBeginThread(behavCapture,(LPVOID)this);
 }
 void CMiniScopeControlDlg::mouseClick(int event, int x, int y, int flags, void *param)
 {
@@ -622,7 +787,7 @@ void CMiniScopeControlDlg::mouseClick(int event, int x, int y, int flags, void *
 			{
 				self->pt2.x = x;
 				self->pt2.y = y;
-				self->behavROI = cv::Rect(self->pt1,self->pt2);
+				self->mBehav->roi = cv::Rect(self->pt1,self->pt2);
 				self->behavGotROI = true;
 				self->dragging=false;
 				self->AddListText(L"ROI Set");
@@ -637,65 +802,249 @@ void CMiniScopeControlDlg::mouseClick(int event, int x, int y, int flags, void *
 
 void CMiniScopeControlDlg::OnBnClickedRecord()
 {
+	LARGE_INTEGER now;
+
+	UpdateData(TRUE);
+	// A trigger that found no armed recording starts this too, its recordings were checked when the box was ticked
+	if (mCheckTrigRec == false && !AdmitRecording())
+		return;
+	OpenRecording();
+	QueryPerformanceCounter(&now);
+	StartRecording(now, 0);
+}
+
+LONG CMiniScopeControlDlg::OpenRecording()
+{ //Creates the recording's folder and shared files and gets every streaming source ready to write. Returns how many will.
 	CString str;
 	CTime time = CTime::GetCurrentTime();
 	std::string tempString;
-
-	UpdateData(TRUE);
+	LONG writers = 0;
 
 	CreateDirectory(L"data",NULL);
 	str.Format(L"data\\%u_%u_%u",time.GetMonth(),time.GetDay(),time.GetYear());
 	CreateDirectory(str,NULL);
 	str.Format(L"data\\%u_%u_%u\\H%u_M%u_S%u",time.GetMonth(),time.GetDay(),time.GetYear(),time.GetHour(),time.GetMinute(),time.GetSecond());
 	CreateDirectory(str,NULL);
+	recordFolderName = str;
 	TSFileName.Format(L"data\\%u_%u_%u\\H%u_M%u_S%u\\%s",time.GetMonth(),time.GetDay(),time.GetYear(),time.GetHour(),time.GetMinute(),time.GetSecond(), L"timestamp.dat");
 	settingsFIleName.Format(L"data\\%u_%u_%u\\H%u_M%u_S%u\\%s",time.GetMonth(),time.GetDay(),time.GetYear(),time.GetHour(),time.GetMinute(),time.GetSecond(), L"settings_and_notes.dat");
+	droppedFileName.Format(L"data\\%u_%u_%u\\H%u_M%u_S%u\\%s",time.GetMonth(),time.GetDay(),time.GetYear(),time.GetHour(),time.GetMinute(),time.GetSecond(), L"droppedFrames.dat");
 
 	str.Format(L"Files created in %s", str);
 	AddListText(str);
 
-	std::ostringstream os, os2;
-	os << "data\\" << time.GetMonth() << "_"  << time.GetDay() << "_"  << time.GetYear() << "\\H"  << time.GetHour() << "_M"  << time.GetMinute() << "_S" << time.GetSecond() << "\\msCam";
-	msCamFileName = os.str();
-	os2  << "data\\" << time.GetMonth() << "_" << time.GetDay() << "_" << time.GetYear() << "\\H" << time.GetHour() << "_M" << time.GetMinute() << "_S" << time.GetSecond() << "\\behavCam";
-	behavCamFileName = os2.str();
+	std::ostringstream os;
+	os << "data\\" << time.GetMonth() << "_"  << time.GetDay() << "_"  << time.GetYear() << "\\H"  << time.GetHour() << "_M"  << time.GetMinute() << "_S" << time.GetSecond() << "\\";
 	
 	
 
 
-	TSFile.Open(TSFileName, CFile::modeCreate|CFile::modeWrite, NULL);
-	str.Format(L"camNum\tframeNum\tsysClock\tbuffer\n");
-	TSFile.WriteString(str);
+	droppedFile.Open(droppedFileName, CFile::modeCreate|CFile::modeWrite, NULL);
+	str.Format(L"camNum\tframeNum\tsysClock\treason\n");
+	droppedFile.WriteString(str);
 
 	settingsFile.Open(settingsFIleName, CFile::modeCreate|CFile::modeWrite, NULL);
+
+	//Frames per video file, 0 to start files only by Writer\SegmentMB or Writer\SegmentSeconds
+	msCamMaxFrames = AfxGetApp()->GetProfileInt(L"Writer", L"msCamSegmentFrames", 1000);		//Changed from 1000 to 3000 Jill 1-7-19
+	behavCamMaxFrames = AfxGetApp()->GetProfileInt(L"Writer", L"behavCamSegmentFrames", 1000);	//Changed from 1000 to 3000 Jill 1-7-19
+	
+	// Writers log binary timestamps, timestamp.dat is written from them once the recording is finished.
+	// The start goes into the header once StartRecording knows it.
+	str = TSFileName;
+	str.Replace(L"timestamp.dat", L"timestamp.msts");
+	if (!mTSLog.Open(str, Frequency.QuadPart, 0))
+		AddListText(L"Could not create " + str);
+	// Every streaming source records into <folder>\<name><n>.avi. The writer count has to be known
+	// before any of them starts, since the last one to finish closes the shared files.
+	for (int i = 0; i < mSourceCount; i++) {
+		mWriting[i] = mSources[i].IsStreaming();
+		if (mWriting[i] == false)
+			continue;
+		mSources[i].PrepareRecording(os.str() + (LPCSTR)CT2CA(mSources[i].Name()),
+			mSources[i].Kind() == CAPTURE_SCOPE ? msCamMaxFrames : behavCamMaxFrames);
+		writers++;
+	}
+	mRecordingOpen = true;
+	return writers;
+}
+
+void CMiniScopeControlDlg::StartRecording(const LARGE_INTEGER& triggerTime, LONGLONG preTriggerTicks)
+{ //Everything slow happened in OpenRecording, so a trigger only starts the clock and the writers.
+  //A triggered recording starts preTriggerTicks before the trigger, or where it was armed if that is later.
+	CString str;
+	LONG writers = 0;
+
+	startOfRecord.QuadPart = max(triggerTime.QuadPart - preTriggerTicks, armedTime.QuadPart);
+	mTSLog.SetStartTicks(startOfRecord.QuadPart);
+
 	str.Format(L"animal\texcitation\tmsCamExposure\trecordLength\n");
 	settingsFile.WriteString(str);
 	str.Format(L"%s\t%i\t%i\t%i\n\nelapsedTime\tNote\n",mMouseName,mValueExcitation,mScopeExposure,mRecordLength);
 	settingsFile.WriteString(str);
-	
+	if (startOfRecord.QuadPart < triggerTime.QuadPart) {
+		str.Format(L"%u\tTrigger, the frames before it are from the pre-trigger window\n",
+			(UINT)((triggerTime.QuadPart - startOfRecord.QuadPart)/Frequency.QuadPart));
+		settingsFile.WriteString(str);
+		str.Format(L"Triggered, recording from %.2f s before the trigger", (double)(triggerTime.QuadPart - startOfRecord.QuadPart)/Frequency.QuadPart);
+		AddListText(str);
+	}
 
-	msCamMaxFrames = 1000;				//Changed from 1000 to 3000 Jill 1-7-19
-	behavCamMaxFrames = 1000;			//Changed from 1000 to 3000 Jill 1-7-19
-	
-	QueryPerformanceCounter(&startOfRecord);
 	GetDlgItem(IDC_RECORD)->EnableWindow(FALSE);
 	if (mCheckTrigRec==false)
 		GetDlgItem(IDC_STOPRECORD)->EnableWindow(TRUE);
 	GetDlgItem(IDC_SUBMITNOTE)->EnableWindow(TRUE);
 	GetDlgItem(IDC_RESETROI)->EnableWindow(FALSE);
+	for (int i = 0; i < mSourceCount; i++) {
+		if (mWriting[i] == true)
+			writers++;
+	}
+	mActiveWriters = writers;
 	record = true;
-	msReadPos = msWritePos;
-	behavReadPos = behavWritePos;
-	//msCam.set(CV_CAP_PROP_GAIN,0x20); //Removed Jill 1-19
-	msCam.set(CV_CAP_PROP_SATURATION,RECORD_START); //Added by Daniel and start Frame Capture Trigger 6_22_2015
-	AfxBeginThread(camWrite,(LPVOID)this,THREAD_PRIORITY_HIGHEST);
+	// Only now, so the sources never see a frame that is neither windowed nor recorded
+	mArmed = false;
+	//mScope->cam.set(CV_CAP_PROP_GAIN,0x20); //Removed Jill 1-19
+	for (int i = 0; i < mSourceCount; i++) {
+		if (mWriting[i] == true && mSources[i].Kind() == CAPTURE_SCOPE && !mSources[i].IsSynthetic())
+			mSources[i].cam.set(CV_CAP_PROP_SATURATION,RECORD_START); //Added by Daniel and start Frame Capture Trigger 6_22_2015
+	}
+	for (int i = 0; i < mSourceCount; i++) {
+		if (mWriting[i] == true)
+			mSources[i].StartWriter();
+	}
+	if (writers == 0) {
+		record = false;
+		AddListText(L"No camera connected");
+		FinishRecording();
+	}
+}
+
+void CMiniScopeControlDlg::ArmRecording()
+{ //While a triggered recording waits for its trigger. From here on the sources keep
+  //Trigger\PreTriggerSeconds of frames in RAM, which the trigger writes ahead of the live ones.
+	if (mArmed || mRecordingOpen || record == true)
+		return;
+	UpdateData(TRUE);
+	OpenRecording();
+	QueryPerformanceCounter(&armedTime);
+	mArmed = true;
+	AddListText(L"Armed, recording starts on the trigger");
+}
+
+void CMiniScopeControlDlg::DisarmRecording()
+{ //The trigger did not come, so the files armed for it go with their folder
+	CString str;
+
+	if (mArmed == false)
+		return;
+	mArmed = false;
+	mTSLog.Close();
+	droppedFile.Close();
+	settingsFile.Close();
+	str = TSFileName;
+	str.Replace(L"timestamp.dat", L"timestamp.msts");
+	DeleteFile(str);
+	DeleteFile(droppedFileName);
+	DeleteFile(settingsFIleName);
+	RemoveDirectory(recordFolderName);
+	mRecordingOpen = false;
+	AddListText(L"Triggered recording disarmed");
+}
+
+UINT CMiniScopeControlDlg::PreTriggerSeconds() const
+{
+	return AfxGetApp()->GetProfileInt(L"Trigger", L"PreTriggerSeconds", 0);
+}
+
+bool CMiniScopeControlDlg::AdmitRecording()
+{ //UI thread. Compares what the streaming sources will write to each folder with what that folder sustains, measuring
+  //a folder the first time, and asks whether to record anyway if one needs more than DiskCheck\HeadroomPercent of it.
+  //A striped source spreads its rate evenly over its stripe folders, one lane each.
+	CWinApp* app = AfxGetApp();
+	DiskCheckResult disk;
+	std::vector<CString> folders;
+	std::vector<CString> needs;
+	std::vector<double> rates;
+	CString str;
+	CString over;
+	double bytes;
+	UINT headroom = app->GetProfileInt(L"DiskCheck", L"HeadroomPercent", 80);
+
+	if (app->GetProfileInt(L"DiskCheck", L"Enabled", 1) == 0)
+		return true;
+	for (int i = 0; i < mSourceCount; i++) {
+		// A burst waits in RAM for the disk, whatever its rate
+		if (!mSources[i].IsStreaming() || mSources[i].IsBursting())
+			continue;
+		std::vector<CString> targets(1, CString(L"data"));
+		if (mSources[i].IsStriping())
+			targets = mSources[i].StripeFolders();
+		bytes = mSources[i].DiskBytesPerSecond()/1048576/targets.size();
+		for (size_t j = 0; j < targets.size(); j++) {
+			size_t k = 0;
+			while (k < folders.size() && folders[k].CompareNoCase(targets[j]) != 0)
+				k++;
+			if (k == folders.size()) {
+				folders.push_back(targets[j]);
+				needs.push_back(CString());
+				rates.push_back(0);
+			}
+			str.Format(L"%s%s %.1f", needs[k].IsEmpty() ? L"" : L", ", mSources[i].Name(), bytes);
+			needs[k] += str;
+			rates[k] += bytes;
+		}
+	}
+	for (size_t k = 0; k < folders.size(); k++) {
+		CreateDirectory(folders[k], NULL);
+		if (!CheckFolderMBps(folders[k], false, disk)) {
+			str.Format(L"Measuring how fast %s writes, the result is kept for DiskCheck\\MaxAgeDays", (LPCTSTR)folders[k]);
+			AddListText(str);
+			CheckFolderMBps(folders[k], true, disk);
+		}
+		if (disk.MBps == 0) {
+			str.Format(L"Disk check skipped for %s, could not measure it: %s", (LPCTSTR)folders[k], (LPCTSTR)disk.error);
+			AddListText(str);
+			continue;
+		}
+		str.Format(L"Recording needs %.1f MB/s of %s (%s), it sustains %.1f MB/s (measured %s)", rates[k],
+			(LPCTSTR)folders[k], (LPCTSTR)needs[k], disk.MBps, (LPCTSTR)disk.measured.Format(L"%Y-%m-%d %H:%M"));
+		AddListText(str);
+		if (rates[k] <= disk.MBps*headroom/100)
+			continue;
+		str.Format(L"%s needs %.0f%% of what it sustains\n", (LPCTSTR)folders[k], 100*rates[k]/disk.MBps);
+		over += str;
+	}
+	if (over.IsEmpty())
+		return true;
+	AddListText(L"Disk check: no go");
+	return AfxMessageBox(over + L"\nIts queues are likely to fill and lose frames. Record anyway?",
+		MB_YESNO | MB_ICONWARNING) == IDYES;
+}
+
+bool CMiniScopeControlDlg::BurstsOver() const
+{ //A recording of bursting sources is over once every one of them has its burst in RAM
+	bool bursting = false;
+
+	for (int i = 0; i < mSourceCount; i++) {
+		if (mWriting[i] == false || !mSources[i].IsBursting())
+			continue;
+		if (!mSources[i].BurstOver())
+			return false;
+		bursting = true;
+	}
+	return bursting;
 }
 
 
 void CMiniScopeControlDlg::OnBnClickedStoprecord()
 {
-	msCam.set(CV_CAP_PROP_SATURATION,RECORD_END); //Added by Daniel and start Frame Capture Trigger 6_22_2015
+	for (int i = 0; i < mSourceCount; i++) {
+		if (mSources[i].IsConnected() && mSources[i].Kind() == CAPTURE_SCOPE)
+			mSources[i].cam.set(CV_CAP_PROP_SATURATION,RECORD_END); //Added by Daniel and start Frame Capture Trigger 6_22_2015
+	}
 	record = false;
+	for (int i = 0; i < mSourceCount; i++)
+		mSources[i].WakeWriter();
 }
 
 
@@ -703,336 +1052,399 @@ void CMiniScopeControlDlg::OnNMReleasedcaptureSliderscopeexposure(NMHDR *pNMHDR,
 {
 	CString str;
 	mScopeExposure = mSliderScopeExposure.GetPos();
-	msCam.set(CV_CAP_PROP_BRIGHTNESS,mScopeExposure);
+	mScope->cam.set(CV_CAP_PROP_BRIGHTNESS,mScopeExposure);
 	UpdateData(FALSE);
 	str.Format(L"\tBlack Offset Value set to %d\n", mScopeExposure);   //Changed Jill 2-17-19
 	AddListText(str);	
 	*pResult = 0;
 }
 
-UINT CMiniScopeControlDlg::msCapture(LPVOID pParam )
-{
-	CMiniScopeControlDlg* self = (CMiniScopeControlDlg*)pParam;
-	CSingleLock msSingleLock(&msCS);
-
-	LARGE_INTEGER previousTime;
-	LARGE_INTEGER currentTime;
-	currentTime = self->startOfRecord;
+void CMiniScopeControlDlg::PollTrigger(CCaptureSource& source)
+{ //Scope's capture thread. Reads the GPIO when triggerable recording is checked and posts what it calls for
+  //to the UI thread, one message at a time, so the capture thread never waits on the dialog.
+	unsigned char temp;
+	TriggerEvent event;
+
+	if (&source != mScope || mCheckTrigRec == false || mTriggerPosted != 0)
+		return;
+	temp = source.cam.get(CV_CAP_PROP_SATURATION);
+	//str.Format(L"GPIO State: %u",temp);
+	//AddListText(str);
+	if ((temp & TRIG_RECORD_EXT) == TRIG_RECORD_EXT) {
+		if (record == true)
+			return;
+		QueryPerformanceCounter(&mTriggerTime);
+		event = TRIGGER_START;
+	}
+	else if (record == true)
+		event = TRIGGER_STOP;
+	// Once the last recording's files are closed the next one's are opened ahead of its trigger
+	else if (mRecordingOpen == false)
+		event = TRIGGER_ARM;
+	else
+		return;
+	InterlockedExchange(&mTriggerPosted, 1);
+	if (!::PostMessage(GetSafeHwnd(), WM_TRIGGER_EVENT, (WPARAM)event, 0))
+		InterlockedExchange(&mTriggerPosted, 0);
+}
 
-	cv::Mat frame; //moved from inside else loop by Daniel 3_27_2015
+LRESULT CMiniScopeControlDlg::OnTriggerEvent(WPARAM wParam, LPARAM lParam)
+{ //The state is checked again, the box may have been unticked or a recording stopped since the message was posted
+	InterlockedExchange(&mTriggerPosted, 0);
+	if (mCheckTrigRec == false)
+		return 0;
+	switch (wParam) {
+	case TRIGGER_START:
+		if (record == true)
+			break;
+		UpdateLEDs(0,mValueExcitation);
+		if (mArmed)
+			StartRecording(mTriggerTime, (LONGLONG)PreTriggerSeconds()*Frequency.QuadPart);
+		else
+			OnBnClickedRecord();//Start recording
+		break;
+	case TRIGGER_STOP:
+		if (record == false)
+			break;
+		OnBnClickedStoprecord();
+		// A pre-trigger window of dark frames would be no use
+		UpdateLEDs(0, PreTriggerSeconds() > 0 ? mValueExcitation : 0);
+		break;
+	case TRIGGER_ARM:
+		ArmRecording();
+		break;
+	}
+	return 0;
+}
+void CMiniScopeControlDlg::ShowFrame(CCaptureSource& source, cv::Mat& frame)
+{
+	if (&source == mScope)
+		ShowScopeFrame(frame);
+	else if (&source == mBehav)
+		ShowBehavFrame(frame);
+	else
+		cv::imshow((LPCSTR)CT2CA(source.Name()), frame);
+}
+void CMiniScopeControlDlg::ShowScopeFrame(cv::Mat& frame)
+{ //Renders the newest scope frame with the fluorescence scaling or Bayer colour the dialog is set to
+	cv::Mat gray; //header over frame when the scope already delivers the Y plane, else over mScopeFrame
+	uchar* before;
+	double scale = 1 << (mScope->BitDepth() - 8); //10 and 12 bit samples are shown on the 8 bit scale of the sliders
 
-	// Added by Daniel 6_22_2015 to try and stop software from crashing on camera disconnect
-	bool status;
-	//----------------------------
 	CString str;
-	CString str2;
 	std::string tempString;
 	
 	std::vector<int> compression_params;
     compression_params.push_back(CV_IMWRITE_PNG_COMPRESSION);
     compression_params.push_back(0);
-	cv::Mat droppedFrameImage = cv::imread("droppedFrameImage.bmp", CV_LOAD_IMAGE_COLOR);
-	unsigned char temp;
-	//Below was commented out
-	cv::Mat trash;
+
+	if (mScopeFrame.empty()) {
+		mScopeFrame = mScope->pool.Borrow(frame.rows, frame.cols, CV_8UC1);
+		mScopeColorFrame = mScope->pool.Borrow(frame.rows, frame.cols, CV_8UC3);
+	}
+
+	if (getScreenShot == true) {
 	
-	if(!self->msCam.isOpened())
-		self->AddListText(L"Camera Not Opened.");
-	self->msCam.read(trash);
+		CT2CA pszConvertedAnsiString = folderLocation + "\\" + mMouseName + "_" + mNote + "_" + currentTime + ".png";
+		tempString = pszConvertedAnsiString;
+		cv::imwrite(tempString,frame,compression_params);
+		getScreenShot = false;
+		str.Format(L"Image saved in %s",folderLocation);
+		AddListText(str);
+		mNote = "";
+		UpdateData(FALSE);
+	}
+	//cv::cvtColor(frame,mScopeFrame,CV_YUV2GRAY_YUYV);//added to correct green color stream
 	
 	
-	while(1) {	
-		
-		
-		//Added for triggerable recording
-		if (self->mCheckTrigRec == true) {
-			temp = self->msCam.get(CV_CAP_PROP_SATURATION);
-			//str.Format(L"GPIO State: %u",temp);
-			//self->AddListText(str);
-			if ((temp & TRIG_RECORD_EXT) == TRIG_RECORD_EXT) {
-				if (self->record == false) {
-					self->UpdateLEDs(0,self->mValueExcitation);
-					self->OnBnClickedRecord();//Start recording
-				}
-			}
-			else {
-				if(self->record == true) {
-					self->OnBnClickedStoprecord();
-					self->UpdateLEDs(0,0);
-					
-				}
-			}
-		}
-		//-------------------------------
+	before = mScopeFrame.data;
+	if (frame.channels() == 1)
+		gray = frame;
+	else {
+		cv::cvtColor(frame,mScopeFrame,CV_BGR2GRAY);//added to correct green color stream
+		gray = mScopeFrame;
+	}
+	mScope->pool.Track(mScopeFrame, before);
+	
+	if (mMSColorCheck == FALSE) {
+		before = mScopeFrame.data;
+		cv::minMaxLoc(gray,&mMinFluor,&mMaxFluor);
+		mMinFluor /= scale;
+		mMaxFluor /= scale;
+		gray.convertTo(mScopeFrame, CV_8U, 255.0/(mMaxFluorDisplay - mMinFluorDisplay)/scale, -mMinFluorDisplay * 255.0/(mMaxFluorDisplay - mMinFluorDisplay));
+		mScope->pool.Track(mScopeFrame, before);
+
+		if (record == true)
+			//cv::imshow("msCam", frame);
+			cv::imshow("msCam",mScopeFrame);//added to correct green color stream
+		else {
+			cv::Mat dst;
+			//cv::threshold(frame,dst,mSaturationThresh,0,4);
+			//cv::threshold(mScopeFrame,dst,mSaturationThresh,0,4);//added to correct green color stream
+			//cv::imshow("msCam", dst);
+			cv::imshow("msCam",mScopeFrame);
 
-		
-		status = self->msCam.grab();
-		if (status == false) {
-			self->record = false;
-			self->AddListText(L"msCam frame grab error! Recording ended.");
-			break;
 		}
-		
-		previousTime = currentTime;
-		QueryPerformanceCounter(&currentTime);
-		self->mMSCurrentFPS = 1/(((double)currentTime.QuadPart - previousTime.QuadPart)/self->Frequency.QuadPart);
-		
-		self->msCapFrameTime[self->msWritePos%BUFFERLENGTH] = 1000*((double)currentTime.QuadPart - self->startOfRecord.QuadPart)/self->Frequency.QuadPart;
-		status = self->msCam.grab();
-/*
-		if (status == false) {
-			self->record = false;
-			self->AddListText(L"msCam frame grab error! Recording ended.");
-			break;
-		}
-*/
-		status = self->msCam.retrieve(self->msFrame[self->msWritePos%BUFFERLENGTH]);
-
-//		status = self->msCam.read(self->msFrame[self->msWritePos%BUFFERLENGTH]);
-/*
-		if (status == false) {
-			
-			self->record = false; //Commented out to not end recording Daniel 11_10_2015
-			self->mMSDroppedFrames++; //Added frame drop tracker Daniel 11_10_2015
-			self->AddListText(L"msCam frame retrieve error! Recording ended.");
-			//self->dFrameDrop.ShowWindow(SW_SHOW);//popup dialog box Daniel 11_10_2015
-			cv::imshow("msCam",droppedFrameImage);
-			self->msCam.release();
-			break; //removed break Daniel 11_10_2015
+	}
+	else { 
+		//cv::Mat channel[3];
+		//cv::cvtColor(frame,mScopeFrame,CV_YUV2GRAY_YUY2);//added to correct green color stream
+		if (gray.depth() != CV_8U) {
+			before = mScopeFrame.data;
+			gray.convertTo(mScopeFrame, CV_8U, 1/scale);
+			mScope->pool.Track(mScopeFrame, before);
+			gray = mScopeFrame;
 		}
-*/
-		if (status == false) {
-			//self->record = false;
-			self->mMSDroppedFrames++; //Added frame drop tracker Daniel 11_10_2015
-			self->AddListText(L"msCam frame retrieve error!");
-			//self->dFrameDrop.ShowWindow(SW_SHOW);//popup dialog box Daniel 11_10_2015
-			cv::imshow("msCam",droppedFrameImage);
-			if (self->mMSDroppedFrames > 0) {
-				self->AddListText(L"reconnecting");
-				self->msCam.release();
-				self->msCam.open(self->mScopeCamID);
-			}
-			continue;
+		before = mScopeColorFrame.data;
+		cv::cvtColor(gray,mScopeColorFrame,CV_BayerRG2BGR);
+		mScope->pool.Track(mScopeColorFrame, before);
+		if (mRed == TRUE || mGreen == TRUE) {
+			// Zero the blue channel and any unselected channel in place instead of split/merge
+			cv::multiply(mScopeColorFrame, cv::Scalar(0, mGreen == TRUE ? 1 : 0, mRed == TRUE ? 1 : 0), mScopeColorFrame);
 		}
 
-		else {//Added else Daniel 11_10_2015
-			//cv::imshow("msCam",self->msFrame[self->msWritePos%BUFFERLENGTH]);
-			
-			if (self->mMSDroppedFrames > 0 || self->mMSCurrentFPS < self->mMSFPS / 2.0) {
-				self->AddListText(L"sending settings");
-//				self->msCam.set(CV_CAP_PROP_BRIGHTNESS, self->mScopeExposure);
-//				self->msCam.set(CV_CAP_PROP_GAIN, self->mScopeGain);
-//				self->OnCbnCloseupCombo1();
-//				self->UpdateLEDs(0, self->mValueExcitation);
-				self->mMSDroppedFrames = 0;
-				continue;
-			}
-			if (self->getScreenShot == true) {
-			
-				CT2CA pszConvertedAnsiString = self->folderLocation + "\\" + self->mMouseName + "_" + self->mNote + "_" + self->currentTime + ".png";
-				tempString = pszConvertedAnsiString;
-				cv::imwrite(tempString,self->msFrame[self->msWritePos%BUFFERLENGTH],compression_params);
-				self->getScreenShot = false;
-				str.Format(L"Image saved in %s",self->folderLocation);
-				self->AddListText(str);
-				self->mNote = "";
-				self->UpdateData(FALSE);
-			}
-			//cv::cvtColor(self->msFrame[self->msWritePos%BUFFERLENGTH],frame,CV_YUV2GRAY_YUYV);//added to correct green color stream
-			
-			
-			if (self->mMSColorCheck == FALSE) {
-				cv::cvtColor(self->msFrame[self->msWritePos%BUFFERLENGTH],frame,CV_BGR2GRAY);//added to correct green color stream
-
-				cv::minMaxLoc(frame,&self->mMinFluor,&self->mMaxFluor);
-				frame.convertTo(frame, CV_8U, 255.0/(self->mMaxFluorDisplay - self->mMinFluorDisplay), -self->mMinFluorDisplay * 255.0/(self->mMaxFluorDisplay - self->mMinFluorDisplay));
-
-				if (self->record == true)
-					//cv::imshow("msCam", self->msFrame[self->msWritePos%BUFFERLENGTH]);
-					cv::imshow("msCam",frame);//added to correct green color stream
-				else {
-					cv::Mat dst;
-					//cv::threshold(self->msFrame[self->msWritePos%BUFFERLENGTH],dst,self->mSaturationThresh,0,4);
-					//cv::threshold(frame,dst,self->mSaturationThresh,0,4);//added to correct green color stream
-					//cv::imshow("msCam", dst);
-					cv::imshow("msCam",frame);
-
-				}
-			}
-			else { 
-				//cv::Mat frame;
-			
-				//cv::Mat channel[3];
-				cv::cvtColor(self->msFrame[self->msWritePos%BUFFERLENGTH],frame,CV_BGR2GRAY);
-				//cv::cvtColor(self->msFrame[self->msWritePos%BUFFERLENGTH],frame,CV_YUV2GRAY_YUY2);//added to correct green color stream
-				cv::cvtColor(frame,frame,CV_BayerRG2BGR);
-				if (self->mRed == TRUE || self->mGreen == TRUE) {
-					cv::Mat bgrChannels[3];
-					cv::split(frame,bgrChannels);
-					bgrChannels[0] = cv::Mat::zeros(frame.rows,frame.cols,CV_8UC1);
-					if (self->mRed == FALSE) 
-						bgrChannels[2] = cv::Mat::zeros(frame.rows,frame.cols,CV_8UC1);
-					if (self->mGreen == FALSE)
-						bgrChannels[1] = cv::Mat::zeros(frame.rows,frame.cols,CV_8UC1);
-					cv::merge(bgrChannels,3,frame);
-				}
-
-			
-				cv::imshow("msCam", frame);
-			}
-			
-			
-			if (self->record == true) {
-				msSingleLock.Lock();  // Attempt to lock the shared resource
-				if (msSingleLock.IsLocked()) { // Resource has been locked
-					self->msWritePos++;
-					msSingleLock.Unlock();
-				}
-				
-			}
-			
-		}
-	}
 	
-	return 0;
+		cv::imshow("msCam", mScopeColorFrame);
+	}
 }
-UINT CMiniScopeControlDlg::behavCapture(LPVOID pParam )
+void CMiniScopeControlDlg::ShowBehavFrame(cv::Mat& frame)
 {
-	CMiniScopeControlDlg* self = (CMiniScopeControlDlg*)pParam;
-	CSingleLock behavSingleLock(&behavCS);
-
-	LARGE_INTEGER previousTime;
-	LARGE_INTEGER currentTime;
-	currentTime = self->startOfRecord;;
-	while(1) {
-		self->behavCam.grab();
-		previousTime = currentTime;
-		QueryPerformanceCounter(&currentTime);
-		self->mBehavCurrentFPS = 1/(((double)currentTime.QuadPart - previousTime.QuadPart)/self->Frequency.QuadPart);
-
-		self->behavCapFrameTime[self->behavWritePos%BUFFERLENGTH] = 1000*((double)currentTime.QuadPart - self->startOfRecord.QuadPart)/self->Frequency.QuadPart;
-		self->behavCam.retrieve(self->behavFrame[self->behavWritePos%BUFFERLENGTH]);
-		
-		if (self->dragging == true) {
-			rectangle(self->behavFrame[self->behavWritePos%BUFFERLENGTH], self->pt1, self->pt2, CV_RGB(255, 0, 0), 3, 8, 0);
-		}
-
-		if (self->behavGotROI)
-			cv::imshow("behavCam", self->behavFrame[self->behavWritePos%BUFFERLENGTH](self->behavROI));
-		else
-			cv::imshow("behavCam", self->behavFrame[self->behavWritePos%BUFFERLENGTH]);
+	// Drawn on the display copy only, so the ROI outline never ends up in the recording
+	if (dragging == true) {
+		rectangle(frame, pt1, pt2, CV_RGB(255, 0, 0), 3, 8, 0);
+	}
 
-		if (self->record == true) {
-			behavSingleLock.Lock();  // Attempt to lock the shared resource
-			if (behavSingleLock.IsLocked()) { // Resource has been locked
-				self->behavWritePos++;
-				behavSingleLock.Unlock();
-			}
+	if (behavGotROI)
+		cv::imshow("behavCam", frame(mBehav->roi));
+	else
+		cv::imshow("behavCam", frame);
+}
+void CMiniScopeControlDlg::SourceLost(CCaptureSource& source)
+{ //Losing the scope ends the recording, any other source just stops contributing to it
+	if (&source == mBehav)
+		behaviorCamConnected = false;
+	if (&source != mScope)
+		return;
+	scopeCamConnected = false;
+	if (record == true) {
+		record = false;
+		for (int i = 0; i < mSourceCount; i++)
+			mSources[i].WakeWriter();
+		AddListText(L"Recording ended.");
+	}
+}
+void CMiniScopeControlDlg::WriterFinished(CCaptureSource& source)
+{ //Called by each writer thread once its queue is drained. The last one out closes the shared files.
+	if (InterlockedDecrement(&mActiveWriters) > 0)
+		return;
+	FinishRecording();
+}
+void CMiniScopeControlDlg::FinishRecording()
+{
+	CString str;
+	CString traceFileName(TSFileName);
+	LONG unlogged = 0;
+	LONG dropped = 0;
+
+	str = TSFileName;
+	str.Replace(L"timestamp.dat", L"timestamp.msts");
+	if (!mTSLog.Close())
+		AddListText(L"Could not write all timestamps to " + str + L", the frames after the failure have none");
+	droppedFile.Close();
+	// Writer\TimestampText 0 keeps only the binary log, ConvertTimestampLog() can still write the text later
+	if (AfxGetApp()->GetProfileInt(L"Writer", L"TimestampText", 1) != 0) {
+		if (ConvertTimestampLog(str, TSFileName) < 0) {
+			str.Format(L"Could not write %s", (LPCTSTR)TSFileName);
+			AddListText(str);
 		}
-		
 	}
+	settingsFile.Close();
+	for (int i = 0; i < mSourceCount; i++) {
+		if (mSources[i].IsConnected()) {
+			AddListText(mSources[i].Summary());
+			unlogged += mSources[i].Unlogged();
+			dropped += mSources[i].Dropped();
+		}
+	}
+	// The last few seconds of every thread, which is where the frames went missing if the queue ran over at the end
+	traceFileName.Replace(L"timestamp.dat", L"pipelineTrace.json");
+	if (dropped > 0 && gTraceEnabled && TraceSave(traceFileName)) {
+		str.Format(L"Frames were dropped, pipeline trace saved to %s", (LPCTSTR)traceFileName);
+		AddListText(str);
+	}
+	if (unlogged > 0) {
+		str.Format(L"%d dropped frames could not be logged to droppedFrames.dat", unlogged);
+		AddListText(str);
+	}
+	mElapsedTime = 0;
+	// Runs on the last writer thread, which must not wait on the UI thread for the buttons either
+	if (GetCurrentThreadId() == AfxGetApp()->m_nThreadID)
+		OnRecordingClosed(0, 0);
+	else
+		::PostMessage(GetSafeHwnd(), WM_RECORDING_CLOSED, 0, 0);
+	mRecordingOpen = false;
+}
+LRESULT CMiniScopeControlDlg::OnRecordingClosed(WPARAM wParam, LPARAM lParam)
+{
+	GetDlgItem(IDC_RECORD)->EnableWindow(TRUE);
+	GetDlgItem(IDC_STOPRECORD)->EnableWindow(FALSE);
+	GetDlgItem(IDC_SUBMITNOTE)->EnableWindow(FALSE);
+	if (behavGotROI)
+		GetDlgItem(IDC_RESETROI)->EnableWindow(TRUE);
+	AddListText(L"Recording Files Closed");
 	return 0;
 }
-UINT CMiniScopeControlDlg::camWrite(LPVOID pParam )
+UINT CMiniScopeControlDlg::runBenchmark(LPVOID pParam )
 {
-
-	cv::VideoWriter msOutVid;
-	cv::VideoWriter behavOutVid;
-
 	CMiniScopeControlDlg* self = (CMiniScopeControlDlg*)pParam;
-	CSingleLock msSingleLock(&msCS);
-	CSingleLock behavSingleLock(&behavCS);
-
 	CString str;
-	std::string tempString;
+	QueueBenchResult result;
+	const ULONGLONG frames = 1000000;
+	const UINT capacity = 256;
+
+	self->AddListText(L"Benchmark: queue contention, no camera needed");
+	result = BenchFrameQueue(frames, capacity);
+	str.Format(L"Lock-free queue: %.0f frames/s, worst push %.1f us, %I64u order errors",
+		result.frames/result.seconds, result.maxPushUs, result.orderErrors);
+	self->AddListText(str);
+	result = BenchLockedRing(frames, capacity);
+	str.Format(L"Locked ring: %.0f frames/s, worst push %.1f us, %I64u order errors",
+		result.frames/result.seconds, result.maxPushUs, result.orderErrors);
+	self->AddListText(str);
+
+	self->AddListText(L"Benchmark: writer CPU use with a synthetic source");
+	const UINT writerFPS[] = {30, 700};
+	for (int i = 0; i < 2; i++) {
+		WriterBenchResult spin = BenchWriterWakeup(false, writerFPS[i], 3);
+		WriterBenchResult wait = BenchWriterWakeup(true, writerFPS[i], 3);
+		str.Format(L"%u fps: busy-spin writer %.1f%% CPU, event-driven writer %.1f%% CPU (%u wakeups, %I64u/%I64u frames)",
+			writerFPS[i], spin.cpuPercent, wait.cpuPercent, wait.wakeups, wait.framesWritten, wait.framesQueued);
+		self->AddListText(str);
+	}
+
+	self->AddListText(L"Benchmark: drop oldest accounting with a slow writer");
+	DropBenchResult drop = BenchDropOldest(frames, capacity);
+	str.Format(L"%I64u frames: %I64u written, %I64u dropped, %I64u accounting errors",
+		drop.frames, drop.written, drop.dropped, drop.accountingErrors);
+	self->AddListText(str);
 
-	LARGE_INTEGER startTime;
-	LARGE_INTEGER endTime;
+	self->AddListText(L"Benchmark: UVC payload replay, 752x480 frames with injected faults");
+	UVCReplayBenchResult replay = BenchUVCReplay(400, 480, 752);
+	if (replay.payloads == 0)
+		self->AddListText(L"Could not write the payload stream to the temp folder");
+	else {
+		str.Format(L"%I64u payloads in %.2f s, %.0f frames/s. Complete %I64u/%I64u, truncated %I64u/%I64u, merged %I64u/%I64u, %I64u content errors",
+			replay.payloads, replay.seconds, replay.frames/replay.seconds, replay.delivered, replay.expectedDelivered,
+			replay.truncated, replay.expectedTruncated, replay.merged, replay.expectedMerged, replay.contentErrors);
+		self->AddListText(str);
+	}
 
-	int msCamFileNumber = 1;
-	int behavCamFileNumber = 1;
-	int mMsCapFrameCount = 0;
-	int mBehavCapFrameCount = 0;
+	self->AddListText(L"Benchmark: gray frame from 752x480 YUY2");
+	LumaBenchResult luma = BenchLumaExtract(1000, 480, 752);
+	str.Format(L"YUY2->BGR->gray %.0f us, OpenCV YUY2->gray %.0f us, scalar %.0f us, SSE2 %.0f us, AVX2 %.0f us per frame (0 = not supported), %I64u mismatches",
+		luma.roundTripUs, luma.openCVUs, luma.kernelUs[LUMA_SCALAR], luma.kernelUs[LUMA_SSE2], luma.kernelUs[LUMA_AVX2], luma.mismatches);
+	self->AddListText(str);
 
-	if (self->scopeCamConnected == true) {
-		tempString = self->msCamFileName + std::to_string(msCamFileNumber) + ".avi";
-		msOutVid.open(tempString,CV_FOURCC('D', 'I', 'B', ' '),20,cv::Size(self->msCam.get(CV_CAP_PROP_FRAME_WIDTH),self->msCam.get(CV_CAP_PROP_FRAME_HEIGHT)),false); //Jill - This line can change play back rate ex. 20 to 30fps 
+	// Capture -> display -> disk with synthetic cameras. Benchmark\ScenarioCount and Benchmark\Scenario<n>
+	// in the app profile replace the default scenarios, see ParsePipelineScenario. Every scenario records
+	// into Benchmark\Folder for Benchmark\Seconds and the results go to benchmark\pipeline_<date>.json.
+	CWinApp* app = AfxGetApp();
+	CTime time = CTime::GetCurrentTime();
+	std::vector<CString> scenarios;
+	std::vector<PipelineBenchResult> runs;
+	CString key;
+	CString folder = app->GetProfileString(L"Benchmark", L"Folder", L"data\\bench");
+	UINT seconds = app->GetProfileInt(L"Benchmark", L"Seconds", 10);
+	UINT scenarioCount = app->GetProfileInt(L"Benchmark", L"ScenarioCount", 0);
+	for (UINT i = 1; i <= scenarioCount; i++) {
+		key.Format(L"Scenario%u", i);
+		scenarios.push_back(app->GetProfileString(L"Benchmark", key, L""));
 	}
-	if (self->behaviorCamConnected == true) {
-		tempString = self->behavCamFileName + std::to_string(msCamFileNumber) + ".avi";;
-		behavOutVid.open(tempString,CV_FOURCC('D', 'I', 'B', ' '),20,cv::Size(self->behavROI.width,self->behavROI.height),true); //Jill - This line can change play back rate ex. 20 to 30fps 
+	if (scenarios.empty()) {
+		scenarios.push_back(L"scope=pattern,752x480,60,4");
+		scenarios.push_back(L"scope=phantom,752x480,60,40,4;behavior=pattern,640x480,30,4");
+		scenarios.push_back(L"scope=pattern,1920x28,700,4;behavior=pattern,640x480,30,4");
+		scenarios.push_back(L"scope=pattern,752x480,0,4");
+		scenarios.push_back(L"codec=ffv1;scope=phantom,752x480,60,40,4;behavior=pattern,640x480,30,4");
+		scenarios.push_back(L"codec=raw;scope=pattern,1920x28,700,4");
+		scenarios.push_back(L"codec=raw;bits=12;scope=pattern,1920x28,700,4");
+		scenarios.push_back(L"codec=ffv1;segment=100;scope=pattern,1920x28,700,4");
 	}
-
-	while(1) {
-		msSingleLock.Lock();  // Attempt to lock the shared resource
-		if (msSingleLock.IsLocked()) { // Resource has been locked
-			if (self->msReadPos != self->msWritePos) { //use to be an if statement
-				QueryPerformanceCounter(&startTime);
-				mMsCapFrameCount++;
-				self->mMsCapFrameCountGlobal = mMsCapFrameCount;
-
-				msOutVid.write(self->msFrame[self->msReadPos%BUFFERLENGTH]);
-			
-				str.Format(L"%u\t%u\t%li\t%u\n", self->mScopeCamID, mMsCapFrameCount, self->msCapFrameTime[self->msReadPos%BUFFERLENGTH],self->msWritePos-self->msReadPos);
-				self->TSFile.WriteString(str);
-
-				if (mMsCapFrameCount%self->msCamMaxFrames == 0) {
-					msOutVid.release();
-					msCamFileNumber++;
-					tempString = self->msCamFileName + std::to_string(msCamFileNumber) + ".avi";
-					msOutVid.open(tempString,CV_FOURCC('D', 'I', 'B', ' '),20,cv::Size(self->msCam.get(CV_CAP_PROP_FRAME_WIDTH),self->msCam.get(CV_CAP_PROP_FRAME_HEIGHT)),false);  //Jill - This line can change play back rate ex. 20 to 30fps 
-				}
-				self->msReadPos++;
-				QueryPerformanceCounter(&endTime);
-				self->mMSCamWriteFPS = 1/(((double)endTime.QuadPart - startTime.QuadPart)/self->Frequency.QuadPart);
-			
-			}
-			msSingleLock.Unlock();
+	CreateDirectory(L"data", NULL);
+	for (size_t i = 0; i < scenarios.size(); i++) {
+		str.Format(L"Benchmark: %s for %u s", (LPCTSTR)scenarios[i], seconds);
+		self->AddListText(str);
+		runs.push_back(BenchPipeline(scenarios[i], folder, seconds));
+		const PipelineBenchResult& run = runs.back();
+		if (!run.error.IsEmpty()) {
+			str.Format(L"%s: %s", (LPCTSTR)scenarios[i], (LPCTSTR)run.error);
+			self->AddListText(str);
 		}
-		behavSingleLock.Lock();  // Attempt to lock the shared resource
-		if (behavSingleLock.IsLocked()) { // Resource has been locked
-			if (self->behavReadPos != self->behavWritePos) { //use to be an if statement
-				QueryPerformanceCounter(&startTime);
-				mBehavCapFrameCount++;
-				self->mBehavCapFrameCountGlobal = mBehavCapFrameCount;
-
-				behavOutVid.write(self->behavFrame[self->behavReadPos%BUFFERLENGTH](self->behavROI));
-
-				str.Format(L"%u\t%u\t%li\t%u\n", self->mBehaviorCamID, mBehavCapFrameCount, self->behavCapFrameTime[self->behavReadPos%BUFFERLENGTH],self->behavWritePos-self->behavReadPos);  //Jill - This line can change play back rate ex. 20 to 30fps 
-				self->TSFile.WriteString(str); 
-
-				if (mBehavCapFrameCount%self->behavCamMaxFrames == 0) {
-					behavOutVid.release();
-					behavCamFileNumber++;
-					tempString = self->behavCamFileName + std::to_string(behavCamFileNumber) + ".avi";
-					behavOutVid.open(tempString,CV_FOURCC('D', 'I', 'B', ' '),20,cv::Size(self->behavROI.width,self->behavROI.height),true);
-				}
-
-				self->behavReadPos++;
-				QueryPerformanceCounter(&endTime);
-				self->mBehavCamWriteFPS = 1/(((double)endTime.QuadPart - startTime.QuadPart)/self->Frequency.QuadPart);
-
+		if (run.seconds == 0)
+			continue;
+		for (size_t j = 0; j < run.sources.size(); j++) {
+			const SourceBenchResult& source = run.sources[j];
+			str.Format(L"%s: %.0f fps grabbed, %.0f fps written, %I64u dropped, queue high water %u/%u, disk p99 %.1f ms, CPU capture %.0f%% writer %.0f%%",
+				(LPCTSTR)source.name, source.grabbed/run.seconds, source.written/run.seconds, source.dropped, source.highWater, source.queueCapacity,
+				source.stages[STAGE_DISK].p99Us/1000, source.threadCPU[THREAD_CAPTURE], source.threadCPU[THREAD_WRITER]);
+			self->AddListText(str);
+			if (source.stages[STAGE_ROLLOVER].count > 0) {
+				str.Format(L"%s: %I64u file rollovers, writer stalled p50 %.0f us, max %.0f us", (LPCTSTR)source.name,
+					source.stages[STAGE_ROLLOVER].count, source.stages[STAGE_ROLLOVER].p50Us, source.stages[STAGE_ROLLOVER].maxUs);
+				self->AddListText(str);
+			}
+			if (source.codec == VIDEO_FFV1 && source.bytesOnDisk > 0 && source.encodeSeconds > 0) {
+				str.Format(L"%s: FFV1 %.2f:1, encoded at %.0f fps", (LPCTSTR)source.name,
+					(double)source.rawBytes/source.bytesOnDisk, source.written/source.encodeSeconds);
+				self->AddListText(str);
+			}
+			if (source.codec == VIDEO_RAW && source.framesInFiles != source.written) {
+				str.Format(L"%s: RAW files hold %I64u of %I64u frames written", (LPCTSTR)source.name, source.framesInFiles, source.written);
+				self->AddListText(str);
+			}
+			if (source.framesInSpill != source.spilled) {
+				str.Format(L"%s: spill file holds %I64u of %I64u frames spilled", (LPCTSTR)source.name, source.framesInSpill, source.spilled);
+				self->AddListText(str);
 			}
-			behavSingleLock.Unlock();
-		}
-		if (self->record == false && self->behavReadPos == self->behavWritePos && self->msReadPos == self->msWritePos) {
-			msOutVid.release();
-			behavOutVid.release();
-			self->TSFile.Close();
-			self->settingsFile.Close();
-			mMsCapFrameCount = 0;
-			mBehavCapFrameCount = 0;
-			self->mElapsedTime = 0;
-			self->GetDlgItem(IDC_RECORD)->EnableWindow(TRUE);
-			self->GetDlgItem(IDC_STOPRECORD)->EnableWindow(FALSE);
-			self->GetDlgItem(IDC_SUBMITNOTE)->EnableWindow(FALSE);
-			if (self->behavGotROI)
-				self->GetDlgItem(IDC_RESETROI)->EnableWindow(TRUE);
-			break;
 		}
+		str.Format(L"%.1f MB/s to disk", run.bytesOnDisk/1048576.0/run.seconds);
+		self->AddListText(str);
 	}
 
-	self->AddListText(L"Recording Files Closed");
+	// Raw frames straight to Benchmark\Folder at 700 fps with each write mode this PC has,
+	// Benchmark\RawWriteCols x Benchmark\RawWriteRows like the fastest scope mode by default
+	std::vector<DiskBenchResult> rawWrites;
+	int rawCols = app->GetProfileInt(L"Benchmark", L"RawWriteCols", 1920);
+	int rawRows = app->GetProfileInt(L"Benchmark", L"RawWriteRows", 28);
+	CreateDirectory(folder, NULL);
+	for (int mode = 0; mode < RAW_WRITE_MODE_COUNT; mode++) {
+		if (!CRawFrameWriter::IsModeAvailable((RawWriteMode)mode))
+			continue;
+		str.Format(L"Benchmark: %dx%d raw frames at 700 fps, %S writes", rawCols, rawRows, CRawFrameWriter::ModeName((RawWriteMode)mode));
+		self->AddListText(str);
+		rawWrites.push_back(BenchRawWrite(std::string(CT2CA(folder)) + "\\rawwrite.msraw", (RawWriteMode)mode,
+			rawRows, rawCols, 700, 700*(ULONGLONG)max(seconds, 1U)));
+		const DiskBenchResult& write = rawWrites.back();
+		if (!write.error.empty())
+			str.Format(L"%S: %S", CRawFrameWriter::ModeName(write.mode), write.error.c_str());
+		else
+			str.Format(L"%S: %.1f MB/s, Write() p50 %.0f us p99 %.0f us max %.1f ms, %I64u late frames, close %.1f ms",
+				CRawFrameWriter::ModeName(write.mode), write.MBps, write.writeP50Us, write.writeP99Us, write.writeMaxUs/1000,
+				write.lateFrames, write.closeMs);
+		self->AddListText(str);
+	}
+	CreateDirectory(L"benchmark", NULL);
+	key.Format(L"benchmark\\pipeline_%u_%u_%u_H%u_M%u_S%u.json", time.GetMonth(), time.GetDay(), time.GetYear(), time.GetHour(), time.GetMinute(), time.GetSecond());
+	if (WritePipelineBenchJSON(key, runs, rawWrites))
+		str.Format(L"Benchmark results written to %s", (LPCTSTR)key);
+	else
+		str.Format(L"Could not write %s", (LPCTSTR)key);
+	self->AddListText(str);
+	key.Replace(L"\\pipeline_", L"\\trace_");
+	if (gTraceEnabled && TraceSave(key)) {
+		str.Format(L"Trace of the last scenario written to %s", (LPCTSTR)key);
+		self->AddListText(str);
+	}
 	return 0;
 }
 
@@ -1063,6 +1475,7 @@ void CMiniScopeControlDlg::OnBnClickedResetroi()
 {
 	// TODO: Add your control notification handler code here
 	behavGotROI = false;
+	mBehav->roi = cv::Rect();
 	GetDlgItem(IDC_RESETROI)->EnableWindow(FALSE);
 	GetDlgItem(IDC_RECORD)->EnableWindow(FALSE);
 }
@@ -1101,11 +1514,11 @@ UINT8 temp;
 	mScopeGain = mSliderScopeGain.GetPos();
 //	if (mScopeGain>=32 && (mScopeGain%2)==1)  // Commented out by Jill 8/28/18
 //		mScopeGain++; //Gains between 32 and 64 must be even for MT9V032
-	msCam.set(CV_CAP_PROP_GAIN,mScopeGain);
+	mScope->cam.set(CV_CAP_PROP_GAIN,mScopeGain);
 	UpdateData(FALSE);
 	*pResult = 0;
-//	temp = msCam.get(CV_CAP_PROP_GAIN);	
-	//temp = msCam.get(CV_CAP_PROP_BRIGHTNESS);	
+//	temp = mScope->cam.get(CV_CAP_PROP_GAIN);	
+	//temp = mScope->cam.get(CV_CAP_PROP_BRIGHTNESS);	
 		//if (record == TRUE) {
 //				str.Format(L"Gain updated: %u", (UINT8)temp);
 //				AddListText(str);		
@@ -1130,12 +1543,12 @@ void CMiniScopeControlDlg::OnBnClickedCheck3()
 	CString str;
 	UpdateData(TRUE);
 	if(mHGC == TRUE){
-		msCam.set(CV_CAP_PROP_SATURATION, HGC_ON);
+		mScope->cam.set(CV_CAP_PROP_SATURATION, HGC_ON);
 		str.Format(L"\tHigh Conversion Gain ON %d\n", mScopeGain);
 		AddListText(str);
 	}
 	else{
-		msCam.set(CV_CAP_PROP_SATURATION, HGC_OFF);
+		mScope->cam.set(CV_CAP_PROP_SATURATION, HGC_OFF);
 		str.Format(L"\tHigh Conversion Gain OFF %d\n", mScopeGain);
 		AddListText(str);
 	}
@@ -1165,7 +1578,7 @@ void CMiniScopeControlDlg::OnBnClickedGreen()
 void CMiniScopeControlDlg::OnNMReleasedcaptureSliderbehavexposure2(NMHDR *pNMHDR, LRESULT *pResult)
 {
 	mBehavExposure = mSliderBehavExposure.GetPos();
-	behavCam.set(CV_CAP_PROP_BRIGHTNESS,mBehavExposure);
+	mBehav->cam.set(CV_CAP_PROP_BRIGHTNESS,mBehavExposure);
 	UpdateData(FALSE);
 	*pResult = 0;
 }
@@ -1173,7 +1586,7 @@ void CMiniScopeControlDlg::OnNMReleasedcaptureSliderbehavexposure2(NMHDR *pNMHDR
 
 void CMiniScopeControlDlg::OnBnClickedBehavprop()
 {
-	behavCam.set(CV_CAP_PROP_SETTINGS,1);
+	mBehav->cam.set(CV_CAP_PROP_SETTINGS,1);
 }
 
 
@@ -1200,13 +1613,18 @@ void CMiniScopeControlDlg::OnBnClickedChecktrigrec()
 		
 
 	UpdateData(TRUE);
-	if (mCheckTrigRec == TRUE) {
+	if (mCheckTrigRec == TRUE && !AdmitRecording()) {
+		mCheckTrigRec = FALSE;
+		UpdateData(FALSE);
+	}
+	else if (mCheckTrigRec == TRUE) {
 		GetDlgItem(IDC_STOPRECORD)->EnableWindow(FALSE);
 		GetDlgItem(IDC_RECORD)->EnableWindow(FALSE);
-		UpdateLEDs(0,0);
+		UpdateLEDs(0, PreTriggerSeconds() > 0 ? mValueExcitation : 0);
 	}
 	else
 	{
+		DisarmRecording();
 		GetDlgItem(IDC_STOPRECORD)->EnableWindow(TRUE);
 		if (record == false)
 			GetDlgItem(IDC_RECORD)->EnableWindow(TRUE);
@@ -1238,82 +1656,86 @@ void CMiniScopeControlDlg::OnCbnCloseupCombo1()
 	{
 		//Commented Out Jill 8/30/18
 		/*		case (5):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS5);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS5);
 			break;
 		case (10):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS10);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS10);
 			break;
 		case (15):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS15);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS15);
 			break;
 		case (20):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS20);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS20);
 			break;
 		case (30):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS30);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS30);
 			break;
 		case (60):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS60);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS60);
 			break;
 		default:
 			break;
 */
 //Added Jill 8/30/18	
 		case (0):
-			msCam.set(CV_CAP_PROP_SATURATION, INIT_F);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, INIT_F);
 			break;
 		case (1):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_1);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_1);
 			break;
 		case (2):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_2);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_2);
 			break;
 		case (3):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_3);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_3);
 			break;
 		case (4):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_4);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_4);
 		break;
 		case (8):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_8);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_8);
 			break;
 		case (30):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_30);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_30);
 			break;
 		case (60):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_60);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_60);
 			break;
 		case (100):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_100);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_100);
 		break;
 		case (153):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_153);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_153);
 		break;
 		case (200):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_200);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_200);
 		break;
 		case (250):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_250);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_250);
 		break;
 		case (293):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_293);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_293);
 		break;
 		case (400):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_400);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_400);
 		break;
 		case (500):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_500);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_500);
 		break;
 		case (700):
-			msCam.set(CV_CAP_PROP_SATURATION, FPS_700);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, FPS_700);
 		break;
 		default:
 			break;
 	
 	
 	}
+	mScope->firmwareFPS = cBoxVal;
 	str.Format(L"Scope FPS updated: %d", cBoxVal);
 			AddListText(str);
+	// The burst's length in seconds follows the frame rate
+	if (mScope->IsBursting())
+		AddListText(mScope->BurstSummary());
 
 }
 void CMiniScopeControlDlg::OnCbnCloseupCombo2()
@@ -1325,73 +1747,74 @@ void CMiniScopeControlDlg::OnCbnCloseupCombo2()
 	switch(cBoxVal) 
 	{
 		case (1):
-			msCam.set(CV_CAP_PROP_SATURATION, INIT_WIN);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, INIT_WIN);
 			break;
 		case (2):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN0);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN0);
 			break;
 		case (3):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN50);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN50);
 			break;
 		case (4):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN100);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN100);
 			break;
 		case (5):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN150);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN150);
 		break;
 		case (6):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN200);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN200);
 		break;
 		case (7):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN250);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN250);
 		break;
 		case (8):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN300);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN300);
 		break;
 		case (9):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN350);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN350);
 		break;
 		case (10):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN400);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN400);
 		break;
 		case (11):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN450);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN450);
 		break;
 		case (12):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN500);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN500);
 		break;
 		case (13):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN550);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN550);
 		break;
 		case (14):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN600);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN600);
 		break;
 		case (15):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN650);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN650);
 		break;
 		case (16):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN700);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN700);
 		break;
 		case (17):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN750);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN750);
 		break;
 		case (18):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN800);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN800);
 		break;
 		case (19):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN850);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN850);
 		break;
 		case (20):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN900);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN900);
 		break;
 		case (21):
-			msCam.set(CV_CAP_PROP_SATURATION, WIN950);
+			mScope->cam.set(CV_CAP_PROP_SATURATION, WIN950);
 		break;
 		default:
 			break;
 	
 	
 	}
+	mScope->firmwareWindow = cBoxVal;
 	str.Format(L"Window Position updated: %d", cBoxVal);
 			AddListText(str);
 
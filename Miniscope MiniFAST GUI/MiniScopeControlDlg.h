@@ -45,12 +45,26 @@
 //#include "opencv2/imgproc/imgproc_c.h"
 
 //other headers
-
-//Definitions
-#define BUFFERLENGTH 256
+#include "CaptureSource.h"
+#include "TimestampLog.h"
+
+// Posted by the scope's capture thread, wParam a TriggerEvent. Everything a trigger does to the
+// recording and the dialog happens on the UI thread.
+#define WM_TRIGGER_EVENT (WM_APP + 1)
+// Posted by AddListText() on any other thread, lParam a new CString the handler adds and deletes.
+// Sending would deadlock with a UI thread that is joining the sender.
+#define WM_LIST_TEXT (WM_APP + 2)
+// Posted by the last writer thread once the recording's files are closed
+#define WM_RECORDING_CLOSED (WM_APP + 3)
+
+enum TriggerEvent {
+	TRIGGER_START = 0,	// GPIO went high
+	TRIGGER_STOP,		// GPIO went low while recording
+	TRIGGER_ARM			// GPIO low and no recording open
+};
 
 // CMiniScopeControlDlg dialog
-class CMiniScopeControlDlg : public CDialogEx
+class CMiniScopeControlDlg : public CDialogEx, public CCaptureHost
 {
 // Construction
 public:
@@ -91,17 +105,23 @@ public:
 	//Variables
 	CListBox mInfoList;
 	
-	cv::VideoCapture msCam;
-	cv::VideoCapture behavCam;
-	cv::Mat msFrame[BUFFERLENGTH];
-	cv::Mat behavFrame[BUFFERLENGTH];
-	cv::Mat initialBehavFrame;
-	UINT16 msReadPos;
-	UINT16 msWritePos;
-	UINT16 behavReadPos;
-	UINT16 behavWritePos;
-	UINT msCapFrameTime[BUFFERLENGTH];
-	UINT behavCapFrameTime[BUFFERLENGTH];
+	CCaptureSource mSources[MAX_CAPTURE_SOURCES];
+	CaptureSourceConfig mSourceConfigs[MAX_CAPTURE_SOURCES];
+	int mSourceCount;
+	CCaptureSource* mScope;	//mSources[0], the scope the dialog's controls drive
+	CCaptureSource* mBehav;	//mSources[1], the behavior cam the ROI is drawn on
+	CaptureSession mSession;
+	CCriticalSection mTSFileCS;	//every writer shares droppedFile
+	volatile LONG mActiveWriters;
+	bool mWriting[MAX_CAPTURE_SOURCES];	//sources the open recording's files are for
+	volatile bool mRecordingOpen;	//from OpenRecording until FinishRecording or DisarmRecording closed the files
+	volatile bool mArmed;		//the next recording's files are open, the trigger only starts it
+	volatile LONG mTriggerPosted;	//a WM_TRIGGER_EVENT is on its way, the capture thread posts no other
+	LARGE_INTEGER mTriggerTime;	//when the capture thread saw the GPIO go high
+	LARGE_INTEGER armedTime;
+	UINT mDisplayMaxFPS;
+	cv::Mat mScopeFrame;		//mScope's display scratch, borrowed from its pool
+	cv::Mat mScopeColorFrame;
 
 	UINT_PTR mTimer;
 	
@@ -114,20 +134,20 @@ public:
 	LARGE_INTEGER Frequency;
 	CString TSFileName;
 	CString settingsFIleName;
+	CString droppedFileName;
+	CString recordFolderName;
 	CString folderLocation;
 	CString currentTime;
-	std::string msCamFileName;
-	std::string behavCamFileName;
 	
 	int msCamMaxFrames;
 	int behavCamMaxFrames;
-	CStdioFile TSFile;
+	CTimestampLog mTSLog;		//timestamp.msts, turned into TSFileName when the recording is finished
 	CStdioFile settingsFile;
+	CStdioFile droppedFile;
 	unsigned long frameCount;
 	bool behavGotROI;
 	bool dragging;
 	bool getScreenShot;
-	cv::Rect behavROI;
 	cv::Point pt1,pt2;
 
 	
@@ -137,12 +157,31 @@ public:
 	static void mouseClick(int event, int x, int y, int flags, void *param);
 	BOOL PreTranslateMessage(MSG* pMsg);
 
-	static UINT msCapture(LPVOID);
-	static UINT behavCapture(LPVOID);
-	static UINT camWrite(LPVOID);
+	void LoadSourceConfigs();
+	int ConnectSources(CaptureKind kind);
+	void ShowScopeFrame(cv::Mat& frame);
+	void ShowBehavFrame(cv::Mat& frame);
+	LONG OpenRecording();
+	void StartRecording(const LARGE_INTEGER& triggerTime, LONGLONG preTriggerTicks);
+	void ArmRecording();
+	void DisarmRecording();
+	UINT PreTriggerSeconds() const;
+	bool BurstsOver() const;
+	bool AdmitRecording();
+	void FinishRecording();
+	static UINT runBenchmark(LPVOID);
+
+	//CCaptureHost, called on the sources' threads
+	virtual void PollTrigger(CCaptureSource& source);
+	virtual void ShowFrame(CCaptureSource& source, cv::Mat& frame);
+	virtual void SourceLost(CCaptureSource& source);
+	virtual void WriterFinished(CCaptureSource& source);
 	
 	afx_msg void OnTimer(UINT_PTR nIDEvent);
 	afx_msg void OnClose();
+	afx_msg LRESULT OnTriggerEvent(WPARAM wParam, LPARAM lParam);
+	afx_msg LRESULT OnListText(WPARAM wParam, LPARAM lParam);
+	afx_msg LRESULT OnRecordingClosed(WPARAM wParam, LPARAM lParam);
 	int mScopeCamID;
 	int mBehaviorCamID;
 	afx_msg void OnBnClickedScopeconnect();
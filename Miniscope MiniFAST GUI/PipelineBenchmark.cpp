@@ -0,0 +1,998 @@
+// PipelineBenchmark.cpp : camera free benchmarks of the capture -> write pipeline
+//
+
+#include "stdafx.h"
+#include "FrameQueue.h"
+#include "FramePool.h"
+#include "UVCPayload.h"
+#include "PipelineBenchmark.h"
+#include "PipelineTrace.h"
+#include "RawFrameFile.h"
+#include "TimestampLog.h"
+#include "WorkerThread.h"
+#include "opencv2/imgproc.hpp"
+#include <vector>
+
+#define BENCH_QUEUE_LENGTH 256
+#define BENCH_REPLAY_BUFFERS 4
+
+namespace {
+
+struct QueueBenchContext {
+	CFrameQueue<FrameSlot>* queue;
+	// Old scheme
+	FrameSlot* ring;
+	CCriticalSection* cs;
+	volatile UINT16 readPos;
+	volatile UINT16 writePos;
+
+	ULONGLONG frames;
+	UINT capacity;
+	LARGE_INTEGER frequency;
+	LONGLONG maxPushTicks;
+	ULONGLONG orderErrors;
+};
+
+UINT QueueProducer(LPVOID pParam)
+{
+	QueueBenchContext* ctx = (QueueBenchContext*)pParam;
+	LARGE_INTEGER start, end;
+	FrameSlot* slot;
+
+	for (ULONGLONG i = 0; i < ctx->frames; i++) {
+		QueryPerformanceCounter(&start);
+		while ((slot = ctx->queue->BeginWrite()) == NULL)
+			SwitchToThread();
+		slot->capTime = (UINT)i;
+		slot->seq = ctx->queue->WriteSeq();
+		ctx->queue->CommitWrite();
+		QueryPerformanceCounter(&end);
+		if (end.QuadPart - start.QuadPart > ctx->maxPushTicks)
+			ctx->maxPushTicks = end.QuadPart - start.QuadPart;
+	}
+	return 0;
+}
+
+UINT QueueConsumer(LPVOID pParam)
+{
+	QueueBenchContext* ctx = (QueueBenchContext*)pParam;
+	FrameSlot* slot;
+	ULONGLONG expected = 0;
+
+	while (expected < ctx->frames) {
+		slot = ctx->queue->Front();
+		if (slot == NULL) {
+			SwitchToThread();
+			continue;
+		}
+		if (slot->seq != expected || slot->capTime != (UINT)expected)
+			ctx->orderErrors++;
+		expected++;
+		ctx->queue->Pop();
+	}
+	return 0;
+}
+
+// Mirrors what msCapture/camWrite did before CFrameQueue
+UINT LockedProducer(LPVOID pParam)
+{
+	QueueBenchContext* ctx = (QueueBenchContext*)pParam;
+	CSingleLock singleLock(ctx->cs);
+	LARGE_INTEGER start, end;
+
+	for (ULONGLONG i = 0; i < ctx->frames; i++) {
+		QueryPerformanceCounter(&start);
+		ctx->ring[ctx->writePos%ctx->capacity].seq = i;
+		singleLock.Lock();
+		if (singleLock.IsLocked()) {
+			ctx->writePos++;
+			singleLock.Unlock();
+		}
+		QueryPerformanceCounter(&end);
+		if (end.QuadPart - start.QuadPart > ctx->maxPushTicks)
+			ctx->maxPushTicks = end.QuadPart - start.QuadPart;
+	}
+	return 0;
+}
+
+UINT LockedConsumer(LPVOID pParam)
+{
+	QueueBenchContext* ctx = (QueueBenchContext*)pParam;
+	CSingleLock singleLock(ctx->cs);
+	ULONGLONG expected = 0;
+	ULONGLONG seq;
+
+	while (expected < ctx->frames) {
+		singleLock.Lock();
+		if (singleLock.IsLocked()) {
+			if (ctx->readPos != ctx->writePos) {
+				seq = ctx->ring[ctx->readPos%ctx->capacity].seq;
+				if (seq != expected) {
+					// The producer lapped us and overwrote unread frames
+					ctx->orderErrors++;
+					if (seq > expected)
+						expected = seq;
+				}
+				expected++;
+				ctx->readPos++;
+			}
+			singleLock.Unlock();
+		}
+	}
+	return 0;
+}
+
+QueueBenchResult RunPair(QueueBenchContext* ctx, AFX_THREADPROC producer, AFX_THREADPROC consumer)
+{
+	QueueBenchResult result;
+	LARGE_INTEGER start, end;
+
+	QueryPerformanceFrequency(&ctx->frequency);
+	ctx->maxPushTicks = 0;
+	ctx->orderErrors = 0;
+
+	QueryPerformanceCounter(&start);
+	CWinThread* consumerThread = StartThread(consumer, ctx, THREAD_PRIORITY_NORMAL);
+	CWinThread* producerThread = StartThread(producer, ctx, THREAD_PRIORITY_NORMAL);
+	JoinThread(producerThread);
+	JoinThread(consumerThread);
+	QueryPerformanceCounter(&end);
+
+	result.frames = ctx->frames;
+	result.seconds = ((double)end.QuadPart - start.QuadPart)/ctx->frequency.QuadPart;
+	result.maxPushUs = 1000000.0*ctx->maxPushTicks/ctx->frequency.QuadPart;
+	result.orderErrors = ctx->orderErrors;
+	return result;
+}
+
+struct WriterBenchContext {
+	CFrameQueue<FrameSlot> queue;
+	CFrameSignal signal;
+	bool eventDriven;
+	volatile bool running;
+	ULONGLONG framesWritten;
+	UINT wakeups;
+	std::vector<uchar> sink;
+};
+
+ULONGLONG FileTimeTo100ns(const FILETIME& ft)
+{
+	return ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+UINT WriterBenchConsumer(LPVOID pParam)
+{
+	WriterBenchContext* ctx = (WriterBenchContext*)pParam;
+	FrameSlot* slot;
+
+	while (1) {
+		slot = ctx->queue.Front();
+		if (slot != NULL) {
+			// Stand-in for VideoWriter::write, touches one small frame worth of memory
+			memset(&ctx->sink[0], (int)slot->seq, ctx->sink.size());
+			ctx->framesWritten++;
+			ctx->queue.Pop();
+			continue;
+		}
+		if (ctx->running == false)
+			break;
+		if (ctx->eventDriven) {
+			ctx->signal.PrepareWait();
+			if (ctx->running == true && ctx->queue.Size() == 0) {
+				ctx->signal.Wait(WRITER_IDLE_TIMEOUT);
+				ctx->wakeups++;
+			}
+			else
+				ctx->signal.CancelWait();
+		}
+	}
+	return 0;
+}
+
+struct DropBenchContext {
+	CFrameQueue<FrameSlot> queue;
+	ULONGLONG frames;
+	std::vector<uchar> written;
+	std::vector<uchar> dropped;
+	volatile bool producerDone;
+	std::vector<uchar> sink;
+};
+
+UINT DropProducer(LPVOID pParam)
+{
+	DropBenchContext* ctx = (DropBenchContext*)pParam;
+	FrameSlot* slot;
+	FrameSlot* oldest;
+
+	for (ULONGLONG i = 0; i < ctx->frames; i++) {
+		slot = ctx->queue.BeginWrite();
+		if (slot == NULL) {
+			oldest = ctx->queue.DropOldest();
+			if (oldest != NULL)
+				ctx->dropped[(size_t)oldest->seq]++;
+			slot = ctx->queue.BeginWrite();
+		}
+		if (slot == NULL) {
+			// Consumer was mid swap, the new frame is the one lost
+			ctx->dropped[(size_t)i]++;
+			continue;
+		}
+		slot->seq = i;
+		ctx->queue.CommitWrite();
+	}
+	ctx->producerDone = true;
+	return 0;
+}
+
+UINT DropConsumer(LPVOID pParam)
+{
+	DropBenchContext* ctx = (DropBenchContext*)pParam;
+	FrameSlot* slot;
+
+	while (1) {
+		slot = ctx->queue.Front();
+		if (slot == NULL) {
+			if (ctx->producerDone == true && ctx->queue.Size() == 0)
+				break;
+			SwitchToThread();
+			continue;
+		}
+		// Slower than the producer so the queue stays full
+		memset(&ctx->sink[0], (int)slot->seq, ctx->sink.size());
+		ctx->written[(size_t)slot->seq]++;
+		ctx->queue.Pop();
+	}
+	return 0;
+}
+
+} // namespace
+
+QueueBenchResult BenchFrameQueue(ULONGLONG frames, UINT capacity)
+{
+	CFrameQueue<FrameSlot> queue;
+	QueueBenchContext ctx;
+
+	queue.Init(capacity);
+	ctx.queue = &queue;
+	ctx.ring = NULL;
+	ctx.cs = NULL;
+	ctx.frames = frames;
+	ctx.capacity = capacity;
+	return RunPair(&ctx, QueueProducer, QueueConsumer);
+}
+
+QueueBenchResult BenchLockedRing(ULONGLONG frames, UINT capacity)
+{
+	CCriticalSection cs;
+	FrameSlot* ring = new FrameSlot[capacity];
+	QueueBenchContext ctx;
+
+	ctx.queue = NULL;
+	ctx.ring = ring;
+	ctx.cs = &cs;
+	ctx.readPos = 0;
+	ctx.writePos = 0;
+	ctx.frames = frames;
+	ctx.capacity = capacity;
+	QueueBenchResult result = RunPair(&ctx, LockedProducer, LockedConsumer);
+	delete[] ring;
+	return result;
+}
+
+WriterBenchResult BenchWriterWakeup(bool eventDriven, UINT fps, UINT seconds)
+{
+	WriterBenchContext ctx;
+	WriterBenchResult result;
+	LARGE_INTEGER frequency, start, now, next;
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	FrameSlot* slot;
+	ULONGLONG queued = 0;
+
+	ctx.queue.Init(BENCH_QUEUE_LENGTH);
+	ctx.eventDriven = eventDriven;
+	ctx.running = true;
+	ctx.framesWritten = 0;
+	ctx.wakeups = 0;
+	ctx.sink.resize(64*1024);
+
+	QueryPerformanceFrequency(&frequency);
+	CWinThread* writer = StartThread(WriterBenchConsumer, &ctx, THREAD_PRIORITY_NORMAL);
+
+	// Synthetic source paced by the performance counter
+	QueryPerformanceCounter(&start);
+	next = start;
+	do {
+		next.QuadPart += frequency.QuadPart/fps;
+		do {
+			SwitchToThread();
+			QueryPerformanceCounter(&now);
+		} while (now.QuadPart < next.QuadPart);
+		slot = ctx.queue.BeginWrite();
+		if (slot != NULL) {
+			slot->seq = ctx.queue.WriteSeq();
+			ctx.queue.CommitWrite();
+			ctx.signal.Notify(ctx.queue.Size());
+			queued++;
+		}
+	} while (now.QuadPart - start.QuadPart < (LONGLONG)seconds*frequency.QuadPart);
+
+	ctx.running = false;
+	ctx.signal.Wake();
+	WaitForSingleObject(writer->m_hThread, INFINITE);
+	QueryPerformanceCounter(&now);
+	GetThreadTimes(writer->m_hThread, &creationTime, &exitTime, &kernelTime, &userTime);
+	JoinThread(writer);
+
+	result.framesQueued = queued;
+	result.framesWritten = ctx.framesWritten;
+	result.wakeups = ctx.wakeups;
+	result.cpuPercent = 100.0*((FileTimeTo100ns(kernelTime) + FileTimeTo100ns(userTime))/1.0e7)
+		/(((double)now.QuadPart - start.QuadPart)/frequency.QuadPart);
+	return result;
+}
+
+DropBenchResult BenchDropOldest(ULONGLONG frames, UINT capacity)
+{
+	DropBenchContext ctx;
+	DropBenchResult result;
+
+	ctx.queue.Init(capacity, true);
+	ctx.frames = frames;
+	ctx.written.assign((size_t)frames, 0);
+	ctx.dropped.assign((size_t)frames, 0);
+	ctx.producerDone = false;
+	ctx.sink.resize(64*1024);
+
+	CWinThread* consumerThread = StartThread(DropConsumer, &ctx, THREAD_PRIORITY_NORMAL);
+	CWinThread* producerThread = StartThread(DropProducer, &ctx, THREAD_PRIORITY_NORMAL);
+	JoinThread(producerThread);
+	JoinThread(consumerThread);
+
+	result.frames = frames;
+	result.written = 0;
+	result.dropped = 0;
+	result.accountingErrors = 0;
+	for (size_t i = 0; i < (size_t)frames; i++) {
+		result.written += ctx.written[i];
+		result.dropped += ctx.dropped[i];
+		if (ctx.written[i] + ctx.dropped[i] != 1)
+			result.accountingErrors++;
+	}
+	return result;
+}
+
+namespace {
+
+// Assembles into buffers borrowed from a CFramePool, round robin, and checks every frame
+// that comes back complete against the pattern WriteBenchFrame() put in it
+class CReplayBenchSink : public CUVCFrameSink
+{
+public:
+	CReplayBenchSink(CFramePool& pool, int rows, int cols)
+		: delivered(0), contentErrors(0), mCurrent(NULL), mNext(0)
+	{
+		for (int i = 0; i < BENCH_REPLAY_BUFFERS; i++)
+			mBuffers[i] = pool.Borrow(rows, cols, CV_8UC1);
+		mBytes = (size_t)rows*cols;
+	}
+
+	uchar* BeginFrame() override
+	{
+		mCurrent = &mBuffers[mNext];
+		mNext = (mNext + 1)%BENCH_REPLAY_BUFFERS;
+		return mCurrent->data;
+	}
+	void EndFrame(UINT status, LONGLONG ticks) override
+	{
+		UINT frame;
+
+		if (status & UVC_FRAME_DAMAGED)
+			return;
+		delivered++;
+		memcpy(&frame, mCurrent->data, sizeof(frame));
+		for (size_t i = sizeof(frame); i < mBytes; i++) {
+			if (mCurrent->data[i] != (uchar)(i + frame)) {
+				contentErrors++;
+				break;
+			}
+		}
+	}
+
+	ULONGLONG delivered;
+	ULONGLONG contentErrors;
+
+private:
+	cv::Mat mBuffers[BENCH_REPLAY_BUFFERS];
+	cv::Mat* mCurrent;
+	UINT mNext;
+	size_t mBytes;
+};
+
+// Cuts one frame into payloads the way the firmware does: full DMA buffers, then a partial
+// one with EOF. Returns the number written.
+UINT WriteBenchFrame(CFile& file, std::vector<uchar>& frame, std::vector<uchar>& payload,
+	UINT frameNum, uchar frameId, bool dropMiddle, bool dropEOF)
+{
+	size_t pos = 0;
+	size_t bytes;
+	UINT payloads = 0;
+	UINT index = 0;
+
+	memcpy(&frame[0], &frameNum, sizeof(frameNum));
+	for (size_t i = sizeof(frameNum); i < frame.size(); i++)
+		frame[i] = (uchar)(i + frameNum);
+	for (; pos < frame.size(); pos += bytes, index++) {
+		bytes = frame.size() - pos;
+		if (bytes > UVC_BUF_FULL_SIZE)
+			bytes = UVC_BUF_FULL_SIZE;
+		memset(&payload[0], 0, UVC_MAX_HEADER);
+		payload[0] = UVC_MAX_HEADER;
+		payload[1] = 0x8C | frameId;	// CY_FX_UVC_HEADER_DEFAULT_BFH
+		if (pos + bytes == frame.size()) {
+			payload[1] |= UVC_HEADER_EOF;
+			if (dropEOF)
+				continue;
+		}
+		else if (dropMiddle && index == 1)
+			continue;
+		memcpy(&payload[UVC_MAX_HEADER], &frame[pos], bytes);
+		CUVCReplay::WritePayload(file, &payload[0], (UINT)(UVC_MAX_HEADER + bytes));
+		payloads++;
+	}
+	return payloads;
+}
+
+} // namespace
+
+UVCReplayBenchResult BenchUVCReplay(UINT frames, int rows, int cols)
+{
+	UVCReplayBenchResult result;
+	TCHAR tempDir[MAX_PATH];
+	TCHAR tempName[MAX_PATH];
+	CFile file;
+	CFramePool pool;
+	CUVCReplay replay;
+	CUVCFrameAssembler assembler;
+	std::vector<uchar> frame((size_t)rows*cols);
+	std::vector<uchar> payload(UVC_STREAM_BUF_SIZE);
+	LARGE_INTEGER frequency, start, end;
+	uchar frameId = 0;
+	UINT fault;
+
+	memset(&result, 0, sizeof(result));
+	GetTempPath(MAX_PATH, tempDir);
+	GetTempFileName(tempDir, L"uvc", 0, tempName);
+	if (!file.Open(tempName, CFile::modeCreate|CFile::modeWrite, NULL))
+		return result;
+
+	// The assembler joins the stream mid frame, so it is expected to throw away frame 0.
+	// After that every 100 frames lose a payload in the middle of a frame, an EOF payload,
+	// and an EOF payload together with the FRAME_ID toggle of the frame after it.
+	for (UINT i = 0; i < frames; i++) {
+		fault = i%100;
+		result.payloads += WriteBenchFrame(file, frame, payload, i, frameId, i > 0 && fault == 10, i > 0 && (fault == 40 || fault == 70));
+		if (i > 0) {
+			if (fault == 10 || fault == 40)
+				result.expectedTruncated++;
+			else if (fault == 70)
+				result.expectedMerged++;
+			else if (fault != 71)
+				result.expectedDelivered++;
+		}
+		if (fault != 70)
+			frameId ^= UVC_HEADER_FRAME_ID;
+	}
+	file.Close();
+
+	pool.Init(BENCH_REPLAY_BUFFERS, rows, cols, CV_8UC1);
+	CReplayBenchSink sink(pool, rows, cols);
+	assembler.Init(frame.size(), &sink);
+	if (replay.Open(tempName)) {
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+		replay.Run(assembler);
+		QueryPerformanceCounter(&end);
+		result.seconds = ((double)end.QuadPart - start.QuadPart)/frequency.QuadPart;
+	}
+	CFile::Remove(tempName);
+
+	result.frames = frames;
+	result.delivered = sink.delivered;
+	result.truncated = assembler.Stats().truncated;
+	result.merged = assembler.Stats().merged;
+	result.contentErrors = sink.contentErrors;
+	return result;
+}
+
+LumaBenchResult BenchLumaExtract(UINT frames, int rows, int cols)
+{
+	LumaBenchResult result;
+	cv::Mat yuyv(rows, cols, CV_8UC2);
+	cv::Mat bgr;
+	cv::Mat gray;
+	cv::Mat reference;
+	LARGE_INTEGER frequency, start, end;
+
+	memset(&result, 0, sizeof(result));
+	cv::randu(yuyv, cv::Scalar::all(0), cv::Scalar::all(256));
+	reference.create(rows, cols, CV_8UC1);
+	ExtractLuma(yuyv.data, reference.data, (size_t)rows*cols, LUMA_SCALAR);
+	QueryPerformanceFrequency(&frequency);
+
+	QueryPerformanceCounter(&start);
+	for (UINT i = 0; i < frames; i++) {
+		cv::cvtColor(yuyv, bgr, CV_YUV2BGR_YUY2);
+		cv::cvtColor(bgr, gray, CV_BGR2GRAY);
+	}
+	QueryPerformanceCounter(&end);
+	result.roundTripUs = 1.0e6*(end.QuadPart - start.QuadPart)/frequency.QuadPart/frames;
+
+	QueryPerformanceCounter(&start);
+	for (UINT i = 0; i < frames; i++)
+		cv::cvtColor(yuyv, gray, CV_YUV2GRAY_YUY2);
+	QueryPerformanceCounter(&end);
+	result.openCVUs = 1.0e6*(end.QuadPart - start.QuadPart)/frequency.QuadPart/frames;
+
+	gray.create(rows, cols, CV_8UC1);
+	for (int kernel = 0; kernel < LUMA_KERNEL_COUNT; kernel++) {
+		if (!LumaKernelSupported((LumaKernel)kernel))
+			continue;
+		QueryPerformanceCounter(&start);
+		for (UINT i = 0; i < frames; i++)
+			ExtractLuma(yuyv.data, gray.data, (size_t)rows*cols, (LumaKernel)kernel);
+		QueryPerformanceCounter(&end);
+		result.kernelUs[kernel] = 1.0e6*(end.QuadPart - start.QuadPart)/frequency.QuadPart/frames;
+		if (memcmp(gray.data, reference.data, (size_t)rows*cols) != 0)
+			result.mismatches++;
+	}
+	return result;
+}
+
+namespace {
+
+// Stands in for the dialog: counts what each display thread is handed and checks the
+// frame numbers CSyntheticCapture stamps into gray frames never go backwards
+class CBenchCaptureHost : public CCaptureHost
+{
+public:
+	CBenchCaptureHost(const CCaptureSource* sources)
+		: lost(FALSE, TRUE), finished(FALSE, TRUE), writers(0), mSources(sources)
+	{
+		memset(displayed, 0, sizeof(displayed));
+		memset(orderErrors, 0, sizeof(orderErrors));
+		memset(mLastStamp, 0, sizeof(mLastStamp));
+	}
+
+	void AddListText(CString str) override {}
+	void PollTrigger(CCaptureSource& source) override {}
+	void ShowFrame(CCaptureSource& source, cv::Mat& frame) override
+	{
+		int i = (int)(&source - mSources);
+		UINT stamp;
+
+		if (frame.depth() == CV_16U) {
+			// The stamp bytes are the 8 most significant bits of the first four samples
+			stamp = 0;
+			for (int b = 0; b < (int)sizeof(stamp); b++)
+				stamp |= (UINT)(frame.ptr<ushort>(0)[b] >> (source.BitDepth() - 8)) << 8*b;
+			if (displayed[i] > 0 && stamp <= mLastStamp[i])
+				orderErrors[i]++;
+			mLastStamp[i] = stamp;
+		}
+		else if (frame.channels() == 1) {
+			memcpy(&stamp, frame.data, sizeof(stamp));
+			if (displayed[i] > 0 && stamp <= mLastStamp[i])
+				orderErrors[i]++;
+			mLastStamp[i] = stamp;
+		}
+		displayed[i]++;
+	}
+	void SourceLost(CCaptureSource& source) override { lost.SetEvent(); }
+	void WriterFinished(CCaptureSource& source) override
+	{
+		if (InterlockedDecrement(&writers) == 0)
+			finished.SetEvent();
+	}
+
+	ULONGLONG displayed[MAX_CAPTURE_SOURCES];
+	ULONGLONG orderErrors[MAX_CAPTURE_SOURCES];
+	CEvent lost;		// an input ran out of frames
+	CEvent finished;	// every writer is done
+	volatile LONG writers;
+
+private:
+	const CCaptureSource* mSources;
+	UINT mLastStamp[MAX_CAPTURE_SOURCES];
+};
+
+// Size of the files a source recorded, which are deleted again
+ULONGLONG RemoveRecording(const CString& fileBase, ULONGLONG& rawFrames, ULONGLONG& spillFrames)
+{ //Raw parts are read back first, so a container the writer left broken shows as missing frames
+	CFileStatus status;
+	CString path;
+	CRawFrameReader reader;
+	CStripedRawReader striped;
+	CSpillReader spill;
+	SpillFrameHeader header;
+	cv::Mat frame;
+	std::vector<std::string> stripes;
+	ULONGLONG bytes = 0;
+
+	rawFrames = 0;
+	spillFrames = 0;
+	for (int part = 1; ; part++) {
+		path.Format(L"%s%d.avi", (LPCTSTR)fileBase, part);
+		if (!CFile::GetStatus(path, status))
+			path.Format(L"%s%d.mkv", (LPCTSTR)fileBase, part);
+		if (!CFile::GetStatus(path, status)) {
+			path.Format(L"%s%d.msraw", (LPCTSTR)fileBase, part);
+			if (CFile::GetStatus(path, status) && reader.Open((LPCSTR)CT2CA(path)) && reader.IsComplete())
+				rawFrames += reader.FrameCount();
+			reader.Close();
+		}
+		if (!CFile::GetStatus(path, status))
+			break;
+		bytes += status.m_size;
+		DeleteFile(path);
+	}
+	// Striped parts are in the stripe folders, the manifest lists them
+	if (striped.Open((LPCSTR)CT2CA(fileBase + L".msstripe"))) {
+		if (striped.IsComplete())
+			rawFrames += striped.FrameCount();
+		for (size_t i = 0; i < striped.PartCount(); i++)
+			stripes.push_back(striped.PartName(i));
+		striped.Close();
+		for (size_t i = 0; i < stripes.size(); i++) {
+			path = stripes[i].c_str();
+			if (CFile::GetStatus(path, status))
+				bytes += status.m_size;
+			DeleteFile(path);
+			RemoveDirectory(path.Left(path.ReverseFind(L'\\')));
+		}
+		DeleteFile(fileBase + L".msstripe");
+	}
+	if (CFile::GetStatus(fileBase + L"_spill.raw", status)) {
+		if (spill.Open(fileBase + L"_spill.raw")) {
+			while (spill.Next(header, frame))
+				spillFrames++;
+			spill.Close();
+		}
+		bytes += status.m_size;
+		DeleteFile(fileBase + L"_spill.raw");
+	}
+	return bytes;
+}
+
+} // namespace
+
+PipelineBenchResult::PipelineBenchResult()
+	: seconds(0)
+	, bytesOnDisk(0)
+{
+}
+
+SourceBenchResult::SourceBenchResult()
+	: kind(CAPTURE_SCOPE)
+	, grabbed(0)
+	, written(0)
+	, dropped(0)
+	, spilled(0)
+	, framesInSpill(0)
+	, displayed(0)
+	, orderErrors(0)
+	, highWater(0)
+	, queueCapacity(0)
+	, bytesOnDisk(0)
+	, codec(VIDEO_DIB)
+	, bitDepth(8)
+	, rawBytes(0)
+	, encodeSeconds(0)
+	, framesInFiles(0)
+{
+	memset(threadCPU, 0, sizeof(threadCPU));
+	memset(stages, 0, sizeof(stages));
+}
+
+bool ParsePipelineScenario(const CString& scenario, std::vector<PipelineBenchInput>& inputs)
+{
+	PipelineBenchInput input;
+	CString token;
+	int pos = 0;
+
+	inputs.clear();
+	input.codec = -1;
+	input.bitDepth = 0;
+	input.segmentFrames = 1000;
+	for (token = scenario.Tokenize(L";", pos); pos >= 0; token = scenario.Tokenize(L";", pos)) {
+		token.Trim();
+		if (token.Left(6) == L"codec=") {
+			if (token.Mid(6).CompareNoCase(L"ffv1") == 0)
+				input.codec = VIDEO_FFV1;
+			else if (token.Mid(6).CompareNoCase(L"raw") == 0)
+				input.codec = VIDEO_RAW;
+			else if (token.Mid(6).CompareNoCase(L"dib") == 0)
+				input.codec = VIDEO_DIB;
+			else
+				return false;
+			continue;
+		}
+		if (token.Left(5) == L"bits=") {
+			input.bitDepth = _ttoi(token.Mid(5));
+			if (input.bitDepth != 8 && input.bitDepth != 10 && input.bitDepth != 12)
+				return false;
+			continue;
+		}
+		if (token.Left(8) == L"segment=") {
+			input.segmentFrames = _ttoi(token.Mid(8));
+			if (input.segmentFrames < 0)
+				return false;
+			continue;
+		}
+		if (token.Left(6) == L"scope=") {
+			input.kind = CAPTURE_SCOPE;
+			input.spec = token.Mid(6);
+		}
+		else if (token.Left(9) == L"behavior=") {
+			input.kind = CAPTURE_BEHAVIOR;
+			input.spec = token.Mid(9);
+		}
+		else
+			return false;
+		if (inputs.size() == MAX_CAPTURE_SOURCES)
+			return false;
+		inputs.push_back(input);
+	}
+	return !inputs.empty();
+}
+
+PipelineBenchResult BenchPipeline(const CString& scenario, LPCTSTR folder, double seconds)
+{
+	CWinApp* app = AfxGetApp();
+	PipelineBenchResult result;
+	std::vector<PipelineBenchInput> inputs;
+	CCaptureSource sources[MAX_CAPTURE_SOURCES];
+	CBenchCaptureHost host(sources);
+	CString fileBase[MAX_CAPTURE_SOURCES];
+	bool writing[MAX_CAPTURE_SOURCES];
+	int kindCount[CAPTURE_KIND_COUNT] = {0, 0};
+	CString tsName;
+	CString droppedName;
+	CTimestampLog tsLog;
+	CStdioFile droppedFile;
+	CCriticalSection fileCS;
+	CaptureSourceConfig config;
+	CaptureSession session;
+	volatile bool record = false;
+	volatile bool armed = false;
+	LARGE_INTEGER start, end, deadline, now;
+	LONG writers = 0;
+	int count;
+
+	result.scenario = scenario;
+	if (!ParsePipelineScenario(scenario, inputs)) {
+		result.error = L"not a valid scenario";
+		return result;
+	}
+	count = (int)inputs.size();
+	CreateDirectory(folder, NULL);
+	tsName.Format(L"%s\\bench_timestamp.msts", folder);
+	droppedName.Format(L"%s\\bench_droppedFrames.dat", folder);
+	QueryPerformanceFrequency(&session.frequency);
+	if (!tsLog.Open(tsName, session.frequency.QuadPart, 0)) {
+		result.error.Format(L"could not create files in %s", folder);
+		return result;
+	}
+	if (!droppedFile.Open(droppedName, CFile::modeCreate|CFile::modeWrite, NULL)) {
+		result.error.Format(L"could not create files in %s", folder);
+		tsLog.Close();
+		DeleteFile(tsName);
+		return result;
+	}
+
+	start.QuadPart = 0;
+	session.record = &record;
+	session.armed = &armed;
+	session.startOfRecord = &start;
+	session.displayMaxFPS = 30;
+	session.tsLog = &tsLog;
+	session.droppedFile = &droppedFile;
+	session.fileCS = &fileCS;
+
+	// Named like the dialog names its sources, so the Writer and Memory settings of the
+	// cameras apply and the benchmark sees the queue sizes an experiment would get
+	for (int i = 0; i < count; i++) {
+		CaptureKind kind = inputs[i].kind;
+		kindCount[kind]++;
+		config.name = kind == CAPTURE_SCOPE ? L"msCam" : L"behavCam";
+		if (kindCount[kind] > 1)
+			config.name.AppendFormat(L"%d", kindCount[kind]);
+		config.kind = kind;
+		config.device = i;
+		config.rawCapture = kind == CAPTURE_SCOPE && app->GetProfileInt(L"Scope", L"RawCapture", 1) != 0;
+		config.bitDepth = kind != CAPTURE_SCOPE ? 8 : inputs[i].bitDepth > 0 ? inputs[i].bitDepth : app->GetProfileInt(L"Scope", L"BitDepth", 8);
+		config.input = inputs[i].spec;
+		fileBase[i].Format(L"%s\\bench_%s", folder, (LPCTSTR)config.name);
+		sources[i].Init(config, &host, &session);
+		if (inputs[i].codec >= 0)
+			sources[i].SetCodec((VideoCodec)inputs[i].codec);
+		if (sources[i].Open())
+			sources[i].StartCapture();
+	}
+	for (int i = 0; i < count; i++) {
+		while (sources[i].IsConnected() && !sources[i].IsStreaming())
+			Sleep(1);
+		writing[i] = sources[i].IsStreaming();
+		if (writing[i] == false) {
+			result.error.Format(L"%s did not start", (LPCTSTR)inputs[i].spec);
+			continue;
+		}
+		sources[i].PrepareRecording((LPCSTR)CT2CA(fileBase[i]), inputs[i].segmentFrames);
+		writers++;
+	}
+
+	if (writers > 0) {
+		host.writers = writers;
+		QueryPerformanceCounter(&start);
+		record = true;
+		for (int i = 0; i < count; i++) {
+			if (writing[i] == true)
+				sources[i].StartWriter();
+		}
+		// Records for the given time or until the first input runs out
+		if (seconds > 0) {
+			deadline.QuadPart = start.QuadPart + (LONGLONG)(seconds*session.frequency.QuadPart);
+			do {
+				QueryPerformanceCounter(&now);
+			} while (now.QuadPart < deadline.QuadPart &&
+				WaitForSingleObject(host.lost, (DWORD)(1000*(deadline.QuadPart - now.QuadPart)/session.frequency.QuadPart) + 1) == WAIT_TIMEOUT);
+		}
+		else
+			WaitForSingleObject(host.lost, INFINITE);
+		record = false;
+		for (int i = 0; i < count; i++)
+			sources[i].WakeWriter();
+		WaitForSingleObject(host.finished, INFINITE);
+		QueryPerformanceCounter(&end);
+		result.seconds = ((double)end.QuadPart - start.QuadPart)/session.frequency.QuadPart;
+	}
+	for (int i = 0; i < count; i++)
+		sources[i].Close();
+	if (!tsLog.Close() && result.error.IsEmpty())
+		result.error.Format(L"could not write %s", (LPCTSTR)tsName);
+	droppedFile.Close();
+
+	for (int i = 0; i < count; i++) {
+		SourceBenchResult source;
+		source.name = sources[i].Name();
+		source.input = inputs[i].spec;
+		source.kind = inputs[i].kind;
+		source.codec = sources[i].Codec();
+		source.bitDepth = sources[i].BitDepth();
+		if (writing[i] == true) {
+			source.grabbed = sources[i].FramesGrabbed();
+			source.written = sources[i].FramesWritten();
+			source.dropped = sources[i].Dropped();
+			source.spilled = sources[i].Spilled();
+			source.displayed = host.displayed[i];
+			source.orderErrors = host.orderErrors[i];
+			source.highWater = sources[i].HighWater();
+			source.queueCapacity = sources[i].QueueCapacity();
+			source.rawBytes = sources[i].RawBytesWritten();
+			source.encodeSeconds = sources[i].EncodeSeconds();
+			for (int t = 0; t < SOURCE_THREAD_COUNT; t++)
+				source.threadCPU[t] = sources[i].ThreadCPU((SourceThread)t);
+			for (int s = 0; s < PIPELINE_STAGE_COUNT; s++) {
+				const CLatencyHistogram& latency = sources[i].Latency((PipelineStage)s);
+				source.stages[s].count = latency.Count();
+				source.stages[s].p50Us = latency.PercentileUs(0.5);
+				source.stages[s].p99Us = latency.PercentileUs(0.99);
+				source.stages[s].p999Us = latency.PercentileUs(0.999);
+				source.stages[s].maxUs = latency.MaxUs();
+			}
+		}
+		source.bytesOnDisk = RemoveRecording(fileBase[i], source.framesInFiles, source.framesInSpill);
+		result.bytesOnDisk += source.bytesOnDisk;
+		result.sources.push_back(source);
+	}
+	CFileStatus status;
+	if (CFile::GetStatus(tsName, status))
+		result.bytesOnDisk += status.m_size;
+	DeleteFile(tsName);
+	DeleteFile(droppedName);
+	return result;
+}
+
+LPCTSTR PipelineStageName(PipelineStage stage)
+{
+	switch (stage) {
+	case STAGE_RETRIEVE:
+		return L"retrieve";
+	case STAGE_QUEUE:
+		return L"queue";
+	case STAGE_WRITE:
+		return L"write";
+	case STAGE_DISK:
+		return L"grabToDisk";
+	case STAGE_ROLLOVER:
+		return L"rollover";
+	default:
+		return L"display";
+	}
+}
+
+bool WritePipelineBenchJSON(LPCTSTR fileName, const std::vector<PipelineBenchResult>& results,
+	const std::vector<DiskBenchResult>& rawWrites)
+{ //One object per run with the machine it ran on, so files from different PCs and releases can be compared
+	CStdioFile file;
+	CString str;
+	TCHAR computer[MAX_COMPUTERNAME_LENGTH + 1];
+	DWORD length = MAX_COMPUTERNAME_LENGTH + 1;
+	SYSTEM_INFO system;
+	MEMORYSTATUSEX memory;
+	CTime time = CTime::GetCurrentTime();
+	LPCTSTR threadNames[SOURCE_THREAD_COUNT] = {L"capture", L"display", L"writer"};
+
+	if (!file.Open(fileName, CFile::modeCreate|CFile::modeWrite, NULL))
+		return false;
+	if (!GetComputerName(computer, &length))
+		computer[0] = 0;
+	GetSystemInfo(&system);
+	memory.dwLength = sizeof(memory);
+	GlobalMemoryStatusEx(&memory);
+
+	file.WriteString(L"{\n");
+	str.Format(L"  \"computer\": %s,\n  \"date\": \"%s\",\n  \"build\": \"%S %S\",\n  \"processors\": %u,\n  \"memoryMB\": %I64u,\n  \"lumaKernel\": \"%s\",\n  \"runs\": [",
+		(LPCTSTR)JSONString(computer), (LPCTSTR)time.Format(L"%Y-%m-%dT%H:%M:%S"), __DATE__, __TIME__, system.dwNumberOfProcessors,
+		memory.ullTotalPhys/1048576, LumaKernelName(BestLumaKernel()));
+	file.WriteString(str);
+	for (size_t r = 0; r < results.size(); r++) {
+		const PipelineBenchResult& run = results[r];
+		str.Format(L"%s\n    {\n      \"scenario\": %s,\n      \"error\": %s,\n      \"seconds\": %.3f,\n      \"bytesOnDisk\": %I64u,\n      \"diskMBps\": %.2f,\n      \"sources\": [",
+			r > 0 ? L"," : L"", (LPCTSTR)JSONString(run.scenario), (LPCTSTR)JSONString(run.error), run.seconds, run.bytesOnDisk,
+			run.seconds > 0 ? run.bytesOnDisk/1048576.0/run.seconds : 0.0);
+		file.WriteString(str);
+		for (size_t i = 0; i < run.sources.size(); i++) {
+			const SourceBenchResult& source = run.sources[i];
+			str.Format(L"%s\n        {\n          \"name\": %s,\n          \"input\": %s,\n          \"kind\": \"%s\",\n"
+				L"          \"grabbed\": %I64u,\n          \"written\": %I64u,\n          \"dropped\": %I64u,\n          \"spilled\": %I64u,\n          \"framesInSpill\": %I64u,\n          \"displayed\": %I64u,\n"
+				L"          \"orderErrors\": %I64u,\n          \"grabFPS\": %.1f,\n          \"writeFPS\": %.1f,\n"
+				L"          \"queueHighWater\": %u,\n          \"queueCapacity\": %u,\n          \"bytesOnDisk\": %I64u,\n"
+				L"          \"codec\": \"%s\",\n          \"bitDepth\": %d,\n          \"rawBytes\": %I64u,\n          \"compressionRatio\": %.3f,\n          \"encodeFPS\": %.1f,\n          \"framesInFiles\": %I64u,\n          \"cpuPercent\": {",
+				i > 0 ? L"," : L"", (LPCTSTR)JSONString(source.name), (LPCTSTR)JSONString(source.input),
+				source.kind == CAPTURE_SCOPE ? L"scope" : L"behavior", source.grabbed, source.written, source.dropped, source.spilled, source.framesInSpill, source.displayed,
+				source.orderErrors, run.seconds > 0 ? source.grabbed/run.seconds : 0.0, run.seconds > 0 ? source.written/run.seconds : 0.0,
+				source.highWater, source.queueCapacity, source.bytesOnDisk,
+				CCaptureSource::CodecName(source.codec), source.bitDepth, source.rawBytes, source.bytesOnDisk > 0 ? (double)source.rawBytes/source.bytesOnDisk : 0.0,
+				source.encodeSeconds > 0 ? source.written/source.encodeSeconds : 0.0, source.framesInFiles);
+			file.WriteString(str);
+			for (int t = 0; t < SOURCE_THREAD_COUNT; t++) {
+				str.Format(L"%s\"%s\": %.1f", t > 0 ? L", " : L"", threadNames[t], source.threadCPU[t]);
+				file.WriteString(str);
+			}
+			file.WriteString(L"},\n          \"latencyUs\": {");
+			for (int s = 0; s < PIPELINE_STAGE_COUNT; s++) {
+				const StageLatencyResult& stage = source.stages[s];
+				str.Format(L"%s\n            \"%s\": {\"count\": %I64u, \"p50\": %.0f, \"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f}",
+					s > 0 ? L"," : L"", PipelineStageName((PipelineStage)s), stage.count, stage.p50Us, stage.p99Us, stage.p999Us, stage.maxUs);
+				file.WriteString(str);
+			}
+			file.WriteString(L"\n          }\n        }");
+		}
+		file.WriteString(L"\n      ]\n    }");
+	}
+	file.WriteString(L"\n  ],\n  \"rawWrite\": [");
+	for (size_t r = 0; r < rawWrites.size(); r++) {
+		const DiskBenchResult& write = rawWrites[r];
+		str.Format(L"%s\n    {\"requested\": \"%S\", \"mode\": \"%S\", \"buffered\": %s, \"width\": %d, \"height\": %d, \"fps\": %.0f, "
+			L"\"frames\": %I64u, \"seconds\": %.3f, \"MBps\": %.2f, \"writeUs\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+			L"\"lateFrames\": %I64u, \"closeMs\": %.1f, \"error\": %s}",
+			r > 0 ? L"," : L"", CRawFrameWriter::ModeName(write.requested), CRawFrameWriter::ModeName(write.mode),
+			write.buffered ? L"true" : L"false", write.cols, write.rows, write.fps, write.frames, write.seconds, write.MBps,
+			write.writeP50Us, write.writeP99Us, write.writeMaxUs, write.lateFrames, write.closeMs,
+			(LPCTSTR)JSONString(CString(write.error.c_str())));
+		file.WriteString(str);
+	}
+	file.WriteString(L"\n  ]\n}\n");
+	file.Close();
+	return true;
+}
@@ -0,0 +1,137 @@
+// PipelineBenchmark.h : camera free benchmarks of the capture -> write pipeline
+//
+
+#pragma once
+#include <vector>
+#include "LumaExtract.h"
+#include "CaptureSource.h"
+#include "DiskBenchmark.h"
+
+struct QueueBenchResult {
+	ULONGLONG frames;		// frames pushed through the queue
+	double seconds;			// wall time from first push to last pop
+	double maxPushUs;		// worst time the producer spent handing one frame over
+	ULONGLONG orderErrors;	// frames that came out of order or were lost
+};
+
+// Pushes 'frames' FrameSlots from a producer thread to a consumer thread through CFrameQueue
+QueueBenchResult BenchFrameQueue(ULONGLONG frames, UINT capacity);
+// Same traffic through the old CCriticalSection guarded ring with UINT16 positions
+QueueBenchResult BenchLockedRing(ULONGLONG frames, UINT capacity);
+
+struct WriterBenchResult {
+	ULONGLONG framesQueued;
+	ULONGLONG framesWritten;
+	UINT wakeups;			// times the writer went to sleep and woke up again
+	double cpuPercent;		// writer thread CPU time / wall time, 100 = one full core
+};
+
+// Feeds a writer thread at 'fps' for 'seconds'. The writer either spins on the queue the
+// way camWrite used to or sleeps on a CFrameSignal, and its CPU time is measured.
+WriterBenchResult BenchWriterWakeup(bool eventDriven, UINT fps, UINT seconds);
+
+struct DropBenchResult {
+	ULONGLONG frames;
+	ULONGLONG written;
+	ULONGLONG dropped;
+	ULONGLONG accountingErrors;	// frames written or dropped twice, both, or neither
+};
+
+// Pushes frames into a drop oldest CFrameQueue faster than the consumer drains it and checks
+// that every frame comes out exactly once, either written or reported as dropped
+DropBenchResult BenchDropOldest(ULONGLONG frames, UINT capacity);
+
+struct UVCReplayBenchResult {
+	UINT frames;				// frames in the synthetic payload stream
+	ULONGLONG payloads;
+	double seconds;				// time to reassemble the whole stream
+	ULONGLONG delivered;		// frames that came out complete
+	ULONGLONG truncated;
+	ULONGLONG merged;
+	ULONGLONG expectedDelivered;
+	ULONGLONG expectedTruncated;
+	ULONGLONG expectedMerged;
+	ULONGLONG contentErrors;	// complete frames whose pixels do not match what was sent
+};
+
+// Records a firmware style payload stream with lost payloads and missed frame ends to a
+// temporary file, replays it through CUVCFrameAssembler into pool buffers and checks that
+// every damaged frame is flagged and every complete one is intact
+UVCReplayBenchResult BenchUVCReplay(UINT frames, int rows, int cols);
+
+struct LumaBenchResult {
+	double roundTripUs;					// YUY2 -> BGR -> gray, the conversions DirectShow and msDisplay used to do
+	double openCVUs;					// cv::cvtColor with CV_YUV2GRAY_YUY2
+	double kernelUs[LUMA_KERNEL_COUNT];	// per frame for each ExtractLuma kernel, 0 if this CPU lacks it
+	ULONGLONG mismatches;				// kernel frames that differ from the scalar one
+};
+
+// Times getting a rows x cols gray frame out of random YUY2 data, averaged over 'frames' frames
+LumaBenchResult BenchLumaExtract(UINT frames, int rows, int cols);
+
+struct PipelineBenchInput {
+	CString spec;			// see CreateSyntheticCapture
+	CaptureKind kind;
+	int codec;				// VideoCodec, -1 for the Writer setting of the camera
+	int bitDepth;			// of a scope's samples, 0 for Scope\BitDepth
+	int segmentFrames;		// frames per video file
+};
+
+struct StageLatencyResult {
+	ULONGLONG count;
+	double p50Us;
+	double p99Us;
+	double p999Us;
+	double maxUs;
+};
+
+struct SourceBenchResult {
+	SourceBenchResult();
+
+	CString name;
+	CString input;
+	CaptureKind kind;
+	ULONGLONG grabbed;			// frames grabbed while recording
+	ULONGLONG written;
+	ULONGLONG dropped;			// frames the queue had no room for
+	ULONGLONG spilled;			// frames handed to the spill thread instead, OVERFLOW_SPILL only
+	ULONGLONG framesInSpill;	// frames read back from the spill file
+	ULONGLONG displayed;
+	ULONGLONG orderErrors;		// displayed frames that were older than the one before
+	UINT highWater;				// most frames queued at once
+	UINT queueCapacity;
+	ULONGLONG bytesOnDisk;
+	VideoCodec codec;
+	int bitDepth;				// of the frames the source delivered
+	ULONGLONG rawBytes;			// frame bytes handed to the video files, bytesOnDisk/rawBytes is the compression
+	double encodeSeconds;		// writer time spent encoding and writing frames
+	ULONGLONG framesInFiles;	// frames read back from the .msraw parts, only with VIDEO_RAW
+	double threadCPU[SOURCE_THREAD_COUNT];		// percent of one core
+	StageLatencyResult stages[PIPELINE_STAGE_COUNT];
+};
+
+struct PipelineBenchResult {
+	PipelineBenchResult();
+
+	CString scenario;
+	CString error;				// empty if every source ran
+	double seconds;				// from the start of the recording until the last writer closed its files
+	ULONGLONG bytesOnDisk;		// videos and timestamps of all sources
+	std::vector<SourceBenchResult> sources;
+};
+
+// A scenario is a ';' separated list of synthetic inputs, each prefixed with the kind of
+// camera it stands in for, e.g. "scope=pattern,1920x28,700,4;behavior=pattern,640x480,30,4".
+// "codec=ffv1", "codec=raw" or "codec=dib" sets the codec of the inputs after it, "bits=10" or
+// "bits=12" the bit depth of the scopes after it, "segment=100" the frames per file, 1000 by default.
+bool ParsePipelineScenario(const CString& scenario, std::vector<PipelineBenchInput>& inputs);
+
+// Runs every input of the scenario through its own CCaptureSource the way the dialog runs
+// cameras, records them into folder for 'seconds' (0: until the first input runs out of
+// frames) and deletes the recording again. Scopes follow Scope\RawCapture and Scope\BitDepth and every source
+// the Writer and Memory settings of the camera it is named after.
+PipelineBenchResult BenchPipeline(const CString& scenario, LPCTSTR folder, double seconds);
+LPCTSTR PipelineStageName(PipelineStage stage);
+// Writes the results and the raw write runs together with a description of this PC as JSON
+bool WritePipelineBenchJSON(LPCTSTR fileName, const std::vector<PipelineBenchResult>& results,
+	const std::vector<DiskBenchResult>& rawWrites);
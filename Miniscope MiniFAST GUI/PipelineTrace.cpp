@@ -0,0 +1,160 @@
+// PipelineTrace.cpp : per thread trace of where frames spend their time, saved in Chrome trace format
+//
+
+#include "stdafx.h"
+#include "PipelineTrace.h"
+#include <atomic>
+#include <vector>
+
+volatile bool gTraceEnabled = false;
+
+namespace {
+
+struct TraceEvent {
+	const char* name;
+	LONGLONG begin;
+	LONGLONG end;
+	UINT frame;
+};
+
+// Written by the thread that owns it, read by TraceSave()
+struct TraceRing {
+	WCHAR name[TRACE_NAME_LENGTH];
+	std::atomic<ULONGLONG> count;	// spans ever recorded, the newest is at (count - 1)%TRACE_THREAD_EVENTS
+	TraceEvent events[TRACE_THREAD_EVENTS];
+};
+
+CCriticalSection gTraceCS;			// guards gRings and gRingCount
+TraceRing* gRings[MAX_TRACE_THREADS];
+int gRingCount = 0;
+__declspec(thread) TraceRing* tRing = NULL;
+
+// Copies the spans of one ring that were complete and not overwritten during the copy
+void CopyRing(TraceRing& ring, std::vector<TraceEvent>& events)
+{
+	ULONGLONG first;
+	ULONGLONG last = ring.count.load(std::memory_order_acquire);
+	ULONGLONG valid;
+
+	first = last > TRACE_THREAD_EVENTS ? last - TRACE_THREAD_EVENTS : 0;
+	events.resize((size_t)(last - first));
+	for (ULONGLONG i = first; i < last; i++)
+		events[(size_t)(i - first)] = ring.events[i%TRACE_THREAD_EVENTS];
+	std::atomic_thread_fence(std::memory_order_acquire);
+	// The owner may be writing span count meanwhile, which lands on the slot of count - TRACE_THREAD_EVENTS
+	valid = ring.count.load(std::memory_order_acquire) + 1;
+	if (valid > first + TRACE_THREAD_EVENTS) {
+		valid -= TRACE_THREAD_EVENTS;
+		events.erase(events.begin(), events.begin() + (size_t)min(valid - first, (ULONGLONG)events.size()));
+	}
+}
+
+} // namespace
+
+void TraceEnable(bool enable)
+{
+	gTraceEnabled = enable;
+}
+
+void TraceThreadName(LPCTSTR name)
+{
+	CSingleLock lock(&gTraceCS, TRUE);
+	TraceRing* ring;
+
+	for (int i = 0; i < gRingCount; i++) {
+		if (wcscmp(gRings[i]->name, name) == 0) {
+			tRing = gRings[i];
+			return;
+		}
+	}
+	if (gRingCount == MAX_TRACE_THREADS) {
+		tRing = NULL;
+		return;
+	}
+	ring = new TraceRing;
+	wcsncpy_s(ring->name, name, _TRUNCATE);
+	ring->count.store(0);
+	gRings[gRingCount++] = ring;
+	tRing = ring;
+}
+
+void TraceSpan(const char* name, LONGLONG begin, UINT frame)
+{
+	TraceRing* ring = tRing;
+	LARGE_INTEGER now;
+	ULONGLONG count;
+
+	if (begin == 0 || ring == NULL || gTraceEnabled == false)
+		return;
+	QueryPerformanceCounter(&now);
+	count = ring->count.load(std::memory_order_relaxed);
+	TraceEvent& event = ring->events[count%TRACE_THREAD_EVENTS];
+	event.name = name;
+	event.begin = begin;
+	event.end = now.QuadPart;
+	event.frame = frame;
+	ring->count.store(count + 1, std::memory_order_release);
+}
+
+CString JSONString(const CString& text)
+{ //Control characters too, system error texts end in CR LF and thread names may hold anything
+	CString str(L"\"");
+
+	for (int i = 0; i < text.GetLength(); i++) {
+		WCHAR c = text[i];
+		if (c == L'\\' || c == L'"')
+			str.AppendFormat(L"\\%c", c);
+		else if (c == L'\n')
+			str += L"\\n";
+		else if (c == L'\r')
+			str += L"\\r";
+		else if (c == L'\t')
+			str += L"\\t";
+		else if (c < 0x20)
+			str.AppendFormat(L"\\u%04x", (UINT)c);
+		else
+			str += c;
+	}
+	return str + L"\"";
+}
+
+bool TraceSave(LPCTSTR fileName)
+{ //Complete ("X") events in microseconds since the oldest span still held, one tid per thread name
+	CSingleLock lock(&gTraceCS, TRUE);
+	int ringCount = gRingCount;			// rings are never freed, so their names stay valid unlocked
+	std::vector<std::vector<TraceEvent> > copies(ringCount);
+	CStdioFile file;
+	CString str;
+	LARGE_INTEGER frequency;
+	LONGLONG origin = 0;
+	double usPerTick;
+	bool first = true;
+
+	for (int i = 0; i < ringCount; i++) {
+		CopyRing(*gRings[i], copies[i]);
+		if (!copies[i].empty() && (origin == 0 || copies[i][0].begin < origin))
+			origin = copies[i][0].begin;
+	}
+	lock.Unlock();
+	if (!file.Open(fileName, CFile::modeCreate|CFile::modeWrite, NULL))
+		return false;
+	QueryPerformanceFrequency(&frequency);
+	usPerTick = 1000000.0/frequency.QuadPart;
+
+	file.WriteString(L"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	for (int i = 0; i < ringCount; i++) {
+		str.Format(L"%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": %s}}",
+			first ? L"" : L",\n", i + 1, (LPCTSTR)JSONString(gRings[i]->name));
+		file.WriteString(str);
+		first = false;
+		for (size_t j = 0; j < copies[i].size(); j++) {
+			const TraceEvent& event = copies[i][j];
+			str.Format(L",\n{\"name\": %s, \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %u}}",
+				(LPCTSTR)JSONString(CString(event.name)), i + 1, (event.begin - origin)*usPerTick, (event.end - event.begin)*usPerTick, event.frame);
+			file.WriteString(str);
+		}
+	}
+	file.WriteString(L"\n]}\n");
+	file.Close();
+	return true;
+}
@@ -0,0 +1,50 @@
+// PipelineTrace.h : per thread trace of where frames spend their time, saved in Chrome trace format
+//
+// Every pipeline thread names itself with TraceThreadName() and then wraps each stage:
+//
+//	LONGLONG begin = TraceNow();
+//	... grab, retrieve, write ...
+//	TraceSpan("grab", begin, frameNum);
+//
+// Spans go into a ring buffer only the calling thread writes, so recording costs two
+// QueryPerformanceCounter calls and a store, and nothing when tracing is off. TraceSave()
+// writes what the rings hold as JSON that chrome://tracing and Perfetto load.
+
+#pragma once
+
+#define TRACE_THREAD_EVENTS 32768	// spans kept per thread, about 5 s of a capture thread at 700 fps
+#define MAX_TRACE_THREADS 64		// distinct thread names
+#define TRACE_NAME_LENGTH 48
+
+// Switched with TraceEnable(), read by every trace point
+extern volatile bool gTraceEnabled;
+
+// Any thread. Spans recorded while disabled are dropped.
+void TraceEnable(bool enable);
+
+// Calling thread. Gives it the ring of the last thread with the same name, so threads that are
+// started again for every recording, like writers, do not use up MAX_TRACE_THREADS. Threads
+// that never call it are not traced.
+void TraceThreadName(LPCTSTR name);
+
+// Start of a span, 0 while tracing is off
+inline LONGLONG TraceNow()
+{
+	LARGE_INTEGER now;
+
+	if (gTraceEnabled == false)
+		return 0;
+	QueryPerformanceCounter(&now);
+	return now.QuadPart;
+}
+
+// Records a span from begin until now on the calling thread. name must be a string literal,
+// only the pointer is kept. frame is the frameNum of droppedFrames.dat, 0 if not known.
+void TraceSpan(const char* name, LONGLONG begin, UINT frame = 0);
+
+// Any thread. Writes every thread's spans to fileName. Threads keep tracing meanwhile, a span
+// they overwrite while it is being copied is left out.
+bool TraceSave(LPCTSTR fileName);
+
+// text as a quoted JSON string, for every JSON file the app writes
+CString JSONString(const CString& text);
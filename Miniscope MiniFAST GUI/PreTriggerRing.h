@@ -0,0 +1,102 @@
+// PreTriggerRing.h : the frames a source grabbed in the seconds before a triggered recording started
+//
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include "FrameQueue.h"
+
+enum PreTriggerState {
+	PRETRIGGER_FILLING = 0,		// the capture thread grabs into it
+	PRETRIGGER_FROZEN,			// the recording started, the writer owns what it kept
+	PRETRIGGER_FLUSHED			// written, the capture thread starts it over
+};
+
+// While a triggered recording is armed the capture thread grabs into this ring instead of the
+// overflow slot, overwriting the oldest frame once it is full, so the frames cost no copy.
+// On the first frame it sees the record flag set, the capture thread freezes the ring before it
+// queues anything: the frames grabbed since startOfRecord are kept, numbered and timed as the
+// recording's first frames. The writer writes them ahead of its queue and then hands the ring
+// back. Buffers are bound from the source's pool like the queue's.
+class CPreTriggerRing
+{
+public:
+	CPreTriggerRing() : mHead(0), mFirst(0), mKept(0) { mState.store(PRETRIGGER_FILLING); }
+
+	// Not thread safe. Only call while neither side is running. 0 frames turns the ring off.
+	void Init(UINT frames)
+	{
+		mSlots.clear();
+		mSlots.resize(frames);
+		mHead = 0;
+		mFirst = 0;
+		mKept = 0;
+		mState.store(PRETRIGGER_FILLING);
+	}
+	UINT Capacity() const { return (UINT)mSlots.size(); }
+	// Direct slot access for binding buffers. Same rules as Init().
+	FrameSlot& Slot(UINT i) { return mSlots[i]; }
+
+	//---------- Capture thread ----------
+	// Slot to grab into, or NULL if the ring is off or the writer has not written what it kept
+	FrameSlot* BeginWrite()
+	{
+		int state = mState.load(std::memory_order_acquire);
+
+		if (mSlots.empty() || state == PRETRIGGER_FROZEN)
+			return NULL;
+		if (state == PRETRIGGER_FLUSHED) {
+			mHead = 0;
+			mState.store(PRETRIGGER_FILLING, std::memory_order_relaxed);
+		}
+		return &mSlots[mHead % mSlots.size()];
+	}
+	void CommitWrite() { mHead++; }
+	// Keeps the frames grabbed at or after startTicks, numbers them from 1 and times them from
+	// startTicks the way the capture thread times queued frames. Returns how many were kept.
+	UINT Freeze(LONGLONG startTicks, LONGLONG frequency)
+	{
+		UINT held;
+
+		if (mSlots.empty())
+			return 0;
+		if (mState.load(std::memory_order_acquire) == PRETRIGGER_FLUSHED)
+			mHead = 0;
+		held = (UINT)min(mHead, (ULONGLONG)mSlots.size());
+		mFirst = mHead - held;
+		while (held > 0 && mSlots[mFirst % mSlots.size()].grabTicks < startTicks) {
+			mFirst++;
+			held--;
+		}
+		mKept = held;
+		for (UINT i = 0; i < mKept; i++) {
+			FrameSlot& slot = Kept(i);
+			slot.frameNum = i + 1;
+			slot.capTime = (UINT)(1000*((double)slot.grabTicks - startTicks)/frequency);
+		}
+		mState.store(PRETRIGGER_FROZEN, std::memory_order_release);
+		return mKept;
+	}
+
+	//---------- Writer thread ----------
+	bool IsFrozen() const { return mState.load(std::memory_order_acquire) == PRETRIGGER_FROZEN; }
+	// Frames Freeze() kept, oldest first. Valid until Release().
+	UINT KeptCount() const { return mKept; }
+	FrameSlot& Kept(UINT i) { return mSlots[(mFirst + i) % mSlots.size()]; }
+	// Once the kept frames are written, or the recording ended without them
+	void Release()
+	{
+		if (IsFrozen())
+			mState.store(PRETRIGGER_FLUSHED, std::memory_order_release);
+	}
+
+private:
+	CPreTriggerRing(const CPreTriggerRing&);
+	CPreTriggerRing& operator=(const CPreTriggerRing&);
+
+	std::vector<FrameSlot> mSlots;
+	ULONGLONG mHead;		// frames grabbed into the ring since it started over
+	ULONGLONG mFirst;		// oldest kept frame
+	UINT mKept;
+	std::atomic<int> mState;
+};
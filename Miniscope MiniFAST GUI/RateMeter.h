@@ -0,0 +1,49 @@
+// RateMeter.h : frames per second over a sliding window
+//
+
+#pragma once
+
+#define RATE_WINDOW_SAMPLES 10
+
+// The counting thread only pays for one interlocked increment per frame. Whoever shows
+// the rate calls Sample() at a regular period and gets the frames counted over the last
+// RATE_WINDOW_SAMPLES periods divided by the time they actually covered.
+class CRateMeter
+{
+public:
+	CRateMeter() : mTotal(0), mNext(0), mFilled(0) {}
+
+	//---------- Counting thread ----------
+	void Count() { InterlockedIncrement(&mTotal); }
+	LONG Total() const { return mTotal; }
+
+	//---------- Sampling thread ----------
+	double Sample(LONGLONG now, LONGLONG frequency)
+	{
+		LONG total = mTotal;
+		UINT oldest;
+
+		mTotals[mNext] = total;
+		mTimes[mNext] = now;
+		mNext = (mNext + 1)%RATE_WINDOW_SAMPLES;
+		if (mFilled < RATE_WINDOW_SAMPLES)
+			mFilled++;
+		oldest = (mNext + RATE_WINDOW_SAMPLES - mFilled)%RATE_WINDOW_SAMPLES;
+		if (now <= mTimes[oldest])
+			return 0;
+		return (double)(total - mTotals[oldest])*frequency/(now - mTimes[oldest]);
+	}
+	// Forget the window, e.g. at the start of a recording
+	void Reset()
+	{
+		mNext = 0;
+		mFilled = 0;
+	}
+
+private:
+	volatile LONG mTotal;
+	LONG mTotals[RATE_WINDOW_SAMPLES];
+	LONGLONG mTimes[RATE_WINDOW_SAMPLES];
+	UINT mNext;
+	UINT mFilled;
+};
@@ -0,0 +1,957 @@
+// RawFrameFile.cpp : indexed raw frame container, written unbuffered and read through mmap
+//
+// Builds on Windows and Linux, so it does not use the precompiled MFC header.
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "RawFrameFile.h"
+#include "SamplePack.h"
+#include "opencv2/imgproc.hpp"
+
+namespace {
+
+const char kFileMagic[8] = {'M', 'S', 'R', 'A', 'W', 'F', 'R', '1'};
+const char kIndexMagic[8] = {'M', 'S', 'R', 'A', 'W', 'I', 'D', 'X'};
+const char kStripeMagic[] = "msstripe";
+
+uint64_t RoundUp(uint64_t bytes)
+{
+	return (bytes + RAW_ALIGN - 1)/RAW_ALIGN*RAW_ALIGN;
+}
+
+uint32_t FrameBytes(const RawFileHeader& header)
+{
+	uint64_t samples = (uint64_t)header.width*header.height*header.channels;
+
+	if (header.packing == RAW_PACK_MIPI)
+		return (uint32_t)MIPIPackedBytes((size_t)samples, header.bitDepth);
+	return (uint32_t)(samples*((header.bitDepth + 7)/8));
+}
+
+uint64_t WallClockUs()
+{
+#ifdef _WIN32
+	FILETIME now;
+	ULARGE_INTEGER ticks;
+	GetSystemTimeAsFileTime(&now);
+	ticks.LowPart = now.dwLowDateTime;
+	ticks.HighPart = now.dwHighDateTime;
+	return (ticks.QuadPart - 116444736000000000ULL)/10;	// 100 ns since 1601
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+#endif
+}
+
+uint8_t* AlignedAlloc(size_t bytes)
+{
+#ifdef _WIN32
+	return (uint8_t*)_aligned_malloc(bytes, RAW_ALIGN);
+#else
+	void* p;
+	return posix_memalign(&p, RAW_ALIGN, bytes) == 0 ? (uint8_t*)p : NULL;
+#endif
+}
+
+void AlignedFree(uint8_t* p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+std::string SystemError()
+{
+#ifdef _WIN32
+	char text[256];
+	DWORD error = GetLastError();
+	DWORD length = FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM|FORMAT_MESSAGE_IGNORE_INSERTS, NULL, error, 0, text, sizeof text, NULL);
+	if (length == 0)
+		return "error " + std::to_string((unsigned long long)error);
+	// Without the CR LF the message ends in, it goes into log lines and reports
+	while (length > 0 && (text[length - 1] == '\r' || text[length - 1] == '\n' || text[length - 1] == ' '))
+		length--;
+	return std::string(text, length);
+#else
+	return strerror(errno);
+#endif
+}
+
+} // namespace
+
+#ifdef __linux__
+// Just enough io_uring for writes to one file, straight on the system calls so nothing
+// beyond the kernel headers is needed
+class CRawUring
+{
+public:
+	CRawUring();
+	~CRawUring();
+
+	// Buffers are registered if the kernel lets us pin them, writes from them then skip
+	// mapping the pages for every request
+	bool Open(unsigned entries, const struct iovec* buffers, unsigned count);
+	// Submits a write of data, which lies in buffer index, tagged with tag. At most
+	// entries writes may be in flight.
+	bool Write(int fd, unsigned index, const void* data, size_t bytes, uint64_t offset, uint64_t tag);
+	// Waits for at least wait completions and hands back up to max, or -1 on failure
+	int Complete(unsigned wait, uint64_t* tags, int* results, int max);
+	bool IsRegistered() const { return mRegistered; }
+	// errno of the last failure
+	int Error() const { return mError; }
+
+private:
+	CRawUring(const CRawUring&);
+	CRawUring& operator=(const CRawUring&);
+
+	int Enter(unsigned submit, unsigned wait);
+
+	int mFd;
+	void* mSqRing;
+	void* mCqRing;
+	size_t mSqRingSize;
+	size_t mCqRingSize;
+	struct io_uring_sqe* mSqes;
+	size_t mSqesSize;
+	unsigned* mSqTail;
+	unsigned* mSqMask;
+	unsigned* mSqArray;
+	unsigned* mCqHead;
+	unsigned* mCqTail;
+	unsigned* mCqMask;
+	struct io_uring_cqe* mCqes;
+	bool mRegistered;
+	int mError;
+};
+
+CRawUring::CRawUring()
+	: mFd(-1)
+	, mSqRing(MAP_FAILED)
+	, mCqRing(MAP_FAILED)
+	, mSqRingSize(0)
+	, mCqRingSize(0)
+	, mSqes((struct io_uring_sqe*)MAP_FAILED)
+	, mSqesSize(0)
+	, mRegistered(false)
+	, mError(0)
+{
+}
+
+CRawUring::~CRawUring()
+{
+	if (mSqes != MAP_FAILED)
+		munmap(mSqes, mSqesSize);
+	if (mCqRing != MAP_FAILED && mCqRing != mSqRing)
+		munmap(mCqRing, mCqRingSize);
+	if (mSqRing != MAP_FAILED)
+		munmap(mSqRing, mSqRingSize);
+	if (mFd != -1)
+		close(mFd);
+}
+
+bool CRawUring::Open(unsigned entries, const struct iovec* buffers, unsigned count)
+{
+	struct io_uring_params params;
+	uint8_t* sq;
+	uint8_t* cq;
+
+	memset(&params, 0, sizeof params);
+	mFd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (mFd == -1) {
+		mError = errno;
+		return false;
+	}
+	mSqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	mCqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		mSqRingSize = mCqRingSize = mSqRingSize > mCqRingSize ? mSqRingSize : mCqRingSize;
+	mSqRing = mmap(NULL, mSqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+	if (mSqRing != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		mCqRing = mSqRing;
+	else if (mSqRing != MAP_FAILED)
+		mCqRing = mmap(NULL, mCqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+	mSqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+	mSqes = (struct io_uring_sqe*)mmap(NULL, mSqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, mFd, IORING_OFF_SQES);
+	if (mSqRing == MAP_FAILED || mCqRing == MAP_FAILED || mSqes == MAP_FAILED) {
+		mError = errno;
+		return false;
+	}
+	sq = (uint8_t*)mSqRing;
+	cq = (uint8_t*)mCqRing;
+	mSqTail = (unsigned*)(sq + params.sq_off.tail);
+	mSqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	mSqArray = (unsigned*)(sq + params.sq_off.array);
+	mCqHead = (unsigned*)(cq + params.cq_off.head);
+	mCqTail = (unsigned*)(cq + params.cq_off.tail);
+	mCqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	mCqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	// Fails without CAP_IPC_LOCK once the buffers exceed RLIMIT_MEMLOCK, plain writes work regardless
+	mRegistered = syscall(__NR_io_uring_register, mFd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+	return true;
+}
+
+int CRawUring::Enter(unsigned submit, unsigned wait)
+{
+	int result;
+
+	do
+		result = (int)syscall(__NR_io_uring_enter, mFd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while (result == -1 && errno == EINTR);
+	if (result == -1)
+		mError = errno;
+	return result;
+}
+
+bool CRawUring::Write(int fd, unsigned index, const void* data, size_t bytes, uint64_t offset, uint64_t tag)
+{ //Only this thread moves the tail, the kernel reads it after the release store
+	unsigned tail = *mSqTail;
+	unsigned slot = tail & *mSqMask;
+	struct io_uring_sqe* sqe = &mSqes[slot];
+
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode = mRegistered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = (uint32_t)bytes;
+	sqe->off = offset;
+	sqe->buf_index = mRegistered ? (uint16_t)index : 0;
+	sqe->user_data = tag;
+	mSqArray[slot] = slot;
+	__atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+	return Enter(1, 0) == 1;
+}
+
+int CRawUring::Complete(unsigned wait, uint64_t* tags, int* results, int max)
+{
+	unsigned head;
+	unsigned tail;
+	int count = 0;
+
+	while (1) {
+		head = *mCqHead;
+		tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail && count < max; head++, count++) {
+			tags[count] = mCqes[head & *mCqMask].user_data;
+			results[count] = mCqes[head & *mCqMask].res;
+		}
+		__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+		if (count >= (int)wait)
+			return count;
+		if (Enter(0, wait - count) == -1)
+			return -1;
+	}
+}
+#endif
+
+CRawFrameWriter::CRawFrameWriter()
+#ifdef _WIN32
+	: mFile(INVALID_HANDLE_VALUE)
+#else
+	: mFd(-1)
+	, mRing(NULL)
+#endif
+	, mMode(RAW_WRITE_DIRECT)
+	, mBlock(NULL)
+	, mCurrent(0)
+	, mStage(NULL)
+	, mStageSize(0)
+	, mStageUsed(0)
+	, mOffset(0)
+	, mBuffered(false)
+{
+	memset(&mHeader, 0, sizeof mHeader);
+}
+
+bool CRawFrameWriter::IsOpened() const
+{
+#ifdef _WIN32
+	return mFile != INVALID_HANDLE_VALUE;
+#else
+	return mFd != -1;
+#endif
+}
+
+bool CRawFrameWriter::Fail(const std::string& what)
+{
+	mLastError = what + ": " + SystemError();
+	return false;
+}
+
+const char* CRawFrameWriter::ModeName(RawWriteMode mode)
+{
+	switch (mode) {
+	case RAW_WRITE_BUFFERED:
+		return "buffered";
+	case RAW_WRITE_URING:
+		return "io_uring";
+	default:
+		return "direct";
+	}
+}
+
+bool CRawFrameWriter::IsModeAvailable(RawWriteMode mode)
+{
+#ifdef __linux__
+	struct io_uring_params params;
+	int fd;
+
+	if (mode == RAW_WRITE_URING) {
+		memset(&params, 0, sizeof params);
+		fd = (int)syscall(__NR_io_uring_setup, 1, &params);
+		if (fd == -1)
+			return false;
+		close(fd);
+	}
+	return mode < RAW_WRITE_MODE_COUNT;
+#else
+	return mode == RAW_WRITE_DIRECT || mode == RAW_WRITE_BUFFERED;
+#endif
+}
+
+bool CRawFrameWriter::Open(const std::string& fileName, const RawFileHeader& header, uint32_t preallocateFrames,
+	RawWriteMode mode)
+{ //The file header goes out with the first records, it is written again with the index by Close()
+	uint64_t preallocate;
+	size_t stages;
+
+	Close();
+	mLastError.clear();
+	mHeader = header;
+	memcpy(mHeader.magic, kFileMagic, sizeof kFileMagic);
+	mHeader.version = RAW_VERSION;
+	mHeader.headerSize = RAW_ALIGN;
+	mHeader.frameBytes = FrameBytes(header);
+	mHeader.recordSize = (uint32_t)RoundUp(RAW_FRAME_HEADER_SIZE + mHeader.frameBytes);
+	mHeader.frameCount = 0;
+	mHeader.indexOffset = 0;
+	mHeader.createdUs = WallClockUs();
+	if (mHeader.frameBytes == 0) {
+		mLastError = "empty frame geometry";
+		return false;
+	}
+	if (mHeader.packing != RAW_PACK_NONE && (mHeader.packing != RAW_PACK_MIPI || mHeader.channels != 1 ||
+		(mHeader.bitDepth != 10 && mHeader.bitDepth != 12))) {
+		mLastError = "MIPI packing takes 10 or 12 bit gray only";
+		return false;
+	}
+	preallocate = mHeader.headerSize + (uint64_t)preallocateFrames*mHeader.recordSize;
+	mStageSize = RAW_STAGE_BYTES > mHeader.recordSize ? RAW_STAGE_BYTES/mHeader.recordSize*mHeader.recordSize : mHeader.recordSize;
+	mMode = mode < RAW_WRITE_MODE_COUNT ? mode : RAW_WRITE_DIRECT;
+#ifndef __linux__
+	if (mMode == RAW_WRITE_URING)
+		mMode = RAW_WRITE_DIRECT;
+#endif
+	stages = mMode == RAW_WRITE_URING ? RAW_URING_STAGES : 1;
+	mBlock = AlignedAlloc(stages*mStageSize);
+	if (mBlock == NULL) {
+		mLastError = "out of memory for the staging buffer";
+		return false;
+	}
+	mStages.resize(stages);
+	for (size_t i = 0; i < stages; i++) {
+		mStages[i].data = mBlock + i*mStageSize;
+		mStages[i].offset = 0;
+		mStages[i].bytes = 0;
+		mStages[i].busy = false;
+	}
+	mCurrent = 0;
+	mStage = mStages[0].data;
+
+	mBuffered = mMode == RAW_WRITE_BUFFERED;
+#ifdef _WIN32
+	mFile = CreateFileA(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL|(mBuffered ? 0 : FILE_FLAG_NO_BUFFERING)|FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (mFile == INVALID_HANDLE_VALUE) {
+		Fail("CreateFile " + fileName);
+		ReleaseStages();
+		return false;
+	}
+	// Reserves clusters without moving the end of file, NTFS returns what is unused on close
+	FILE_ALLOCATION_INFO allocation;
+	allocation.AllocationSize.QuadPart = (LONGLONG)preallocate;
+	SetFileInformationByHandle(mFile, FileAllocationInfo, &allocation, sizeof allocation);
+#else
+	mFd = open(fileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC|(mBuffered ? 0 : O_DIRECT), 0644);
+	if (mFd == -1 && errno == EINVAL) {
+		mFd = open(fileName.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		mBuffered = true;
+	}
+	if (mFd == -1) {
+		Fail("open " + fileName);
+		ReleaseStages();
+		return false;
+	}
+	// Best effort, Close() truncates what is not used
+	fallocate(mFd, FALLOC_FL_KEEP_SIZE, 0, (off_t)preallocate);
+#endif
+#ifdef __linux__
+	if (mMode == RAW_WRITE_URING) {
+		std::vector<struct iovec> buffers(stages);
+		for (size_t i = 0; i < stages; i++) {
+			buffers[i].iov_base = mStages[i].data;
+			buffers[i].iov_len = mStageSize;
+		}
+		// Room for every stage in flight, so a submission never finds the ring full
+		mRing = new CRawUring;
+		if (!mRing->Open(2*RAW_URING_STAGES, &buffers[0], (unsigned)stages)) {
+			delete mRing;
+			mRing = NULL;
+			mMode = RAW_WRITE_DIRECT;
+		}
+	}
+#endif
+
+	mIndex.reserve(preallocateFrames);
+	memset(mStage, 0, mHeader.headerSize);
+	memcpy(mStage, &mHeader, sizeof mHeader);
+	mStageUsed = mHeader.headerSize;
+	mOffset = 0;
+	return true;
+}
+
+bool CRawFrameWriter::Write(const RawFrameHeader& frame, const cv::Mat& pixels)
+{
+	const cv::Mat* source = &pixels;
+	RawFrameHeader* record;
+	RawIndexEntry entry;
+	uint8_t* dest;
+	size_t rowBytes;
+
+	if (!IsOpened())
+		return false;
+	if (pixels.channels() == 3 && mHeader.channels == 1) {
+		cv::cvtColor(pixels, mGray, cv::COLOR_BGR2GRAY);
+		source = &mGray;
+	}
+	rowBytes = mHeader.width*mHeader.channels*((mHeader.bitDepth + 7)/8);
+	if (source->rows != (int)mHeader.height || source->cols*source->elemSize() != rowBytes ||
+		(mHeader.packing == RAW_PACK_MIPI && source->type() != CV_16UC1)) {
+		mLastError = "frame does not match the file's geometry";
+		return false;
+	}
+	if (mStageUsed + mHeader.recordSize > mStageSize && !Flush())
+		return false;
+
+	entry.offset = mOffset + mStageUsed;
+	entry.hostTicks = frame.hostTicks;
+	entry.frameNumber = frame.frameNumber;
+	entry.captureFrame = frame.captureFrame;
+	entry.capTimeMs = frame.capTimeMs;
+	entry.reserved = 0;
+	mIndex.push_back(entry);
+
+	record = (RawFrameHeader*)(mStage + mStageUsed);
+	*record = frame;
+	record->magic = RAW_FRAME_MAGIC;
+	dest = mStage + mStageUsed + RAW_FRAME_HEADER_SIZE;
+	if (mHeader.packing == RAW_PACK_MIPI) {
+		// Groups run on over the ends of rows, so a cropped frame is packed from a continuous copy
+		if (!source->isContinuous()) {
+			source->copyTo(mSamples);
+			source = &mSamples;
+		}
+		PackMIPI((const uint16_t*)source->data, dest, source->total(), mHeader.bitDepth);
+	}
+	else if (source->isContinuous())
+		memcpy(dest, source->data, mHeader.frameBytes);
+	else for (int y = 0; y < source->rows; y++, dest += rowBytes)
+		memcpy(dest, source->ptr(y), rowBytes);
+	memset(mStage + mStageUsed + RAW_FRAME_HEADER_SIZE + mHeader.frameBytes, 0,
+		mHeader.recordSize - RAW_FRAME_HEADER_SIZE - mHeader.frameBytes);
+	mStageUsed += mHeader.recordSize;
+	return true;
+}
+
+bool CRawFrameWriter::Flush()
+{ //Only the last flush of a file, the one with the end of the index, needs padding
+	size_t bytes = (size_t)RoundUp(mStageUsed);
+
+	if (mStageUsed == 0)
+		return true;
+	memset(mStage + mStageUsed, 0, bytes - mStageUsed);
+#ifdef __linux__
+	if (mRing != NULL) {
+		Stage& stage = mStages[mCurrent];
+		stage.offset = mOffset;
+		stage.bytes = bytes;
+		if (!mRing->Write(mFd, (unsigned)mCurrent, stage.data, bytes, mOffset, mCurrent)) {
+			errno = mRing->Error();
+			return Fail("io_uring_enter");
+		}
+		stage.busy = true;
+		mOffset += bytes;
+		mStageUsed = 0;
+		return NextStage();
+	}
+#endif
+	if (!WriteAt(mOffset, mStage, bytes))
+		return false;
+	mOffset += bytes;
+	mStageUsed = 0;
+	return true;
+}
+
+bool CRawFrameWriter::NextStage()
+{
+	size_t next;
+	bool ok = Reap(false);
+
+	while (1) {
+		for (size_t i = 1; i <= mStages.size(); i++) {
+			next = (mCurrent + i)%mStages.size();
+			if (!mStages[next].busy) {
+				mCurrent = next;
+				mStage = mStages[next].data;
+				return ok;
+			}
+		}
+		if (!Reap(true))
+			return false;
+	}
+}
+
+bool CRawFrameWriter::Reap(bool wait)
+{ //A write the kernel cut short is finished synchronously, a failed one fails the file
+#ifdef __linux__
+	uint64_t tags[RAW_URING_STAGES];
+	int results[RAW_URING_STAGES];
+	int count;
+	bool ok = true;
+
+	if (mRing == NULL)
+		return true;
+	count = mRing->Complete(wait ? 1 : 0, tags, results, RAW_URING_STAGES);
+	if (count == -1) {
+		// Nothing more will be heard of the writes in flight
+		for (size_t i = 0; i < mStages.size(); i++)
+			mStages[i].busy = false;
+		errno = mRing->Error();
+		return Fail("io_uring_enter");
+	}
+	for (int i = 0; i < count; i++) {
+		Stage& stage = mStages[(size_t)tags[i]];
+		stage.busy = false;
+		if (results[i] < 0) {
+			errno = -results[i];
+			ok = Fail("io_uring write");
+		}
+		else if ((size_t)results[i] < stage.bytes && ok)
+			ok = WriteAt(stage.offset + results[i], stage.data + results[i], stage.bytes - results[i]);
+	}
+	return ok;
+#else
+	return true;
+#endif
+}
+
+bool CRawFrameWriter::Drain()
+{
+	bool ok = true;
+
+	for (size_t i = 0; i < mStages.size(); i++) {
+		while (mStages[i].busy)
+			ok = Reap(true) && ok;
+	}
+	return ok;
+}
+
+void CRawFrameWriter::ReleaseStages()
+{
+#ifdef __linux__
+	delete mRing;
+	mRing = NULL;
+#endif
+	AlignedFree(mBlock);
+	mBlock = NULL;
+	mStage = NULL;
+	mStages.clear();
+}
+
+bool CRawFrameWriter::WriteAt(uint64_t offset, const void* data, size_t bytes)
+{
+#ifdef _WIN32
+	OVERLAPPED position;
+	DWORD written;
+	memset(&position, 0, sizeof position);
+	position.Offset = (DWORD)offset;
+	position.OffsetHigh = (DWORD)(offset >> 32);
+	if (!WriteFile(mFile, data, (DWORD)bytes, &written, &position) || written != bytes)
+		return Fail("WriteFile");
+#else
+	const uint8_t* p = (const uint8_t*)data;
+	while (bytes > 0) {
+		ssize_t written = pwrite(mFd, p, bytes, (off_t)offset);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return Fail("pwrite");
+		p += written;
+		offset += written;
+		bytes -= written;
+	}
+#endif
+	return true;
+}
+
+bool CRawFrameWriter::Close()
+{ //The index goes through the staging buffer like the records, so it is written in the same aligned pieces
+	RawIndexHeader index;
+	const uint8_t* entries;
+	size_t left;
+	size_t part;
+	bool ok;
+
+	if (!IsOpened())
+		return true;
+	ok = Flush();
+	mHeader.frameCount = mIndex.size();
+	mHeader.indexOffset = mOffset;
+	memset(&index, 0, sizeof index);
+	memcpy(index.magic, kIndexMagic, sizeof kIndexMagic);
+	index.count = mIndex.size();
+	index.entrySize = sizeof(RawIndexEntry);
+	memcpy(mStage, &index, sizeof index);
+	mStageUsed = sizeof index;
+	entries = mIndex.empty() ? NULL : (const uint8_t*)&mIndex[0];
+	left = mIndex.size()*sizeof(RawIndexEntry);
+	while (ok && left > 0) {
+		part = left < mStageSize - mStageUsed ? left : mStageSize - mStageUsed;
+		memcpy(mStage + mStageUsed, entries, part);
+		mStageUsed += part;
+		entries += part;
+		left -= part;
+		if (mStageUsed == mStageSize)
+			ok = Flush();
+	}
+	ok = ok && Flush();
+	ok = Drain() && ok;
+	if (ok) {
+		memset(mStage, 0, mHeader.headerSize);
+		memcpy(mStage, &mHeader, sizeof mHeader);
+		ok = WriteAt(0, mStage, mHeader.headerSize);
+	}
+
+#ifdef _WIN32
+	CloseHandle(mFile);
+	mFile = INVALID_HANDLE_VALUE;
+#else
+	if (ftruncate(mFd, (off_t)mOffset) == -1 && ok)
+		ok = Fail("ftruncate");
+	close(mFd);
+	mFd = -1;
+#endif
+	ReleaseStages();
+	mStageUsed = 0;
+	mIndex.clear();
+	return ok;
+}
+
+CRawFrameReader::CRawFrameReader()
+#ifdef _WIN32
+	: mFile(INVALID_HANDLE_VALUE)
+	, mMapping(NULL)
+#else
+	: mFd(-1)
+#endif
+	, mData(NULL)
+	, mSize(0)
+	, mFrameCount(0)
+{
+}
+
+bool CRawFrameReader::Open(const std::string& fileName)
+{
+	Close();
+	mLastError.clear();
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	mFile = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (mFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(mFile, &size)) {
+		mLastError = "open " + fileName + ": " + SystemError();
+		Close();
+		return false;
+	}
+	mSize = size.QuadPart;
+	if (mSize >= sizeof(RawFileHeader)) {
+		mMapping = CreateFileMapping(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mMapping != NULL)
+			mData = (const uint8_t*)MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+		if (mData == NULL) {
+			mLastError = "map " + fileName + ": " + SystemError();
+			Close();
+			return false;
+		}
+	}
+#else
+	struct stat status;
+	mFd = open(fileName.c_str(), O_RDONLY);
+	if (mFd == -1 || fstat(mFd, &status) == -1) {
+		mLastError = "open " + fileName + ": " + SystemError();
+		Close();
+		return false;
+	}
+	mSize = status.st_size;
+	if (mSize >= sizeof(RawFileHeader)) {
+		void* data = mmap(NULL, (size_t)mSize, PROT_READ, MAP_SHARED, mFd, 0);
+		if (data == MAP_FAILED) {
+			mLastError = "mmap " + fileName + ": " + SystemError();
+			Close();
+			return false;
+		}
+		mData = (const uint8_t*)data;
+	}
+#endif
+
+	if (mData == NULL || memcmp(Header().magic, kFileMagic, sizeof kFileMagic) != 0 || Header().version != RAW_VERSION
+		|| Header().headerSize < sizeof(RawFileHeader) || Header().recordSize < RAW_FRAME_HEADER_SIZE + (uint64_t)Header().frameBytes
+		|| Header().packing > RAW_PACK_MIPI || Header().frameBytes != FrameBytes(Header())) {
+		mLastError = fileName + " is not a raw frame file";
+		Close();
+		return false;
+	}
+	if (Header().indexOffset != 0) {
+		mFrameCount = Header().frameCount;
+		if (Header().headerSize + mFrameCount*Header().recordSize > mSize) {
+			mLastError = fileName + " is shorter than its index";
+			Close();
+			return false;
+		}
+	}
+	else {
+		mFrameCount = 0;
+		while (Header().headerSize + (mFrameCount + 1)*Header().recordSize <= mSize && FrameHeader(mFrameCount).magic == RAW_FRAME_MAGIC)
+			mFrameCount++;
+	}
+	return true;
+}
+
+void CRawFrameReader::Close()
+{
+#ifdef _WIN32
+	if (mData != NULL)
+		UnmapViewOfFile(mData);
+	if (mMapping != NULL)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+	mMapping = NULL;
+	mFile = INVALID_HANDLE_VALUE;
+#else
+	if (mData != NULL)
+		munmap((void*)mData, (size_t)mSize);
+	if (mFd != -1)
+		close(mFd);
+	mFd = -1;
+#endif
+	mData = NULL;
+	mSize = 0;
+	mFrameCount = 0;
+}
+
+const RawFrameHeader& CRawFrameReader::FrameHeader(uint64_t i) const
+{
+	return *(const RawFrameHeader*)Record(i);
+}
+
+uint64_t CRawFrameReader::FindFrame(uint32_t capTimeMs) const
+{ //capTimeMs only grows through a file, so the records are searched in place without reading the rest
+	uint64_t first = 0;
+	uint64_t last = mFrameCount;
+	uint64_t middle;
+
+	while (first < last) {
+		middle = first + (last - first)/2;
+		if (FrameHeader(middle).capTimeMs < capTimeMs)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+	return first;
+}
+
+cv::Mat CRawFrameReader::Frame(uint64_t i) const
+{
+	int depth = Header().bitDepth > 8 ? CV_16U : CV_8U;
+
+	if (Header().packing != RAW_PACK_NONE)
+		return cv::Mat();
+	return cv::Mat(Header().height, Header().width, CV_MAKETYPE(depth, Header().channels), (void*)(Record(i) + RAW_FRAME_HEADER_SIZE));
+}
+
+bool CRawFrameReader::ReadFrame(uint64_t i, cv::Mat& frame) const
+{
+	if (i >= mFrameCount)
+		return false;
+	if (Header().packing == RAW_PACK_NONE) {
+		frame = Frame(i);
+		return true;
+	}
+	if (Header().packing != RAW_PACK_MIPI)
+		return false;
+	frame.create(Header().height, Header().width, CV_16UC1);
+	UnpackMIPI(Record(i) + RAW_FRAME_HEADER_SIZE, (uint16_t*)frame.data, frame.total(), Header().bitDepth);
+	return true;
+}
+
+bool CStripedRawReader::Open(const std::string& fileName)
+{ //Parts are merged by the frameNumber of their records, which the writer counts over the whole recording
+	FILE* manifest;
+	char line[1024];
+	char* path;
+	size_t end;
+	unsigned file;
+	unsigned lane;
+	int used;
+	std::string folder;
+	std::string name;
+
+	Close();
+	mLastError.clear();
+	manifest = fopen(fileName.c_str(), "rb");
+	if (manifest == NULL) {
+		mLastError = "open " + fileName + ": " + SystemError();
+		return false;
+	}
+	if (fgets(line, sizeof line, manifest) == NULL || strncmp(line, kStripeMagic, sizeof kStripeMagic - 1) != 0) {
+		fclose(manifest);
+		if (!OpenPart(fileName, ""))
+			return false;
+	}
+	else {
+		end = fileName.find_last_of("\\/");
+		folder = end == std::string::npos ? "" : fileName.substr(0, end + 1);
+		while (fgets(line, sizeof line, manifest) != NULL) {
+			if (sscanf(line, "part %u %u %n", &file, &lane, &used) != 2)
+				continue;
+			path = line + used;
+			path[strcspn(path, "\r\n")] = 0;
+			name = path;
+			end = name.find_last_of("\\/");
+			if (!OpenPart(name, folder + (end == std::string::npos ? name : name.substr(end + 1)))) {
+				fclose(manifest);
+				Close();
+				return false;
+			}
+		}
+		fclose(manifest);
+		if (mParts.empty()) {
+			mLastError = fileName + " lists no parts";
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < mParts.size(); i++) {
+		const RawFileHeader& header = mParts[i]->Header();
+		if (header.width != Header().width || header.height != Header().height || header.bitDepth != Header().bitDepth
+			|| header.channels != Header().channels || header.packing != Header().packing) {
+			mLastError = mPartNames[i] + " does not match the first part's frames";
+			Close();
+			return false;
+		}
+		for (uint64_t j = 0; j < mParts[i]->FrameCount(); j++) {
+			Entry entry;
+			entry.frameNumber = mParts[i]->FrameHeader(j).frameNumber;
+			entry.part = (uint32_t)i;
+			entry.record = j;
+			mOrder.push_back(entry);
+		}
+	}
+	std::sort(mOrder.begin(), mOrder.end(), EarlierFrame);
+	return true;
+}
+
+bool CStripedRawReader::EarlierFrame(const Entry& a, const Entry& b)
+{
+	if (a.frameNumber != b.frameNumber)
+		return a.frameNumber < b.frameNumber;
+	return a.part < b.part;
+}
+
+bool CStripedRawReader::OpenPart(const std::string& fileName, const std::string& fallback)
+{
+	CRawFrameReader* part = new CRawFrameReader;
+
+	if (part->Open(fileName))
+		mPartNames.push_back(fileName);
+	else if (!fallback.empty() && part->Open(fallback))
+		mPartNames.push_back(fallback);
+	else {
+		mLastError = part->LastError();
+		delete part;
+		return false;
+	}
+	mParts.push_back(part);
+	return true;
+}
+
+void CStripedRawReader::Close()
+{
+	for (size_t i = 0; i < mParts.size(); i++)
+		delete mParts[i];
+	mParts.clear();
+	mPartNames.clear();
+	mOrder.clear();
+}
+
+bool CStripedRawReader::IsComplete() const
+{
+	for (size_t i = 0; i < mParts.size(); i++) {
+		if (!mParts[i]->IsComplete())
+			return false;
+	}
+	return !mParts.empty();
+}
+
+const RawFrameHeader& CStripedRawReader::FrameHeader(uint64_t i) const
+{
+	return mParts[mOrder[(size_t)i].part]->FrameHeader(mOrder[(size_t)i].record);
+}
+
+uint64_t CStripedRawReader::FindFrame(uint32_t capTimeMs) const
+{
+	uint64_t first = 0;
+	uint64_t last = mOrder.size();
+	uint64_t middle;
+
+	while (first < last) {
+		middle = first + (last - first)/2;
+		if (FrameHeader(middle).capTimeMs < capTimeMs)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+	return first;
+}
+
+cv::Mat CStripedRawReader::Frame(uint64_t i) const
+{
+	return mParts[mOrder[(size_t)i].part]->Frame(mOrder[(size_t)i].record);
+}
+
+bool CStripedRawReader::ReadFrame(uint64_t i, cv::Mat& frame) const
+{
+	if (i >= mOrder.size())
+		return false;
+	return mParts[mOrder[(size_t)i].part]->ReadFrame(mOrder[(size_t)i].record, frame);
+}
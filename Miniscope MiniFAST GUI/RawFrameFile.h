@@ -0,0 +1,287 @@
+// RawFrameFile.h : indexed raw frame container, written unbuffered and read through mmap
+//
+// For the 500-700 fps modes no codec sits between the queue and the disk. A .msraw file is
+//
+//	RawFileHeader				RAW_ALIGN bytes
+//	record 0 .. frameCount-1	recordSize bytes each: RawFrameHeader, the pixels, zero padding
+//	RawIndexHeader, entries		padded to RAW_ALIGN, at indexOffset
+//
+// Everything is little endian and starts on a RAW_ALIGN boundary, so records go to disk in
+// large unbuffered writes (FILE_FLAG_NO_BUFFERING, O_DIRECT) straight from an aligned staging
+// buffer, and frame i is at headerSize + i*recordSize for anything that maps the file, e.g.
+//
+//	rec = numpy.memmap(name, numpy.uint8, 'r', headerSize, (frameCount, recordSize))
+//	frames = rec[:, RAW_FRAME_HEADER_SIZE:RAW_FRAME_HEADER_SIZE + frameBytes].reshape(frameCount, height, width)
+//
+// 10 and 12 bit samples are either 16 bit words or, with packing RAW_PACK_MIPI, packed like
+// CSI-2 RAW10 / RAW12 over the whole frame, see SamplePack.h.
+//
+// A file whose recording was cut short has indexOffset 0 and no index, CRawFrameReader then
+// counts the records that carry RAW_FRAME_MAGIC. Builds on Windows and Linux.
+//
+// On Linux the writer can hand its staging buffers to io_uring instead of calling pwrite(),
+// see RAW_WRITE_URING. The file is the same either way.
+//
+// A striped recording spreads every file over several volumes as parts, one ordinary .msraw
+// per volume, see StripedRawWriter.h. Its folder holds <name>.msstripe, a text manifest with
+//
+//	msstripe 1
+//	stripe <frames>						frames that go to one part before the next part's turn
+//	part <file> <lane> <path>			one line per part, in the order they were created
+//
+// The parts' records carry the recording's frameNumber, so CStripedRawReader merges them by
+// it and needs nothing else from the manifest. A path that no longer opens is looked for next
+// to the manifest, so the parts can be gathered into one folder later.
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "opencv2/core.hpp"
+
+#define RAW_ALIGN 4096				// page and sector size every write is a multiple of
+#define RAW_VERSION 1
+#define RAW_FRAME_HEADER_SIZE 64
+#define RAW_FRAME_MAGIC 0x5246534D	// "MSFR"
+#define RAW_STAGE_BYTES (4*1048576)	// records collected before each write
+#define RAW_URING_STAGES 4			// staging buffers with RAW_WRITE_URING, all but one can be in flight
+
+// How CRawFrameWriter gets its staging buffers to disk
+enum RawWriteMode {
+	RAW_WRITE_DIRECT = 0,		// unbuffered, the writer waits for each write
+	RAW_WRITE_BUFFERED,			// through the OS file cache
+	RAW_WRITE_URING,			// Linux: unbuffered, submitted through io_uring while the next buffer fills
+	RAW_WRITE_MODE_COUNT
+};
+
+enum RawPacking {
+	RAW_PACK_NONE = 0,			// one or two bytes per sample
+	RAW_PACK_MIPI,				// 10 or 12 bit gray, 1.25 or 1.5 bytes per sample
+};
+
+struct RawFileHeader {
+	char magic[8];				// "MSRAWFR1"
+	uint32_t version;
+	uint32_t headerSize;		// where record 0 starts, RAW_ALIGN
+	uint32_t width;
+	uint32_t height;
+	uint32_t bitDepth;			// per sample
+	uint32_t channels;			// 1 gray, 3 BGR
+	uint32_t frameBytes;		// pixels of one frame, rows without padding, packed if packing says so
+	uint32_t recordSize;		// RAW_FRAME_HEADER_SIZE + frameBytes rounded up to RAW_ALIGN
+	uint32_t device;			// camNum column of timestamp.dat
+	uint32_t firmwareFPS;		// frame rate mode the scope was set to, 0 if it was not set
+	uint32_t firmwareWindow;	// window position mode, 0 if it was not set
+	uint32_t packing;			// RawPacking
+	uint64_t frameCount;		// records in the file, 0 until the file is closed
+	uint64_t indexOffset;		// 0 until the file is closed
+	uint64_t tickFrequency;		// of hostTicks, per second
+	uint64_t startTicks;		// hostTicks when the recording started, capTimeMs counts from here
+	uint64_t createdUs;			// wall clock when the file was created, us since 1970 UTC
+	char name[32];				// source, e.g. msCam
+	uint32_t rateMilliHz;		// nominal frame rate in 1/1000 fps, 0 if unknown. Each record has its own time.
+	uint8_t reserved[124];
+};
+
+struct RawFrameHeader {
+	uint32_t magic;				// RAW_FRAME_MAGIC
+	uint32_t frameNumber;		// frameCount column of timestamp.dat, from 1 over all files of a recording
+	uint32_t captureFrame;		// frameNum of droppedFrames.dat, gaps are frames the queue dropped
+	uint32_t capTimeMs;			// time column of timestamp.dat
+	uint64_t hostTicks;			// when the frame was grabbed
+	uint64_t deviceTimestamp;	// the camera's own clock if it sends one, else 0
+	uint32_t reserved[8];
+};
+
+struct RawIndexHeader {
+	char magic[8];				// "MSRAWIDX"
+	uint64_t count;
+	uint32_t entrySize;
+	uint32_t reserved[3];
+};
+
+struct RawIndexEntry {
+	uint64_t offset;			// of the record
+	uint64_t hostTicks;
+	uint32_t frameNumber;
+	uint32_t captureFrame;
+	uint32_t capTimeMs;
+	uint32_t reserved;
+};
+
+class CRawUring;
+
+// Appends frames to a preallocated file through an aligned staging buffer, bypassing the
+// OS file cache. One thread at a time.
+//
+// With RAW_WRITE_URING the staging buffers are registered with the ring once per file. A full
+// buffer is submitted and Write() carries on in the next free one, so a write that stalls in
+// the filesystem, e.g. behind a journal commit, only stalls the writer once every buffer is
+// in flight. A buffer is reused only after the kernel reported its write complete.
+class CRawFrameWriter
+{
+public:
+	CRawFrameWriter();
+	~CRawFrameWriter() { Close(); }
+
+	// header gives the geometry, source and clock, the rest is filled in. Space for
+	// preallocateFrames records is reserved up front so the file does not fragment.
+	// RAW_WRITE_URING falls back to RAW_WRITE_DIRECT where io_uring is not available.
+	bool Open(const std::string& fileName, const RawFileHeader& header, uint32_t preallocateFrames,
+		RawWriteMode mode = RAW_WRITE_DIRECT);
+	// pixels must match the header's geometry, except that BGR goes to a gray file as gray.
+	// A packed file takes CV_16UC1 samples and packs them.
+	bool Write(const RawFrameHeader& frame, const cv::Mat& pixels);
+	// Writes what is staged, the index and the final header
+	bool Close();
+	bool IsOpened() const;
+
+	uint64_t FramesWritten() const { return mIndex.size(); }
+	uint64_t BytesWritten() const { return mOffset + mStageUsed; }
+	// What each Write() adds to the file, once it is open
+	uint32_t RecordSize() const { return mHeader.recordSize; }
+	// Unbuffered I/O was not available, e.g. on tmpfs, and the file went through the cache
+	bool IsBuffered() const { return mBuffered; }
+	// What the open file is written with
+	RawWriteMode Mode() const { return mMode; }
+	const std::string& LastError() const { return mLastError; }
+
+	static const char* ModeName(RawWriteMode mode);
+	// Whether this build and kernel can write with mode
+	static bool IsModeAvailable(RawWriteMode mode);
+
+private:
+	CRawFrameWriter(const CRawFrameWriter&);
+	CRawFrameWriter& operator=(const CRawFrameWriter&);
+
+	struct Stage {
+		uint8_t* data;
+		uint64_t offset;		// in the file, while in flight
+		size_t bytes;
+		bool busy;				// submitted and not completed yet
+	};
+
+	bool Flush();
+	bool WriteAt(uint64_t offset, const void* data, size_t bytes);
+	bool Fail(const std::string& what);
+	// Makes mStage a buffer that is not in flight, waiting for a completion if there is none
+	bool NextStage();
+	// Takes the completions the ring has, or waits for at least one
+	bool Reap(bool wait);
+	// Waits for every write in flight
+	bool Drain();
+	void ReleaseStages();
+
+#ifdef _WIN32
+	void* mFile;				// HANDLE
+#else
+	int mFd;
+	CRawUring* mRing;			// RAW_WRITE_URING
+#endif
+	RawFileHeader mHeader;
+	RawWriteMode mMode;
+	uint8_t* mBlock;			// every staging buffer, RAW_ALIGN aligned
+	std::vector<Stage> mStages;
+	size_t mCurrent;			// the stage being filled
+	uint8_t* mStage;			// its data
+	size_t mStageSize;			// whole records
+	size_t mStageUsed;
+	uint64_t mOffset;			// file position of the stage
+	std::vector<RawIndexEntry> mIndex;
+	cv::Mat mGray;
+	cv::Mat mSamples;			// continuous copy of a cropped frame that is packed
+	bool mBuffered;
+	std::string mLastError;
+};
+
+// Maps a .msraw file read only. Frames are headers over the mapping, nothing is copied.
+class CRawFrameReader
+{
+public:
+	CRawFrameReader();
+	~CRawFrameReader() { Close(); }
+
+	bool Open(const std::string& fileName);
+	void Close();
+	bool IsOpened() const { return mData != NULL; }
+
+	const RawFileHeader& Header() const { return *(const RawFileHeader*)mData; }
+	// From the index, or the run of intact records of a file that was not closed
+	uint64_t FrameCount() const { return mFrameCount; }
+	// Whether the file was closed and carries its index
+	bool IsComplete() const { return Header().indexOffset != 0; }
+	const RawFrameHeader& FrameHeader(uint64_t i) const;
+	// First frame grabbed at or after capTimeMs, FrameCount() if none was
+	uint64_t FindFrame(uint32_t capTimeMs) const;
+	// CV_8UC1, CV_8UC3 or CV_16UC1, valid while the reader is open. Empty for a packed file.
+	cv::Mat Frame(uint64_t i) const;
+	// Frame(), or for a packed file the samples unpacked into frame
+	bool ReadFrame(uint64_t i, cv::Mat& frame) const;
+	const std::string& LastError() const { return mLastError; }
+
+private:
+	CRawFrameReader(const CRawFrameReader&);
+	CRawFrameReader& operator=(const CRawFrameReader&);
+
+	const uint8_t* Record(uint64_t i) const { return mData + Header().headerSize + i*Header().recordSize; }
+
+#ifdef _WIN32
+	void* mFile;
+	void* mMapping;
+#else
+	int mFd;
+#endif
+	const uint8_t* mData;
+	uint64_t mSize;
+	uint64_t mFrameCount;
+	std::string mLastError;
+};
+
+// Maps every part of a striped recording, from its .msstripe manifest, and reads them as one
+// stream in frameNumber order. A plain .msraw opens as a recording of one part.
+class CStripedRawReader
+{
+public:
+	CStripedRawReader() {}
+	~CStripedRawReader() { Close(); }
+
+	bool Open(const std::string& fileName);
+	void Close();
+	bool IsOpened() const { return !mParts.empty(); }
+
+	size_t PartCount() const { return mParts.size(); }
+	const CRawFrameReader& Part(size_t i) const { return *mParts[i]; }
+	// Where the part was found, which is not the manifest's path if it was moved
+	const std::string& PartName(size_t i) const { return mPartNames[i]; }
+	// Geometry, source and clock, the same in every part
+	const RawFileHeader& Header() const { return mParts[0]->Header(); }
+	// Over all parts. Parts that were not closed contribute their intact records.
+	uint64_t FrameCount() const { return mOrder.size(); }
+	// Whether every part was closed and carries its index
+	bool IsComplete() const;
+	const RawFrameHeader& FrameHeader(uint64_t i) const;
+	// First frame grabbed at or after capTimeMs, FrameCount() if none was
+	uint64_t FindFrame(uint32_t capTimeMs) const;
+	// As CRawFrameReader's, frame i of the whole recording
+	cv::Mat Frame(uint64_t i) const;
+	bool ReadFrame(uint64_t i, cv::Mat& frame) const;
+	const std::string& LastError() const { return mLastError; }
+
+private:
+	CStripedRawReader(const CStripedRawReader&);
+	CStripedRawReader& operator=(const CStripedRawReader&);
+
+	struct Entry {
+		uint32_t frameNumber;
+		uint32_t part;
+		uint64_t record;
+	};
+
+	static bool EarlierFrame(const Entry& a, const Entry& b);
+	bool OpenPart(const std::string& fileName, const std::string& fallback);
+
+	std::vector<CRawFrameReader*> mParts;
+	std::vector<std::string> mPartNames;
+	std::vector<Entry> mOrder;
+	std::string mLastError;
+};
@@ -0,0 +1,104 @@
+// SamplePack.cpp : 10 and 12 bit samples as the scope streams them and raw files store them
+//
+// Builds on Windows and Linux, so it does not use the precompiled MFC header.
+
+#include "SamplePack.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define SAMPLE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Pixels per MIPI group, the group is that many MSB bytes and one byte of LSBs
+int GroupPixels(int bits)
+{
+	return bits == 10 ? 4 : 2;
+}
+
+} // namespace
+
+size_t MIPIPackedBytes(size_t samples, int bits)
+{
+	size_t group = GroupPixels(bits);
+	return (samples + group - 1)/group*(group + 1);
+}
+
+void UnpackWords(const uint8_t* src, uint16_t* dst, size_t samples, int bits)
+{
+	const int shift = 16 - bits;
+	size_t i = 0;
+
+#ifdef SAMPLE_SSE2
+	// The pairs are big endian, swap the bytes of each 16 bit lane and shift the padding out
+	const __m128i count = _mm_cvtsi32_si128(shift);
+	for (; i + 8 <= samples; i += 8) {
+		__m128i w = _mm_loadu_si128((const __m128i*)(src + 2*i));
+		w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_srl_epi16(w, count));
+	}
+#endif
+	for (; i < samples; i++)
+		dst[i] = (uint16_t)(((src[2*i] << 8) | src[2*i + 1]) >> shift);
+}
+
+void UnpackMIPI(const uint8_t* src, uint16_t* dst, size_t samples, int bits)
+{
+	const int group = GroupPixels(bits);
+	const int low = bits - 8;
+	const int mask = (1 << low) - 1;
+
+	for (size_t i = 0; i < samples; i += group, src += group + 1) {
+		int lsb = src[group];
+		for (int k = 0; k < group && i + k < samples; k++)
+			dst[i + k] = (uint16_t)((src[k] << low) | ((lsb >> (k*low)) & mask));
+	}
+}
+
+void PackMIPI(const uint16_t* src, uint8_t* dst, size_t samples, int bits)
+{
+	const int group = GroupPixels(bits);
+	const int low = bits - 8;
+	const int mask = (1 << low) - 1;
+
+	for (size_t i = 0; i < samples; i += group, dst += group + 1) {
+		int lsb = 0;
+		for (int k = 0; k < group; k++) {
+			int value = i + k < samples ? src[i + k] : 0;
+			dst[k] = (uint8_t)(value >> low);
+			lsb |= (value & mask) << (k*low);
+		}
+		dst[group] = (uint8_t)lsb;
+	}
+}
+
+bool UnpackSamples(const cv::Mat& raw, cv::Mat& frame, int rows, int cols, int bits)
+{
+	size_t samples = (size_t)rows*cols;
+	size_t bytes = raw.total()*raw.elemSize();
+	bool words = bytes == 2*samples;
+
+	if (bits <= 8 || bits > MAX_SAMPLE_BITS || raw.empty() || raw.depth() != CV_8U || !raw.isContinuous())
+		return false;
+	if (!words && !((bits == 10 || bits == 12) && bytes == MIPIPackedBytes(samples, bits)))
+		return false;
+	frame.create(rows, cols, CV_16UC1);
+	if (frame.isContinuous()) {
+		if (words)
+			UnpackWords(raw.data, (uint16_t*)frame.data, samples, bits);
+		else
+			UnpackMIPI(raw.data, (uint16_t*)frame.data, samples, bits);
+		return true;
+	}
+	// Padded rows, MIPI groups then have to end with the row
+	if (!words && cols % GroupPixels(bits) != 0)
+		return false;
+	for (int row = 0; row < rows; row++) {
+		if (words)
+			UnpackWords(raw.data + (size_t)row*cols*2, frame.ptr<uint16_t>(row), cols, bits);
+		else
+			UnpackMIPI(raw.data + MIPIPackedBytes((size_t)row*cols, bits), frame.ptr<uint16_t>(row), cols, bits);
+	}
+	return true;
+}
@@ -0,0 +1,36 @@
+// SamplePack.h : 10 and 12 bit samples as the scope streams them and raw files store them
+//
+// With the sensor at its native bit depth (Scope\BitDepth) samples come in one of two layouts:
+//
+//	words	two bytes per pixel, the 8 most significant bits first and the remaining bits at the
+//			top of the second byte, in the slots of a YUY2 stream, so the Y bytes alone are the
+//			8 bit image and USB carries what it carried at 8 bits. The synthetic inputs send this.
+//			The scope's firmware does not: its GPIF carries 8 bits a pixel, and the second byte
+//			is chroma.
+//	MIPI	CSI-2 RAW10 / RAW12 packing: for each group of 4 (RAW10) or 2 (RAW12) pixels their 8
+//			most significant bits, then one byte with the rest of the group, first pixel in the
+//			lowest bits. 1.25 or 1.5 bytes per pixel, used by .msraw files.
+//
+// Unpacked frames are CV_16UC1 holding the sample values, 0 .. 2^bits - 1. Builds on Windows and Linux.
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "opencv2/core.hpp"
+
+#define MAX_SAMPLE_BITS 16
+
+// Bytes samples pixels take MIPI packed, a last partial group padded. bits is 10 or 12.
+size_t MIPIPackedBytes(size_t samples, int bits);
+
+void UnpackWords(const uint8_t* src, uint16_t* dst, size_t samples, int bits);
+void UnpackMIPI(const uint8_t* src, uint16_t* dst, size_t samples, int bits);
+// Samples above 2^bits - 1 lose their high bits
+void PackMIPI(const uint16_t* src, uint8_t* dst, size_t samples, int bits);
+
+// Fills frame with the rows x cols samples in raw, as the capture backend returns them with RGB
+// conversion off. The layout follows from the size: 2*rows*cols bytes are words, MIPIPackedBytes()
+// are MIPI packed. Words are the size of 8 bit YUY2, so only call this for an input known to send
+// samples. frame is only reallocated if it is not rows x cols CV_16UC1. Returns false if
+// raw holds neither or bits is not 9 .. MAX_SAMPLE_BITS.
+bool UnpackSamples(const cv::Mat& raw, cv::Mat& frame, int rows, int cols, int bits);
@@ -0,0 +1,200 @@
+// StripedRawWriter.cpp : one RAW file of a recording spread over several volumes
+//
+
+#include "stdafx.h"
+#include "StripedRawWriter.h"
+#include "PipelineTrace.h"
+#include "WorkerThread.h"
+
+CStripedRawWriter::CStripedRawWriter()
+	: mStripeFrames(1)
+	, mTurn(0)
+	, mInStripe(0)
+	, mBytes(0)
+	, mOpened(false)
+{
+}
+
+CStripedRawWriter::~CStripedRawWriter()
+{
+	Close();
+	for (size_t i = 0; i < mLanes.size(); i++)
+		delete mLanes[i];
+}
+
+void CStripedRawWriter::Init(UINT lanes, UINT stripeFrames, LPCTSTR traceName)
+{
+	for (size_t i = 0; i < mLanes.size(); i++)
+		delete mLanes[i];
+	mLanes.clear();
+	mStripeFrames = max(stripeFrames, 1U);
+	for (UINT i = 0; i < lanes; i++) {
+		Lane* lane = new Lane;
+		// Two stripes, so a lane still has one to write while the writer fills the next
+		lane->queue.Init(2*mStripeFrames);
+		lane->thread = NULL;
+		lane->stop = false;
+		lane->failed = false;
+		lane->traceName.Format(L"%s stripe %u", traceName, i);
+		mLanes.push_back(lane);
+	}
+}
+
+UINT CStripedRawWriter::SlotCount() const
+{
+	return mLanes.empty() ? 0 : (UINT)mLanes.size()*mLanes[0]->queue.SlotCount();
+}
+
+StripeFrame& CStripedRawWriter::Slot(UINT i)
+{
+	UINT perLane = mLanes[0]->queue.SlotCount();
+
+	return mLanes[i/perLane]->queue.Slot(i%perLane);
+}
+
+bool CStripedRawWriter::Open(const std::vector<std::string>& fileNames, const RawFileHeader& header, uint32_t preallocateFrames,
+	RawWriteMode mode)
+{ //Every part is created before any thread starts, so a volume that is missing fails the whole file
+	Close();
+	mLastError.clear();
+	if (mLanes.empty() || fileNames.size() != mLanes.size()) {
+		mLastError = "one file name per stripe folder needed";
+		return false;
+	}
+	mBytes = 0;
+	for (size_t i = 0; i < mLanes.size(); i++) {
+		if (!mLanes[i]->writer.Open(fileNames[i], header, preallocateFrames/(uint32_t)mLanes.size() + mStripeFrames, mode)) {
+			mLastError = mLanes[i]->writer.LastError();
+			for (size_t j = 0; j < i; j++) {
+				mLanes[j]->writer.Close();
+				DeleteFileA(fileNames[j].c_str());
+			}
+			return false;
+		}
+		mBytes += mLanes[i]->writer.BytesWritten();
+	}
+	for (size_t i = 0; i < mLanes.size(); i++) {
+		mLanes[i]->stop = false;
+		mLanes[i]->failed = false;
+		mLanes[i]->error.clear();
+		mLanes[i]->thread = StartThread(LaneThread, (LPVOID)mLanes[i], THREAD_PRIORITY_HIGHEST);
+	}
+	mTurn = 0;
+	mInStripe = 0;
+	mOpened = true;
+	return true;
+}
+
+bool CStripedRawWriter::Write(const RawFrameHeader& header, cv::Mat& frame, const cv::Rect& roi, bool keep)
+{
+	Lane* lane;
+	StripeFrame* slot;
+
+	if (!mOpened || LaneFailed())
+		return false;
+	lane = mLanes[mTurn];
+	while ((slot = lane->queue.BeginWrite()) == NULL) {
+		if (LaneFailed())
+			return false;
+		lane->spaceSignal.PrepareWait();
+		if (lane->queue.BeginWrite() == NULL)
+			lane->spaceSignal.Wait(WRITER_IDLE_TIMEOUT);
+		else
+			lane->spaceSignal.CancelWait();
+	}
+	if (keep)
+		frame.copyTo(slot->frame);
+	else
+		cv::swap(slot->frame, frame);
+	slot->roi = roi;
+	slot->header = header;
+	lane->queue.CommitWrite();
+	lane->dataSignal.Notify(lane->queue.Size());
+	mBytes += lane->writer.RecordSize();
+	if (++mInStripe == mStripeFrames) {
+		mInStripe = 0;
+		mTurn = (mTurn + 1) % mLanes.size();
+	}
+	return true;
+}
+
+bool CStripedRawWriter::Close()
+{ //Each lane closes its own part as its last act, so the volumes write their indexes at the same time
+	bool ok;
+
+	if (!mOpened)
+		return true;
+	for (size_t i = 0; i < mLanes.size(); i++) {
+		mLanes[i]->stop = true;
+		mLanes[i]->dataSignal.Wake();
+	}
+	for (size_t i = 0; i < mLanes.size(); i++)
+		JoinThread(mLanes[i]->thread);
+	ok = !LaneFailed();
+	mOpened = false;
+	return ok;
+}
+
+RawWriteMode CStripedRawWriter::Mode() const
+{
+	return mLanes.empty() ? RAW_WRITE_DIRECT : mLanes[0]->writer.Mode();
+}
+
+bool CStripedRawWriter::IsBuffered() const
+{
+	for (size_t i = 0; i < mLanes.size(); i++) {
+		if (mLanes[i]->writer.IsBuffered())
+			return true;
+	}
+	return false;
+}
+
+bool CStripedRawWriter::LaneFailed()
+{
+	for (size_t i = 0; i < mLanes.size(); i++) {
+		if (mLanes[i]->failed) {
+			if (mLastError.empty())
+				mLastError = mLanes[i]->error;
+			return true;
+		}
+	}
+	return false;
+}
+
+UINT CStripedRawWriter::LaneThread(LPVOID pParam)
+{ //After a failed write the lane keeps taking frames off its queue, so the writer never waits on it
+	Lane* lane = (Lane*)pParam;
+	StripeFrame* slot;
+	LONGLONG traceBegin;
+	bool stop;
+
+	TraceThreadName(lane->traceName);
+	while (1) {
+		// Read first, so every frame committed before Close() set it is seen below
+		stop = lane->stop;
+		slot = lane->queue.Front();
+		if (slot != NULL) {
+			traceBegin = TraceNow();
+			if (!lane->failed && !lane->writer.Write(slot->header, slot->roi.area() > 0 ? slot->frame(slot->roi) : slot->frame)) {
+				lane->error = lane->writer.LastError();
+				lane->failed = true;
+			}
+			TraceSpan("write part", traceBegin, slot->header.captureFrame);
+			lane->queue.Pop();
+			lane->spaceSignal.Notify(1);
+			continue;
+		}
+		if (stop)
+			break;
+		lane->dataSignal.PrepareWait();
+		if (!lane->stop && lane->queue.Size() == 0)
+			lane->dataSignal.Wait(WRITER_IDLE_TIMEOUT);
+		else
+			lane->dataSignal.CancelWait();
+	}
+	if (!lane->writer.Close() && !lane->failed) {
+		lane->error = lane->writer.LastError();
+		lane->failed = true;
+	}
+	return 0;
+}
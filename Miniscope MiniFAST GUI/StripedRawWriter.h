@@ -0,0 +1,84 @@
+// StripedRawWriter.h : one RAW file of a recording spread over several volumes
+//
+// With Writer\StripeFolders set, a RAW file is one part per folder, each an ordinary .msraw.
+// The source's writer thread hands the parts stripeFrames frames at a time in turn, and every
+// part has a thread and a queue of its own, so each volume only takes its share of the stream
+// and the volumes write at the same time. Frames change hands by swapping buffers with the
+// part's queue, which holds pool buffers like the source's queue. See RawFrameFile.h for the
+// manifest that ties the parts together and CStripedRawReader for reading them back.
+
+#pragma once
+#include <string>
+#include <vector>
+#include "FrameQueue.h"
+#include "RawFrameFile.h"
+
+// A frame on its way to a part
+struct StripeFrame {
+	cv::Mat frame;
+	cv::Rect roi;			// part of frame that is written, empty for all of it
+	RawFrameHeader header;
+};
+
+class CStripedRawWriter
+{
+public:
+	CStripedRawWriter();
+	~CStripedRawWriter();
+
+	// Not thread safe, only while closed. Queues 2*stripeFrames frames for each of lanes parts.
+	// Lane i traces as "<traceName> stripe i", a name no other file that is open at the same time uses.
+	void Init(UINT lanes, UINT stripeFrames, LPCTSTR traceName);
+	UINT Lanes() const { return (UINT)mLanes.size(); }
+	// Slots that need a buffer bound, and direct access for binding them. Same rules as Init().
+	UINT SlotCount() const;
+	StripeFrame& Slot(UINT i);
+
+	// One file name per lane. Opens every part and starts its thread. preallocateFrames is
+	// for the whole file, each part reserves its share.
+	bool Open(const std::vector<std::string>& fileNames, const RawFileHeader& header, uint32_t preallocateFrames,
+		RawWriteMode mode = RAW_WRITE_DIRECT);
+	// Writer thread. frame is the whole captured frame, it is exchanged for a written buffer of
+	// the part whose turn it is, or copied with keep. Waits while that part is a queue behind.
+	// False once a part failed, the frames before stay in their parts.
+	bool Write(const RawFrameHeader& header, cv::Mat& frame, const cv::Rect& roi, bool keep);
+	// Waits until every part has written its queue, then closes them
+	bool Close();
+	bool IsOpened() const { return mOpened; }
+
+	// Handed to the parts so far, headers included
+	uint64_t BytesWritten() const { return mBytes; }
+	// Of the first part, all parts are opened alike
+	RawWriteMode Mode() const;
+	// Any part went through the OS file cache
+	bool IsBuffered() const;
+	const std::string& LastError() const { return mLastError; }
+
+private:
+	CStripedRawWriter(const CStripedRawWriter&);
+	CStripedRawWriter& operator=(const CStripedRawWriter&);
+
+	struct Lane {
+		CRawFrameWriter writer;
+		CFrameQueue<StripeFrame> queue;	// writer thread -> lane thread
+		CFrameSignal dataSignal;
+		CFrameSignal spaceSignal;		// lane thread -> writer thread, the queue has room again
+		CWinThread* thread;
+		volatile bool stop;
+		volatile bool failed;
+		std::string error;				// set before failed
+		CString traceName;
+	};
+
+	static UINT LaneThread(LPVOID pParam);
+	// Collects what the lanes reported
+	bool LaneFailed();
+
+	std::vector<Lane*> mLanes;
+	UINT mStripeFrames;
+	UINT mTurn;				// lane the next frame goes to
+	UINT mInStripe;			// frames it got of its stripe
+	uint64_t mBytes;
+	bool mOpened;
+	std::string mLastError;
+};
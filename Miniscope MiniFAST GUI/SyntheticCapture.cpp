@@ -0,0 +1,364 @@
+// SyntheticCapture.cpp : camera free frame sources behind the cv::VideoCapture interface
+//
+
+#include "stdafx.h"
+#include "SyntheticCapture.h"
+#include "opencv2/imgproc.hpp"
+
+CSyntheticCapture::CSyntheticCapture()
+	: mRng(1)
+	, mOpened(false)
+	, mRows(0)
+	, mCols(0)
+	, mFPS(0)
+	, mFrames(0)
+	, mIndex(0)
+	, mRaw(false)
+	, mBits(8)
+{
+	QueryPerformanceFrequency(&mFrequency);
+	mStart.QuadPart = 0;
+}
+
+void CSyntheticCapture::Start(int rows, int cols, double fps, UINT frames, double noise, UINT seed)
+{
+	mRng = cv::RNG(seed);
+	mRows = rows;
+	mCols = cols;
+	mFPS = fps;
+	mFrames = frames;
+	mIndex = 0;
+	for (int i = 0; i < SYNTHETIC_NOISE_FRAMES; i++) {
+		if (noise > 0) {
+			mNoise[i].create(rows, cols, CV_16SC1);
+			mRng.fill(mNoise[i], cv::RNG::NORMAL, 0, noise);
+		}
+		else
+			mNoise[i].release();
+	}
+	FillChroma();
+	mOpened = true;
+}
+
+void CSyntheticCapture::release()
+{
+	mOpened = false;
+	mFrame.release();
+	mOutput.release();
+}
+
+bool CSyntheticCapture::grab()
+{
+	LARGE_INTEGER now;
+	LONGLONG due;
+	LONGLONG wait;
+	double dueSeconds = 0;
+
+	if (mOpened == false || (mFrames != 0 && mIndex >= mFrames))
+		return false;
+	if (!Produce(mIndex, mFrame, dueSeconds))
+		return false;
+	Format();
+
+	QueryPerformanceCounter(&now);
+	if (mIndex == 0)
+		mStart = now;
+	due = mStart.QuadPart + (LONGLONG)(dueSeconds*mFrequency.QuadPart);
+	// Fell far behind, e.g. while the consumer was setting up its buffers. A camera would not
+	// deliver the missed frames in a burst either, so carry on from here.
+	if (now.QuadPart - due > mFrequency.QuadPart/10)
+		mStart.QuadPart += now.QuadPart - due;
+	// Sleep() only has ms resolution, so spin out the last of the wait
+	while (now.QuadPart < due) {
+		wait = 1000*(due - now.QuadPart)/mFrequency.QuadPart;
+		if (wait > 2)
+			Sleep((DWORD)(wait - 1));
+		else
+			SwitchToThread();
+		QueryPerformanceCounter(&now);
+	}
+	mIndex++;
+	return true;
+}
+
+bool CSyntheticCapture::retrieve(cv::OutputArray image, int flag)
+{
+	if (mOutput.empty())
+		return false;
+	mOutput.copyTo(image);
+	return true;
+}
+
+bool CSyntheticCapture::set(int propId, double value)
+{
+	switch (propId) {
+	case CV_CAP_PROP_CONVERT_RGB:
+		mRaw = value == 0;
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool CSyntheticCapture::SetBitDepth(int bits)
+{
+	if (bits != 8 && bits != 10 && bits != 12)
+		return false;
+	mBits = bits;
+	FillChroma();
+	return true;
+}
+
+double CSyntheticCapture::get(int propId)
+{
+	switch (propId) {
+	case CV_CAP_PROP_FRAME_WIDTH:
+		return mCols;
+	case CV_CAP_PROP_FRAME_HEIGHT:
+		return mRows;
+	case CV_CAP_PROP_FPS:
+		return mFPS;
+	case CV_CAP_PROP_CONVERT_RGB:
+		return mRaw ? 0 : 1;
+	default:
+		return 0;
+	}
+}
+
+void CSyntheticCapture::Format()
+{ //Puts the produced frame in the layout a camera would deliver
+	if (mRaw == true) {
+		if (mFrame.channels() == 3)
+			cv::cvtColor(mFrame, mGray, CV_BGR2GRAY);
+		else
+			mGray = mFrame;
+		cv::Mat planes[2] = {mGray, mChroma};
+		cv::merge(planes, 2, mOutput);
+	}
+	else if (mFrame.channels() == 1)
+		cv::cvtColor(mFrame, mOutput, CV_GRAY2BGR);
+	else
+		mOutput = mFrame;
+}
+
+void CSyntheticCapture::FillChroma()
+{ //The picture stays in the 8 most significant bits, below them is noise the 8 bit frames do not have
+	if (mBits > 8 && mRows > 0) {
+		mChroma.create(mRows, mCols, CV_8UC1);
+		mRng.fill(mChroma, cv::RNG::UNIFORM, 0, 256);
+		cv::bitwise_and(mChroma, cv::Scalar((0xFF << (16 - mBits)) & 0xFF), mChroma);
+	}
+	else
+		mChroma = cv::Mat(mRows, mCols, CV_8UC1, cv::Scalar(128));
+}
+
+void CSyntheticCapture::AddNoise(UINT index, cv::Mat& frame)
+{
+	const cv::Mat& noise = mNoise[index%SYNTHETIC_NOISE_FRAMES];
+
+	if (!noise.empty())
+		cv::add(frame, noise, frame, cv::noArray(), CV_8U);
+}
+
+void CSyntheticCapture::Stamp(UINT index, cv::Mat& frame)
+{
+	if (frame.isContinuous() && frame.total()*frame.elemSize() >= sizeof(index))
+		memcpy(frame.data, &index, sizeof(index));
+}
+
+bool CPatternCapture::Open(int rows, int cols, double fps, double noise, UINT frames, UINT seed)
+{
+	if (rows < 1 || cols < 2 || (cols & 1) != 0)
+		return false;
+	Start(rows, cols, fps, frames, noise, seed);
+	return true;
+}
+
+bool CPatternCapture::Produce(UINT index, cv::Mat& frame, double& due)
+{
+	uchar* p;
+
+	frame.create(mRows, mCols, CV_8UC1);
+	for (int row = 0; row < mRows; row++) {
+		p = frame.ptr(row);
+		for (int col = 0; col < mCols; col++)
+			p[col] = (uchar)(row + col + index);
+	}
+	AddNoise(index, frame);
+	Stamp(index, frame);
+	due = index*Interval();
+	return true;
+}
+
+bool CCalciumPhantom::Open(int rows, int cols, double fps, int cells, double noise, UINT frames, UINT seed)
+{
+	const int margin = 3*PHANTOM_MAX_RADIUS + 1;
+	double cx = cols/2.0;
+	double cy = rows/2.0;
+	double radius;
+	double brightness;
+	int half;
+	float* p;
+
+	if ((cols & 1) != 0 || rows <= 2*margin || cols <= 2*margin || cells < 0)
+		return false;
+	Start(rows, cols, fps, frames, noise, seed);
+
+	// Uneven illumination that falls off towards the edge of the GRIN lens
+	mBackground.create(rows, cols, CV_32FC1);
+	for (int row = 0; row < rows; row++) {
+		p = mBackground.ptr<float>(row);
+		for (int col = 0; col < cols; col++)
+			p[col] = (float)(30 + 40*(1 - ((col - cx)*(col - cx) + (row - cy)*(row - cy))/(cx*cx + cy*cy)));
+	}
+
+	mCells.resize(cells);
+	for (int i = 0; i < cells; i++) {
+		Cell& cell = mCells[i];
+		radius = mRng.uniform(PHANTOM_MAX_RADIUS/2.0, (double)PHANTOM_MAX_RADIUS);
+		brightness = mRng.uniform(60.0, 150.0);
+		half = (int)(3*radius);
+		cell.box = cv::Rect(mRng.uniform(margin, cols - margin) - half, mRng.uniform(margin, rows - margin) - half, 2*half + 1, 2*half + 1);
+		cell.kernel.create(2*half + 1, 2*half + 1, CV_32FC1);
+		for (int y = -half; y <= half; y++) {
+			p = cell.kernel.ptr<float>(y + half);
+			for (int x = -half; x <= half; x++)
+				p[x + half] = (float)(brightness*exp(-(x*x + y*y)/(2*radius*radius)));
+		}
+		cell.calcium = 0;
+	}
+	// A paced phantom decays per frame interval, an unpaced one as if it ran at 30 fps
+	mDecay = exp(-(fps > 0 ? 1/fps : 1/30.0)/PHANTOM_TAU);
+	mSpikeChance = PHANTOM_SPIKE_RATE*(fps > 0 ? 1/fps : 1/30.0);
+	return true;
+}
+
+bool CCalciumPhantom::Produce(UINT index, cv::Mat& frame, double& due)
+{
+	mBackground.copyTo(mAccum);
+	for (size_t i = 0; i < mCells.size(); i++) {
+		Cell& cell = mCells[i];
+		cell.calcium *= mDecay;
+		if (mRng.uniform(0.0, 1.0) < mSpikeChance)
+			cell.calcium += 1;
+		if (cell.calcium > 0.01) {
+			cv::Mat target = mAccum(cell.box);
+			cv::scaleAdd(cell.kernel, cell.calcium, target, target);
+		}
+	}
+	mAccum.convertTo(frame, CV_8U);
+	AddNoise(index, frame);
+	Stamp(index, frame);
+	due = index*Interval();
+	return true;
+}
+
+bool CReplayCapture::Open(const std::string& prefix, int camNum, double speed)
+{
+	cv::Mat first;
+
+	release();
+	mPrefix = prefix;
+	mSpeed = speed;
+	if (!OpenPart(1) || !mVideo.read(first))
+		return false;
+	// Rewind to the first frame again
+	if (!OpenPart(1))
+		return false;
+	LoadTimes(prefix, camNum);
+	Start(first.rows, first.cols, mVideo.get(CV_CAP_PROP_FPS), 0, 0, 1);
+	return true;
+}
+
+void CReplayCapture::release()
+{
+	mVideo.release();
+	CSyntheticCapture::release();
+}
+
+bool CReplayCapture::OpenPart(int part)
+{
+	mVideo.release();
+	mPart = part;
+	return mVideo.open(mPrefix + std::to_string(part) + ".avi");
+}
+
+void CReplayCapture::LoadTimes(const std::string& prefix, int camNum)
+{ //Frame times of camNum from the timestamp.dat in the prefix's folder. Missing or unreadable
+  //times leave the replay paced by the video's frame rate.
+	std::string folder;
+	size_t slash = prefix.find_last_of("\\/");
+	CStdioFile file;
+	CString line;
+	int cam;
+	UINT frameNum;
+	UINT time;
+
+	mTimes.clear();
+	if (slash != std::string::npos)
+		folder = prefix.substr(0, slash + 1);
+	if (!file.Open(CString((folder + "timestamp.dat").c_str()), CFile::modeRead|CFile::shareDenyNone, NULL))
+		return;
+	while (file.ReadString(line)) {
+		if (swscanf_s(line, L"%d\t%u\t%u", &cam, &frameNum, &time) == 3 && cam == camNum)
+			mTimes.push_back(time);
+	}
+	file.Close();
+}
+
+bool CReplayCapture::Produce(UINT index, cv::Mat& frame, double& due)
+{
+	while (!mVideo.read(frame)) {
+		if (!OpenPart(mPart + 1))
+			return false;
+	}
+	if (mSpeed <= 0)
+		due = 0;
+	else if (index < mTimes.size())
+		due = (mTimes[index] - mTimes[0])/1000.0/mSpeed;
+	else
+		due = index*Interval()/mSpeed;
+	return true;
+}
+
+CSyntheticCapture* CreateSyntheticCapture(const CString& spec, CString& error)
+{
+	int rows = 0;
+	int cols = 0;
+	double fps = 0;
+	double noise = 0;
+	double speed = 1;
+	int cells = 0;
+	int camNum = 0;
+	int prefixStart = 0;
+	UINT frames = 0;
+
+	if (spec.Left(8) == L"pattern,") {
+		if (swscanf_s(spec, L"pattern,%dx%d,%lf,%lf,%u", &cols, &rows, &fps, &noise, &frames) >= 4) {
+			CPatternCapture* pattern = new CPatternCapture;
+			if (pattern->Open(rows, cols, fps, noise, frames))
+				return pattern;
+			delete pattern;
+		}
+	}
+	else if (spec.Left(8) == L"phantom,") {
+		if (swscanf_s(spec, L"phantom,%dx%d,%lf,%d,%lf,%u", &cols, &rows, &fps, &cells, &noise, &frames) >= 5) {
+			CCalciumPhantom* phantom = new CCalciumPhantom;
+			if (phantom->Open(rows, cols, fps, cells, noise, frames))
+				return phantom;
+			delete phantom;
+		}
+	}
+	else if (spec.Left(7) == L"replay,") {
+		if (swscanf_s(spec, L"replay,%lf,%d,%n", &speed, &camNum, &prefixStart) >= 2 && prefixStart > 0) {
+			CReplayCapture* replay = new CReplayCapture;
+			if (replay->Open((LPCSTR)CT2CA(spec.Mid(prefixStart)), camNum, speed))
+				return replay;
+			delete replay;
+			error.Format(L"%s: could not open the recording", (LPCTSTR)spec);
+			return NULL;
+		}
+	}
+	error.Format(L"%s: not a valid input", (LPCTSTR)spec);
+	return NULL;
+}
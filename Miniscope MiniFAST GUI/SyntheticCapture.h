@@ -0,0 +1,141 @@
+// SyntheticCapture.h : camera free frame sources behind the cv::VideoCapture interface
+//
+// A capture source reads its frames through cv::VideoCapture whether they come from a
+// camera or from here, so everything downstream of grab() - luma extraction, queueing,
+// display and writing - runs unchanged without a scope attached. Which input a source
+// uses is a spec string, see CreateSyntheticCapture().
+
+#pragma once
+#include <vector>
+#include <string>
+#include "opencv2/core.hpp"
+#include "opencv2/videoio.hpp"
+
+#define SYNTHETIC_NOISE_FRAMES 8		// noise fields cycled through, so noise costs an add per frame
+#define PHANTOM_MAX_RADIUS 8			// px, largest cell the phantom draws
+#define PHANTOM_TAU 0.4					// s, GCaMP6f-like decay of a transient
+#define PHANTOM_SPIKE_RATE 0.5			// Hz, mean rate of transients per cell
+
+// Paces, numbers and formats frames a subclass produces. With CV_CAP_PROP_CONVERT_RGB off
+// frames come out as YUY2 with the picture in the luma bytes, like the MiniFAST sends them,
+// otherwise as BGR like DirectShow converts them. After SetBitDepth(10) or (12) the
+// second byte of each raw pixel carries random low bits, see SamplePack.h.
+class CSyntheticCapture : public cv::VideoCapture
+{
+public:
+	CSyntheticCapture();
+	virtual ~CSyntheticCapture() {}
+
+	bool isOpened() const override { return mOpened; }
+	void release() override;
+	// Produces the next frame and waits until it is due. Fails like an unplugged camera
+	// once the frame limit is reached or the subclass has no more frames.
+	bool grab() override;
+	bool retrieve(cv::OutputArray image, int flag = 0) override;
+	// Only CV_CAP_PROP_CONVERT_RGB does anything
+	bool set(int propId, double value) override;
+	double get(int propId) override;
+	// Bits of a raw sample, 8, 10 or 12. Set on the host side, nothing on a camera matches it.
+	bool SetBitDepth(int bits);
+
+	UINT Served() const { return mIndex; }
+
+protected:
+	// fps 0 serves frames as fast as they are grabbed. frames 0 never runs out.
+	void Start(int rows, int cols, double fps, UINT frames, double noise, UINT seed);
+	// Fills frame with 8 bit gray or BGR frame number index and sets when it is due, in
+	// seconds after the first one. Returns false when there are no more frames.
+	virtual bool Produce(UINT index, cv::Mat& frame, double& due) = 0;
+	// Gaussian read noise with the sigma given to Start()
+	void AddNoise(UINT index, cv::Mat& frame);
+	// Frame number in the first four pixels, so a consumer can check order and loss
+	void Stamp(UINT index, cv::Mat& frame);
+	double Interval() const { return mFPS > 0 ? 1/mFPS : 0; }
+
+	cv::RNG mRng;
+	bool mOpened;
+	int mRows;
+	int mCols;
+	double mFPS;
+
+private:
+	void Format();
+	// The second byte of the raw output for the current bit depth
+	void FillChroma();
+
+	UINT mFrames;
+	UINT mIndex;
+	bool mRaw;
+	int mBits;			// of a raw sample
+	cv::Mat mFrame;		// what Produce() made
+	cv::Mat mGray;
+	cv::Mat mChroma;	// constant 128, the U and V bytes of the YUY2 output, or the low bits of 10 and 12 bit samples
+	cv::Mat mOutput;	// what retrieve() hands out
+	cv::Mat mNoise[SYNTHETIC_NOISE_FRAMES];
+	LARGE_INTEGER mStart;
+	LARGE_INTEGER mFrequency;
+};
+
+// Test pattern: a diagonal gradient that moves one step per frame plus read noise
+class CPatternCapture : public CSyntheticCapture
+{
+public:
+	bool Open(int rows, int cols, double fps, double noise, UINT frames = 0, UINT seed = 1);
+
+protected:
+	bool Produce(UINT index, cv::Mat& frame, double& due) override;
+};
+
+// Calcium imaging phantom: a vignetted background with round cells that fire Poisson
+// transients decaying with PHANTOM_TAU, plus read noise. The same seed gives the same movie.
+class CCalciumPhantom : public CSyntheticCapture
+{
+public:
+	bool Open(int rows, int cols, double fps, int cells, double noise, UINT frames = 0, UINT seed = 1);
+
+protected:
+	bool Produce(UINT index, cv::Mat& frame, double& due) override;
+
+private:
+	struct Cell {
+		cv::Rect box;		// where kernel goes in the frame
+		cv::Mat kernel;		// CV_32F gaussian footprint scaled to the cell's brightness
+		double calcium;		// current transient, 0 at rest
+	};
+
+	std::vector<Cell> mCells;
+	cv::Mat mBackground;	// CV_32F
+	cv::Mat mAccum;			// CV_32F
+	double mDecay;			// per frame
+	double mSpikeChance;	// per cell and frame
+};
+
+// Streams a recording back: <prefix>1.avi, <prefix>2.avi, ... with the frame times of one
+// camera from the timestamp.dat next to them. speed 1 plays at the recorded timing, 4 four
+// times as fast, 0 as fast as the frames are grabbed.
+class CReplayCapture : public CSyntheticCapture
+{
+public:
+	CReplayCapture() : mPart(0), mSpeed(1) {}
+	bool Open(const std::string& prefix, int camNum, double speed);
+	void release() override;
+
+protected:
+	bool Produce(UINT index, cv::Mat& frame, double& due) override;
+
+private:
+	bool OpenPart(int part);
+	void LoadTimes(const std::string& prefix, int camNum);
+
+	std::string mPrefix;
+	cv::VideoCapture mVideo;
+	int mPart;
+	double mSpeed;
+	std::vector<UINT> mTimes;	// ms, from timestamp.dat
+};
+
+// Creates the input a spec asks for, or returns NULL with error set. Specs:
+//   pattern,<cols>x<rows>,<fps>,<noise>[,<frames>]
+//   phantom,<cols>x<rows>,<fps>,<cells>,<noise>[,<frames>]
+//   replay,<speed>,<camNum>,<file prefix, e.g. data\1_2_2019\H10_M5_S3\msCam>
+CSyntheticCapture* CreateSyntheticCapture(const CString& spec, CString& error);
@@ -0,0 +1,213 @@
+// FrameQueueTest.cpp : checks CFrameQueue's ordering and drop oldest accounting, no camera or dialog needed
+//
+// Build FrameQueueTest.vcxproj and run it from a console or a CI step. It prints every check
+// and exits with the number that failed, 0 when all passed.
+
+#include <afxwin.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+#include "../FrameQueue.h"
+
+namespace {
+
+struct TestSlot {
+	ULONGLONG seq;
+	ULONGLONG check;	// derived from seq, catches a slot read while it is being written
+};
+
+int gFailures = 0;
+
+void Check(bool ok, const char* what)
+{
+	printf("%s %s\n", ok ? "pass" : "FAIL", what);
+	if (!ok)
+		gFailures++;
+}
+
+ULONGLONG CheckValue(ULONGLONG seq)
+{
+	return seq*0x9E3779B97F4A7C15ULL ^ 0x5A5A5A5A5A5A5A5AULL;
+}
+
+bool Push(CFrameQueue<TestSlot>& queue, ULONGLONG seq)
+{
+	TestSlot* slot = queue.BeginWrite();
+
+	if (slot == NULL)
+		return false;
+	slot->seq = seq;
+	slot->check = CheckValue(seq);
+	queue.CommitWrite();
+	return true;
+}
+
+void TestFIFO()
+{ //One thread, both sides, wrapping the ring several times
+	CFrameQueue<TestSlot> queue;
+	ULONGLONG next = 0;
+	ULONGLONG expected = 0;
+	bool ordered = true;
+	TestSlot* slot;
+
+	queue.Init(4);
+	for (int round = 0; round < 10; round++) {
+		while (Push(queue, next))
+			next++;
+		if (queue.Size() != 4)
+			ordered = false;
+		for (int i = 0; i < 3 && (slot = queue.Front()) != NULL; i++) {
+			if (slot->seq != expected++)
+				ordered = false;
+			queue.Pop();
+		}
+	}
+	while ((slot = queue.Front()) != NULL) {
+		if (slot->seq != expected++)
+			ordered = false;
+		queue.Pop();
+	}
+	Check(ordered && expected == next && queue.Size() == 0, "FIFO order, full and empty, single thread");
+}
+
+void TestDropOldestSingle()
+{ //DropOldest takes the oldest unread slot, and a slot the consumer holds is never handed out
+	CFrameQueue<TestSlot> queue;
+	TestSlot* slot;
+	TestSlot* dropped;
+	bool ok = true;
+
+	queue.Init(3, true);
+	for (ULONGLONG seq = 0; seq < 3; seq++)
+		Push(queue, seq);
+	ok = ok && queue.BeginWrite() == NULL;
+	dropped = queue.DropOldest();
+	ok = ok && dropped != NULL && dropped->seq == 0;
+	ok = ok && Push(queue, 3);
+	slot = queue.Front();
+	ok = ok && slot != NULL && slot->seq == 1;
+	// The consumer holds 1 in its spare, dropping now takes 2
+	dropped = queue.DropOldest();
+	ok = ok && dropped != NULL && dropped->seq == 2;
+	ok = ok && slot->seq == 1 && slot->check == CheckValue(1);
+	queue.Pop();
+	slot = queue.Front();
+	ok = ok && slot != NULL && slot->seq == 3;
+	queue.Pop();
+	ok = ok && queue.Front() == NULL && queue.DropOldest() == NULL;
+	Check(ok, "dropOldest drops the oldest unread slot, not the one being read");
+}
+
+void TestConcurrent(bool dropOldest, UINT capacity, ULONGLONG frames)
+{ //Producer and consumer threads. Every sequence number has to come out exactly once, read, dropped
+  //or refused, and what is read in increasing order.
+	CFrameQueue<TestSlot> queue;
+	std::vector<unsigned char> seen((size_t)frames, 0);
+	ULONGLONG read = 0;
+	ULONGLONG dropped = 0;
+	ULONGLONG refused = 0;
+	ULONGLONG lostRaces = 0;
+	ULONGLONG outOfOrder = 0;
+	ULONGLONG torn = 0;			// producer's counts
+	ULONGLONG twice = 0;
+	ULONGLONG readTorn = 0;		// consumer's
+	ULONGLONG readTwice = 0;
+	ULONGLONG missing = 0;
+	std::atomic<bool> done(false);
+	char what[160];
+
+	queue.Init(capacity, dropOldest);
+	std::thread consumer([&]() {
+		ULONGLONG last = 0;
+		bool first = true;
+		TestSlot* slot;
+
+		while (1) {
+			// Read before Front(), so every slot committed before done was set is seen
+			bool finished = done.load();
+			slot = queue.Front();
+			if (slot == NULL) {
+				if (finished)
+					break;
+				std::this_thread::yield();
+				continue;
+			}
+			if (slot->check != CheckValue(slot->seq))
+				readTorn++;
+			else if (slot->seq >= frames || seen[(size_t)slot->seq]++ != 0)
+				readTwice++;
+			if (!first && slot->seq <= last)
+				outOfOrder++;
+			first = false;
+			last = slot->seq;
+			read++;
+			queue.Pop();
+		}
+	});
+
+	for (ULONGLONG seq = 0; seq < frames; seq++) {
+		TestSlot* slot = queue.BeginWrite();
+		// A plain queue waits for the consumer
+		while (slot == NULL && !dropOldest) {
+			std::this_thread::yield();
+			slot = queue.BeginWrite();
+		}
+		if (slot == NULL) {
+			TestSlot* oldest = queue.DropOldest();
+			if (oldest == NULL)
+				lostRaces++;	// the consumer won the CAS on the tail
+			else {
+				if (oldest->check != CheckValue(oldest->seq))
+					torn++;
+				else if (oldest->seq >= frames || seen[(size_t)oldest->seq]++ != 0)
+					twice++;
+				dropped++;
+			}
+			slot = queue.BeginWrite();
+		}
+		// Only while the consumer swaps out the slot that would be filled next
+		if (slot == NULL) {
+			seen[(size_t)seq]++;
+			refused++;
+			continue;
+		}
+		slot->seq = seq;
+		slot->check = CheckValue(seq);
+		queue.CommitWrite();
+		// Lets the consumer in now and then on a machine with fewer cores than threads
+		if (seq % 64 == 0)
+			std::this_thread::yield();
+	}
+	done.store(true);
+	consumer.join();
+	torn += readTorn;
+	twice += readTwice;
+
+	for (size_t i = 0; i < seen.size(); i++) {
+		if (seen[i] == 0)
+			missing++;
+		else if (seen[i] > 1)
+			twice++;
+	}
+	sprintf_s(what, sizeof what, "%s, capacity %u: %llu read, %llu dropped, %llu refused, %llu lost CAS races",
+		dropOldest ? "dropOldest" : "plain", capacity, read, dropped, refused, lostRaces);
+	Check(missing == 0 && twice == 0 && torn == 0 && outOfOrder == 0 && read + dropped + refused == frames, what);
+	if (missing + twice + torn + outOfOrder > 0)
+		printf("     %llu missing, %llu twice, %llu torn, %llu out of order\n", missing, twice, torn, outOfOrder);
+}
+
+} // namespace
+
+int main()
+{
+	TestFIFO();
+	TestDropOldestSingle();
+	TestConcurrent(false, 2, 2000000);
+	TestConcurrent(false, 256, 2000000);
+	// Small rings keep the producer dropping while the consumer claims, which is where the CAS races
+	TestConcurrent(true, 1, 2000000);
+	TestConcurrent(true, 2, 2000000);
+	TestConcurrent(true, 16, 2000000);
+	printf("%d failed\n", gFailures);
+	return gFailures;
+}
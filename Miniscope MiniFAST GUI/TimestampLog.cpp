@@ -0,0 +1,200 @@
+// TimestampLog.cpp : binary per frame timestamps of a recording, and their timestamp.dat text
+//
+
+#include "stdafx.h"
+#include "TimestampLog.h"
+#include <algorithm>
+
+namespace {
+
+const char kLogMagic[8] = {'M', 'S', 'T', 'S', 'L', 'O', 'G', '1'};
+
+bool EarlierGrab(const TimestampRecord& a, const TimestampRecord& b)
+{
+	return a.hostTicks < b.hostTicks;
+}
+
+} // namespace
+
+CTimestampLog::CTimestampLog()
+	: mUsed(0)
+	, mRecords(0)
+	, mOpened(false)
+	, mFailed(false)
+{
+}
+
+bool CTimestampLog::Open(LPCTSTR fileName, LONGLONG tickFrequency, LONGLONG startTicks)
+{
+	TimestampLogHeader& header = mHeader;
+	FILETIME now;
+
+	Close();
+	mFailed = false;
+	if (!mFile.Open(fileName, CFile::modeCreate|CFile::modeWrite|CFile::shareDenyWrite, NULL))
+		return false;
+	GetSystemTimeAsFileTime(&now);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kLogMagic, sizeof(kLogMagic));
+	header.version = TIMESTAMP_VERSION;
+	header.headerSize = TIMESTAMP_HEADER_SIZE;
+	header.recordSize = sizeof(TimestampRecord);
+	header.tickFrequency = tickFrequency;
+	header.startTicks = startTicks;
+	// FILETIME counts 100 ns from 1601
+	header.createdUs = ((((UINT64)now.dwHighDateTime << 32) | now.dwLowDateTime) - 116444736000000000ULL)/10;
+	mOpened = true;
+	if (!Write(&header, sizeof(header)))
+		return false;
+	mBuffer.resize(TIMESTAMP_LOG_BUFFER);
+	mUsed = 0;
+	mRecords = 0;
+	return true;
+}
+
+void CTimestampLog::Append(const TimestampRecord* records, size_t count)
+{ //The lock is held for a copy, and for a write once every TIMESTAMP_LOG_BUFFER bytes
+	CSingleLock singleLock(&mLock, TRUE);
+	const BYTE* data = (const BYTE*)records;
+	size_t left = count*sizeof(TimestampRecord);
+	size_t part;
+
+	if (!mOpened)
+		return;
+	while (left > 0) {
+		part = min(left, mBuffer.size() - mUsed);
+		memcpy(&mBuffer[mUsed], data, part);
+		mUsed += part;
+		data += part;
+		left -= part;
+		if (mUsed == mBuffer.size()) {
+			mUsed = 0;
+			if (!Write(&mBuffer[0], (UINT)mBuffer.size()))
+				return;
+		}
+	}
+	mRecords += count;
+}
+
+void CTimestampLog::SetStartTicks(LONGLONG startTicks)
+{ //The header is rewritten in place, records before it are not touched
+	CSingleLock singleLock(&mLock, TRUE);
+	ULONGLONG position;
+
+	if (!mOpened)
+		return;
+	mHeader.startTicks = startTicks;
+	try {
+		position = mFile.GetPosition();
+		mFile.Seek(0, CFile::begin);
+		mFile.Write(&mHeader, sizeof(mHeader));
+		mFile.Seek(position, CFile::begin);
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		mFile.Abort();
+		mOpened = false;
+		mFailed = true;
+	}
+}
+
+bool CTimestampLog::Close()
+{
+	CSingleLock singleLock(&mLock, TRUE);
+
+	if (!mOpened)
+		return !mFailed;
+	if (mUsed > 0 && !Write(&mBuffer[0], (UINT)mUsed))
+		return false;
+	mUsed = 0;
+	mOpened = false;
+	try {
+		mFile.Close();
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		mFile.Abort();
+		mFailed = true;
+	}
+	return !mFailed;
+}
+
+bool CTimestampLog::Write(const void* data, UINT bytes)
+{
+	try {
+		mFile.Write(data, bytes);
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		mFile.Abort();
+		mUsed = 0;
+		mOpened = false;
+		mFailed = true;
+		return false;
+	}
+	return true;
+}
+
+LONGLONG ConvertTimestampLog(LPCTSTR logName, LPCTSTR datName)
+{ //Written with CRLF line ends, as CStdioFile in text mode wrote them
+	CFile log;
+	CFile dat;
+	TimestampLogHeader header;
+	std::vector<TimestampRecord> records;
+	std::vector<char> text;
+	ULONGLONG length;
+	size_t count;
+	int used;
+
+	if (!log.Open(logName, CFile::modeRead|CFile::shareDenyWrite, NULL))
+		return -1;
+	try {
+		length = log.GetLength();
+		if (length < sizeof(header) || log.Read(&header, sizeof(header)) != sizeof(header) ||
+			memcmp(header.magic, kLogMagic, sizeof(kLogMagic)) != 0 || header.recordSize != sizeof(TimestampRecord) ||
+			header.headerSize < sizeof(header) || header.headerSize > length) {
+			log.Abort();
+			return -1;
+		}
+		// A log whose recording did not finish may end in part of a record
+		count = (size_t)((length - header.headerSize)/sizeof(TimestampRecord));
+		records.resize(count);
+		log.Seek(header.headerSize, CFile::begin);
+		if (count > 0 && log.Read(&records[0], (UINT)(count*sizeof(TimestampRecord))) != count*sizeof(TimestampRecord)) {
+			log.Abort();
+			return -1;
+		}
+		log.Close();
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		log.Abort();
+		return -1;
+	}
+	// Each writer's records are in order already, stable keeps them so for frames grabbed in the same tick
+	std::stable_sort(records.begin(), records.end(), EarlierGrab);
+
+	if (!dat.Open(datName, CFile::modeCreate|CFile::modeWrite, NULL))
+		return -1;
+	text.resize(TIMESTAMP_LOG_BUFFER);
+	used = sprintf_s(&text[0], text.size(), "camNum\tframeNum\tsysClock\tbuffer\r\n");
+	try {
+		for (size_t i = 0; i < count; i++) {
+			// Longest line is 4 UINT32s, 3 tabs and CRLF
+			if (text.size() - used < 64) {
+				dat.Write(&text[0], used);
+				used = 0;
+			}
+			used += sprintf_s(&text[used], text.size() - used, "%u\t%u\t%u\t%u\r\n",
+				records[i].camera, records[i].frameNumber, records[i].capTimeMs, records[i].queueDepth);
+		}
+		dat.Write(&text[0], used);
+		dat.Close();
+	}
+	catch (CFileException* e) {
+		e->Delete();
+		dat.Abort();
+		return -1;
+	}
+	return (LONGLONG)count;
+}
@@ -0,0 +1,95 @@
+// TimestampLog.h : binary per frame timestamps of a recording, and their timestamp.dat text
+//
+// Writers used to format one line of timestamp.dat per frame under the shared file lock. Now
+// each writer collects fixed size TimestampRecords and hands them to CTimestampLog a batch at a
+// time, which appends them to timestamp.msts through its own buffer. The file is
+//
+//	TimestampLogHeader		TIMESTAMP_HEADER_SIZE bytes
+//	TimestampRecord			recordSize bytes each, in the order the batches arrived
+//
+// little endian, so e.g. numpy.fromfile(name, dtype, offset=headerSize) reads it with
+//
+//	dtype = [('camera', '<u4'), ('frameNumber', '<u4'), ('captureFrame', '<u4'), ('capTimeMs', '<u4'),
+//		('hostTicks', '<u8'), ('deviceTimestamp', '<u8'), ('queueDepth', '<u4'), ('flags', '<u4')]
+//
+// ConvertTimestampLog() writes the text file existing analysis scripts read.
+
+#pragma once
+#include <vector>
+
+#define TIMESTAMP_VERSION 1
+#define TIMESTAMP_HEADER_SIZE 64
+#define TIMESTAMP_BATCH 64					// records a writer collects before it takes the log's lock
+#define TIMESTAMP_LOG_BUFFER (256*1024)		// bytes the log collects before it writes
+
+enum TimestampFlags {
+	TIMESTAMP_FRAMES_LOST = 0x1,	// captureFrame is not the one after the previous record's, see droppedFrames.dat
+	TIMESTAMP_NEW_FILE = 0x2,		// first frame of a video file
+	TIMESTAMP_NOT_WRITTEN = 0x4,	// the video file could not take the frame
+	TIMESTAMP_PRE_TRIGGER = 0x8,	// grabbed before the trigger, from the pre-trigger window
+};
+
+struct TimestampLogHeader {
+	char magic[8];				// "MSTSLOG1"
+	UINT32 version;
+	UINT32 headerSize;			// TIMESTAMP_HEADER_SIZE
+	UINT32 recordSize;			// sizeof(TimestampRecord)
+	UINT32 reserved0;
+	UINT64 tickFrequency;		// of hostTicks, per second
+	UINT64 startTicks;			// hostTicks when the recording started
+	UINT64 createdUs;			// wall clock when the file was created, us since 1970 UTC
+	BYTE reserved[16];
+};
+
+struct TimestampRecord {
+	UINT32 camera;				// camNum column of timestamp.dat
+	UINT32 frameNumber;			// frameNum column, frames written by this camera, from 1
+	UINT32 captureFrame;		// frameNum of droppedFrames.dat
+	UINT32 capTimeMs;			// sysClock column
+	UINT64 hostTicks;			// when the frame was grabbed
+	UINT64 deviceTimestamp;		// the camera's own clock if it sends one, else 0
+	UINT32 queueDepth;			// buffer column, frames queued behind this one when it was written
+	UINT32 flags;				// TimestampFlags
+};
+
+// Shared by the writers of a recording, Append() from any thread. A failed write closes the
+// file, the records before it stay readable and the ones after it are lost.
+class CTimestampLog
+{
+public:
+	CTimestampLog();
+	~CTimestampLog() { Close(); }
+
+	bool Open(LPCTSTR fileName, LONGLONG tickFrequency, LONGLONG startTicks);
+	void Append(const TimestampRecord* records, size_t count);
+	// For a log opened before its recording's start was known, e.g. armed for a trigger
+	void SetStartTicks(LONGLONG startTicks);
+	// Writes what is buffered. Records appended after this are lost. False if a write of this
+	// log failed, at any time since Open().
+	bool Close();
+	bool IsOpened() const { return mOpened; }
+	bool Failed() const { return mFailed; }
+	ULONGLONG Records() const { return mRecords; }
+
+private:
+	CTimestampLog(const CTimestampLog&);
+	CTimestampLog& operator=(const CTimestampLog&);
+
+	// Under mLock. Closes the file if the write fails.
+	bool Write(const void* data, UINT bytes);
+
+	CFile mFile;
+	TimestampLogHeader mHeader;
+	CCriticalSection mLock;
+	std::vector<BYTE> mBuffer;
+	size_t mUsed;
+	ULONGLONG mRecords;
+	bool mOpened;
+	bool mFailed;
+};
+
+// Writes timestamp.dat as the writers used to, one "camNum frameNum sysClock buffer" line per
+// record. Records are ordered by grab time, so the cameras interleave about as they did when every
+// writer logged its own frames. Returns the records converted, or -1 if logName is not a timestamp
+// log, or either file cannot be read or written.
+LONGLONG ConvertTimestampLog(LPCTSTR logName, LPCTSTR datName);
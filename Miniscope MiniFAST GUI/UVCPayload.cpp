@@ -0,0 +1,219 @@
+// UVCPayload.cpp : reassembles frames from the bulk payloads the FX3 firmware streams
+//
+
+#include "stdafx.h"
+#include "UVCPayload.h"
+
+CUVCFrameAssembler::CUVCFrameAssembler()
+	: mFrameBytes(0)
+	, mSink(NULL)
+{
+	Reset();
+	ResetStats();
+}
+
+void CUVCFrameAssembler::Init(size_t frameBytes, CUVCFrameSink* sink)
+{
+	mFrameBytes = frameBytes;
+	mSink = sink;
+	Reset();
+	ResetStats();
+}
+
+void CUVCFrameAssembler::Reset()
+{
+	mSynced = false;
+	mHaveFrameId = false;
+	mInFrame = false;
+	mContinued = false;
+	mSkipping = true;
+	mHeaderBytes = 0;
+	mFrameId = 0;
+	mDest = NULL;
+	mBytes = 0;
+	mStatus = 0;
+}
+
+void CUVCFrameAssembler::ResetStats()
+{
+	memset(&mStats, 0, sizeof(mStats));
+}
+
+void CUVCFrameAssembler::Feed(const BYTE* transfer, size_t length, LONGLONG ticks)
+{ //A transfer that came back full ended without a short packet, so its last payload goes on in the next one
+	bool continued = mContinued;
+	size_t start = 0;
+	size_t end;
+
+	mContinued = length == UVC_STREAM_BUF_SIZE;
+	do {
+		end = PayloadEnd(transfer, length, start, continued);
+		FeedPayload(transfer + start, end - start, continued, end < length || !mContinued, ticks);
+		continued = false;
+		start = end;
+	} while (start < length);
+}
+
+size_t CUVCFrameAssembler::PayloadEnd(const BYTE* transfer, size_t length, size_t start, bool continued) const
+{ //Only an EOF payload can be followed by another in the same transfer, see the top of UVCPayload.h
+	const BYTE* header = continued ? mHeader : transfer + start;
+	size_t headerBytes = continued ? mHeaderBytes : length - start >= 2 ? header[0] : 0;
+	BYTE bits;
+
+	if (headerBytes < 2 || headerBytes > UVC_MAX_HEADER || (header[1] & UVC_HEADER_EOF) == 0)
+		return length;
+	bits = (header[1] ^ UVC_HEADER_FRAME_ID) & ~UVC_HEADER_EOF;
+	for (size_t next = start + UVC_PACKET_ALIGN; next + headerBytes <= length; next += UVC_PACKET_ALIGN) {
+		if (transfer[next] == headerBytes && (transfer[next + 1] & ~UVC_HEADER_EOF) == bits
+			&& memcmp(transfer + next + 2, header + 2, headerBytes - 2) == 0)
+			return next;
+	}
+	return length;
+}
+
+void CUVCFrameAssembler::FeedPayload(const BYTE* payload, size_t length, bool continued, bool complete, LONGLONG ticks)
+{
+	size_t headerBytes = 0;
+	size_t fits;
+	BYTE bits;
+	BYTE frameId;
+
+	if (!continued) {
+		if (length == 0)
+			return;
+		mStats.payloads++;
+		mSkipping = true;
+		mHeaderBytes = 0;
+		headerBytes = payload[0];
+		if (length < 2 || headerBytes < 2 || headerBytes > length || headerBytes > UVC_MAX_HEADER) {
+			// Nothing in it can be trusted, and the frame in progress lost the data it carried
+			mStats.badPayloads++;
+			if (mInFrame)
+				mStatus |= UVC_FRAME_TRUNCATED;
+			return;
+		}
+		memcpy(mHeader, payload, headerBytes);
+		mHeaderBytes = headerBytes;
+		bits = payload[1];
+		frameId = bits & UVC_HEADER_FRAME_ID;
+
+		if (!mSynced) {
+			// Started listening somewhere inside a frame. Skip to the first payload that
+			// follows an EOF or carries the other FRAME_ID.
+			if (!mHaveFrameId || frameId == mFrameId) {
+				mHaveFrameId = true;
+				mFrameId = frameId;
+				if (bits & UVC_HEADER_EOF)
+					mSynced = true;
+				return;
+			}
+			mSynced = true;
+		}
+
+		if (mInFrame && frameId != mFrameId) {
+			// The frame in progress never got its EOF payload
+			EndFrame(mStatus | UVC_FRAME_NO_EOF, ticks);
+		}
+		if (!mInFrame)
+			StartFrame(frameId);
+		if (bits & UVC_HEADER_ERR)
+			mStatus |= UVC_FRAME_ERROR;
+		mSkipping = false;
+	}
+	if (mSkipping)
+		return;
+
+	length -= headerBytes;
+	if (mBytes + length > mFrameBytes) {
+		// Both the EOF and the FRAME_ID toggle of the previous frame went missing
+		mStatus |= UVC_FRAME_MERGED;
+		fits = mBytes < mFrameBytes ? mFrameBytes - mBytes : 0;
+	}
+	else
+		fits = length;
+	if (mDest != NULL && fits > 0)
+		memcpy(mDest + mBytes, payload + headerBytes, fits);
+	mBytes += length;
+
+	if (complete && (mHeader[1] & UVC_HEADER_EOF))
+		EndFrame(mStatus, ticks);
+}
+
+void CUVCFrameAssembler::StartFrame(BYTE frameId)
+{
+	mInFrame = true;
+	mFrameId = frameId;
+	mBytes = 0;
+	mStatus = 0;
+	mDest = mSink != NULL ? mSink->BeginFrame() : NULL;
+	if (mDest == NULL)
+		mStats.skipped++;
+}
+
+void CUVCFrameAssembler::EndFrame(UINT status, LONGLONG ticks)
+{
+	if (mBytes < mFrameBytes)
+		status |= UVC_FRAME_TRUNCATED;
+	if (status & UVC_FRAME_MERGED)
+		mStats.merged++;
+	else if (status & UVC_FRAME_TRUNCATED)
+		mStats.truncated++;
+	if (status & UVC_FRAME_ERROR)
+		mStats.errors++;
+	if (mDest != NULL) {
+		if ((status & UVC_FRAME_DAMAGED) == 0)
+			mStats.frames++;
+		mSink->EndFrame(status, ticks);
+	}
+	mInFrame = false;
+	mDest = NULL;
+}
+
+CUVCReplay::CUVCReplay()
+{
+}
+
+bool CUVCReplay::Open(LPCTSTR fileName)
+{
+	CFile file;
+	ULONGLONG length;
+
+	mData.clear();
+	if (!file.Open(fileName, CFile::modeRead|CFile::shareDenyWrite, NULL))
+		return false;
+	length = file.GetLength();
+	mData.resize((size_t)length);
+	if (length > 0 && file.Read(&mData[0], (UINT)length) != (UINT)length) {
+		mData.clear();
+		return false;
+	}
+	return true;
+}
+
+ULONGLONG CUVCReplay::Run(CUVCFrameAssembler& assembler)
+{
+	LARGE_INTEGER now;
+	size_t pos = 0;
+	UINT32 length;
+	ULONGLONG payloads = 0;
+
+	while (pos + sizeof(length) <= mData.size()) {
+		memcpy(&length, &mData[pos], sizeof(length));
+		pos += sizeof(length);
+		if (length > mData.size() - pos)
+			break;	// the recording was cut off inside this payload
+		QueryPerformanceCounter(&now);
+		assembler.Feed(&mData[pos], length, now.QuadPart);
+		pos += length;
+		payloads++;
+	}
+	return payloads;
+}
+
+void CUVCReplay::WritePayload(CFile& file, const BYTE* payload, UINT length)
+{
+	UINT32 header = length;
+
+	file.Write(&header, sizeof(header));
+	file.Write(payload, length);
+}
@@ -0,0 +1,127 @@
+// UVCPayload.h : reassembles frames from the bulk payloads the FX3 firmware streams
+//
+// Every DMA buffer the firmware commits to the video endpoint is one payload: the 12 byte
+// header CyFxUVCAddHeader() puts in front, then up to CY_FX_UVC_BUF_FULL_SIZE bytes of
+// pixels. All payloads of a frame carry the same FRAME_ID bit, the last one also has EOF
+// set, and the firmware toggles FRAME_ID once the frame has been read out. Frames end on
+// those two bits only.
+//
+// On the bus a payload ends with a short packet. A full payload, 16380 bytes, always does,
+// but the EOF payload ends on a packet boundary whenever its length is a multiple of
+// wMaxPacketSize, and the firmware sends no zero length packet after it. The transfer that
+// holds it then runs on into the first payload of the next frame, which the next transfer
+// finishes. The assembler takes transfers as they complete and, after an EOF payload, looks
+// for the next frame's header at every packet boundary. The firmware puts the same header on
+// every payload but for FRAME_ID and EOF, so pixel data is not mistaken for one.
+
+#pragma once
+#include <vector>
+
+// Mirrors of the firmware definitions in uvc.h
+#define UVC_STREAM_BUF_SIZE		(16*1024)					// CY_FX_UVC_STREAM_BUF_SIZE
+#define UVC_BUF_FULL_SIZE		(UVC_STREAM_BUF_SIZE - 16)	// CY_FX_UVC_BUF_FULL_SIZE
+#define UVC_MAX_HEADER			12							// CY_FX_UVC_MAX_HEADER
+#define UVC_PACKET_ALIGN		512		// wMaxPacketSize at USB 2.0, payloads start on multiples of it at 2.0 and 3.0
+#define UVC_HEADER_FRAME_ID		0x01
+#define UVC_HEADER_EOF			0x02
+#define UVC_HEADER_ERR			0x40
+#define UVC_HEADER_EOH			0x80
+
+// Why a frame did not come out whole. A frame with no flags is complete.
+enum {
+	UVC_FRAME_TRUNCATED = 0x1,	// ended short, payloads were lost or the sensor cut it off
+	UVC_FRAME_MERGED = 0x2,		// more data than one frame under one FRAME_ID, an end was missed
+	UVC_FRAME_ERROR = 0x4,		// the device set the error bit in one of its payloads
+	UVC_FRAME_NO_EOF = 0x8		// ended by the FRAME_ID toggle instead of EOF. Not damage on its own.
+};
+#define UVC_FRAME_DAMAGED (UVC_FRAME_TRUNCATED|UVC_FRAME_MERGED|UVC_FRAME_ERROR)
+
+struct UVCAssemblerStats {
+	ULONGLONG payloads;
+	ULONGLONG badPayloads;	// header too short, or longer than the payload or UVC_MAX_HEADER
+	ULONGLONG frames;		// delivered complete
+	ULONGLONG truncated;
+	ULONGLONG merged;
+	ULONGLONG errors;
+	ULONGLONG skipped;		// the sink had no buffer to assemble into
+};
+
+// Where assembled frames go. Both calls are made on the thread that calls Feed().
+class CUVCFrameSink
+{
+public:
+	virtual ~CUVCFrameSink() {}
+	// Buffer of at least the frame size to assemble the next frame in, or NULL to skip it
+	virtual BYTE* BeginFrame() = 0;
+	// The buffer BeginFrame() handed out is finished. status is UVC_FRAME_ flags and
+	// ticks the QueryPerformanceCounter time of the payload that ended the frame.
+	virtual void EndFrame(UINT status, LONGLONG ticks) = 0;
+};
+
+// Copies payload data straight into the buffer the sink provides, so a frame is touched
+// once between the USB transfer buffer and the writer. Frames that do not add up to
+// exactly frameBytes are still handed back to the sink, flagged, so it can decide.
+class CUVCFrameAssembler
+{
+public:
+	CUVCFrameAssembler();
+
+	// Not thread safe. Call before the first Feed().
+	void Init(size_t frameBytes, CUVCFrameSink* sink);
+	// Forget the frame in progress. Whatever arrives next is discarded up to the next frame start.
+	void Reset();
+
+	// One bulk transfer of at most UVC_STREAM_BUF_SIZE bytes exactly as it came off the endpoint
+	void Feed(const BYTE* transfer, size_t length, LONGLONG ticks);
+
+	size_t FrameBytes() const { return mFrameBytes; }
+	const UVCAssemblerStats& Stats() const { return mStats; }
+	void ResetStats();
+
+private:
+	CUVCFrameAssembler(const CUVCFrameAssembler&);
+	CUVCFrameAssembler& operator=(const CUVCFrameAssembler&);
+
+	// Where the payload at start ends, length if it fills the rest of the transfer
+	size_t PayloadEnd(const BYTE* transfer, size_t length, size_t start, bool continued) const;
+	// continued: the payload started in the last transfer. complete: it ends in this one.
+	void FeedPayload(const BYTE* payload, size_t length, bool continued, bool complete, LONGLONG ticks);
+	void StartFrame(BYTE frameId);
+	void EndFrame(UINT status, LONGLONG ticks);
+
+	size_t mFrameBytes;
+	CUVCFrameSink* mSink;
+	UVCAssemblerStats mStats;
+
+	bool mSynced;		// seen a frame boundary since Reset(), so the next frame starts at its first payload
+	bool mHaveFrameId;
+	bool mInFrame;
+	bool mContinued;	// the last transfer came back full, its last payload goes on
+	bool mSkipping;		// the payload in progress is not part of a frame
+	BYTE mHeader[UVC_MAX_HEADER];	// of the payload in progress
+	size_t mHeaderBytes;
+	BYTE mFrameId;		// FRAME_ID of the frame in progress, or of the last one after EOF
+	BYTE* mDest;		// NULL while skipping a frame
+	size_t mBytes;		// bytes of the frame in progress, counting the ones that did not fit
+	UINT mStatus;
+};
+
+// Payload streams recorded by CUVCReceiver::RecordPayloads(). Each transfer is stored as
+// its UINT32 length followed by the bytes, so a stream replays exactly as it arrived,
+// header bits and payloads that share a transfer included.
+class CUVCReplay
+{
+public:
+	CUVCReplay();
+
+	bool Open(LPCTSTR fileName);
+	// Feeds every transfer of the stream to the assembler as fast as it takes them.
+	// Returns the number of transfers fed.
+	ULONGLONG Run(CUVCFrameAssembler& assembler);
+
+	// Appends one transfer to a recording, the format Open() reads
+	static void WritePayload(CFile& file, const BYTE* payload, UINT length);
+
+private:
+	std::vector<BYTE> mData;
+};
@@ -0,0 +1,472 @@
+// UVCReceiver.cpp : reads the FX3 video endpoint with libusb instead of going through the UVC driver
+//
+
+#include "stdafx.h"
+#include "UVCReceiver.h"
+#include "WorkerThread.h"
+#include "opencv2/imgproc.hpp"
+
+#ifdef MINIFAST_LIBUSB
+
+#pragma comment(lib, "libusb-1.0.lib")
+
+// UVC class requests on the streaming interface, see CyFxUVCAppInThread in uvc.c
+#define UVC_SET_CUR				0x01
+#define UVC_GET_CUR				0x81
+#define UVC_SET_REQUEST_TYPE	0x21
+#define UVC_GET_REQUEST_TYPE	0xA1
+#define UVC_PROBE_CONTROL		0x0100
+#define UVC_COMMIT_CONTROL		0x0200
+#define UVC_PROBE_LENGTH		26
+#define UVC_CONTROL_TIMEOUT		1000	// ms
+
+CUVCReceiver::CUVCReceiver()
+	: mContext(NULL)
+	, mHandle(NULL)
+	, mAssembler(NULL)
+	, mThread(NULL)
+	, mStreaming(false)
+	, mInFlight(0)
+	, mMaxFrameBytes(0)
+	, mRecordThread(NULL)
+	, mRecording(false)
+	, mRecordStop(false)
+	, mRecordFailed(false)
+	, mUnrecorded(0)
+	, mPayloads(0)
+	, mTransferErrors(0)
+{
+}
+
+CUVCReceiver::~CUVCReceiver()
+{
+	Close();
+}
+
+bool CUVCReceiver::Fail(LPCTSTR what, int error)
+{
+	mLastError.Format(L"%s: %S", what, libusb_error_name(error));
+	return false;
+}
+
+bool CUVCReceiver::Open(UINT16 vid, UINT16 pid)
+{
+	libusb_device** devices;
+	libusb_device_descriptor descriptor;
+	ssize_t count;
+	int error;
+
+	Close();
+	error = libusb_init(&mContext);
+	if (error < 0) {
+		mContext = NULL;
+		return Fail(L"libusb_init", error);
+	}
+	count = libusb_get_device_list(mContext, &devices);
+	for (ssize_t i = 0; i < count && mHandle == NULL; i++) {
+		if (libusb_get_device_descriptor(devices[i], &descriptor) < 0 || descriptor.idVendor != vid)
+			continue;
+		if (pid != 0 ? descriptor.idProduct != pid
+			: descriptor.idProduct != UVC_MINIFAST_PID_HS && descriptor.idProduct != UVC_MINIFAST_PID_SS)
+			continue;
+		error = libusb_open(devices[i], &mHandle);
+		if (error < 0)
+			mHandle = NULL;
+	}
+	if (count >= 0)
+		libusb_free_device_list(devices, 1);
+	if (mHandle == NULL) {
+		mLastError = L"No MiniFAST found, or it is not bound to WinUSB/libusb";
+		Close();
+		return false;
+	}
+
+	// Takes the interfaces from uvcvideo on Linux, does nothing on Windows
+	libusb_set_auto_detach_kernel_driver(mHandle, 1);
+	error = libusb_claim_interface(mHandle, UVC_CONTROL_INTERFACE);
+	if (error == 0)
+		error = libusb_claim_interface(mHandle, UVC_STREAM_INTERFACE);
+	if (error < 0) {
+		Fail(L"libusb_claim_interface", error);
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void CUVCReceiver::Close()
+{
+	Stop();
+	if (mHandle != NULL) {
+		libusb_release_interface(mHandle, UVC_STREAM_INTERFACE);
+		libusb_release_interface(mHandle, UVC_CONTROL_INTERFACE);
+		libusb_close(mHandle);
+		mHandle = NULL;
+	}
+	if (mContext != NULL) {
+		libusb_exit(mContext);
+		mContext = NULL;
+	}
+}
+
+bool CUVCReceiver::CommitStream()
+{ //The firmware has a single format and frame, so the probe it reports back is committed as is.
+  //The COMMIT is what sets CY_FX_UVC_STREAM_EVENT and starts the GPIF filling buffers.
+	BYTE probe[UVC_PROBE_LENGTH];
+	int result;
+
+	result = libusb_control_transfer(mHandle, UVC_GET_REQUEST_TYPE, UVC_GET_CUR, UVC_PROBE_CONTROL,
+		UVC_STREAM_INTERFACE, probe, sizeof(probe), UVC_CONTROL_TIMEOUT);
+	if (result < 0)
+		return Fail(L"GET_CUR probe", result);
+	result = libusb_control_transfer(mHandle, UVC_SET_REQUEST_TYPE, UVC_SET_CUR, UVC_PROBE_CONTROL,
+		UVC_STREAM_INTERFACE, probe, sizeof(probe), UVC_CONTROL_TIMEOUT);
+	if (result < 0)
+		return Fail(L"SET_CUR probe", result);
+	result = libusb_control_transfer(mHandle, UVC_SET_REQUEST_TYPE, UVC_SET_CUR, UVC_COMMIT_CONTROL,
+		UVC_STREAM_INTERFACE, probe, sizeof(probe), UVC_CONTROL_TIMEOUT);
+	if (result < 0)
+		return Fail(L"SET_CUR commit", result);
+	mMaxFrameBytes = probe[18] | probe[19] << 8 | probe[20] << 16 | (DWORD)probe[21] << 24;
+	return true;
+}
+
+bool CUVCReceiver::Start(CUVCFrameAssembler* assembler, UINT transfers)
+{
+	libusb_transfer* transfer;
+	int error;
+
+	if (mHandle == NULL || mStreaming)
+		return false;
+	mAssembler = assembler;
+	mAssembler->Reset();
+	mPayloads = 0;
+	mTransferErrors = 0;
+
+	// A halt left over from the last Stop() would fail every transfer
+	libusb_clear_halt(mHandle, UVC_VIDEO_ENDPOINT);
+	if (!CommitStream())
+		return false;
+
+	mBuffers.resize((size_t)transfers*UVC_STREAM_BUF_SIZE);
+	mStreaming = true;
+	for (UINT i = 0; i < transfers; i++) {
+		transfer = libusb_alloc_transfer(0);
+		if (transfer == NULL) {
+			mLastError = L"Out of memory for transfers";
+			break;
+		}
+		libusb_fill_bulk_transfer(transfer, mHandle, UVC_VIDEO_ENDPOINT, &mBuffers[(size_t)i*UVC_STREAM_BUF_SIZE],
+			UVC_STREAM_BUF_SIZE, TransferDone, this, 0);
+		mTransfers.push_back(transfer);
+		error = libusb_submit_transfer(transfer);
+		if (error < 0) {
+			Fail(L"libusb_submit_transfer", error);
+			break;
+		}
+		InterlockedIncrement(&mInFlight);
+	}
+	if (mTransfers.size() < transfers || mInFlight < (LONG)transfers) {
+		Stop();
+		return false;
+	}
+
+	mThread = StartThread(EventThread, this, THREAD_PRIORITY_HIGHEST);
+	return true;
+}
+
+void CUVCReceiver::Stop()
+{
+	timeval timeout = {0, 100000};
+
+	if (!mStreaming && mTransfers.empty())
+		return;
+	mStreaming = false;
+	for (size_t i = 0; i < mTransfers.size(); i++)
+		libusb_cancel_transfer(mTransfers[i]);
+	JoinThread(mThread);
+	// Start() may have failed before the event thread was running
+	while (mInFlight > 0)
+		libusb_handle_events_timeout(mContext, &timeout);
+	for (size_t i = 0; i < mTransfers.size(); i++)
+		libusb_free_transfer(mTransfers[i]);
+	mTransfers.clear();
+
+	// CLEAR_FEATURE on the video endpoint is the firmware's signal to stop streaming
+	libusb_clear_halt(mHandle, UVC_VIDEO_ENDPOINT);
+	StopRecordingPayloads();
+}
+
+bool CUVCReceiver::RecordPayloads(LPCTSTR fileName)
+{ //Payloads the event thread queued after the last recording stopped are not part of this one
+	StopRecordingPayloads();
+	if (!mRecordFile.Open(fileName, CFile::modeCreate|CFile::modeWrite|CFile::shareDenyWrite, NULL))
+		return false;
+	if (mRecordQueue.SlotCount() == 0) {
+		mRecordQueue.Init(UVC_RECORD_QUEUE);
+		for (UINT i = 0; i < mRecordQueue.SlotCount(); i++)
+			mRecordQueue.Slot(i).data.resize(UVC_STREAM_BUF_SIZE);
+	}
+	mRecordQueue.Discard();
+	mRecordFailed = false;
+	mUnrecorded = 0;
+	mRecordStop = false;
+	mRecordThread = StartThread(RecordThread, this, THREAD_PRIORITY_NORMAL);
+	mRecording = true;
+	return true;
+}
+
+void CUVCReceiver::StopRecordingPayloads()
+{ //The record thread writes what was queued before it closes the file
+	if (mRecordThread == NULL)
+		return;
+	mRecording = false;
+	mRecordStop = true;
+	mRecordSignal.Wake();
+	JoinThread(mRecordThread);
+}
+
+UINT CUVCReceiver::RecordThread(LPVOID pParam)
+{
+	CUVCReceiver* self = (CUVCReceiver*)pParam;
+	RecordedPayload* payload;
+	bool stop;
+
+	while (1) {
+		// Read first, so every payload queued before StopRecordingPayloads() set it is written below
+		stop = self->mRecordStop;
+		payload = self->mRecordQueue.Front();
+		if (payload != NULL) {
+			if (self->mRecordFailed)
+				InterlockedIncrement(&self->mUnrecorded);
+			else {
+				try {
+					CUVCReplay::WritePayload(self->mRecordFile, &payload->data[0], payload->length);
+				}
+				catch (CFileException* e) {
+					// Keeps the transfers before this one, the replay stops at the one cut short
+					e->Delete();
+					self->mRecordFile.Abort();
+					self->mRecording = false;
+					self->mRecordFailed = true;
+					InterlockedIncrement(&self->mUnrecorded);
+				}
+			}
+			self->mRecordQueue.Pop();
+			continue;
+		}
+		if (stop)
+			break;
+		self->mRecordSignal.PrepareWait();
+		if (!self->mRecordStop && self->mRecordQueue.Size() == 0)
+			self->mRecordSignal.Wait(WRITER_IDLE_TIMEOUT);
+		else
+			self->mRecordSignal.CancelWait();
+	}
+	if (!self->mRecordFailed) {
+		try {
+			self->mRecordFile.Close();
+		}
+		catch (CFileException* e) {
+			e->Delete();
+			self->mRecordFile.Abort();
+			self->mRecordFailed = true;
+		}
+	}
+	return 0;
+}
+
+void LIBUSB_CALL CUVCReceiver::TransferDone(libusb_transfer* transfer)
+{
+	CUVCReceiver* self = (CUVCReceiver*)transfer->user_data;
+	RecordedPayload* payload;
+	LARGE_INTEGER now;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		QueryPerformanceCounter(&now);
+		self->mPayloads++;
+		if (self->mRecording) {
+			payload = self->mRecordQueue.BeginWrite();
+			if (payload != NULL) {
+				memcpy(&payload->data[0], transfer->buffer, transfer->actual_length);
+				payload->length = transfer->actual_length;
+				self->mRecordQueue.CommitWrite();
+				self->mRecordSignal.Notify(self->mRecordQueue.Size());
+			}
+			else
+				InterlockedIncrement(&self->mUnrecorded);
+		}
+		self->mAssembler->Feed(transfer->buffer, transfer->actual_length, now.QuadPart);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		self->mStreaming = false;
+		break;
+	default:
+		// Whatever this transfer held is gone, the assembler sees the hole as a truncated frame
+		InterlockedIncrement(&self->mTransferErrors);
+		break;
+	}
+	if (self->mStreaming && libusb_submit_transfer(transfer) == 0)
+		return;
+	InterlockedDecrement(&self->mInFlight);
+}
+
+UINT CUVCReceiver::EventThread(LPVOID pParam)
+{
+	CUVCReceiver* self = (CUVCReceiver*)pParam;
+	timeval timeout = {0, 100000};
+
+	// Transfers complete, and payloads are assembled, inside this call
+	while (self->mInFlight > 0)
+		libusb_handle_events_timeout(self->mContext, &timeout);
+	return 0;
+}
+
+CUVCCapture::CUVCCapture()
+	: mAssembling(NULL)
+	, mHolding(false)
+	, mRaw(false)
+	, mRows(0)
+	, mCols(0)
+{
+}
+
+CUVCCapture::~CUVCCapture()
+{
+	release();
+}
+
+bool CUVCCapture::Open(int rows, int cols)
+{ //The queue's slots are all the buffers there are, the one being assembled is never committed yet
+	release();
+	mRows = rows;
+	mCols = cols;
+	mQueue.Init(UVC_CAPTURE_FRAMES);
+	if (!mPool.Init(mQueue.SlotCount(), rows, cols, CV_8UC2)) {
+		mLastError = L"Out of memory for frame buffers";
+		return false;
+	}
+	for (UINT i = 0; i < mQueue.SlotCount(); i++)
+		mQueue.Slot(i).frame = mPool.Borrow(rows, cols, CV_8UC2);
+	mAssembler.Init((size_t)rows*cols*2, this);
+	if (!mReceiver.Open() || !mReceiver.Start(&mAssembler)) {
+		mLastError = mReceiver.LastError();
+		release();
+		return false;
+	}
+	if (mReceiver.MaxFrameBytes() != 0 && mReceiver.MaxFrameBytes() != mAssembler.FrameBytes()) {
+		mLastError.Format(L"the scope sends %u byte frames, not %dx%d YUY2", mReceiver.MaxFrameBytes(), cols, rows);
+		release();
+		return false;
+	}
+	return true;
+}
+
+void CUVCCapture::release()
+{ //Closing the receiver ends its event thread, so nothing assembles into the buffers after this
+	mReceiver.Close();
+	for (UINT i = 0; i < mQueue.SlotCount(); i++)
+		mQueue.Slot(i).frame.release();
+	mPool.Release();
+	mAssembling = NULL;
+	mHolding = false;
+}
+
+bool CUVCCapture::grab()
+{ //Only a frame wakes the wait early, so counting whole waits never gives up too soon
+	UINT waited = 0;
+
+	if (mHolding) {
+		mQueue.Pop();
+		mHolding = false;
+	}
+	while (mQueue.Front() == NULL) {
+		if (!mReceiver.IsStreaming() || waited >= UVC_GRAB_TIMEOUT)
+			return false;
+		mSignal.PrepareWait();
+		if (mQueue.Front() == NULL)
+			mSignal.Wait(WRITER_IDLE_TIMEOUT);
+		else
+			mSignal.CancelWait();
+		waited += WRITER_IDLE_TIMEOUT;
+	}
+	mHolding = true;
+	return true;
+}
+
+bool CUVCCapture::retrieve(cv::OutputArray image, int flag)
+{
+	if (!mHolding)
+		return false;
+	cv::Mat& frame = mQueue.Front()->frame;
+	if (!mRaw)
+		cv::cvtColor(frame, image, CV_YUV2BGR_YUY2);
+	else if (image.kind() == cv::_InputArray::MAT)
+		image.getMatRef() = frame;
+	else
+		frame.copyTo(image);
+	return true;
+}
+
+bool CUVCCapture::set(int propId, double value)
+{
+	if (propId != CV_CAP_PROP_CONVERT_RGB)
+		return false;
+	mRaw = value == 0;
+	return true;
+}
+
+double CUVCCapture::get(int propId)
+{ //The firmware does not report its frame rate
+	switch (propId) {
+	case CV_CAP_PROP_FRAME_WIDTH:
+		return mCols;
+	case CV_CAP_PROP_FRAME_HEIGHT:
+		return mRows;
+	case CV_CAP_PROP_CONVERT_RGB:
+		return mRaw ? 0 : 1;
+	default:
+		return 0;
+	}
+}
+
+BYTE* CUVCCapture::BeginFrame()
+{ //Event thread. While the capture thread is a queue behind, frames are skipped.
+	mAssembling = mQueue.BeginWrite();
+	return mAssembling != NULL ? mAssembling->frame.data : NULL;
+}
+
+void CUVCCapture::EndFrame(UINT status, LONGLONG ticks)
+{ //A damaged frame stays in its slot, the next one is assembled over it
+	if (status & UVC_FRAME_DAMAGED)
+		return;
+	mAssembling->grabTicks = ticks;
+	mQueue.CommitWrite();
+	mSignal.Notify(mQueue.Size());
+}
+
+#endif // MINIFAST_LIBUSB
+
+cv::VideoCapture* CreateUSBCapture(const CString& spec, CString& error)
+{
+#ifdef MINIFAST_LIBUSB
+	int rows = 0;
+	int cols = 0;
+
+	if (swscanf_s(spec, L"usb,%dx%d", &cols, &rows) == 2 && rows > 0 && cols > 0) {
+		CUVCCapture* usb = new CUVCCapture;
+		if (usb->Open(rows, cols))
+			return usb;
+		error.Format(L"%s: %s", (LPCTSTR)spec, (LPCTSTR)usb->LastError());
+		delete usb;
+		return NULL;
+	}
+	error.Format(L"%s: not a valid input", (LPCTSTR)spec);
+#else
+	error.Format(L"%s: this build has no libusb, see UVCReceiver.h", (LPCTSTR)spec);
+#endif
+	return NULL;
+}
@@ -0,0 +1,166 @@
+// UVCReceiver.h : reads the FX3 video endpoint with libusb instead of going through the UVC driver
+//
+// Only built with MINIFAST_LIBUSB defined and libusb-1.0 on the include and library paths.
+// On Windows the scope then has to be bound to WinUSB (e.g. with Zadig) instead of
+// usbvideo.sys, after which DirectShow no longer sees it as a camera. A capture source reads
+// it through CUVCCapture, with the input spec usb,<cols>x<rows>.
+
+#pragma once
+#include "opencv2/core.hpp"
+#include "opencv2/videoio.hpp"
+
+// Creates the input "usb,<cols>x<rows>" asks for, or returns NULL with error set. Always
+// fails without MINIFAST_LIBUSB.
+cv::VideoCapture* CreateUSBCapture(const CString& spec, CString& error);
+
+#ifdef MINIFAST_LIBUSB
+
+#include <vector>
+#include "libusb.h"
+#include "UVCPayload.h"
+#include "FramePool.h"
+#include "FrameQueue.h"
+
+#define UVC_MINIFAST_VID		0x04B4
+#define UVC_MINIFAST_PID_HS		0x00F8	// USB 2.0 device descriptor in cyfxuvcdscr.c
+#define UVC_MINIFAST_PID_SS		0x00F9	// USB 3.0 device descriptor
+#define UVC_VIDEO_ENDPOINT		0x83	// CY_FX_EP_BULK_VIDEO
+#define UVC_CONTROL_INTERFACE	0
+#define UVC_STREAM_INTERFACE	1		// CY_FX_UVC_STREAM_INTERFACE
+#define UVC_DEFAULT_TRANSFERS	32
+#define UVC_CAPTURE_FRAMES		8		// assembled frames the capture thread can fall behind by
+#define UVC_GRAB_TIMEOUT		1000	// ms without a frame before grab() fails like an unplugged camera
+#define UVC_RECORD_QUEUE		64		// transfers waiting for the payload recorder, more are not recorded
+
+// One transfer on its way from the event thread to a payload recording
+struct RecordedPayload {
+	std::vector<BYTE> data;		// UVC_STREAM_BUF_SIZE
+	UINT length;
+};
+
+// Keeps a ring of UVC_STREAM_BUF_SIZE bulk transfers queued on the video endpoint so the
+// host controller always has somewhere to put the next DMA buffer the firmware commits.
+// A transfer completes at a short packet or when it is full. Full firmware buffers end in
+// a short packet, but the one that ends a frame does not when its length is a multiple of
+// wMaxPacketSize, and its transfer then runs on into the next frame, see UVCPayload.h.
+// Each completion is fed to the assembler on the receiver's event thread and queued again
+// right away. At 16 KB per transfer, 32 in flight cover about 1.5 frames of 752x480 YUY2,
+// a few ms of latency from the event thread at 700 fps.
+class CUVCReceiver
+{
+public:
+	CUVCReceiver();
+	~CUVCReceiver();
+
+	// Opens the first scope found. pid 0 accepts either the USB 2.0 or the USB 3.0 id.
+	bool Open(UINT16 vid = UVC_MINIFAST_VID, UINT16 pid = 0);
+	void Close();
+	bool IsOpened() const { return mHandle != NULL; }
+	// False once Stop() was called or the scope was unplugged
+	bool IsStreaming() const { return mStreaming; }
+	// dwMaxVideoFrameSize of the committed stream
+	DWORD MaxFrameBytes() const { return mMaxFrameBytes; }
+
+	// Commits the stream format, which starts the firmware streaming, and queues the
+	// transfers. Every payload is fed to assembler on the event thread.
+	bool Start(CUVCFrameAssembler* assembler, UINT transfers = UVC_DEFAULT_TRANSFERS);
+	// Cancels the transfers, waits for all of them to come back and stops the firmware
+	void Stop();
+
+	// Appends every payload to a file CUVCReplay can play back. The event thread only copies
+	// them into a queue, a thread of the recording's own writes them. Can be turned on and off
+	// while streaming. A write that fails ends the recording, see RecordFailed().
+	bool RecordPayloads(LPCTSTR fileName);
+	void StopRecordingPayloads();
+	// The last recording ended early because the file did not take a payload
+	bool RecordFailed() const { return mRecordFailed; }
+	// Payloads of the last recording that are not in the file
+	LONG Unrecorded() const { return mUnrecorded; }
+
+	// 64 bit reads are not atomic on Win32
+	LONGLONG Payloads() const { return InterlockedCompareExchange64((volatile LONGLONG*)&mPayloads, 0, 0); }
+	LONG TransferErrors() const { return mTransferErrors; }
+	const CString& LastError() const { return mLastError; }
+
+private:
+	CUVCReceiver(const CUVCReceiver&);
+	CUVCReceiver& operator=(const CUVCReceiver&);
+
+	bool Fail(LPCTSTR what, int error);
+	bool CommitStream();
+	static void LIBUSB_CALL TransferDone(libusb_transfer* transfer);
+	static UINT EventThread(LPVOID pParam);
+	static UINT RecordThread(LPVOID pParam);
+
+	libusb_context* mContext;
+	libusb_device_handle* mHandle;
+	CUVCFrameAssembler* mAssembler;
+	std::vector<libusb_transfer*> mTransfers;
+	std::vector<BYTE> mBuffers;	// one block for all transfers
+	CWinThread* mThread;
+	volatile bool mStreaming;
+	volatile LONG mInFlight;
+	DWORD mMaxFrameBytes;
+
+	CFile mRecordFile;							// record thread only
+	CFrameQueue<RecordedPayload> mRecordQueue;	// event thread -> record thread
+	CFrameSignal mRecordSignal;
+	CWinThread* mRecordThread;
+	volatile bool mRecording;
+	volatile bool mRecordStop;
+	volatile bool mRecordFailed;
+	volatile LONG mUnrecorded;
+
+	volatile LONGLONG mPayloads;
+	volatile LONG mTransferErrors;
+	CString mLastError;
+};
+
+// The receiver behind the cv::VideoCapture interface, so a capture source reads the scope over
+// libusb like any other input. Frames are assembled on the event thread straight into pool
+// buffers queued for the capture thread, and with CV_CAP_PROP_CONVERT_RGB off retrieve() hands
+// out a header over the oldest one, so luma extraction reads the pixels where the transfer copy
+// put them. Damaged frames are never queued.
+class CUVCCapture : public cv::VideoCapture, private CUVCFrameSink
+{
+public:
+	CUVCCapture();
+	virtual ~CUVCCapture();
+
+	// rows x cols YUY2, the stream itself only tells the frame size in bytes
+	bool Open(int rows, int cols);
+	const CString& LastError() const { return mLastError; }
+
+	bool isOpened() const override { return mReceiver.IsStreaming(); }
+	void release() override;
+	// Hands back the frame the last grab() got and waits for the next one. Fails once the
+	// scope is gone or sent nothing whole for UVC_GRAB_TIMEOUT.
+	bool grab() override;
+	// A raw frame stays valid until the next grab(). With CV_CAP_PROP_CONVERT_RGB on it is
+	// converted to BGR like DirectShow does.
+	bool retrieve(cv::OutputArray image, int flag = 0) override;
+	// Only CV_CAP_PROP_CONVERT_RGB does anything, the camera controls stay with DirectShow
+	bool set(int propId, double value) override;
+	double get(int propId) override;
+
+private:
+	CUVCCapture(const CUVCCapture&);
+	CUVCCapture& operator=(const CUVCCapture&);
+
+	BYTE* BeginFrame() override;
+	void EndFrame(UINT status, LONGLONG ticks) override;
+
+	CUVCReceiver mReceiver;
+	CUVCFrameAssembler mAssembler;
+	CFramePool mPool;
+	CFrameQueue<FrameSlot> mQueue;	// event thread -> capture thread, grabTicks is when the frame ended
+	CFrameSignal mSignal;
+	FrameSlot* mAssembling;			// event thread, what BeginFrame() handed out
+	bool mHolding;					// capture thread, the front slot is the grabbed frame
+	bool mRaw;
+	int mRows;
+	int mCols;
+	CString mLastError;
+};
+
+#endif // MINIFAST_LIBUSB
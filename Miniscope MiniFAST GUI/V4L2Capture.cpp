@@ -0,0 +1,461 @@
+// V4L2Capture.cpp : Linux capture straight from a V4L2 device through mmap'd driver buffers
+//
+
+#ifdef __linux__
+
+#include "V4L2Capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+int Ioctl(int fd, unsigned long request, void* arg)
+{
+	int result;
+	do {
+		result = ioctl(fd, request, arg);
+	} while (result == -1 && errno == EINTR);
+	return result;
+}
+
+uint64_t NowUs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+void SleepUntilUs(uint64_t timeUs)
+{
+	struct timespec until;
+	until.tv_sec = (time_t)(timeUs/1000000);
+	until.tv_nsec = (long)(timeUs%1000000)*1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+		;
+}
+
+} // namespace
+
+CV4L2Capture::CV4L2Capture()
+	: mFd(-1)
+	, mWidth(0)
+	, mHeight(0)
+	, mPixelFormat(0)
+	, mStride(0)
+	, mStreaming(false)
+	, mLastSequence(0)
+	, mHaveSequence(false)
+	, mDropped(0)
+	, mFake(false)
+	, mFakeData(NULL)
+	, mFakeSize(0)
+	, mFakeFrameBytes(0)
+	, mFakeFrameCount(0)
+	, mFakePeriodUs(0)
+	, mFakeNextUs(0)
+	, mFakeSequence(0)
+{
+}
+
+CV4L2Capture::~CV4L2Capture()
+{
+	Close();
+}
+
+int CV4L2Capture::MatType(uint32_t pixelFormat)
+{
+	switch (pixelFormat) {
+	case V4L2_PIX_FMT_GREY:
+		return CV_8UC1;
+	case V4L2_PIX_FMT_Y16:
+		return CV_16UC1;
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+		return CV_8UC2;
+	case V4L2_PIX_FMT_BGR24:
+	case V4L2_PIX_FMT_RGB24:
+		return CV_8UC3;
+	default:
+		return -1;
+	}
+}
+
+bool CV4L2Capture::Fail(const char* what)
+{
+	mLastError = what;
+	if (errno != 0) {
+		mLastError += ": ";
+		mLastError += strerror(errno);
+	}
+	return false;
+}
+
+bool CV4L2Capture::Open(const std::string& device, int width, int height, uint32_t pixelFormat, int bufferCount)
+{
+	struct v4l2_capability cap;
+	struct v4l2_format fmt;
+	uint32_t caps;
+
+	Close();
+	mLastError.clear();
+	errno = 0;
+	if (MatType(pixelFormat) < 0)
+		return Fail("unsupported pixel format");
+	mFd = open(device.c_str(), O_RDWR|O_NONBLOCK);
+	if (mFd < 0)
+		return Fail("open");
+
+	memset(&cap, 0, sizeof(cap));
+	if (Ioctl(mFd, VIDIOC_QUERYCAP, &cap) < 0) {
+		Fail("VIDIOC_QUERYCAP");
+		Close();
+		return false;
+	}
+	caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) != 0 ? cap.device_caps : cap.capabilities;
+	if ((caps & V4L2_CAP_VIDEO_CAPTURE) == 0 || (caps & V4L2_CAP_STREAMING) == 0) {
+		errno = 0;
+		Fail("not a streaming capture device");
+		Close();
+		return false;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = width;
+	fmt.fmt.pix.height = height;
+	fmt.fmt.pix.pixelformat = pixelFormat;
+	fmt.fmt.pix.field = V4L2_FIELD_NONE;
+	if (Ioctl(mFd, VIDIOC_S_FMT, &fmt) < 0) {
+		Fail("VIDIOC_S_FMT");
+		Close();
+		return false;
+	}
+	// The driver picks the closest format it supports, make sure it is still one we can wrap
+	if (fmt.fmt.pix.pixelformat != pixelFormat) {
+		errno = 0;
+		Fail("device does not support the requested pixel format");
+		Close();
+		return false;
+	}
+	mWidth = fmt.fmt.pix.width;
+	mHeight = fmt.fmt.pix.height;
+	mPixelFormat = pixelFormat;
+	mStride = fmt.fmt.pix.bytesperline;
+	if (mStride == 0)
+		mStride = mWidth*CV_ELEM_SIZE(MatType(pixelFormat));
+
+	if (!MapBuffers(bufferCount)) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool CV4L2Capture::MapBuffers(int bufferCount)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	Buffer buffer;
+
+	memset(&req, 0, sizeof(req));
+	req.count = bufferCount;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (Ioctl(mFd, VIDIOC_REQBUFS, &req) < 0)
+		return Fail("VIDIOC_REQBUFS");
+	if (req.count < 2) {
+		errno = 0;
+		return Fail("not enough driver buffers");
+	}
+
+	for (uint32_t i = 0; i < req.count; i++) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (Ioctl(mFd, VIDIOC_QUERYBUF, &buf) < 0)
+			return Fail("VIDIOC_QUERYBUF");
+		buffer.length = buf.length;
+		buffer.start = mmap(NULL, buf.length, PROT_READ|PROT_WRITE, MAP_SHARED, mFd, buf.m.offset);
+		buffer.queued = false;
+		if (buffer.start == MAP_FAILED)
+			return Fail("mmap");
+		mBuffers.push_back(buffer);
+	}
+	return true;
+}
+
+bool CV4L2Capture::OpenFake(const std::string& rawFile, int width, int height, uint32_t pixelFormat, double fps, int bufferCount)
+{
+	struct stat info;
+	Buffer buffer;
+	int fd;
+
+	Close();
+	mLastError.clear();
+	errno = 0;
+	if (MatType(pixelFormat) < 0)
+		return Fail("unsupported pixel format");
+	if (fps <= 0 || bufferCount < 2) {
+		errno = EINVAL;
+		return Fail("OpenFake");
+	}
+	fd = open(rawFile.c_str(), O_RDONLY);
+	if (fd < 0)
+		return Fail("open");
+	if (fstat(fd, &info) < 0 || info.st_size == 0) {
+		close(fd);
+		return Fail("fstat");
+	}
+	mFakeSize = (size_t)info.st_size;
+	mFakeData = (const uint8_t*)mmap(NULL, mFakeSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mFakeData == MAP_FAILED) {
+		mFakeData = NULL;
+		return Fail("mmap");
+	}
+
+	mWidth = width;
+	mHeight = height;
+	mPixelFormat = pixelFormat;
+	mStride = width*CV_ELEM_SIZE(MatType(pixelFormat));
+	mFakeFrameBytes = mStride*height;
+	mFakeFrameCount = mFakeSize/mFakeFrameBytes;
+	mFakePeriodUs = (uint64_t)(1000000/fps);
+	mFake = true;
+	if (mFakeFrameCount == 0) {
+		errno = 0;
+		Fail("file holds less than one frame");
+		Close();
+		return false;
+	}
+
+	for (int i = 0; i < bufferCount; i++) {
+		buffer.length = mFakeFrameBytes;
+		buffer.start = mmap(NULL, mFakeFrameBytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		buffer.queued = false;
+		if (buffer.start == MAP_FAILED) {
+			Fail("mmap");
+			Close();
+			return false;
+		}
+		mBuffers.push_back(buffer);
+	}
+	return true;
+}
+
+void CV4L2Capture::Close()
+{
+	struct v4l2_requestbuffers req;
+
+	Stop();
+	for (size_t i = 0; i < mBuffers.size(); i++)
+		munmap(mBuffers[i].start, mBuffers[i].length);
+	mBuffers.clear();
+	if (mFd >= 0) {
+		// Frees the driver's buffers now rather than when the fd goes away
+		memset(&req, 0, sizeof(req));
+		req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		req.memory = V4L2_MEMORY_MMAP;
+		Ioctl(mFd, VIDIOC_REQBUFS, &req);
+		close(mFd);
+		mFd = -1;
+	}
+	if (mFakeData != NULL)
+		munmap((void*)mFakeData, mFakeSize);
+	mFakeData = NULL;
+	mFakeSize = 0;
+	mFake = false;
+}
+
+bool CV4L2Capture::QueueBuffer(int index)
+{
+	struct v4l2_buffer buf;
+
+	if (mFake) {
+		mFakeQueue.push_back(index);
+		mBuffers[index].queued = true;
+		return true;
+	}
+	memset(&buf, 0, sizeof(buf));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	if (Ioctl(mFd, VIDIOC_QBUF, &buf) < 0)
+		return Fail("VIDIOC_QBUF");
+	mBuffers[index].queued = true;
+	return true;
+}
+
+bool CV4L2Capture::Start()
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (!IsOpened())
+		return false;
+	if (mStreaming)
+		return true;
+	errno = 0;
+	mHaveSequence = false;
+	mDropped = 0;
+	for (size_t i = 0; i < mBuffers.size(); i++) {
+		if (!QueueBuffer((int)i))
+			return false;
+	}
+	if (mFake) {
+		mFakeSequence = 0;
+		mFakeNextUs = NowUs() + mFakePeriodUs;
+	}
+	else if (Ioctl(mFd, VIDIOC_STREAMON, &type) < 0)
+		return Fail("VIDIOC_STREAMON");
+	mStreaming = true;
+	return true;
+}
+
+void CV4L2Capture::Stop()
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if (!mStreaming)
+		return;
+	// STREAMOFF takes every buffer back from the driver, filled or not
+	if (!mFake)
+		Ioctl(mFd, VIDIOC_STREAMOFF, &type);
+	mFakeQueue.clear();
+	mFakeFilled.clear();
+	for (size_t i = 0; i < mBuffers.size(); i++)
+		mBuffers[i].queued = false;
+	mStreaming = false;
+}
+
+void CV4L2Capture::Deliver(V4L2Frame& frame, int index, uint64_t timestampUs, uint32_t sequence)
+{
+	if (mHaveSequence && sequence != mLastSequence + 1)
+		mDropped += sequence - mLastSequence - 1;
+	mLastSequence = sequence;
+	mHaveSequence = true;
+	mBuffers[index].queued = false;
+
+	frame.frame = cv::Mat(mHeight, mWidth, MatType(mPixelFormat), mBuffers[index].start, mStride);
+	frame.timestampUs = timestampUs;
+	frame.sequence = sequence;
+	frame.index = index;
+}
+
+bool CV4L2Capture::Grab(V4L2Frame& frame, int timeoutMs)
+{
+	struct pollfd pfd;
+	struct v4l2_buffer buf;
+	int result;
+
+	if (!mStreaming)
+		return false;
+	if (mFake)
+		return GrabFake(frame, timeoutMs);
+
+	errno = 0;
+	while (1) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (Ioctl(mFd, VIDIOC_DQBUF, &buf) == 0) {
+			if ((buf.flags & V4L2_BUF_FLAG_ERROR) != 0) {
+				// Corrupted transfer, give it straight back. The sequence gap counts it as dropped.
+				QueueBuffer(buf.index);
+				continue;
+			}
+			Deliver(frame, buf.index, (uint64_t)buf.timestamp.tv_sec*1000000 + buf.timestamp.tv_usec, buf.sequence);
+			return true;
+		}
+		if (errno != EAGAIN)
+			return Fail("VIDIOC_DQBUF");
+
+		pfd.fd = mFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		result = poll(&pfd, 1, timeoutMs);
+		if (result == 0) {
+			errno = 0;
+			return Fail("timeout");
+		}
+		if (result < 0 && errno != EINTR)
+			return Fail("poll");
+	}
+}
+
+void CV4L2Capture::FakeFill(uint64_t timestampUs)
+{
+	FakeFilled filled;
+	int index;
+
+	filled.sequence = mFakeSequence++;
+	if (mFakeQueue.empty())
+		return;	// every buffer is held by the application, the frame is lost like on a real driver
+	index = mFakeQueue.front();
+	mFakeQueue.pop_front();
+	memcpy(mBuffers[index].start, mFakeData + (filled.sequence%mFakeFrameCount)*mFakeFrameBytes, mFakeFrameBytes);
+	filled.index = index;
+	filled.timestampUs = timestampUs;
+	mFakeFilled.push_back(filled);
+}
+
+bool CV4L2Capture::GrabFake(V4L2Frame& frame, int timeoutMs)
+{
+	uint64_t deadline = NowUs() + (uint64_t)timeoutMs*1000;
+	uint64_t now;
+	FakeFilled filled;
+
+	while (1) {
+		// Catch up on every frame period that passed since the last call
+		now = NowUs();
+		while (mFakeNextUs <= now) {
+			FakeFill(mFakeNextUs);
+			mFakeNextUs += mFakePeriodUs;
+		}
+		if (!mFakeFilled.empty()) {
+			filled = mFakeFilled.front();
+			mFakeFilled.pop_front();
+			Deliver(frame, filled.index, filled.timestampUs, filled.sequence);
+			return true;
+		}
+		if (mFakeNextUs > deadline) {
+			SleepUntilUs(deadline);
+			errno = 0;
+			return Fail("timeout");
+		}
+		SleepUntilUs(mFakeNextUs);
+	}
+}
+
+void CV4L2Capture::Release(const V4L2Frame& frame)
+{
+	if (!mStreaming || frame.index < 0 || frame.index >= (int)mBuffers.size() || mBuffers[frame.index].queued)
+		return;
+	QueueBuffer(frame.index);
+}
+
+int CV4L2Capture::ExportDmabuf(int index)
+{
+	struct v4l2_exportbuffer expbuf;
+
+	if (mFd < 0 || index < 0 || index >= (int)mBuffers.size())
+		return -1;
+	memset(&expbuf, 0, sizeof(expbuf));
+	expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	expbuf.index = index;
+	expbuf.flags = O_RDONLY|O_CLOEXEC;
+	if (Ioctl(mFd, VIDIOC_EXPBUF, &expbuf) < 0) {
+		Fail("VIDIOC_EXPBUF");
+		return -1;
+	}
+	return expbuf.fd;
+}
+
+#endif // __linux__
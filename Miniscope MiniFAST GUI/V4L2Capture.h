@@ -0,0 +1,117 @@
+// V4L2Capture.h : Linux capture straight from a V4L2 device through mmap'd driver buffers
+//
+// Not part of the Windows build. On Linux the FX3 enumerates as a UVC camera, and this
+// talks to uvcvideo through V4L2 streaming I/O instead of cv::VideoCapture, which copies
+// every frame at least twice and throws away the driver timestamps.
+//
+// Without a scope attached either load the vivid virtual driver (modprobe vivid) and
+// Open() the /dev/video node it creates, or use OpenFake() with a raw file of frames.
+
+#pragma once
+#ifdef __linux__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <linux/videodev2.h>
+#include "opencv2/core.hpp"
+
+#define V4L2_DEFAULT_BUFFERS 8
+
+// One dequeued driver buffer
+struct V4L2Frame {
+	cv::Mat frame;			// header over the mapped driver buffer, no copy. Valid until Release().
+	uint64_t timestampUs;	// kernel capture time from VIDIOC_DQBUF, CLOCK_MONOTONIC
+	uint32_t sequence;		// driver frame counter, a gap means the driver dropped frames
+	int index;				// driver buffer, hand it back with Release()
+};
+
+// The driver owns a ring of buffers that the application maps once. Grab() dequeues the
+// oldest filled one and the application works on it in place, and Release() queues it
+// back for the driver to fill again. The driver can only fill buffers that are queued,
+// so a stage that holds on to frames too long makes the driver drop, which shows up as
+// a gap in sequence and is counted in Dropped().
+class CV4L2Capture
+{
+public:
+	CV4L2Capture();
+	~CV4L2Capture();
+
+	// Opens a V4L2 device, negotiates the format and maps bufferCount buffers.
+	// pixelFormat is a V4L2_PIX_FMT_ code, e.g. V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_GREY.
+	bool Open(const std::string& device, int width, int height, uint32_t pixelFormat, int bufferCount = V4L2_DEFAULT_BUFFERS);
+	// File backed fake device. Serves the frames of a raw file in a loop at fps through the
+	// same buffer ring, stamping and dropping frames the way the driver would.
+	bool OpenFake(const std::string& rawFile, int width, int height, uint32_t pixelFormat, double fps, int bufferCount = V4L2_DEFAULT_BUFFERS);
+	void Close();
+	bool IsOpened() const { return mFd >= 0 || mFake; }
+
+	bool Start();
+	void Stop();
+
+	// Waits up to timeoutMs for the next filled buffer. Returns false on timeout or error.
+	bool Grab(V4L2Frame& frame, int timeoutMs);
+	// Every frame Grab() returned has to come back here, in any order
+	void Release(const V4L2Frame& frame);
+	// DMABUF fd for a driver buffer so it can be imported elsewhere without a copy, or -1
+	int ExportDmabuf(int index);
+
+	int Width() const { return mWidth; }
+	int Height() const { return mHeight; }
+	uint32_t PixelFormat() const { return mPixelFormat; }
+	int BufferCount() const { return (int)mBuffers.size(); }
+	uint32_t Dropped() const { return mDropped; }
+	const std::string& LastError() const { return mLastError; }
+
+	// OpenCV type of a frame in the given V4L2 pixel format, or -1 if it is not supported
+	static int MatType(uint32_t pixelFormat);
+
+private:
+	CV4L2Capture(const CV4L2Capture&);
+	CV4L2Capture& operator=(const CV4L2Capture&);
+
+	struct Buffer {
+		void* start;
+		size_t length;
+		bool queued;	// owned by the driver (or the fake)
+	};
+	struct FakeFilled {
+		int index;
+		uint64_t timestampUs;
+		uint32_t sequence;
+	};
+
+	bool Fail(const char* what);
+	bool MapBuffers(int bufferCount);
+	bool QueueBuffer(int index);
+	bool GrabFake(V4L2Frame& frame, int timeoutMs);
+	void FakeFill(uint64_t timestampUs);
+	void Deliver(V4L2Frame& frame, int index, uint64_t timestampUs, uint32_t sequence);
+
+	int mFd;
+	std::vector<Buffer> mBuffers;
+	int mWidth;
+	int mHeight;
+	uint32_t mPixelFormat;
+	size_t mStride;
+	bool mStreaming;
+	uint32_t mLastSequence;
+	bool mHaveSequence;
+	uint32_t mDropped;
+	std::string mLastError;
+
+	// Fake device
+	bool mFake;
+	const uint8_t* mFakeData;
+	size_t mFakeSize;
+	size_t mFakeFrameBytes;
+	size_t mFakeFrameCount;
+	uint64_t mFakePeriodUs;
+	uint64_t mFakeNextUs;
+	uint32_t mFakeSequence;
+	std::deque<int> mFakeQueue;			// queued buffers in the order the fake fills them
+	std::deque<FakeFilled> mFakeFilled;	// filled and waiting for Grab()
+};
+
+#endif // __linux__
@@ -0,0 +1,23 @@
+// WorkerThread.h : starting and joining the threads a module owns
+//
+
+#pragma once
+
+// Starts proc on a thread that is not deleted when it ends, so JoinThread() can wait for it
+inline CWinThread* StartThread(AFX_THREADPROC proc, LPVOID param, int priority)
+{
+	CWinThread* thread = AfxBeginThread(proc, param, priority, 0, CREATE_SUSPENDED);
+	thread->m_bAutoDelete = FALSE;
+	thread->ResumeThread();
+	return thread;
+}
+
+// Waits for a thread StartThread() started to end and deletes it. NULL is already joined.
+inline void JoinThread(CWinThread*& thread)
+{
+	if (thread == NULL)
+		return;
+	WaitForSingleObject(thread->m_hThread, INFINITE);
+	delete thread;
+	thread = NULL;
+}